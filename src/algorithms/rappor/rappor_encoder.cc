@@ -133,6 +133,34 @@ Status BasicRapporEncoder::EncodeNullObservation(BasicRapporObservation* observa
   return kOK;
 }
 
+Status BasicRapporEncoder::EncodeIndicators(const std::vector<bool>& indicators,
+                                            BasicRapporObservation* observation_out) {
+  std::string data;
+  auto status = InitializeObservationData(&data);
+  if (status != kOK) {
+    return status;
+  }
+  if (indicators.size() != config_->num_bits()) {
+    LOG(ERROR) << "BasicRapporEncoder::EncodeIndicators(): Expected " << config_->num_bits()
+               << " indicators but received " << indicators.size();
+    return kInvalidInput;
+  }
+  for (uint32_t bit_index = 0; bit_index < indicators.size(); bit_index++) {
+    if (indicators[bit_index]) {
+      // Indexed from the right, i.e. the least-significant bit.
+      data[data.size() - (bit_index / kBitsPerByte + 1)] |=
+          static_cast<char>(1 << (bit_index % kBitsPerByte));
+    }
+  }
+  // Randomly flip some of the bits based on the probabilities p and q.
+  status = FlipBits(config_->prob_0_becomes_1(), config_->prob_1_stays_1(), random_.get(), &data);
+  if (status != kOK) {
+    return status;
+  }
+  observation_out->set_data(data);
+  return kOK;
+}
+
 // Initialize |data| to a string of all zero bytes.
 // (The C++ Protocol Buffer API uses string to represent an array of bytes.)
 Status BasicRapporEncoder::InitializeObservationData(std::string* data) {
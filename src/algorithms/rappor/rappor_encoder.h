@@ -18,6 +18,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "src/algorithms/rappor/rappor_config_validator.h"
 #include "src/lib/crypto_util/random.h"
@@ -54,6 +55,17 @@ class BasicRapporEncoder {
   // was passed to the constructor is not valid.
   Status EncodeNullObservation(BasicRapporObservation* observation_out);
 
+  // Applies Basic RAPPOR encoding to the sequence of bits |indicators|, whose
+  // length must be equal to the number of categories in the config which was
+  // passed to the constructor. Unlike Encode(), any number of bits may be set.
+  // Bit i of the result, counting from the least-significant bit, encodes
+  // |indicators[i]|. Each bit is flipped with the same probabilities as in
+  // Encode(). Returns kOK on success, kInvalidConfig if the config that was
+  // passed to the constructor is not valid, and kInvalidInput if the length of
+  // |indicators| is not the number of categories.
+  Status EncodeIndicators(const std::vector<bool>& indicators,
+                          BasicRapporObservation* observation_out);
+
  private:
   friend class BasicRapporAnalyzerTest;
   friend class BasicRapporDeterministicTest;
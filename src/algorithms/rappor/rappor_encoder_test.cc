@@ -483,4 +483,30 @@ TEST(BasicRapporEncoderTest, EncodeIndex) {
   EXPECT_EQ(kInvalidInput, encoder.Encode(value, &obs));
 }
 
+// Tests that BasicRapporEncoder::EncodeIndicators() sets one bit per indicator.
+TEST(BasicRapporEncoderTest, EncodeIndicators) {
+  // Configure Basic RAPPOR with 10 indexed categories.
+  // We use no randomness so we can check that the correct bits are being set.
+  BasicRapporConfig config;
+  config.prob_0_becomes_1 = 0.0;
+  config.prob_1_stays_1 = 1.0;
+  config.categories.set_indexed(10);
+
+  // Construct a BasicRapporEncoder.
+  static const std::string kClientSecretToken = ClientSecret::GenerateNewSecret().GetToken();
+  BasicRapporEncoder encoder(config, ClientSecret::FromToken(kClientSecretToken));
+
+  BasicRapporObservation obs;
+  EXPECT_EQ(kOK, encoder.EncodeIndicators(
+                     {true, false, false, true, false, false, false, false, false, true}, &obs));
+  EXPECT_EQ("0000001000001001", DataToBinaryString(obs.data()));
+  obs.Clear();
+  EXPECT_EQ(kOK, encoder.EncodeIndicators(std::vector<bool>(10, false), &obs));
+  EXPECT_EQ("0000000000000000", DataToBinaryString(obs.data()));
+  obs.Clear();
+
+  // Validate that the wrong number of indicators yields kInvalidInput.
+  EXPECT_EQ(kInvalidInput, encoder.EncodeIndicators(std::vector<bool>(9, true), &obs));
+}
+
 }  // namespace cobalt::rappor
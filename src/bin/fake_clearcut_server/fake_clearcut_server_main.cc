@@ -0,0 +1,119 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A stand-in for the Clearcut backend, for measuring the upload path end to end. It accepts the
+// LogRequests sent by a Cobalt client such as test_app, decrypts and counts the Observations they
+// carry, and periodically prints what it received.
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "gflags/gflags.h"
+#include "src/lib/clearcut/testing/fake_clearcut_server.h"
+#include "src/logging.h"
+
+DEFINE_int32(port, 0, "The loopback port to listen on. If 0, a free port is chosen.");
+DEFINE_int32(connect_latency_ms, 0, "Latency added to each new connection.");
+DEFINE_int32(request_latency_ms, 0, "Latency added to each request.");
+DEFINE_int32(request_latency_jitter_ms, 0,
+             "A random latency of up to this many milliseconds is added to each request.");
+DEFINE_uint64(bandwidth_bytes_per_second, 0,
+              "The bandwidth of each connection. If 0, the bandwidth is not limited.");
+DEFINE_double(error_rate, 0.0, "The fraction of requests answered with a 500.");
+DEFINE_double(unavailable_rate, 0.0, "The fraction of requests answered with a 503.");
+DEFINE_int64(next_request_wait_ms, -1,
+             "The next_request_wait_millis sent with each 503. If -1, none is sent.");
+DEFINE_string(key_dir, "",
+              "If set, new Shuffler and Analyzer key pairs are generated, and their public keys "
+              "are written to shuffler_public.cobalt_key and analyzer_public.cobalt_key in this "
+              "directory, to be passed to test_app with -shuffler_tink_keyset_file and "
+              "-analyzer_tink_keyset_file. Otherwise Envelopes and Observations must be "
+              "unencrypted.");
+DEFINE_int32(stats_interval_seconds, 5, "How often to print the statistics of the requests.");
+
+namespace {
+
+using cobalt::CobaltEncryptionKey;
+using cobalt::lib::clearcut::testing::FakeClearcutServer;
+using cobalt::lib::clearcut::testing::GenerateTestKey;
+
+volatile std::sig_atomic_t shut_down = 0;
+
+void HandleSignal(int /*signal*/) { shut_down = 1; }
+
+// Generates a key pair, writes its public key to |file_name| in FLAGS_key_dir and returns its
+// private keyset.
+std::unique_ptr<crypto::tink::KeysetHandle> MakeKeyOrDie(CobaltEncryptionKey::KeyPurpose purpose,
+                                                        const std::string& file_name) {
+  auto key_or = GenerateTestKey(purpose);
+  CHECK(key_or.ok()) << "Unable to generate a key: " << key_or.status().error_message();
+  auto key = key_or.ConsumeValueOrDie();
+  std::string path = FLAGS_key_dir + "/" + file_name;
+  std::ofstream key_file(path, std::ios::binary | std::ios::trunc);
+  key_file << key.cobalt_encryption_key_bytes;
+  CHECK(key_file.good()) << "Unable to write " << path;
+  return std::move(key.private_keyset);
+}
+
+void PrintStats(const FakeClearcutServer::Stats& stats, std::chrono::duration<double> elapsed) {
+  double seconds = std::max(elapsed.count(), 1e-9);
+  std::cout << "requests=" << stats.num_requests
+            << " injected_errors=" << stats.num_injected_errors
+            << " bad_requests=" << stats.num_bad_requests << " envelopes=" << stats.num_envelopes
+            << " observations=" << stats.num_observations
+            << " invalid_messages=" << stats.num_invalid_messages
+            << " bytes_received=" << stats.num_bytes_received
+            << " observations/s=" << static_cast<double>(stats.num_observations) / seconds
+            << " bytes/s=" << static_cast<double>(stats.num_bytes_received) / seconds << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  google::SetUsageMessage(
+      "A local stand-in for the Clearcut backend.\n"
+      "Point test_app at it with -clearcut_endpoint=<the printed URL>.");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  INIT_LOGGING(argv[0]);
+
+  FakeClearcutServer::Options options;
+  options.port = FLAGS_port;
+  options.connect_latency = std::chrono::milliseconds(FLAGS_connect_latency_ms);
+  options.request_latency = std::chrono::milliseconds(FLAGS_request_latency_ms);
+  options.request_latency_jitter = std::chrono::milliseconds(FLAGS_request_latency_jitter_ms);
+  options.bandwidth_bytes_per_second = FLAGS_bandwidth_bytes_per_second;
+  options.error_rate = FLAGS_error_rate;
+  options.unavailable_rate = FLAGS_unavailable_rate;
+  options.next_request_wait_millis = FLAGS_next_request_wait_ms;
+  if (!FLAGS_key_dir.empty()) {
+    options.shuffler_private_keyset =
+        MakeKeyOrDie(CobaltEncryptionKey::SHUFFLER, "shuffler_public.cobalt_key");
+    options.analyzer_private_keyset =
+        MakeKeyOrDie(CobaltEncryptionKey::ANALYZER, "analyzer_public.cobalt_key");
+  }
+
+  FakeClearcutServer server(std::move(options));
+  CHECK(server.ok()) << "Unable to start the server.";
+  std::cout << "Listening on " << server.url() << std::endl;
+
+  std::signal(SIGINT, HandleSignal);
+  std::signal(SIGTERM, HandleSignal);
+  auto start = std::chrono::steady_clock::now();
+  auto next_print = start + std::chrono::seconds(FLAGS_stats_interval_seconds);
+  while (shut_down == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (std::chrono::steady_clock::now() >= next_print) {
+      PrintStats(server.stats(), std::chrono::steady_clock::now() - start);
+      next_print += std::chrono::seconds(FLAGS_stats_interval_seconds);
+    }
+  }
+  PrintStats(server.stats(), std::chrono::steady_clock::now() - start);
+  return 0;
+}
@@ -6,10 +6,12 @@
 
 #include <libgen.h>
 
+#include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -19,6 +21,7 @@
 #include "src/lib/util/datetime_util.h"
 #include "src/lib/util/file_util.h"
 #include "src/lib/util/posix_file_system.h"
+#include "src/lib/util/protected_fields.h"
 #include "src/lib/util/status.h"
 #include "src/logger/project_context.h"
 #include "src/logger/project_context_factory.h"
@@ -51,15 +54,17 @@ using util::SystemClock;
 using util::SystemClockInterface;
 using util::TimeToDayIndex;
 
-// There are three modes of operation of the Cobalt TestClient program
+// There are four modes of operation of the Cobalt TestClient program
 // determined by the value of this flag.
 // - interactive: The program runs an interactive command-loop.
 // - send-once: The program sends a single Envelope described by flags.
 // - automatic: The program runs forever sending many Envelopes with randomly
 //              generated values.
+// - benchmark: The program logs random events for a fixed time, sends them,
+//              and reports the throughput and the latency of the uploads.
 DEFINE_string(mode, "interactive",
-              "This program may be used in 3 modes: 'interactive', "
-              "'send-once', 'automatic'");
+              "This program may be used in 4 modes: 'interactive', "
+              "'send-once', 'automatic', 'benchmark'");
 
 // Customer ID for Fuchsia is 1.
 DEFINE_uint32(customer_id, 1, "Customer ID");
@@ -89,6 +94,18 @@ DEFINE_string(local_aggregate_backup_file, "", "Back up local aggregates of even
 DEFINE_string(aggregated_obs_history_backup_file, "",
               "Back up the history of sent aggregated Observations to this file.");
 
+DEFINE_string(event_mix, "",
+              "In benchmark mode, a comma-separated list of <metric name>:<weight> "
+              "pairs. Events are logged for each metric in proportion to its weight. "
+              "If empty, only events for -metric_name are logged.");
+DEFINE_uint32(benchmark_seconds, 10, "In benchmark mode, how long to log events for.");
+DEFINE_uint32(benchmark_events_per_second, 0,
+              "In benchmark mode, the rate at which to log events. If 0, events are "
+              "logged as fast as possible.");
+DEFINE_uint32(benchmark_upload_interval_seconds, 1,
+              "In benchmark mode, the interval between uploads while events are "
+              "being logged.");
+
 namespace {
 
 constexpr size_t kMaxBytesPerObservation = 100 * 1024;
@@ -254,6 +271,9 @@ TestApp::Mode ParseMode() {
   if (FLAGS_mode == "automatic") {
     return TestApp::kAutomatic;
   }
+  if (FLAGS_mode == "benchmark") {
+    return TestApp::kBenchmark;
+  }
   LOG(FATAL) << "Unrecognized mode: " << FLAGS_mode;
   std::exit(-1);
 }
@@ -290,10 +310,54 @@ std::vector<std::string> Tokenize(const std::string& line) {
   return tokens;
 }
 
+// Returns the |percentile|th percentile of |sorted_latencies| in milliseconds.
+double PercentileMillis(const std::vector<std::chrono::steady_clock::duration>& sorted_latencies,
+                        double percentile) {
+  if (sorted_latencies.empty()) {
+    return 0.0;
+  }
+  auto index = static_cast<size_t>(percentile / 100 * (sorted_latencies.size() - 1));
+  return std::chrono::duration<double, std::milli>(sorted_latencies[index]).count();
+}
+
 }  // namespace
 
 namespace internal {
 
+// An HTTPClient which records the size and the latency of each request it
+// sends through another HTTPClient.
+class RecordingHTTPClient : public lib::clearcut::HTTPClient {
+ public:
+  RecordingHTTPClient(std::unique_ptr<lib::clearcut::HTTPClient> client,
+                      std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats)
+      : client_(std::move(client)), upload_stats_(std::move(upload_stats)) {}
+
+  lib::statusor::StatusOr<lib::clearcut::HTTPResponse> PostSync(
+      lib::clearcut::HTTPRequest request,
+      std::chrono::steady_clock::time_point deadline) override {
+    size_t request_size = request.body.size();
+    auto start = std::chrono::steady_clock::now();
+    auto response_or = client_->PostSync(std::move(request), deadline);
+    auto latency = std::chrono::steady_clock::now() - start;
+
+    auto stats = upload_stats_->lock();
+    stats->num_requests++;
+    stats->bytes_sent += request_size;
+    stats->latencies.push_back(latency);
+    if (response_or.ok()) {
+      stats->bytes_received += response_or.ValueOrDie().response.size();
+    }
+    if (!response_or.ok() || response_or.ValueOrDie().http_code != 200) {
+      stats->num_failed_requests++;
+    }
+    return response_or;
+  }
+
+ private:
+  std::unique_ptr<lib::clearcut::HTTPClient> client_;
+  std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats_;
+};
+
 // The number of seconds in a day.
 static const int kDay = 86400;
 
@@ -303,7 +367,8 @@ class RealLoggerFactory : public LoggerFactory {
 
   RealLoggerFactory(std::unique_ptr<CobaltService> cobalt_service,
                     std::unique_ptr<ProjectContextFactory> project_context_factory,
-                    uint32_t customer_id, uint32_t project_id);
+                    uint32_t customer_id, uint32_t project_id,
+                    std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats);
 
   std::unique_ptr<LoggerInterface> NewLogger(uint32_t day_index) override;
   size_t ObservationCount() override;
@@ -311,6 +376,7 @@ class RealLoggerFactory : public LoggerFactory {
   void ResetLocalAggregation() override;
   bool GenerateAggregatedObservations(uint32_t day_index) override;
   bool SendAccumulatedObservations() override;
+  UploadStats GetUploadStats() override { return *upload_stats_->const_lock(); }
   const ProjectContext* project_context() override { return project_context_.get(); }
 
  private:
@@ -321,16 +387,19 @@ class RealLoggerFactory : public LoggerFactory {
   std::unique_ptr<ProjectContext> project_context_;
   std::unique_ptr<FakeValidatedClock> validated_clock_;
   std::unique_ptr<SystemClockInterface> mock_clock_;
+  std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats_;
 };
 
-RealLoggerFactory::RealLoggerFactory(std::unique_ptr<CobaltService> cobalt_service,
-                                     std::unique_ptr<ProjectContextFactory> project_context_factory,
-                                     uint32_t customer_id, uint32_t project_id)
+RealLoggerFactory::RealLoggerFactory(
+    std::unique_ptr<CobaltService> cobalt_service,
+    std::unique_ptr<ProjectContextFactory> project_context_factory, uint32_t customer_id,
+    uint32_t project_id, std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats)
     : cobalt_service_(std::move(cobalt_service)),
       project_context_factory_(std::move(project_context_factory)),
       customer_id_(customer_id),
       project_id_(project_id),
-      project_context_(project_context_factory_->NewProjectContext(customer_id_, project_id_)) {}
+      project_context_(project_context_factory_->NewProjectContext(customer_id_, project_id_)),
+      upload_stats_(std::move(upload_stats)) {}
 
 std::unique_ptr<LoggerInterface> RealLoggerFactory::NewLogger(uint32_t day_index) {
   if (day_index != 0u) {
@@ -375,7 +444,9 @@ bool RealLoggerFactory::SendAccumulatedObservations() {
 
 class TestAppPipeline : public TargetPipelineInterface {
  public:
-  TestAppPipeline() : TargetPipelineInterface(system_data::Environment::DEVEL) {}
+  explicit TestAppPipeline(std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats)
+      : TargetPipelineInterface(system_data::Environment::DEVEL),
+        upload_stats_(std::move(upload_stats)) {}
 
   [[nodiscard]] std::optional<std::string> analyzer_encryption_key() const override {
     if (FLAGS_analyzer_tink_keyset_file.empty() || FLAGS_shuffler_tink_keyset_file.empty()) {
@@ -398,11 +469,15 @@ class TestAppPipeline : public TargetPipelineInterface {
   }
 
   [[nodiscard]] std::unique_ptr<lib::clearcut::HTTPClient> TakeHttpClient() override {
-    return std::make_unique<lib::clearcut::CurlHTTPClient>();
+    return std::make_unique<RecordingHTTPClient>(std::make_unique<lib::clearcut::CurlHTTPClient>(),
+                                                 upload_stats_);
   }
 
   [[nodiscard]] std::string clearcut_endpoint() const override { return FLAGS_clearcut_endpoint; }
   [[nodiscard]] size_t clearcut_max_retries() const override { return kDefaultClearcutMaxRetries; }
+
+ private:
+  std::shared_ptr<util::ProtectedFields<UploadStats>> upload_stats_;
 };
 
 }  // namespace internal
@@ -446,7 +521,8 @@ std::unique_ptr<TestApp> TestApp::CreateFromFlagsOrDie(char* argv[]) {
   cfg.min_interval = std::chrono::seconds(0);
   cfg.initial_interval = uploader::UploadScheduler::kMaxSeconds;
 
-  cfg.target_pipeline = std::make_unique<internal::TestAppPipeline>();
+  auto upload_stats = std::make_shared<util::ProtectedFields<UploadStats>>();
+  cfg.target_pipeline = std::make_unique<internal::TestAppPipeline>(upload_stats);
 
   if (mode == TestApp::kAutomatic) {
     // In automatic mode, let the ShippingManager send to the Shuffler
@@ -457,14 +533,26 @@ std::unique_ptr<TestApp> TestApp::CreateFromFlagsOrDie(char* argv[]) {
     cfg.initial_interval = upload_interval;
   }
 
+  if (mode == TestApp::kBenchmark) {
+    // In benchmark mode, upload while events are being logged, as a device
+    // would.
+    const auto upload_interval = std::chrono::seconds(FLAGS_benchmark_upload_interval_seconds);
+    cfg.target_interval = upload_interval;
+    cfg.min_interval = std::chrono::seconds(0);
+    cfg.initial_interval = upload_interval;
+  }
+
   auto cobalt_service = std::make_unique<CobaltService>(std::move(cfg));
 
-  std::unique_ptr<LoggerFactory> logger_factory(
-      new internal::RealLoggerFactory(std::move(cobalt_service), std::move(project_context_factory),
-                                      FLAGS_customer_id, FLAGS_project_id));
+  std::unique_ptr<LoggerFactory> logger_factory(new internal::RealLoggerFactory(
+      std::move(cobalt_service), std::move(project_context_factory), FLAGS_customer_id,
+      FLAGS_project_id, std::move(upload_stats)));
 
   std::unique_ptr<TestApp> test_app(
       new TestApp(std::move(logger_factory), FLAGS_metric_name, mode, &std::cout));
+  test_app->SetBenchmarkParams({.event_mix = FLAGS_event_mix,
+                                .duration = std::chrono::seconds(FLAGS_benchmark_seconds),
+                                .events_per_second = FLAGS_benchmark_events_per_second});
   return test_app;
 }  // namespace cobalt
 
@@ -495,6 +583,9 @@ void TestApp::Run() {
     case kInteractive:
       CommandLoop();
       break;
+    case kBenchmark:
+      RunBenchmark();
+      break;
     default:
       CHECK(false) << "Only interactive mode is coded so far.";
   }
@@ -511,6 +602,171 @@ void TestApp::CommandLoop() {
   }
 }
 
+void TestApp::RunBenchmark() {
+  std::vector<MixedMetric> mix;
+  std::string event_mix = benchmark_params_.event_mix;
+  if (event_mix.empty()) {
+    event_mix = current_metric_->metric_name() + ":1";
+  }
+  if (!ParseEventMix(event_mix, &mix)) {
+    return;
+  }
+  std::vector<uint32_t> weights;
+  for (const auto& mixed_metric : mix) {
+    weights.push_back(mixed_metric.weight);
+  }
+  std::discrete_distribution<size_t> choose_metric(weights.begin(), weights.end());
+  std::mt19937 random;
+
+  auto logger = logger_factory_->NewLogger();
+  logger_factory_->ResetObservationCount();
+  size_t num_events = 0;
+  size_t num_failed_events = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + benchmark_params_.duration;
+  for (auto now = start; now < end; now = std::chrono::steady_clock::now()) {
+    if (benchmark_params_.events_per_second > 0) {
+      std::this_thread::sleep_until(
+          start + std::chrono::microseconds(1000000 * static_cast<int64_t>(num_events) /
+                                            benchmark_params_.events_per_second));
+    }
+    if (LogRandomEvent(logger.get(), mix[choose_metric(random)], &random) != logger::kOK) {
+      num_failed_events++;
+    }
+    num_events++;
+  }
+  auto logging_end = std::chrono::steady_clock::now();
+  bool sent = logger_factory_->SendAccumulatedObservations();
+  auto sending_end = std::chrono::steady_clock::now();
+
+  size_t num_observations = logger_factory_->ObservationCount();
+  UploadStats upload_stats = logger_factory_->GetUploadStats();
+  std::sort(upload_stats.latencies.begin(), upload_stats.latencies.end());
+  double logging_seconds = std::chrono::duration<double>(logging_end - start).count();
+  double total_seconds = std::chrono::duration<double>(sending_end - start).count();
+  *ostream_ << "Logged " << num_events << " events (" << num_failed_events << " failed) in "
+            << logging_seconds << "s: " << num_events / logging_seconds << " events/s."
+            << std::endl;
+  *ostream_ << "Sent " << num_observations << " observations in " << total_seconds
+            << "s, including " << total_seconds - logging_seconds << "s to send the last ones"
+            << (sent ? "" : ", which failed") << ": " << num_observations / total_seconds
+            << " observations/s." << std::endl;
+  *ostream_ << "Uploads: " << upload_stats.num_requests << " requests ("
+            << upload_stats.num_failed_requests << " failed), " << upload_stats.bytes_sent
+            << " bytes sent, " << upload_stats.bytes_received << " bytes received, "
+            << (num_observations > 0
+                    ? static_cast<double>(upload_stats.bytes_sent) / num_observations
+                    : 0.0)
+            << " bytes sent per observation." << std::endl;
+  *ostream_ << "Upload latency: p50=" << PercentileMillis(upload_stats.latencies, 50)
+            << "ms p90=" << PercentileMillis(upload_stats.latencies, 90)
+            << "ms p99=" << PercentileMillis(upload_stats.latencies, 99)
+            << "ms max=" << PercentileMillis(upload_stats.latencies, 100) << "ms." << std::endl;
+}
+
+bool TestApp::ParseEventMix(const std::string& event_mix, std::vector<MixedMetric>* mix) {
+  CHECK(mix);
+  mix->clear();
+  std::istringstream event_mix_stream(event_mix);
+  std::string entry;
+  while (std::getline(event_mix_stream, entry, ',')) {
+    auto colon = entry.rfind(':');
+    int64_t weight = 0;
+    if (colon == std::string::npos ||
+        !ParseNonNegativeInt(entry.substr(colon + 1), false, &weight) || weight == 0) {
+      *ostream_ << "Expected <metric name>:<positive weight> in the event mix: " << entry
+                << std::endl;
+      return false;
+    }
+    const MetricDefinition* metric =
+        logger_factory_->project_context()->GetMetric(entry.substr(0, colon));
+    if (!metric) {
+      *ostream_ << "There is no metric named '" << entry.substr(0, colon) << "'." << std::endl;
+      return false;
+    }
+    bool supported = false;
+    switch (metric->metric_type()) {
+      case MetricDefinition::EVENT_OCCURRED:
+        supported = metric->metric_dimensions_size() == 1;
+        break;
+      case MetricDefinition::EVENT_COUNT:
+      case MetricDefinition::ELAPSED_TIME:
+      case MetricDefinition::FRAME_RATE:
+      case MetricDefinition::MEMORY_USAGE:
+      case MetricDefinition::INT_HISTOGRAM:
+        supported = true;
+        break;
+      default:
+        break;
+    }
+    if (!supported) {
+      *ostream_ << "Events of the metric '" << metric->metric_name()
+                << "' cannot be logged by the benchmark." << std::endl;
+      return false;
+    }
+    MixedMetric mixed_metric = {metric, static_cast<uint32_t>(weight), {}};
+    for (const auto& dimension : metric->metric_dimensions()) {
+      std::vector<uint32_t> event_codes;
+      for (const auto& event_code : dimension.event_codes()) {
+        event_codes.push_back(event_code.first);
+      }
+      std::sort(event_codes.begin(), event_codes.end());
+      mixed_metric.event_codes.push_back(std::move(event_codes));
+    }
+    mix->push_back(std::move(mixed_metric));
+  }
+  if (mix->empty()) {
+    *ostream_ << "The event mix is empty." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+Status TestApp::LogRandomEvent(LoggerInterface* logger, const MixedMetric& mixed_metric,
+                               std::mt19937* random) {
+  std::vector<uint32_t> event_codes;
+  for (int i = 0; i < mixed_metric.metric->metric_dimensions_size(); i++) {
+    const auto& dimension_event_codes = mixed_metric.event_codes[i];
+    if (dimension_event_codes.empty()) {
+      event_codes.push_back(std::uniform_int_distribution<uint32_t>(
+          0, mixed_metric.metric->metric_dimensions(i).max_event_code())(*random));
+    } else {
+      event_codes.push_back(dimension_event_codes[std::uniform_int_distribution<size_t>(
+          0, dimension_event_codes.size() - 1)(*random)]);
+    }
+  }
+  const uint32_t metric_id = mixed_metric.metric->id();
+  const std::string component;
+  switch (mixed_metric.metric->metric_type()) {
+    case MetricDefinition::EVENT_OCCURRED:
+      return logger->LogEvent(metric_id, event_codes[0]);
+    case MetricDefinition::EVENT_COUNT:
+      return logger->LogEventCount(metric_id, event_codes, component, 0, 1);
+    case MetricDefinition::ELAPSED_TIME:
+      return logger->LogElapsedTime(
+          metric_id, event_codes, component,
+          std::uniform_int_distribution<int64_t>(0, 1000000)(*random));
+    case MetricDefinition::FRAME_RATE:
+      return logger->LogFrameRate(metric_id, event_codes, component,
+                                  std::uniform_real_distribution<float>(0, 120)(*random));
+    case MetricDefinition::MEMORY_USAGE:
+      return logger->LogMemoryUsage(
+          metric_id, event_codes, component,
+          std::uniform_int_distribution<int64_t>(0, 1 << 30)(*random));
+    case MetricDefinition::INT_HISTOGRAM: {
+      HistogramPtr histogram = std::make_unique<RepeatedPtrField<HistogramBucket>>();
+      auto* bucket = histogram->Add();
+      bucket->set_index(std::uniform_int_distribution<uint32_t>(0, 9)(*random));
+      bucket->set_count(1);
+      return logger->LogIntHistogram(metric_id, event_codes, component, std::move(histogram));
+    }
+    default:
+      LOG(FATAL) << "Unexpected metric type in the event mix: "
+                 << mixed_metric.metric->metric_type();
+      return logger::kInvalidArguments;
+  }
+}
+
 bool TestApp::ProcessCommandLine(const std::string& command_line) {
   return ProcessCommand(Tokenize(command_line));
 }
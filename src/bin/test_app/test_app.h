@@ -7,8 +7,10 @@
 
 #include <stdint.h>
 
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -21,6 +23,17 @@
 
 namespace cobalt {
 
+// The HTTP requests sent to the Clearcut server, as recorded in benchmark mode.
+struct UploadStats {
+  size_t num_requests = 0;
+  // Requests which failed or were not answered with 200.
+  size_t num_failed_requests = 0;
+  // The sizes of the request and response bodies as sent, after any compression.
+  size_t bytes_sent = 0;
+  size_t bytes_received = 0;
+  std::vector<std::chrono::steady_clock::duration> latencies;
+};
+
 class LoggerFactory {
  public:
   virtual ~LoggerFactory() = default;
@@ -41,6 +54,8 @@ class LoggerFactory {
   virtual bool GenerateAggregatedObservations(uint32_t day_index) = 0;
 
   virtual bool SendAccumulatedObservations() = 0;
+
+  virtual UploadStats GetUploadStats() = 0;
 };
 
 // The Cobalt testing client application.
@@ -62,7 +77,24 @@ class TestApp {
 
     // In this mode the TestApp loops forever generating random Observations and
     // sending many RPCs to the Shuffler.
-    kAutomatic = 2
+    kAutomatic = 2,
+
+    // In this mode the TestApp logs a mix of random events for a fixed time,
+    // then sends all of the resulting Observations, and reports the end-to-end
+    // throughput, the latencies of the uploads and the bytes sent.
+    kBenchmark = 3
+  };
+
+  // The parameters of benchmark mode.
+  struct BenchmarkParams {
+    // A comma-separated list of <metric name>:<weight> pairs. Events are logged
+    // for each metric in proportion to its weight. If empty, only events for
+    // the current metric are logged.
+    std::string event_mix;
+    std::chrono::seconds duration = std::chrono::seconds(10);
+    // The rate at which events are logged. If 0, events are logged as fast as
+    // possible.
+    uint32_t events_per_second = 0;
   };
 
   // Constructor. The |ostream| is used for emitting output in interactive mode.
@@ -76,6 +108,8 @@ class TestApp {
 
   bool SetMetric(const std::string& metric_name);
 
+  void SetBenchmarkParams(BenchmarkParams params) { benchmark_params_ = std::move(params); }
+
   // Run() is invoked by main(). It invokes either CommandLoop(),
   // SendAndQuit(), or RunAutomatic() depending on the mode.
   void Run();
@@ -99,6 +133,27 @@ class TestApp {
   // Implements automatic mode.
   void RunAutomatic();
 
+  // Implements benchmark mode.
+  void RunBenchmark();
+
+  // A metric of the event mix of benchmark mode, with its registered event
+  // codes for each of its dimensions. Events of a dimension without registered
+  // event codes may have any code up to its max_event_code.
+  struct MixedMetric {
+    const MetricDefinition* metric;
+    uint32_t weight;
+    std::vector<std::vector<uint32_t>> event_codes;
+  };
+
+  // Parses |event_mix|, in the format of BenchmarkParams::event_mix, into
+  // |mix|. Returns false if it does not name a metric of the current project
+  // whose events may be logged by the benchmark, or if it is malformed.
+  bool ParseEventMix(const std::string& event_mix, std::vector<MixedMetric>* mix);
+
+  // Logs a random event for |mixed_metric| to |logger|.
+  logger::Status LogRandomEvent(logger::LoggerInterface* logger, const MixedMetric& mixed_metric,
+                                std::mt19937* random);
+
   bool ProcessCommand(const std::vector<std::string>& command);
 
   void Log(const std::vector<std::string>& command);
@@ -161,6 +216,7 @@ class TestApp {
   FRIEND_TEST(TestAppTest, ParseIndex);
   FRIEND_TEST(TestAppTest, ParseNonNegativeInt);
   FRIEND_TEST(TestAppTest, ParseDay);
+  FRIEND_TEST(TestAppTest, ParseEventMix);
 
   // Parses a string of the form <part>:<value> and writes <part> into
   // |part_name| and <value> into |value|.
@@ -181,6 +237,7 @@ class TestApp {
   const MetricDefinition* current_metric_;
   // The TestApp is in interactive mode unless set_mode() is invoked.
   Mode mode_ = kInteractive;
+  BenchmarkParams benchmark_params_;
   std::unique_ptr<LoggerFactory> logger_factory_;
   std::ostream* ostream_;
   std::unique_ptr<util::SystemClockInterface> clock_;
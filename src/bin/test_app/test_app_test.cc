@@ -66,6 +66,8 @@ class TestLoggerFactory : public LoggerFactory {
 
   bool SendAccumulatedObservations() override;
 
+  UploadStats GetUploadStats() override { return UploadStats(); }
+
  private:
   const ProjectContext* project_context_;
   std::unique_ptr<FakeObservationStore> observation_store_;
@@ -288,6 +290,27 @@ TEST_F(TestAppTest, ParseIndex) {
   ClearOutput();
 }
 
+// Tests the parsing of the event mix of benchmark mode.
+TEST_F(TestAppTest, ParseEventMix) {
+  std::vector<TestApp::MixedMetric> mix;
+  ASSERT_TRUE(test_app_->ParseEventMix("ErrorOccurred:3,CacheMiss:1", &mix));
+  ASSERT_EQ(2u, mix.size());
+  EXPECT_EQ("ErrorOccurred", mix[0].metric->metric_name());
+  EXPECT_EQ(3u, mix[0].weight);
+  // ErrorOccurred has one dimension, without registered event codes.
+  ASSERT_EQ(1u, mix[0].event_codes.size());
+  EXPECT_TRUE(mix[0].event_codes[0].empty());
+  EXPECT_EQ("CacheMiss", mix[1].metric->metric_name());
+  EXPECT_EQ(1u, mix[1].weight);
+
+  EXPECT_FALSE(test_app_->ParseEventMix("", &mix));
+  EXPECT_FALSE(test_app_->ParseEventMix("ErrorOccurred", &mix));
+  EXPECT_FALSE(test_app_->ParseEventMix("ErrorOccurred:0", &mix));
+  EXPECT_FALSE(test_app_->ParseEventMix("ErrorOccurred:x", &mix));
+  EXPECT_FALSE(test_app_->ParseEventMix("NoSuchMetric:1", &mix));
+  EXPECT_TRUE(OutputContains("There is no metric named 'NoSuchMetric'"));
+}
+
 // Tests ParseDay utility function.
 TEST_F(TestAppTest, ParseDay) {
   uint32_t d;
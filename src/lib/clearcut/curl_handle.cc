@@ -4,6 +4,8 @@
 
 #include "src/lib/clearcut/curl_handle.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -18,6 +20,7 @@ CurlHandle::~CurlHandle() {
     curl_easy_cleanup(handle_);
     handle_ = nullptr;
   }
+  curl_slist_free_all(header_list_);
 }
 
 StatusOr<std::unique_ptr<CurlHandle>> CurlHandle::Init() {
@@ -29,6 +32,10 @@ StatusOr<std::unique_ptr<CurlHandle>> CurlHandle::Init() {
   RETURN_IF_ERROR(handle->Setopt(CURLOPT_ERRORBUFFER, handle->errbuf_));
   RETURN_IF_ERROR(handle->Setopt(CURLOPT_WRITEDATA, &handle->response_body_));
   RETURN_IF_ERROR(handle->Setopt(CURLOPT_WRITEFUNCTION, CurlHandle::WriteResponseData));
+  // Timeouts must not be implemented with signals, since several handles may be used concurrently.
+  RETURN_IF_ERROR(handle->Setopt(CURLOPT_NOSIGNAL, 1L));
+  // Keep the connection alive while the handle is idle between requests.
+  RETURN_IF_ERROR(handle->Setopt(CURLOPT_TCP_KEEPALIVE, 1L));
   return handle;
 }
 
@@ -47,25 +54,23 @@ Status CurlHandle::Setopt(CURLoption option, Param parameter) {
 }
 
 Status CurlHandle::SetHeaders(const std::map<std::string, std::string> &headers) {
-  if (!headers.empty()) {
-    struct curl_slist *header_list = nullptr;
-    for (const auto &header : headers) {
-      std::string header_str = header.first + ": " + header.second;
-      if (header.second.empty()) {
-        header_str = header.first + ";";
-      }
-      header_list = curl_slist_append(header_list, header_str.c_str());
+  struct curl_slist *header_list = nullptr;
+  for (const auto &header : headers) {
+    std::string header_str = header.first + ": " + header.second;
+    if (header.second.empty()) {
+      header_str = header.first + ";";
     }
-    return Setopt(CURLOPT_HTTPHEADER, header_list);
+    header_list = curl_slist_append(header_list, header_str.c_str());
   }
-  return Status::OK;
+  // The list must stay valid until the request is performed.
+  Status status = Setopt(CURLOPT_HTTPHEADER, header_list);
+  curl_slist_free_all(header_list_);
+  header_list_ = header_list;
+  return status;
 }
 
 Status CurlHandle::SetTimeout(int64_t timeout_ms) {
-  if (timeout_ms > 0) {
-    return Setopt(CURLOPT_TIMEOUT_MS, timeout_ms);
-  }
-  return Status::OK;
+  return Setopt(CURLOPT_TIMEOUT_MS, std::max(timeout_ms, int64_t{0}));
 }
 
 Status CurlHandle::CURLCodeToStatus(CURLcode code) {
@@ -76,17 +81,19 @@ Status CurlHandle::CURLCodeToStatus(CURLcode code) {
   return Status(util::StatusCode::INTERNAL, curl_easy_strerror(code), details);
 }
 
-StatusOr<HTTPResponse> CurlHandle::Post(const std::string &url, std::string body) {
+StatusOr<HTTPResponse> CurlHandle::Post(const std::string &url, const std::string &body) {
   RETURN_IF_ERROR(Setopt(CURLOPT_URL, url.c_str()));
   RETURN_IF_ERROR(Setopt(CURLOPT_POSTFIELDSIZE, body.size()));
   RETURN_IF_ERROR(Setopt(CURLOPT_POSTFIELDS, body.data()));
+  response_body_.clear();
+  errbuf_[0] = '\0';
   auto result = curl_easy_perform(handle_);
 
   switch (result) {
     case CURLE_OK:
       int64_t response_code;
       curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &response_code);
-      return HTTPResponse(response_body_, Status::OK, response_code);
+      return HTTPResponse(std::move(response_body_), Status::OK, response_code);
     case CURLE_OPERATION_TIMEDOUT:
       return Status(util::StatusCode::DEADLINE_EXCEEDED, "Post request timed out.");
     default:
@@ -22,18 +22,24 @@ using lib::statusor::StatusOr;
 using util::Status;
 
 // CurlHandle wraps around a CURL * to make it easier to interact with curl.
+//
+// A CurlHandle may be used for several requests one after the other. curl then keeps the
+// connection to the server open between them, so that later requests to the same server do not
+// pay for a new TCP and TLS handshake.
 class CurlHandle {
  public:
   ~CurlHandle();
 
   template <class Param>
   Status Setopt(CURLoption option, Param parameter);
+  // Replaces the headers of the previous request, if any.
   Status SetHeaders(const std::map<std::string, std::string> &headers);
+  // If |timeout_ms| is not positive, no timeout is used.
   Status SetTimeout(int64_t timeout_ms);
 
   static StatusOr<std::unique_ptr<CurlHandle>> Init();
 
-  StatusOr<HTTPResponse> Post(const std::string &url, std::string body);
+  StatusOr<HTTPResponse> Post(const std::string &url, const std::string &body);
 
  private:
   explicit CurlHandle(CURL *handle);
@@ -43,6 +49,7 @@ class CurlHandle {
 
   char errbuf_[CURL_ERROR_SIZE];
   std::string response_body_;
+  struct curl_slist *header_list_ = nullptr;
   CURL *handle_;
 
   // Disallow copy and assign
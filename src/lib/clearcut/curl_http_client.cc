@@ -17,16 +17,19 @@ using clearcut::HTTPResponse;
 
 bool CurlHTTPClient::global_init_called_ = false;
 
-CurlHTTPClient::CurlHTTPClient() {
+CurlHTTPClient::CurlHTTPClient(size_t max_idle_handles, std::chrono::seconds max_idle_time)
+    : max_idle_handles_(max_idle_handles), max_idle_time_(max_idle_time) {
   if (!CurlHTTPClient::global_init_called_) {
     CurlHTTPClient::global_init_called_ = true;
     curl_global_init(CURL_GLOBAL_ALL);
   }
 }
 
+CurlHTTPClient::~CurlHTTPClient() = default;
+
 StatusOr<HTTPResponse> CurlHTTPClient::PostSync(HTTPRequest request,
                                                 std::chrono::steady_clock::time_point deadline) {
-  auto handle_or = CurlHandle::Init();
+  auto handle_or = TakeHandle();
   if (!handle_or.ok()) {
     return handle_or.status();
   }
@@ -36,7 +39,47 @@ StatusOr<HTTPResponse> CurlHTTPClient::PostSync(HTTPRequest request,
                         .count();
   handle->SetTimeout(timeout_ms);
   handle->SetHeaders(request.headers);
-  return handle->Post(request.url, request.body);
+  auto response = handle->Post(request.url, request.body);
+  ReturnHandle(std::move(handle));
+  return response;
+}
+
+size_t CurlHTTPClient::num_idle_handles() const { return idle_handles_.const_lock()->size(); }
+
+StatusOr<std::unique_ptr<CurlHandle>> CurlHTTPClient::TakeHandle() {
+  std::vector<std::unique_ptr<CurlHandle>> evicted;
+  {
+    auto idle_handles = idle_handles_.lock();
+    EvictIdleHandles(&*idle_handles, &evicted);
+    if (!idle_handles->empty()) {
+      auto handle = std::move(idle_handles->back().handle);
+      idle_handles->pop_back();
+      return handle;
+    }
+  }
+  return CurlHandle::Init();
+}
+
+void CurlHTTPClient::ReturnHandle(std::unique_ptr<CurlHandle> handle) {
+  // The evicted handles, and |handle| if it is not kept, are destroyed after the lock is released.
+  std::vector<std::unique_ptr<CurlHandle>> evicted;
+  auto idle_handles = idle_handles_.lock();
+  EvictIdleHandles(&*idle_handles, &evicted);
+  if (idle_handles->size() < max_idle_handles_) {
+    idle_handles->push_back({std::move(handle), std::chrono::steady_clock::now()});
+  }
+}
+
+void CurlHTTPClient::EvictIdleHandles(std::vector<IdleHandle>* idle_handles,
+                                      std::vector<std::unique_ptr<CurlHandle>>* evicted) const {
+  // The handles are ordered by the time they became idle, so the ones to evict are at the front.
+  auto now = std::chrono::steady_clock::now();
+  auto it = idle_handles->begin();
+  while (it != idle_handles->end() && now - it->idle_since >= max_idle_time_) {
+    evicted->push_back(std::move(it->handle));
+    it++;
+  }
+  idle_handles->erase(idle_handles->begin(), it);
 }
 
 }  // namespace cobalt::lib::clearcut
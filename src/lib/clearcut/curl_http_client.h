@@ -5,24 +5,72 @@
 #ifndef COBALT_SRC_LIB_CLEARCUT_CURL_HTTP_CLIENT_H_
 #define COBALT_SRC_LIB_CLEARCUT_CURL_HTTP_CLIENT_H_
 
+#include <chrono>
+#include <memory>
+#include <vector>
+
 #include "src/lib/clearcut/http_client.h"
 #include "src/lib/statusor/statusor.h"
+#include "src/lib/util/protected_fields.h"
 
 namespace cobalt::lib::clearcut {
 
 using lib::statusor::StatusOr;
 
+class CurlHandle;
+
 // CurlHTTPClient implements clearcut::HTTPClient with a curl backend. This is
 // a basic implementation that is designed to be used on linux clients (not
 // fuchsia).
+//
+// The curl handles, and so the connections to the server, are kept after a
+// request to be reused by later ones. PostSync() may be called concurrently,
+// in which case each concurrent request uses its own handle.
 class CurlHTTPClient : public clearcut::HTTPClient {
  public:
-  CurlHTTPClient();
+  static constexpr size_t kDefaultMaxIdleHandles = 4;
+  static constexpr std::chrono::seconds kDefaultMaxIdleTime = std::chrono::seconds(60);
+
+  // |max_idle_handles|: The maximum number of handles which are kept while no request uses them. If
+  // 0, a new connection is made for each request.
+  //
+  // |max_idle_time|: How long a handle may be kept while no request uses it. Servers close idle
+  // connections after a while, so there is no point in keeping a handle much longer than that.
+  explicit CurlHTTPClient(size_t max_idle_handles = kDefaultMaxIdleHandles,
+                          std::chrono::seconds max_idle_time = kDefaultMaxIdleTime);
+
+  ~CurlHTTPClient() override;
 
   StatusOr<clearcut::HTTPResponse> PostSync(
       clearcut::HTTPRequest request, std::chrono::steady_clock::time_point deadline) override;
 
+  // Returns the number of handles which are kept for later requests.
+  [[nodiscard]] size_t num_idle_handles() const;
+
   static bool global_init_called_;
+
+ private:
+  struct IdleHandle {
+    std::unique_ptr<CurlHandle> handle;
+    std::chrono::steady_clock::time_point idle_since;
+  };
+
+  // Returns the most recently used idle handle, or a new one if there is none.
+  StatusOr<std::unique_ptr<CurlHandle>> TakeHandle();
+
+  // Keeps |handle| for later requests, if there is room for it.
+  void ReturnHandle(std::unique_ptr<CurlHandle> handle);
+
+  // Moves the handles which have been idle for too long from |idle_handles| to |evicted|. They are
+  // destroyed by the caller, after releasing the lock.
+  void EvictIdleHandles(std::vector<IdleHandle>* idle_handles,
+                        std::vector<std::unique_ptr<CurlHandle>>* evicted) const;
+
+  const size_t max_idle_handles_;
+  const std::chrono::seconds max_idle_time_;
+
+  // The idle handles, the most recently used last.
+  util::ProtectedFields<std::vector<IdleHandle>> idle_handles_;
 };
 
 }  // namespace cobalt::lib::clearcut
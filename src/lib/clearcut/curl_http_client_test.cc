@@ -0,0 +1,122 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/clearcut/curl_http_client.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/lib/clearcut/testing/local_http_server.h"
+#include "src/logging.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::lib::clearcut {
+
+using testing::LocalHttpServer;
+
+namespace {
+
+constexpr std::chrono::seconds kTimeout(10);
+
+// Answers each request with its body.
+LocalHttpServer::Response Echo(const LocalHttpServer::Request& request) {
+  return {200, request.body};
+}
+
+// Posts |body| to |server| and checks that it was echoed back.
+void PostAndCheck(CurlHTTPClient* client, const LocalHttpServer& server, const std::string& body) {
+  auto response = client->PostSync(HTTPRequest(server.url(), body),
+                                   std::chrono::steady_clock::now() + kTimeout);
+  ASSERT_TRUE(response.ok()) << response.status().error_message();
+  EXPECT_EQ(200, response.ValueOrDie().http_code);
+  EXPECT_EQ(body, response.ValueOrDie().response);
+}
+
+}  // namespace
+
+// Tests that consecutive requests reuse a single connection.
+TEST(CurlHTTPClientTest, ReusesConnection) {
+  LocalHttpServer server(Echo);
+  ASSERT_TRUE(server.ok());
+  CurlHTTPClient client;
+  for (int i = 0; i < 5; i++) {
+    PostAndCheck(&client, server, "request " + std::to_string(i));
+  }
+  // A large body, which curl sends after an "Expect: 100-continue".
+  PostAndCheck(&client, server, std::string(100000, 'x'));
+  EXPECT_EQ(6u, server.num_requests());
+  EXPECT_EQ(1u, server.num_connections());
+  EXPECT_EQ(1u, client.num_idle_handles());
+}
+
+// Tests that no connection is reused when no idle handle is kept.
+TEST(CurlHTTPClientTest, NoIdleHandles) {
+  LocalHttpServer server(Echo);
+  ASSERT_TRUE(server.ok());
+  CurlHTTPClient client(/*max_idle_handles=*/0);
+  for (int i = 0; i < 3; i++) {
+    PostAndCheck(&client, server, "request " + std::to_string(i));
+  }
+  EXPECT_EQ(3u, server.num_connections());
+  EXPECT_EQ(0u, client.num_idle_handles());
+}
+
+// Tests that handles which have been idle for too long are not reused.
+TEST(CurlHTTPClientTest, EvictsIdleHandles) {
+  LocalHttpServer server(Echo);
+  ASSERT_TRUE(server.ok());
+  CurlHTTPClient client(CurlHTTPClient::kDefaultMaxIdleHandles,
+                        /*max_idle_time=*/std::chrono::seconds(1));
+  PostAndCheck(&client, server, "first");
+  PostAndCheck(&client, server, "second");
+  EXPECT_EQ(1u, server.num_connections());
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  PostAndCheck(&client, server, "third");
+  EXPECT_EQ(2u, server.num_connections());
+}
+
+// Tests that concurrent requests each get a handle, and that the handles are then kept for reuse.
+TEST(CurlHTTPClientTest, ConcurrentPosts) {
+  const int kNumThreads = 4;
+  LocalHttpServer server(Echo, std::chrono::milliseconds::zero(), std::chrono::milliseconds(20));
+  ASSERT_TRUE(server.ok());
+  CurlHTTPClient client(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&client, &server, t] {
+      for (int i = 0; i < 10; i++) {
+        PostAndCheck(&client, server, std::to_string(t) + "/" + std::to_string(i));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(40u, server.num_requests());
+  EXPECT_LE(server.num_connections(), static_cast<size_t>(kNumThreads));
+  EXPECT_EQ(server.num_connections(), client.num_idle_handles());
+}
+
+// Measures the latency of requests with and without reused connections, to a server whose new
+// connections take 50ms to set up. Run with --gtest_also_run_disabled_tests.
+TEST(CurlHTTPClientTest, DISABLED_PostLatency) {
+  const int kNumRequests = 20;
+  LocalHttpServer server(Echo, std::chrono::milliseconds(50), std::chrono::milliseconds(5));
+  ASSERT_TRUE(server.ok());
+  for (size_t max_idle_handles : {0, 1}) {
+    CurlHTTPClient client(max_idle_handles);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumRequests; i++) {
+      PostAndCheck(&client, server, std::string(1000, 'x'));
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << "max_idle_handles=" << max_idle_handles << ": "
+              << elapsed.count() / kNumRequests << "ms/request";
+  }
+}
+
+}  // namespace cobalt::lib::clearcut
@@ -48,6 +48,7 @@ class HTTPRequest {
  public:
   std::string url;
   std::string body;
+  // Extra headers of the request. If |body| is compressed, "Content-Encoding" names the encoding.
   std::map<std::string, std::string> headers;
 
   explicit HTTPRequest(std::string url, std::string body = "")
@@ -0,0 +1,263 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/clearcut/testing/fake_clearcut_server.h"
+
+#include <thread>
+#include <utility>
+
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "src/lib/clearcut/clearcut.pb.h"
+#include "src/lib/util/gzip_stream.h"
+#include "src/lib/util/testing/hybrid_tink_batch_decrypt.h"
+#include "src/logging.h"
+#include "src/pb/clearcut_extensions.pb.h"
+#include "src/pb/envelope.pb.h"
+#include "src/pb/observation2.pb.h"
+#include "third_party/tink/cc/cleartext_keyset_handle.h"
+#include "third_party/tink/cc/hybrid_config.h"
+#include "third_party/tink/cc/hybrid_key_templates.h"
+#include "third_party/tink/proto/tink.pb.h"
+
+namespace cobalt::lib::clearcut::testing {
+
+using clearcut_extensions::LogEventExtension;
+using util::Status;
+using util::StatusCode;
+
+namespace {
+
+constexpr char kShufflerContextInfo[] = "cobalt-1.0-shuffler";
+constexpr char kAnalyzerContextInfo[] = "cobalt-1.0-analyzer";
+
+constexpr int kHttpOk = 200;
+constexpr int kHttpBadRequest = 400;
+constexpr int kHttpInternalServerError = 500;
+constexpr int kHttpServiceUnavailable = 503;
+
+std::unique_ptr<::crypto::tink::HybridDecrypt> MakeDecrypter(
+    const ::crypto::tink::KeysetHandle* private_keyset, bool* ok) {
+  if (private_keyset == nullptr) {
+    return nullptr;
+  }
+  auto decrypter_result = private_keyset->GetPrimitive<::crypto::tink::HybridDecrypt>();
+  if (!decrypter_result.ok()) {
+    LOG(ERROR) << "FakeClearcutServer: Unusable private keyset: "
+               << decrypter_result.status().error_message();
+    *ok = false;
+    return nullptr;
+  }
+  return std::move(decrypter_result.ValueOrDie());
+}
+
+}  // namespace
+
+lib::statusor::StatusOr<TestKey> GenerateTestKey(CobaltEncryptionKey::KeyPurpose purpose,
+                                                 uint32_t key_index) {
+  auto status = ::crypto::tink::HybridConfig::Register();
+  if (!status.ok()) {
+    return Status(StatusCode::INTERNAL, status.error_message());
+  }
+  auto keyset_handle_result = ::crypto::tink::KeysetHandle::GenerateNew(
+      ::crypto::tink::HybridKeyTemplates::EciesP256HkdfHmacSha256Aes128Gcm());
+  if (!keyset_handle_result.ok()) {
+    return Status(StatusCode::INTERNAL, keyset_handle_result.status().error_message());
+  }
+  TestKey key;
+  key.private_keyset = std::move(keyset_handle_result.ValueOrDie());
+
+  auto public_keyset_handle_result = key.private_keyset->GetPublicKeysetHandle();
+  if (!public_keyset_handle_result.ok()) {
+    return Status(StatusCode::INTERNAL, public_keyset_handle_result.status().error_message());
+  }
+  CobaltEncryptionKey cobalt_encryption_key;
+  if (!::crypto::tink::CleartextKeysetHandle::GetKeyset(*public_keyset_handle_result.ValueOrDie())
+           .SerializeToString(cobalt_encryption_key.mutable_serialized_key())) {
+    return Status(StatusCode::INTERNAL, "Unable to serialize the public keyset.");
+  }
+  cobalt_encryption_key.set_key_index(key_index);
+  cobalt_encryption_key.set_purpose(purpose);
+  if (!cobalt_encryption_key.SerializeToString(&key.cobalt_encryption_key_bytes)) {
+    return Status(StatusCode::INTERNAL, "Unable to serialize the CobaltEncryptionKey.");
+  }
+  return key;
+}
+
+FakeClearcutServer::FakeClearcutServer(Options options)
+    : request_latency_jitter_(options.request_latency_jitter),
+      error_rate_(options.error_rate),
+      unavailable_rate_(options.unavailable_rate),
+      next_request_wait_millis_(options.next_request_wait_millis),
+      shuffler_private_keyset_(std::move(options.shuffler_private_keyset)),
+      analyzer_private_keyset_(std::move(options.analyzer_private_keyset)),
+      shuffler_decrypter_(MakeDecrypter(shuffler_private_keyset_.get(), &ok_)),
+      analyzer_decrypter_(MakeDecrypter(analyzer_private_keyset_.get(), &ok_)),
+      server_([this](const LocalHttpServer::Request& request) { return HandleRequest(request); },
+              options.connect_latency, options.request_latency, options.port) {
+  state_.lock()->random.seed(options.seed);
+  server_.SetBandwidth(options.bandwidth_bytes_per_second);
+}
+
+FakeClearcutServer::Stats FakeClearcutServer::stats() const {
+  Stats stats = state_.const_lock()->stats;
+  stats.num_bytes_received = server_.num_bytes_received();
+  return stats;
+}
+
+LocalHttpServer::Response FakeClearcutServer::HandleRequest(
+    const LocalHttpServer::Request& request) {
+  std::chrono::milliseconds extra_latency(0);
+  int injected_error = 0;
+  {
+    auto locked = state_.lock();
+    locked->stats.num_requests++;
+    if (request_latency_jitter_.count() > 0) {
+      extra_latency = std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(
+          0, request_latency_jitter_.count())(locked->random));
+    }
+    double draw = std::uniform_real_distribution<double>(0.0, 1.0)(locked->random);
+    if (draw < error_rate_) {
+      injected_error = kHttpInternalServerError;
+    } else if (draw < error_rate_ + unavailable_rate_) {
+      injected_error = kHttpServiceUnavailable;
+    }
+    if (injected_error != 0) {
+      locked->stats.num_injected_errors++;
+    }
+  }
+  std::this_thread::sleep_for(extra_latency);
+
+  LocalHttpServer::Response response;
+  if (injected_error == kHttpInternalServerError) {
+    response.http_code = kHttpInternalServerError;
+    return response;
+  }
+  LogResponse log_response;
+  if (injected_error == kHttpServiceUnavailable) {
+    response.http_code = kHttpServiceUnavailable;
+    log_response.set_next_request_wait_millis(next_request_wait_millis_);
+    log_response.SerializeToString(&response.body);
+    return response;
+  }
+
+  Stats counts;
+  bool valid = CountLogRequest(request, &counts);
+  {
+    auto locked = state_.lock();
+    locked->stats.num_envelopes += counts.num_envelopes;
+    locked->stats.num_observations += counts.num_observations;
+    locked->stats.num_invalid_messages += counts.num_invalid_messages;
+    if (!valid) {
+      locked->stats.num_bad_requests++;
+    }
+  }
+  if (!valid) {
+    response.http_code = kHttpBadRequest;
+    return response;
+  }
+  response.http_code = kHttpOk;
+  log_response.SerializeToString(&response.body);
+  return response;
+}
+
+bool FakeClearcutServer::CountLogRequest(const LocalHttpServer::Request& request,
+                                         Stats* stats) const {
+  LogRequest log_request;
+  if (request.content_encoding == "gzip") {
+    google::protobuf::io::ArrayInputStream compressed(request.body.data(),
+                                                      static_cast<int>(request.body.size()));
+    util::GzipInputStream decompressed(&compressed);
+    if (!log_request.ParseFromZeroCopyStream(&decompressed) || decompressed.had_error()) {
+      return false;
+    }
+  } else if (!request.content_encoding.empty() || !log_request.ParseFromString(request.body)) {
+    return false;
+  }
+  if (log_request.log_source() < 0 || !log_request.client_info().has_client_type()) {
+    return false;
+  }
+
+  for (const auto& log_event : log_request.log_event()) {
+    if (!log_event.HasExtension(LogEventExtension::ext) ||
+        !log_event.GetExtension(LogEventExtension::ext).has_cobalt_encrypted_envelope()) {
+      stats->num_invalid_messages++;
+      continue;
+    }
+    CountEnvelope(log_event.GetExtension(LogEventExtension::ext).cobalt_encrypted_envelope(),
+                  stats);
+  }
+  return true;
+}
+
+void FakeClearcutServer::CountEnvelope(const EncryptedMessage& encrypted_envelope,
+                                       Stats* stats) const {
+  std::string serialized_envelope;
+  Envelope envelope;
+  if (!Decrypt(shuffler_decrypter_.get(), shuffler_private_keyset_.get(), kShufflerContextInfo,
+               encrypted_envelope, &serialized_envelope) ||
+      !envelope.ParseFromString(serialized_envelope) || envelope.api_key().empty()) {
+    stats->num_invalid_messages++;
+    return;
+  }
+  stats->num_envelopes++;
+
+  for (const auto& batch : envelope.batch()) {
+    const auto& metadata = batch.meta_data();
+    bool valid_metadata = metadata.customer_id() != 0 && metadata.project_id() != 0 &&
+                          metadata.metric_id() != 0 && metadata.report_id() != 0;
+    for (const auto& encrypted_observation : batch.encrypted_observation()) {
+      if (valid_metadata && IsValidObservation(batch.kem_bytes(), encrypted_observation)) {
+        stats->num_observations++;
+      } else {
+        stats->num_invalid_messages++;
+      }
+    }
+  }
+}
+
+bool FakeClearcutServer::IsValidObservation(const std::string& kem_bytes,
+                                            const EncryptedMessage& encrypted_observation) const {
+  std::string serialized_observation;
+  if (encrypted_observation.scheme() == EncryptedMessage::HYBRID_TINK_BATCH) {
+    if (analyzer_private_keyset_ == nullptr) {
+      return false;
+    }
+    auto decrypted_or = util::testing::DecryptHybridTinkBatch(
+        *analyzer_private_keyset_, kAnalyzerContextInfo, kem_bytes, encrypted_observation);
+    if (!decrypted_or.ok()) {
+      return false;
+    }
+    serialized_observation = decrypted_or.ConsumeValueOrDie();
+  } else if (!Decrypt(analyzer_decrypter_.get(), analyzer_private_keyset_.get(),
+                      kAnalyzerContextInfo, encrypted_observation, &serialized_observation)) {
+    return false;
+  }
+  Observation2 observation;
+  return observation.ParseFromString(serialized_observation);
+}
+
+bool FakeClearcutServer::Decrypt(const ::crypto::tink::HybridDecrypt* decrypter,
+                                 const ::crypto::tink::KeysetHandle* private_keyset,
+                                 const std::string& context_info, const EncryptedMessage& message,
+                                 std::string* plaintext) {
+  if (private_keyset == nullptr) {
+    if (message.scheme() != EncryptedMessage::NONE) {
+      return false;
+    }
+    *plaintext = message.ciphertext();
+    return true;
+  }
+  if (decrypter == nullptr || message.scheme() == EncryptedMessage::NONE) {
+    return false;
+  }
+  auto decrypted_result = decrypter->Decrypt(message.ciphertext(), context_info);
+  if (!decrypted_result.ok()) {
+    return false;
+  }
+  *plaintext = std::move(decrypted_result.ValueOrDie());
+  return true;
+}
+
+}  // namespace cobalt::lib::clearcut::testing
@@ -0,0 +1,145 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_CLEARCUT_TESTING_FAKE_CLEARCUT_SERVER_H_
+#define COBALT_SRC_LIB_CLEARCUT_TESTING_FAKE_CLEARCUT_SERVER_H_
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "src/lib/clearcut/testing/local_http_server.h"
+#include "src/lib/statusor/statusor.h"
+#include "src/lib/util/protected_fields.h"
+#include "src/pb/encrypted_message.pb.h"
+#include "src/pb/key.pb.h"
+#include "third_party/tink/cc/hybrid_decrypt.h"
+#include "third_party/tink/cc/keyset_handle.h"
+
+namespace cobalt::lib::clearcut::testing {
+
+// A key pair of the Shuffler or the Analyzer, for testing.
+struct TestKey {
+  std::unique_ptr<::crypto::tink::KeysetHandle> private_keyset;
+  // A serialized CobaltEncryptionKey holding the public keyset, as expected by
+  // EncryptedMessageMaker::MakeForEnvelopes() or MakeForObservations().
+  std::string cobalt_encryption_key_bytes;
+};
+
+// Generates a new ECIES-AEAD-HKDF key pair with an AES-GCM DEM, which supports batch encryption.
+lib::statusor::StatusOr<TestKey> GenerateTestKey(CobaltEncryptionKey::KeyPurpose purpose,
+                                                 uint32_t key_index = 1);
+
+// FakeClearcutServer stands in for the Clearcut backend in end-to-end tests and benchmarks. It
+// accepts LogRequests posted to a loopback port, decrypts the Envelopes and the Observations they
+// carry, checks that they are well-formed and counts them.
+//
+// It can inject latency, errors, requests to pause uploads, and bandwidth limits.
+class FakeClearcutServer {
+ public:
+  struct Options {
+    // The loopback port to listen on. If 0, a free port is chosen.
+    int port = 0;
+
+    // How long a new connection waits before its first request is read.
+    std::chrono::milliseconds connect_latency = std::chrono::milliseconds::zero();
+
+    // How long each request waits before it is answered. A random extra latency of up to
+    // |request_latency_jitter| is added to each request.
+    std::chrono::milliseconds request_latency = std::chrono::milliseconds::zero();
+    std::chrono::milliseconds request_latency_jitter = std::chrono::milliseconds::zero();
+
+    // The bandwidth of each connection in bytes per second. 0 means no limit.
+    size_t bandwidth_bytes_per_second = 0;
+
+    // The fraction of requests which are answered with "500 Internal Server Error".
+    double error_rate = 0.0;
+
+    // The fraction of requests which are answered with "503 Service Unavailable".
+    double unavailable_rate = 0.0;
+
+    // The next_request_wait_millis of the LogResponse sent with each 503. -1 means none.
+    int64_t next_request_wait_millis = -1;
+
+    // The private keysets of the Shuffler and of the Analyzer. Envelopes and Observations must be
+    // unencrypted if the corresponding keyset is null.
+    std::unique_ptr<::crypto::tink::KeysetHandle> shuffler_private_keyset;
+    std::unique_ptr<::crypto::tink::KeysetHandle> analyzer_private_keyset;
+
+    // Seeds the choice of the latencies and of the requests which fail.
+    uint32_t seed = 0;
+  };
+
+  struct Stats {
+    // All of the requests received, including those answered with an injected error.
+    size_t num_requests = 0;
+    size_t num_injected_errors = 0;
+    // Requests which are not LogRequests. They are answered with "400 Bad Request".
+    size_t num_bad_requests = 0;
+    size_t num_envelopes = 0;
+    size_t num_observations = 0;
+    // Envelopes and Observations which cannot be decrypted or parsed, or whose metadata is
+    // incomplete.
+    size_t num_invalid_messages = 0;
+    // The bytes of the requests, including their HTTP headers.
+    size_t num_bytes_received = 0;
+  };
+
+  explicit FakeClearcutServer(Options options);
+
+  // Returns false if the server could not listen on a port or a keyset is not usable.
+  [[nodiscard]] bool ok() const { return ok_ && server_.ok(); }
+
+  // Returns the URL to which LogRequests should be posted.
+  [[nodiscard]] std::string url() const { return server_.url(); }
+
+  [[nodiscard]] Stats stats() const;
+
+ private:
+  LocalHttpServer::Response HandleRequest(const LocalHttpServer::Request& request);
+
+  // Parses the LogRequest in |request| and counts its contents in |stats|. Returns false if
+  // |request| is not a LogRequest.
+  bool CountLogRequest(const LocalHttpServer::Request& request, Stats* stats) const;
+
+  // Decrypts the Envelope in |encrypted_envelope| and counts it and its Observations in |stats|.
+  void CountEnvelope(const EncryptedMessage& encrypted_envelope, Stats* stats) const;
+
+  // Returns true if |encrypted_observation| holds an Observation2. |kem_bytes| is the key
+  // encapsulation of its ObservationBatch.
+  bool IsValidObservation(const std::string& kem_bytes,
+                          const EncryptedMessage& encrypted_observation) const;
+
+  // Decrypts |message| into |plaintext| with |decrypter| and |private_keyset|, which are null if
+  // messages of that kind are unencrypted.
+  static bool Decrypt(const ::crypto::tink::HybridDecrypt* decrypter,
+                      const ::crypto::tink::KeysetHandle* private_keyset,
+                      const std::string& context_info, const EncryptedMessage& message,
+                      std::string* plaintext);
+
+  const std::chrono::milliseconds request_latency_jitter_;
+  const double error_rate_;
+  const double unavailable_rate_;
+  const int64_t next_request_wait_millis_;
+  const std::unique_ptr<::crypto::tink::KeysetHandle> shuffler_private_keyset_;
+  const std::unique_ptr<::crypto::tink::KeysetHandle> analyzer_private_keyset_;
+  // Declared before the decrypters, whose construction may clear it.
+  bool ok_ = true;
+  std::unique_ptr<::crypto::tink::HybridDecrypt> shuffler_decrypter_;
+  std::unique_ptr<::crypto::tink::HybridDecrypt> analyzer_decrypter_;
+
+  struct State {
+    Stats stats;
+    std::mt19937 random;
+  };
+  util::ProtectedFields<State> state_;
+
+  // Declared last so that it stops calling HandleRequest() before the rest is destroyed.
+  LocalHttpServer server_;
+};
+
+}  // namespace cobalt::lib::clearcut::testing
+
+#endif  // COBALT_SRC_LIB_CLEARCUT_TESTING_FAKE_CLEARCUT_SERVER_H_
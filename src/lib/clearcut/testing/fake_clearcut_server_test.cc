@@ -0,0 +1,179 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/clearcut/testing/fake_clearcut_server.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "src/lib/clearcut/curl_http_client.h"
+#include "src/lib/clearcut/uploader.h"
+#include "src/lib/util/encrypted_message_util.h"
+#include "src/pb/clearcut_extensions.pb.h"
+#include "src/pb/envelope.pb.h"
+#include "src/pb/observation2.pb.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::lib::clearcut::testing {
+
+using clearcut_extensions::LogEventExtension;
+using util::EncryptedMessageMaker;
+using util::StatusCode;
+
+namespace {
+
+constexpr int32_t kLogSource = 844;
+constexpr char kApiKey[] = "test_api_key";
+
+// Returns a LogRequest with an Envelope for each entry of |observations_per_envelope|, holding
+// that many Observations.
+LogRequest MakeLogRequest(const std::vector<size_t>& observations_per_envelope,
+                          const EncryptedMessageMaker& envelope_encrypter,
+                          const EncryptedMessageMaker& observation_encrypter) {
+  LogRequest request;
+  request.set_log_source(kLogSource);
+  for (size_t num_observations : observations_per_envelope) {
+    Envelope envelope;
+    envelope.set_api_key(kApiKey);
+    auto* batch = envelope.add_batch();
+    batch->mutable_meta_data()->set_customer_id(1);
+    batch->mutable_meta_data()->set_project_id(2);
+    batch->mutable_meta_data()->set_metric_id(3);
+    batch->mutable_meta_data()->set_report_id(4);
+    batch->set_kem_bytes(observation_encrypter.kem_bytes());
+    for (size_t i = 0; i < num_observations; i++) {
+      Observation2 observation;
+      observation.set_random_id("random_id");
+      observation.mutable_basic_rappor()->set_data("data");
+      EXPECT_TRUE(observation_encrypter.Encrypt(observation, batch->add_encrypted_observation()));
+    }
+    auto extension = std::make_unique<LogEventExtension>();
+    EXPECT_TRUE(
+        envelope_encrypter.Encrypt(envelope, extension->mutable_cobalt_encrypted_envelope()));
+    request.add_log_event()->SetAllocatedExtension(LogEventExtension::ext, extension.release());
+  }
+  return request;
+}
+
+std::unique_ptr<ClearcutUploader> MakeUploader(const FakeClearcutServer& server) {
+  return std::make_unique<ClearcutUploader>(server.url(), std::make_unique<CurlHTTPClient>(),
+                                            /*upload_timeout_millis=*/10000,
+                                            /*initial_backoff_millis=*/10);
+}
+
+}  // namespace
+
+// Tests that the Envelopes and Observations of unencrypted requests are counted, whether or not
+// the requests are compressed.
+TEST(FakeClearcutServerTest, CountsObservations) {
+  FakeClearcutServer server({});
+  ASSERT_TRUE(server.ok());
+  auto uploader = MakeUploader(server);
+  auto unencrypted = EncryptedMessageMaker::MakeUnencrypted();
+
+  LogRequest request = MakeLogRequest({3, 5}, *unencrypted, *unencrypted);
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+  uploader->SetCompression(9, 0);
+  request = MakeLogRequest({7}, *unencrypted, *unencrypted);
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+
+  auto stats = server.stats();
+  EXPECT_EQ(2u, stats.num_requests);
+  EXPECT_EQ(0u, stats.num_bad_requests);
+  EXPECT_EQ(3u, stats.num_envelopes);
+  EXPECT_EQ(15u, stats.num_observations);
+  EXPECT_EQ(0u, stats.num_invalid_messages);
+  EXPECT_GT(stats.num_bytes_received, 0u);
+}
+
+// Tests that messages encrypted with the server's keys are decrypted, and that unencrypted
+// messages are then rejected.
+TEST(FakeClearcutServerTest, DecryptsWithTestKeys) {
+  auto shuffler_key_or = GenerateTestKey(CobaltEncryptionKey::SHUFFLER);
+  auto analyzer_key_or = GenerateTestKey(CobaltEncryptionKey::ANALYZER);
+  ASSERT_TRUE(shuffler_key_or.ok());
+  ASSERT_TRUE(analyzer_key_or.ok());
+  auto shuffler_key = shuffler_key_or.ConsumeValueOrDie();
+  auto analyzer_key = analyzer_key_or.ConsumeValueOrDie();
+  auto envelope_encrypter =
+      EncryptedMessageMaker::MakeForEnvelopes(shuffler_key.cobalt_encryption_key_bytes)
+          .ConsumeValueOrDie();
+  auto observation_encrypter =
+      EncryptedMessageMaker::MakeForObservations(analyzer_key.cobalt_encryption_key_bytes,
+                                                 /*batch_encryption=*/true)
+          .ConsumeValueOrDie();
+
+  FakeClearcutServer::Options options;
+  options.shuffler_private_keyset = std::move(shuffler_key.private_keyset);
+  options.analyzer_private_keyset = std::move(analyzer_key.private_keyset);
+  FakeClearcutServer server(std::move(options));
+  ASSERT_TRUE(server.ok());
+  auto uploader = MakeUploader(server);
+
+  LogRequest request = MakeLogRequest({4}, *envelope_encrypter, *observation_encrypter);
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+  auto batch_encrypter = observation_encrypter->NewBatchEncrypter();
+  request = MakeLogRequest({6}, *envelope_encrypter, *batch_encrypter);
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+  auto unencrypted = EncryptedMessageMaker::MakeUnencrypted();
+  request = MakeLogRequest({2}, *unencrypted, *unencrypted);
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+
+  auto stats = server.stats();
+  EXPECT_EQ(2u, stats.num_envelopes);
+  EXPECT_EQ(10u, stats.num_observations);
+  EXPECT_EQ(1u, stats.num_invalid_messages);
+}
+
+// Tests that a body which is not a LogRequest is answered with "400 Bad Request".
+TEST(FakeClearcutServerTest, RejectsBadRequests) {
+  FakeClearcutServer server({});
+  ASSERT_TRUE(server.ok());
+  CurlHTTPClient client;
+  auto response_or = client.PostSync(HTTPRequest(server.url(), "not a LogRequest"),
+                                     std::chrono::steady_clock::now() + std::chrono::seconds(10));
+  ASSERT_TRUE(response_or.ok());
+  EXPECT_EQ(400, response_or.ValueOrDie().http_code);
+  EXPECT_EQ(1u, server.stats().num_bad_requests);
+}
+
+// Tests that injected 503s carry the wait requested of the uploader.
+TEST(FakeClearcutServerTest, InjectsServiceUnavailable) {
+  FakeClearcutServer::Options options;
+  options.unavailable_rate = 1.0;
+  options.next_request_wait_millis = 60000;
+  FakeClearcutServer server(std::move(options));
+  ASSERT_TRUE(server.ok());
+  auto uploader = MakeUploader(server);
+  auto unencrypted = EncryptedMessageMaker::MakeUnencrypted();
+
+  LogRequest request = MakeLogRequest({1}, *unencrypted, *unencrypted);
+  EXPECT_EQ(StatusCode::RESOURCE_EXHAUSTED, uploader->UploadEvents(&request, 1).error_code());
+  EXPECT_GT(uploader->pause_uploads_until(),
+            std::chrono::steady_clock::now() + std::chrono::seconds(30));
+  auto stats = server.stats();
+  EXPECT_EQ(1u, stats.num_requests);
+  EXPECT_EQ(1u, stats.num_injected_errors);
+  EXPECT_EQ(0u, stats.num_observations);
+}
+
+// Tests that the bandwidth limit adds the transfer time of each request to its latency.
+TEST(FakeClearcutServerTest, LimitsBandwidth) {
+  FakeClearcutServer::Options options;
+  options.bandwidth_bytes_per_second = 100 * 1000;
+  FakeClearcutServer server(std::move(options));
+  ASSERT_TRUE(server.ok());
+  auto uploader = MakeUploader(server);
+  auto unencrypted = EncryptedMessageMaker::MakeUnencrypted();
+
+  // Each Observation takes more than 20 bytes, so this request takes more than 200ms.
+  LogRequest request = MakeLogRequest({1000}, *unencrypted, *unencrypted);
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(uploader->UploadEvents(&request, 1).ok());
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200));
+  EXPECT_EQ(1000u, server.stats().num_observations);
+}
+
+}  // namespace cobalt::lib::clearcut::testing
@@ -0,0 +1,187 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/clearcut/testing/local_http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <utility>
+
+namespace cobalt::lib::clearcut::testing {
+
+namespace {
+
+constexpr int kPollTimeoutMillis = 50;
+constexpr char kHeaderEnd[] = "\r\n\r\n";
+
+// Returns the value of the header |name| in |headers|, or the empty string. |name| must be lower
+// case.
+std::string GetHeader(const std::string& headers, const std::string& name) {
+  std::string lower_headers = headers;
+  std::transform(lower_headers.begin(), lower_headers.end(), lower_headers.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  auto pos = lower_headers.find("\r\n" + name + ":");
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += name.size() + 3;
+  auto end = headers.find("\r\n", pos);
+  std::string value = headers.substr(pos, end - pos);
+  value.erase(0, value.find_first_not_of(' '));
+  return value;
+}
+
+bool SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (result <= 0) {
+      return false;
+    }
+    sent += result;
+  }
+  return true;
+}
+
+}  // namespace
+
+LocalHttpServer::LocalHttpServer(Handler handler, std::chrono::milliseconds connect_latency,
+                                 std::chrono::milliseconds request_latency, int port)
+    : handler_(std::move(handler)),
+      connect_latency_(connect_latency),
+      request_latency_(request_latency) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return;
+  }
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t address_size = sizeof(address);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0 ||
+      getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_size) != 0) {
+    close(fd);
+    return;
+  }
+  listen_fd_ = fd;
+  port_ = ntohs(address.sin_port);
+  accept_thread_ = std::thread([this] { Accept(); });
+}
+
+LocalHttpServer::~LocalHttpServer() {
+  shut_down_ = true;
+  if (accept_thread_.joinable()) {
+    accept_thread_.join();
+  }
+
+  Connections connections;
+  {
+    auto locked = connections_.lock();
+    for (int fd : locked->fds) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    std::swap(connections, *locked);
+  }
+  for (auto& thread : connections.threads) {
+    thread.join();
+  }
+  for (int fd : connections.fds) {
+    close(fd);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+  }
+}
+
+std::string LocalHttpServer::url() const {
+  return "http://127.0.0.1:" + std::to_string(port_) + "/";
+}
+
+void LocalHttpServer::Accept() {
+  while (!shut_down_) {
+    pollfd poll_fd = {listen_fd_, POLLIN, 0};
+    if (poll(&poll_fd, 1, kPollTimeoutMillis) <= 0) {
+      continue;
+    }
+    int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    num_connections_++;
+    auto locked = connections_.lock();
+    locked->fds.push_back(fd);
+    locked->threads.emplace_back([this, fd] { Serve(fd); });
+  }
+}
+
+void LocalHttpServer::Serve(int fd) {
+  std::this_thread::sleep_for(connect_latency_);
+  std::string buffer;
+  char chunk[4096];
+  while (!shut_down_) {
+    // Read the request line and the headers.
+    size_t header_end;
+    while ((header_end = buffer.find(kHeaderEnd)) == std::string::npos) {
+      ssize_t result = recv(fd, chunk, sizeof(chunk), 0);
+      if (result <= 0) {
+        return;
+      }
+      buffer.append(chunk, result);
+    }
+    std::string headers = buffer.substr(0, header_end + 2);
+    buffer.erase(0, header_end + sizeof(kHeaderEnd) - 1);
+
+    if (GetHeader(headers, "expect") == "100-continue" &&
+        !SendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      return;
+    }
+    std::string content_length = GetHeader(headers, "content-length");
+    size_t body_size = content_length.empty() ? 0 : std::stoul(content_length);
+    while (buffer.size() < body_size) {
+      ssize_t result = recv(fd, chunk, sizeof(chunk), 0);
+      if (result <= 0) {
+        return;
+      }
+      buffer.append(chunk, result);
+    }
+    Request request;
+    request.content_encoding = GetHeader(headers, "content-encoding");
+    request.body = buffer.substr(0, body_size);
+    buffer.erase(0, body_size);
+    // |headers| lacks the final blank line.
+    size_t request_size = headers.size() + 2 + body_size;
+    num_bytes_received_ += request_size;
+    WaitForTransfer(request_size);
+
+    std::this_thread::sleep_for(request_latency_);
+    Response response = handler_(request);
+    std::string message = "HTTP/1.1 " + std::to_string(response.http_code) +
+                          (response.http_code == 200 ? " OK" : " Error") +
+                          "\r\nContent-Type: application/x-protobuf\r\nContent-Length: " +
+                          std::to_string(response.body.size()) + "\r\n\r\n" + response.body;
+    WaitForTransfer(message.size());
+    num_requests_++;
+    if (!SendAll(fd, message) || GetHeader(headers, "connection") == "close") {
+      return;
+    }
+  }
+}
+
+void LocalHttpServer::WaitForTransfer(size_t num_bytes) const {
+  size_t bytes_per_second = bytes_per_second_;
+  if (bytes_per_second == 0) {
+    return;
+  }
+  std::this_thread::sleep_for(std::chrono::microseconds(num_bytes * 1000000 / bytes_per_second));
+}
+
+}  // namespace cobalt::lib::clearcut::testing
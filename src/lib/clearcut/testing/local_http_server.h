@@ -0,0 +1,101 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_CLEARCUT_TESTING_LOCAL_HTTP_SERVER_H_
+#define COBALT_SRC_LIB_CLEARCUT_TESTING_LOCAL_HTTP_SERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/lib/util/protected_fields.h"
+
+namespace cobalt::lib::clearcut::testing {
+
+// LocalHttpServer is a minimal HTTP/1.1 server listening on a loopback port, for testing HTTP
+// clients. It keeps connections alive between requests, and can inject latency into new
+// connections and into each request to stand in for the handshakes and round trips of a remote
+// server. It can also limit its bandwidth to stand in for a slow network.
+//
+// Each connection is served by its own thread.
+class LocalHttpServer {
+ public:
+  struct Request {
+    // The value of the Content-Encoding header, or the empty string.
+    std::string content_encoding;
+    std::string body;
+  };
+
+  struct Response {
+    int http_code = 200;
+    std::string body;
+  };
+
+  // Computes the response to a POST request. It may be called concurrently.
+  using Handler = std::function<Response(const Request& request)>;
+
+  // |connect_latency|: How long a new connection waits before its first request is read.
+  // |request_latency|: How long each request waits before it is answered.
+  // |port|: The loopback port to listen on. If 0, a free port is chosen.
+  explicit LocalHttpServer(
+      Handler handler,
+      std::chrono::milliseconds connect_latency = std::chrono::milliseconds::zero(),
+      std::chrono::milliseconds request_latency = std::chrono::milliseconds::zero(), int port = 0);
+
+  // Closes all of the connections and stops the server.
+  ~LocalHttpServer();
+
+  // Returns false if the server could not listen on a port.
+  [[nodiscard]] bool ok() const { return listen_fd_ >= 0; }
+
+  // Returns the URL for requests to the server.
+  [[nodiscard]] std::string url() const;
+
+  // The number of connections which have been accepted so far.
+  [[nodiscard]] size_t num_connections() const { return num_connections_; }
+
+  // The number of requests which have been answered so far.
+  [[nodiscard]] size_t num_requests() const { return num_requests_; }
+
+  // The number of bytes of requests, including their headers, which have been read so far.
+  [[nodiscard]] size_t num_bytes_received() const { return num_bytes_received_; }
+
+  // Limits the rate at which each connection transfers requests and responses to
+  // |bytes_per_second|. The transfer time is added to the latency of each request. 0, the default,
+  // means no limit.
+  void SetBandwidth(size_t bytes_per_second) { bytes_per_second_ = bytes_per_second; }
+
+ private:
+  void Accept();
+  void Serve(int fd);
+
+  // Waits for as long as |num_bytes| take to transfer at the bandwidth limit.
+  void WaitForTransfer(size_t num_bytes) const;
+
+  const Handler handler_;
+  const std::chrono::milliseconds connect_latency_;
+  const std::chrono::milliseconds request_latency_;
+
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::atomic<bool> shut_down_{false};
+  std::atomic<size_t> num_connections_{0};
+  std::atomic<size_t> num_requests_{0};
+  std::atomic<size_t> num_bytes_received_{0};
+  std::atomic<size_t> bytes_per_second_{0};
+  std::thread accept_thread_;
+
+  struct Connections {
+    std::vector<int> fds;
+    std::vector<std::thread> threads;
+  };
+  util::ProtectedFields<Connections> connections_;
+};
+
+}  // namespace cobalt::lib::clearcut::testing
+
+#endif  // COBALT_SRC_LIB_CLEARCUT_TESTING_LOCAL_HTTP_SERVER_H_
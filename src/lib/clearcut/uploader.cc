@@ -7,8 +7,12 @@
 #include <algorithm>
 #include <cmath>
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
 #include "src/lib/clearcut/clearcut.pb.h"
 #include "src/lib/statusor/status_macros.h"
+#include "src/lib/util/gzip_stream.h"
 #include "src/logging.h"
 #include "unistd.h"
 
@@ -38,6 +42,16 @@ ClearcutUploader::ClearcutUploader(std::string url, std::unique_ptr<HTTPClient>
 }
 
 Status ClearcutUploader::UploadEvents(LogRequest* log_request, int32_t max_retries) {
+  // The request is serialized and compressed once, and each attempt sends a copy of it.
+  log_request->mutable_client_info()->set_client_type(kFuchsiaClientType);
+  HTTPRequest request(url_);
+  if (!log_request->SerializeToString(&request.body)) {
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  "ClearcutUploader: Unable to serialize log_request to binary proto.");
+  }
+  size_t raw_request_body_size = request.body.size();
+  MaybeCompress(&request);
+
   int32_t i = 0;
   auto deadline = std::chrono::steady_clock::time_point::max();
   if (upload_timeout_ > std::chrono::milliseconds(0)) {
@@ -45,7 +59,8 @@ Status ClearcutUploader::UploadEvents(LogRequest* log_request, int32_t max_retri
   }
   auto backoff = initial_backoff_;
   while (true) {
-    Status response = TryUploadEvents(log_request, deadline);
+    Status response =
+        TryUploadEvents(&request, raw_request_body_size, i + 1 == max_retries, deadline);
     if (response.ok() || ++i == max_retries) {
       return response;
     }
@@ -63,7 +78,7 @@ Status ClearcutUploader::UploadEvents(LogRequest* log_request, int32_t max_retri
       return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded.");
     }
     // Exponential backoff.
-    auto time_until_pause_end = pause_uploads_until_ - steady_clock_->now();
+    auto time_until_pause_end = pause_uploads_until_.load() - steady_clock_->now();
     if (time_until_pause_end > backoff) {
       VLOG(5) << "ClearcutUploader: Sleeping for time requested by server: "
               << std::chrono::duration<double>(time_until_pause_end).count() << "s";
@@ -78,35 +93,39 @@ Status ClearcutUploader::UploadEvents(LogRequest* log_request, int32_t max_retri
   }
 }
 
-Status ClearcutUploader::TryUploadEvents(LogRequest* log_request,
+Status ClearcutUploader::TryUploadEvents(HTTPRequest* request, size_t raw_request_body_size,
+                                         bool last_attempt,
                                          std::chrono::steady_clock::time_point deadline) {
-  if (steady_clock_->now() < pause_uploads_until_) {
+  if (steady_clock_->now() < pause_uploads_until_.load()) {
     return Status(StatusCode::RESOURCE_EXHAUSTED,
                   "Uploads are currently paused at the request of the "
                   "clearcut server");
   }
 
-  log_request->mutable_client_info()->set_client_type(kFuchsiaClientType);
   HTTPResponse response;
   // Because we will be moving the request body into the Post() method it will not be available to
-  // us later. Here we keep an escaped copy of the request body just in case we need to use it
-  // in an error log message later.
+  // us later. If errors are logged, here we keep an escaped copy of the request body just in case
+  // we need to use it in an error log message later.
   std::string escaped_request_body;
-  uint32_t request_body_size;  // Needed for metrics on successful requests after Post() move.
+  if (VLOG_IS_ON(1)) {
+    escaped_request_body = absl::CEscape(request->body);
+  }
+  uint32_t request_body_size = request->body.size();
+  internal_metrics_->BytesUploaded(logger::PerDeviceBytesUploadedMetricDimensionStatus::Attempted,
+                                   request_body_size);
+
+  VLOG(5) << "ClearcutUploader: Sending POST request of " << request_body_size << " bytes ("
+          << raw_request_body_size << " bytes uncompressed) to " << url_ << ".";
   {
-    HTTPRequest request(url_);
-    if (!log_request->SerializeToString(&request.body)) {
-      return Status(StatusCode::INVALID_ARGUMENT,
-                    "ClearcutUploader: Unable to serialize log_request to binary proto.");
+    // The request is only copied if it may have to be sent again.
+    HTTPRequest attempt(request->url);
+    if (last_attempt) {
+      attempt = std::move(*request);
+    } else {
+      attempt.body = request->body;
+      attempt.headers = request->headers;
     }
-
-    escaped_request_body = absl::CEscape(request.body);
-    request_body_size = request.body.size();
-    internal_metrics_->BytesUploaded(logger::PerDeviceBytesUploadedMetricDimensionStatus::Attempted,
-                                     request_body_size);
-
-    VLOG(5) << "ClearcutUploader: Sending POST request to " << url_ << ".";
-    auto response_or = client_->PostSync(std::move(request), deadline);
+    auto response_or = client_->PostSync(std::move(attempt), deadline);
     if (!response_or.ok()) {
       const Status& status = response_or.status();
       VLOG(5) << "ClearcutUploader: Failed to send POST request: (" << status.error_code() << ") "
@@ -126,20 +145,22 @@ Status ClearcutUploader::TryUploadEvents(LogRequest* log_request,
 
   VLOG(5) << "ClearcutUploader: Received POST response: " << response.http_code << ".";
   if (response.http_code != kHttpOk) {
-    std::ostringstream s;
-    std::string escaped_response_body = absl::CEscape(response.response);
-    s << "ClearcutUploader: Response was not OK: " << response.http_code << ".";
-    s << " url=" << url_;
-    s << " response contained " << response.headers.size() << " <headers>";
-    for (const auto& pair : response.headers) {
-      s << "<key>" << pair.first << "</key>"
-        << ":"
-        << "<value>" << pair.second << "</value>,";
+    if (VLOG_IS_ON(1)) {
+      std::ostringstream s;
+      std::string escaped_response_body = absl::CEscape(response.response);
+      s << "ClearcutUploader: Response was not OK: " << response.http_code << ".";
+      s << " url=" << url_;
+      s << " response contained " << response.headers.size() << " <headers>";
+      for (const auto& pair : response.headers) {
+        s << "<key>" << pair.first << "</key>"
+          << ":"
+          << "<value>" << pair.second << "</value>,";
+      }
+      s << "</headers>";
+      s << " request <body>" << escaped_request_body << "</body>.";
+      s << " response <body>" << escaped_response_body << "</body>.";
+      VLOG(1) << s.str();
     }
-    s << "</headers>";
-    s << " request <body>" << escaped_request_body << "</body>.";
-    s << " response <body>" << escaped_response_body << "</body>.";
-    VLOG(1) << s.str();
 
     std::ostringstream stauts_string_stream;
     stauts_string_stream << response.http_code << ": ";
@@ -155,6 +176,8 @@ Status ClearcutUploader::TryUploadEvents(LogRequest* log_request,
         stauts_string_stream << "Not Found";
         return Status(StatusCode::NOT_FOUND, stauts_string_stream.str());
       case kHttpServiceUnavailable:  // service unavailable
+        // The server may say how long to wait before the next request.
+        MaybePauseUploads(response.response);
         stauts_string_stream << "Service Unavailable";
         return Status(StatusCode::RESOURCE_EXHAUSTED, stauts_string_stream.str());
       default:
@@ -166,18 +189,49 @@ Status ClearcutUploader::TryUploadEvents(LogRequest* log_request,
   internal_metrics_->BytesUploaded(logger::PerDeviceBytesUploadedMetricDimensionStatus::Succeeded,
                                    request_body_size);
 
-  LogResponse log_response;
-  if (!log_response.ParseFromString(response.response)) {
+  if (!MaybePauseUploads(response.response)) {
     // TODO(fxb/45751): add metric to capture how often this happens.
     LOG(ERROR) << "Unable to parse response from clearcut server";
-  } else {
-    if (log_response.next_request_wait_millis() >= 0) {
-      pause_uploads_until_ =
-          steady_clock_->now() + std::chrono::milliseconds(log_response.next_request_wait_millis());
-    }
   }
 
   return Status::OK;
 }
 
+bool ClearcutUploader::MaybePauseUploads(const std::string& response_body) {
+  LogResponse log_response;
+  if (!log_response.ParseFromString(response_body)) {
+    return false;
+  }
+  if (log_response.next_request_wait_millis() >= 0) {
+    pause_uploads_until_ =
+        steady_clock_->now() + std::chrono::milliseconds(log_response.next_request_wait_millis());
+  }
+  return true;
+}
+
+void ClearcutUploader::MaybeCompress(HTTPRequest* request) const {
+  if (compression_level_ == 0 || request->body.size() < min_compressed_bytes_) {
+    return;
+  }
+  std::string compressed;
+  {
+    google::protobuf::io::StringOutputStream string_stream(&compressed);
+    util::GzipOutputStream gzip_stream(&string_stream, compression_level_);
+    {
+      google::protobuf::io::CodedOutputStream coded_stream(&gzip_stream);
+      coded_stream.WriteRaw(request->body.data(), static_cast<int>(request->body.size()));
+    }
+    if (!gzip_stream.Close()) {
+      LOG(ERROR) << "ClearcutUploader: Unable to compress the request body. Sending it "
+                    "uncompressed.";
+      return;
+    }
+  }
+  if (compressed.size() >= request->body.size()) {
+    return;
+  }
+  request->body = std::move(compressed);
+  request->headers["Content-Encoding"] = "gzip";
+}
+
 }  // namespace cobalt::lib::clearcut
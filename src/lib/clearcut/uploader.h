@@ -5,6 +5,7 @@
 #ifndef COBALT_SRC_LIB_CLEARCUT_UPLOADER_H_
 #define COBALT_SRC_LIB_CLEARCUT_UPLOADER_H_
 
+#include <atomic>
 #include <chrono>
 #include <memory>
 #include <vector>
@@ -23,10 +24,14 @@ namespace cobalt::lib::clearcut {
 static const int32_t kFuchsiaClientType = 17;
 static const int32_t kMaxRetries = 8;  // Wait between tries: 0.25s 0.5.s 1s 2s 4s 8s 16s
 static const int64_t kInitialBackoffMillis = 250;
+// Request bodies smaller than this are not worth compressing.
+static const size_t kMinCompressedBytes = 1024;
 
 // A ClearcutUploader sends events to clearcut using the given HTTPClient.
 //
-// Note: This class is not threadsafe.
+// UploadEvents() may be called concurrently if the HTTPClient supports concurrent requests. A
+// request of the clearcut server to pause uploads applies to all of the concurrent uploads. The
+// other methods are not threadsafe.
 class ClearcutUploader {
  public:
   // url: The URL of the Clearcut server to which POST requests should be sent.
@@ -54,14 +59,38 @@ class ClearcutUploader {
   // Uploads the |log_request|  with retries.
   Status UploadEvents(LogRequest *log_request, int32_t max_retries = kMaxRetries);
 
+  // Compresses the bodies of requests of at least |min_compressed_bytes| bytes with gzip at the
+  // zlib compression |level| (1-9, or -1 for the zlib default), and sends them with the header
+  // "Content-Encoding: gzip". A body is sent uncompressed if compressing it does not make it
+  // smaller. A |level| of 0 disables compression, which is the default.
+  void SetCompression(int level, size_t min_compressed_bytes = kMinCompressedBytes) {
+    compression_level_ = level;
+    min_compressed_bytes_ = min_compressed_bytes;
+  }
+
+  // Returns the time before which the clearcut server asked not to be sent another request.
+  [[nodiscard]] std::chrono::steady_clock::time_point pause_uploads_until() const {
+    return pause_uploads_until_.load();
+  }
+
   // Resets the internal metrics to use the provided logger.
   void ResetInternalMetrics(logger::LoggerInterface *internal_logger = nullptr) {
     internal_metrics_ = logger::InternalMetrics::NewWithLogger(internal_logger);
   }
 
  private:
-  // Tries once to upload |log_request|.
-  Status TryUploadEvents(LogRequest *log_request, std::chrono::steady_clock::time_point deadline);
+  // Tries once to send |request|, the serialized LogRequest, which was |raw_request_body_size|
+  // bytes before compression. |request| is consumed if this is the |last_attempt|.
+  Status TryUploadEvents(HTTPRequest *request, size_t raw_request_body_size, bool last_attempt,
+                         std::chrono::steady_clock::time_point deadline);
+
+  // Parses |response_body| as a LogResponse and, if it asks for a wait before the next request,
+  // pauses uploads until then. Returns false if |response_body| is not a LogResponse.
+  bool MaybePauseUploads(const std::string &response_body);
+
+  // Replaces the body of |request| with its gzip compression and sets the Content-Encoding header
+  // if compression is enabled, the body is large enough, and compressing makes it smaller.
+  void MaybeCompress(HTTPRequest *request) const;
 
   const std::string url_;
   const std::unique_ptr<HTTPClient> client_;
@@ -71,13 +100,16 @@ class ClearcutUploader {
   const std::unique_ptr<cobalt::util::SteadyClockInterface> steady_clock_;
   const std::unique_ptr<cobalt::util::SleeperInterface> sleeper_;
 
+  int compression_level_ = 0;
+  size_t min_compressed_bytes_ = kMinCompressedBytes;
+
   std::unique_ptr<logger::InternalMetrics> internal_metrics_;
 
   friend class UploaderTest;
 
   // When we get a next_request_wait_millis from the clearcut server, we set
   // this value to now() + next_request_wait_millis.
-  std::chrono::steady_clock::time_point pause_uploads_until_;
+  std::atomic<std::chrono::steady_clock::time_point> pause_uploads_until_;
 };
 
 }  // namespace cobalt::lib::clearcut
@@ -7,8 +7,11 @@
 #include <chrono>
 #include <thread>
 
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
 #include "src/lib/clearcut/clearcut.pb.h"
 #include "src/lib/util/clock.h"
+#include "src/lib/util/gzip_stream.h"
 #include "src/lib/util/sleeper.h"
 #include "src/logging.h"
 #include "third_party/gflags/include/gflags/gflags.h"
@@ -34,7 +37,13 @@ class FakeHttpClient : public HTTPClient {
       HTTPRequest request, std::chrono::steady_clock::time_point deadline) override {
     EXPECT_EQ(request.url, kFakeClearcutURL);
     last_deadline_seen = deadline;
-    EXPECT_EQ(0, request.headers.size());
+    last_body_size_seen = request.body.size();
+    last_content_encoding_seen.clear();
+    if (!request.headers.empty()) {
+      EXPECT_EQ(1, request.headers.size());
+      last_content_encoding_seen = request.headers["Content-Encoding"];
+      EXPECT_EQ(last_content_encoding_seen, "gzip");
+    }
     if (!error_statuses_to_return.empty()) {
       auto next_status = error_statuses_to_return.front();
       error_statuses_to_return.pop_front();
@@ -44,7 +53,15 @@ class FakeHttpClient : public HTTPClient {
     }
 
     LogRequest req;
-    req.ParseFromString(request.body);
+    if (last_content_encoding_seen == "gzip") {
+      google::protobuf::io::ArrayInputStream compressed(request.body.data(),
+                                                        static_cast<int>(request.body.size()));
+      util::GzipInputStream decompressed(&compressed);
+      EXPECT_TRUE(req.ParseFromZeroCopyStream(&decompressed));
+      EXPECT_FALSE(decompressed.had_error());
+    } else {
+      req.ParseFromString(request.body);
+    }
     for (auto &event : req.log_event()) {
       seen_event_codes.insert(event.event_code());
     }
@@ -73,6 +90,8 @@ class FakeHttpClient : public HTTPClient {
   std::set<uint32_t> seen_event_codes = {};
   int next_request_wait_millis = -1;
   std::chrono::steady_clock::time_point last_deadline_seen;
+  size_t last_body_size_seen = 0;
+  std::string last_content_encoding_seen;
   std::deque<StatusCode> error_statuses_to_return;
   std::deque<int> http_response_codes_to_return;
 };
@@ -97,11 +116,14 @@ class UploaderTest : public ::testing::Test {
   void SetUp() override { DoSetUp(kUploadTimeoutMillis); }
 
  public:
-  Status UploadClearcutDemoEvent(uint32_t event_code, int32_t max_retries = 1) {
+  Status UploadClearcutDemoEvent(uint32_t event_code, int32_t max_retries = 1,
+                                 size_t num_events = 1) {
     LogRequest request;
     constexpr int32_t kClearcutDemoSource = 12345;
     request.set_log_source(kClearcutDemoSource);
-    request.add_log_event()->set_event_code(event_code);
+    for (size_t i = 0; i < num_events; i++) {
+      request.add_log_event()->set_event_code(event_code);
+    }
     auto status = uploader->UploadEvents(&request, max_retries);
     return status;
   }
@@ -171,6 +193,25 @@ TEST_F(UploaderTest, RateLimitingWorks) {
   ASSERT_TRUE(SawEventCode(150));
 }
 
+// Tests that a wait requested in a 503 response is obeyed by the next attempt.
+TEST_F(UploaderTest, RateLimitingOnServiceUnavailable) {
+  client->next_request_wait_millis = 2000;
+  client->http_response_codes_to_return = {503};
+  fake_sleeper->Reset();
+  ASSERT_TRUE(UploadClearcutDemoEvent(100, 2).ok());
+  ASSERT_TRUE(SawEventCode(100));
+  // The retry waited for the time requested by the server rather than for the initial backoff.
+  EXPECT_GE(fake_sleeper->last_sleep_duration().count(), 1900);
+
+  // A 503 without a requested wait does not pause uploads.
+  fake_clock->increment_by(std::chrono::seconds(3));
+  client->next_request_wait_millis = -1;
+  client->http_response_codes_to_return = {503};
+  fake_sleeper->Reset();
+  ASSERT_TRUE(UploadClearcutDemoEvent(101, 2).ok());
+  EXPECT_EQ(fake_sleeper->last_sleep_duration().count(), kInitialBackoffMillisForTest);
+}
+
 // Tests the functionality of retrying multiple times with exponential backoff.
 TEST_F(UploaderTest, ShouldRetryOnFailedUpload) {
   // Arrange for the upload to fail three times.
@@ -277,4 +318,36 @@ TEST_F(UploaderTest, HttpResponseCodes) {
   EXPECT_EQ(fake_sleeper->last_sleep_duration().count(), kInitialBackoffMillisForTest * 4);
 }
 
+// Tests that large requests are compressed when compression is enabled.
+TEST_F(UploaderTest, CompressesLargeRequests) {
+  constexpr size_t kManyEvents = 1000;
+  ASSERT_TRUE(UploadClearcutDemoEvent(1, 1, kManyEvents).ok());
+  EXPECT_EQ(client->last_content_encoding_seen, "");
+  size_t uncompressed_size = client->last_body_size_seen;
+
+  uploader->SetCompression(9);
+  ASSERT_TRUE(UploadClearcutDemoEvent(2, 1, kManyEvents).ok());
+  EXPECT_TRUE(SawEventCode(2));
+  EXPECT_EQ(client->last_content_encoding_seen, "gzip");
+  EXPECT_LT(client->last_body_size_seen, uncompressed_size);
+
+  uploader->SetCompression(0);
+  ASSERT_TRUE(UploadClearcutDemoEvent(3, 1, kManyEvents).ok());
+  EXPECT_TRUE(SawEventCode(3));
+  EXPECT_EQ(client->last_content_encoding_seen, "");
+}
+
+// Tests that requests smaller than the threshold are sent uncompressed.
+TEST_F(UploaderTest, DoesNotCompressSmallRequests) {
+  uploader->SetCompression(9);
+  ASSERT_TRUE(UploadClearcutDemoEvent(1).ok());
+  EXPECT_TRUE(SawEventCode(1));
+  EXPECT_EQ(client->last_content_encoding_seen, "");
+
+  uploader->SetCompression(9, 0);
+  ASSERT_TRUE(UploadClearcutDemoEvent(2, 1, 100).ok());
+  EXPECT_TRUE(SawEventCode(2));
+  EXPECT_EQ(client->last_content_encoding_seen, "gzip");
+}
+
 }  // namespace cobalt::lib::clearcut
@@ -106,6 +106,16 @@ Status ConsistentProtoStore::Read(MessageLite *proto) {
   return Status::OK;
 }
 
+Status ConsistentProtoStore::Delete() {
+  // The override file is deleted first, since it takes precedence over the primary file.
+  for (const auto &file : {override_file_, primary_file_, tmp_file_}) {
+    if (fs_->FileExists(file) && !fs_->Delete(file)) {
+      return Status(StatusCode::ABORTED, "Unable to remove `" + file + "`.", strerror(errno));
+    }
+  }
+  return Status::OK;
+}
+
 Status ConsistentProtoStore::WriteToTmp(const MessageLite &proto) {
   CB_ASSIGN_OR_RETURN(auto outstream, fs_->NewProtoOutputStream(tmp_file_));
   if (!proto.SerializeToZeroCopyStream(outstream.get())) {
@@ -48,6 +48,10 @@ class ConsistentProtoStore {
   // data is corrupt (does not represent a valid protocol buffer).
   virtual Status Read(google::protobuf::MessageLite *proto);
 
+  // Deletes the files of the store, so that a later Read() fails with NOT_FOUND. Succeeds if there
+  // were no files to delete.
+  virtual Status Delete();
+
  private:
   friend class TestConsistentProtoStore;
 
@@ -151,6 +151,18 @@ TEST_F(ConsistentProtoStoreTest, Normal) {
   EXPECT_EQ(pout.s(), "Data!");
 }
 
+TEST_F(ConsistentProtoStoreTest, Delete) {
+  Mkdir();
+  EXPECT_TRUE(store_.Delete().ok());
+  TestProto pin, pout;
+  pin.set_i(42);
+  ASSERT_TRUE(store_.Write(pin).ok());
+  ASSERT_TRUE(store_.Read(&pout).ok());
+
+  EXPECT_TRUE(store_.Delete().ok());
+  EXPECT_EQ(StatusCode::NOT_FOUND, store_.Read(&pout).error_code());
+}
+
 TEST_F(ConsistentProtoStoreTest, ReadCompatible) {
   Mkdir();
   TestProto pin;
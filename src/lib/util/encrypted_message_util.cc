@@ -4,9 +4,12 @@
 
 #include "src/lib/util/encrypted_message_util.h"
 
+#include <atomic>
 #include <utility>
 #include <vector>
 
+#include <openssl/aead.h>
+
 #include "google/protobuf/message_lite.h"
 #include "src/lib/util/status.h"
 #include "src/lib/util/status_codes.h"
@@ -17,6 +20,10 @@
 #include "third_party/tink/cc/hybrid/hybrid_config.h"
 #include "third_party/tink/cc/hybrid_encrypt.h"
 #include "third_party/tink/cc/keyset_handle.h"
+#include "third_party/tink/cc/util/enums.h"
+#include "third_party/tink/proto/aes_gcm.pb.h"
+#include "third_party/tink/proto/ecies_aead_hkdf.pb.h"
+#include "third_party/tink/proto/tink.pb.h"
 
 namespace cobalt::util {
 
@@ -24,13 +31,150 @@ namespace {
 constexpr char kShufflerContextInfo[] = "cobalt-1.0-shuffler";
 constexpr char kAnalyzerContextInfo[] = "cobalt-1.0-analyzer";
 
+constexpr char kEciesAeadHkdfPublicKeyTypeUrl[] =
+    "type.googleapis.com/google.crypto.tink.EciesAeadHkdfPublicKey";
+constexpr char kAesGcmKeyTypeUrl[] = "type.googleapis.com/google.crypto.tink.AesGcmKey";
+constexpr size_t kAesGcmNonceSize = 12;
+
 Status StatusFromTinkStatus(const ::crypto::tink::util::Status& tink_status) {
   return Status(StatusCode(tink_status.error_code()), tink_status.error_message());
 }
 
-// Make a HybridTinkEncryptedMessageMaker from a serialized encoded keyset.
+void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Encrypts the messages of one batch with the HYBRID_TINK_BATCH scheme, using the result of a
+// single key encapsulation.
+class HybridTinkBatchEncrypter : public EncryptedMessageMaker {
+ public:
+  HybridTinkBatchEncrypter(std::string kem_bytes, const uint8_t* key, size_t key_size,
+                           uint32_t key_index)
+      : kem_bytes_(std::move(kem_bytes)), key_index_(key_index) {
+    const EVP_AEAD* aead = nullptr;
+    if (key_size == 16) {
+      aead = EVP_aead_aes_128_gcm();
+    } else if (key_size == 32) {
+      aead = EVP_aead_aes_256_gcm();
+    }
+    initialized_ = aead != nullptr && EVP_AEAD_CTX_init(ctx_.get(), aead, key, key_size,
+                                                        EVP_AEAD_DEFAULT_TAG_LENGTH, nullptr) == 1;
+  }
+
+  [[nodiscard]] bool initialized() const { return initialized_; }
+
+  bool Encrypt(const google::protobuf::MessageLite& message,
+               EncryptedMessage* encrypted_message) const override {
+    std::string serialized_message;
+    message.SerializeToString(&serialized_message);
+    return EncryptSerialized(std::move(serialized_message), encrypted_message);
+  }
+
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override {
+    TRACE_DURATION("cobalt_core", "HybridTinkBatchEncrypter::Encrypt");
+    if (!encrypted_message) {
+      return false;
+    }
+
+    // The nonces are unique because each index is used once with a key which is used for this
+    // batch only.
+    uint64_t index = next_index_++;
+    uint8_t nonce[kAesGcmNonceSize] = {};
+    for (size_t i = 0; i < sizeof(index); i++) {
+      nonce[kAesGcmNonceSize - 1 - i] = static_cast<uint8_t>(index >> (8 * i));
+    }
+
+    std::string ciphertext;
+    AppendVarint(index, &ciphertext);
+    size_t prefix_size = ciphertext.size();
+    ciphertext.resize(prefix_size + serialized_message.size() +
+                      EVP_AEAD_max_overhead(EVP_AEAD_CTX_aead(ctx_.get())));
+    size_t sealed_size;
+    if (EVP_AEAD_CTX_seal(ctx_.get(), reinterpret_cast<uint8_t*>(&ciphertext[prefix_size]),
+                          &sealed_size, ciphertext.size() - prefix_size, nonce, sizeof(nonce),
+                          reinterpret_cast<const uint8_t*>(serialized_message.data()),
+                          serialized_message.size(), nullptr, 0) != 1) {
+      VLOG(5) << "EncryptedMessage: AES-GCM could not encrypt message.";
+      return false;
+    }
+    ciphertext.resize(prefix_size + sealed_size);
+
+    encrypted_message->set_scheme(EncryptedMessage::HYBRID_TINK_BATCH);
+    encrypted_message->set_key_index(key_index_);
+    encrypted_message->set_ciphertext(std::move(ciphertext));
+    return true;
+  }
+
+  [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
+    return EncryptedMessage::HYBRID_TINK_BATCH;
+  }
+
+  [[nodiscard]] std::string kem_bytes() const override { return kem_bytes_; }
+
+ private:
+  std::string kem_bytes_;
+  uint32_t key_index_;
+  bssl::ScopedEVP_AEAD_CTX ctx_;
+  bool initialized_;
+  mutable std::atomic<uint64_t> next_index_{0};
+};
+
+// Extracts from a serialized public keyset the parameters of the HYBRID_TINK_BATCH scheme. Fails if
+// the primary key of the keyset is not an ECIES-AEAD-HKDF key with an AES-GCM DEM.
+lib::statusor::StatusOr<HybridTinkBatchEncryptedMessageMaker::BatchParams> GetBatchParams(
+    const std::string& public_keyset_bytes) {
+  google::crypto::tink::Keyset keyset;
+  if (!keyset.ParseFromString(public_keyset_bytes)) {
+    return Status(INVALID_ARGUMENT, "EncryptedMessageMaker: Invalid keyset.");
+  }
+  for (const auto& key : keyset.key()) {
+    if (key.key_id() != keyset.primary_key_id()) {
+      continue;
+    }
+    google::crypto::tink::EciesAeadHkdfPublicKey public_key;
+    if (key.key_data().type_url() != kEciesAeadHkdfPublicKeyTypeUrl ||
+        !public_key.ParseFromString(key.key_data().value())) {
+      return Status(INVALID_ARGUMENT,
+                    "EncryptedMessageMaker: Batch encryption needs an ECIES-AEAD-HKDF key.");
+    }
+    const auto& params = public_key.params();
+    google::crypto::tink::AesGcmKeyFormat aes_gcm_key_format;
+    if (params.dem_params().aead_dem().type_url() != kAesGcmKeyTypeUrl ||
+        !aes_gcm_key_format.ParseFromString(params.dem_params().aead_dem().value())) {
+      return Status(INVALID_ARGUMENT,
+                    "EncryptedMessageMaker: Batch encryption needs an AES-GCM DEM.");
+    }
+
+    auto kem_result = ::crypto::tink::subtle::EciesHkdfSenderKemBoringSsl::New(
+        ::crypto::tink::util::Enums::ProtoToSubtle(params.kem_params().curve_type()),
+        public_key.x(), public_key.y());
+    if (!kem_result.ok()) {
+      return StatusFromTinkStatus(kem_result.status());
+    }
+
+    HybridTinkBatchEncryptedMessageMaker::BatchParams batch_params;
+    batch_params.kem = std::move(kem_result.ValueOrDie());
+    batch_params.hkdf_hash =
+        ::crypto::tink::util::Enums::ProtoToSubtle(params.kem_params().hkdf_hash_type());
+    batch_params.hkdf_salt = params.kem_params().hkdf_salt();
+    batch_params.point_format =
+        ::crypto::tink::util::Enums::ProtoToSubtle(params.ec_point_format());
+    batch_params.aes_gcm_key_size = aes_gcm_key_format.key_size();
+    return batch_params;
+  }
+  return Status(INVALID_ARGUMENT, "EncryptedMessageMaker: The keyset has no primary key.");
+}
+
+// Make a HybridTinkEncryptedMessageMaker from a serialized encoded keyset. If |batch_encryption|
+// is true, a HybridTinkBatchEncryptedMessageMaker is made instead if the key supports it.
 lib::statusor::StatusOr<std::unique_ptr<EncryptedMessageMaker>> MakeHybridTinkEncryptedMessageMaker(
-    const std::string& public_keyset_bytes, const std::string& context_info, uint32_t key_index) {
+    const std::string& public_keyset_bytes, const std::string& context_info, uint32_t key_index,
+    bool batch_encryption = false) {
   auto status = ::crypto::tink::HybridConfig::Register();
   if (!status.ok()) {
     return StatusFromTinkStatus(status);
@@ -47,6 +191,18 @@ lib::statusor::StatusOr<std::unique_ptr<EncryptedMessageMaker>> MakeHybridTinkEn
     return StatusFromTinkStatus(primitive_result.status());
   }
 
+  if (batch_encryption) {
+    auto batch_params_result = GetBatchParams(public_keyset_bytes);
+    if (batch_params_result.ok()) {
+      std::unique_ptr<EncryptedMessageMaker> maker(new HybridTinkBatchEncryptedMessageMaker(
+          std::move(primitive_result.ValueOrDie()), context_info, key_index,
+          std::move(batch_params_result.ValueOrDie())));
+      return maker;
+    }
+    LOG(ERROR) << "Observations will be encrypted one at a time: "
+               << batch_params_result.status().error_message();
+  }
+
   std::unique_ptr<EncryptedMessageMaker> maker(new HybridTinkEncryptedMessageMaker(
       std::move(primitive_result.ValueOrDie()), context_info, key_index));
 
@@ -98,7 +254,8 @@ EncryptedMessageMaker::MakeForEnvelopes(const std::string& cobalt_encryption_key
 }
 
 lib::statusor::StatusOr<std::unique_ptr<EncryptedMessageMaker>>
-EncryptedMessageMaker::MakeForObservations(const std::string& cobalt_encryption_key_bytes) {
+EncryptedMessageMaker::MakeForObservations(const std::string& cobalt_encryption_key_bytes,
+                                           bool batch_encryption) {
   auto cobalt_encryption_key_or_result = ParseCobaltEncryptionKey(cobalt_encryption_key_bytes);
   if (!cobalt_encryption_key_or_result.ok()) {
     return cobalt_encryption_key_or_result.status();
@@ -111,7 +268,7 @@ EncryptedMessageMaker::MakeForObservations(const std::string& cobalt_encryption_
 
   return MakeHybridTinkEncryptedMessageMaker(cobalt_encryption_key.serialized_key(),
                                              kAnalyzerContextInfo,
-                                             cobalt_encryption_key.key_index());
+                                             cobalt_encryption_key.key_index(), batch_encryption);
 }
 
 HybridTinkEncryptedMessageMaker::HybridTinkEncryptedMessageMaker(
@@ -123,14 +280,18 @@ HybridTinkEncryptedMessageMaker::HybridTinkEncryptedMessageMaker(
 
 bool HybridTinkEncryptedMessageMaker::Encrypt(const google::protobuf::MessageLite& message,
                                               EncryptedMessage* encrypted_message) const {
+  std::string serialized_message;
+  message.SerializeToString(&serialized_message);
+  return EncryptSerialized(std::move(serialized_message), encrypted_message);
+}
+
+bool HybridTinkEncryptedMessageMaker::EncryptSerialized(std::string serialized_message,
+                                                        EncryptedMessage* encrypted_message) const {
   TRACE_DURATION("cobalt_core", "HybridTinkEncryptedMessageMaker::Encrypt");
   if (!encrypted_message) {
     return false;
   }
 
-  std::string serialized_message;
-  message.SerializeToString(&serialized_message);
-
   VLOG(5) << "EncryptedMessage: encryption_scheme=HYBRID_TINK.";
 
   auto encrypted_result = encrypter_->Encrypt(serialized_message, context_info_);
@@ -139,7 +300,7 @@ bool HybridTinkEncryptedMessageMaker::Encrypt(const google::protobuf::MessageLit
             << encrypted_result.status().error_message();
     return false;
   }
-  encrypted_message->set_ciphertext(encrypted_result.ValueOrDie());
+  encrypted_message->set_ciphertext(std::move(encrypted_result.ValueOrDie()));
   if (key_index_ == 0) {
     encrypted_message->set_scheme(EncryptedMessage::HYBRID_TINK);
   } else {
@@ -149,16 +310,49 @@ bool HybridTinkEncryptedMessageMaker::Encrypt(const google::protobuf::MessageLit
   return true;
 }
 
+HybridTinkBatchEncryptedMessageMaker::HybridTinkBatchEncryptedMessageMaker(
+    std::unique_ptr<::crypto::tink::HybridEncrypt> encrypter, std::string context_info,
+    uint32_t key_index, BatchParams batch_params)
+    : HybridTinkEncryptedMessageMaker(std::move(encrypter), std::move(context_info), key_index),
+      batch_params_(std::move(batch_params)) {}
+
+std::unique_ptr<EncryptedMessageMaker> HybridTinkBatchEncryptedMessageMaker::NewBatchEncrypter()
+    const {
+  TRACE_DURATION("cobalt_core", "HybridTinkBatchEncryptedMessageMaker::NewBatchEncrypter");
+  auto kem_key_result = batch_params_.kem->GenerateKey(
+      batch_params_.hkdf_hash, batch_params_.hkdf_salt, context_info(),
+      batch_params_.aes_gcm_key_size, batch_params_.point_format);
+  if (!kem_key_result.ok()) {
+    VLOG(5) << "EncryptedMessage: Tink could not encapsulate a key: "
+            << kem_key_result.status().error_message();
+    return nullptr;
+  }
+  auto kem_key = std::move(kem_key_result.ValueOrDie());
+  const auto& symmetric_key = kem_key->get_symmetric_key();
+  auto batch_encrypter = std::make_unique<HybridTinkBatchEncrypter>(
+      kem_key->get_kem_bytes(), reinterpret_cast<const uint8_t*>(symmetric_key.data()),
+      symmetric_key.size(), key_index());
+  if (!batch_encrypter->initialized()) {
+    return nullptr;
+  }
+  return batch_encrypter;
+}
+
 bool UnencryptedMessageMaker::Encrypt(const google::protobuf::MessageLite& message,
                                       EncryptedMessage* encrypted_message) const {
+  std::string serialized_message;
+  message.SerializeToString(&serialized_message);
+  return EncryptSerialized(std::move(serialized_message), encrypted_message);
+}
+
+bool UnencryptedMessageMaker::EncryptSerialized(std::string serialized_message,
+                                                EncryptedMessage* encrypted_message) const {
   TRACE_DURATION("cobalt_core", "UnencryptedMessageMaker::Encrypt");
   if (!encrypted_message) {
     return false;
   }
-  std::string serialized_message;
-  message.SerializeToString(&serialized_message);
   encrypted_message->set_scheme(EncryptedMessage::NONE);
-  encrypted_message->set_ciphertext(serialized_message);
+  encrypted_message->set_ciphertext(std::move(serialized_message));
   VLOG(5) << "EncryptedMessage: encryption_scheme=NONE.";
   return true;
 }
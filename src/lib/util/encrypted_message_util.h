@@ -21,6 +21,8 @@
 #include "src/lib/statusor/statusor.h"
 #include "src/pb/encrypted_message.pb.h"
 #include "third_party/tink/cc/hybrid_encrypt.h"
+#include "third_party/tink/cc/subtle/common_enums.h"
+#include "third_party/tink/cc/subtle/ecies_hkdf_sender_kem_boringssl.h"
 
 namespace cobalt {
 namespace util {
@@ -39,9 +41,28 @@ class EncryptedMessageMaker {
   virtual bool Encrypt(const google::protobuf::MessageLite& message,
                        EncryptedMessage* encrypted_message) const = 0;
 
+  // Encrypts the already serialized protocol buffer |serialized_message| and
+  // populates |encrypted_message| with the result. Returns true for success or
+  // false on failure. This lets callers build the serialization incrementally
+  // instead of materializing the message.
+  virtual bool EncryptSerialized(std::string serialized_message,
+                                 EncryptedMessage* encrypted_message) const = 0;
+
   // Returns the EncryptionScheme used by the EncryptedMessageMaker.
   [[nodiscard]] virtual EncryptedMessage::EncryptionScheme scheme() const = 0;
 
+  // Returns an EncryptedMessageMaker to be used for all of the messages of one batch, such as the
+  // Observations of an ObservationBatch, if the scheme supports sharing work between the messages
+  // of a batch, or nullptr otherwise. The returned object supports concurrent calls to Encrypt()
+  // and does not depend on this one.
+  [[nodiscard]] virtual std::unique_ptr<EncryptedMessageMaker> NewBatchEncrypter() const {
+    return nullptr;
+  }
+
+  // Returns the key encapsulation which must be sent once with the messages
+  // encrypted by a batch encrypter, or an empty string if there is none.
+  [[nodiscard]] virtual std::string kem_bytes() const { return std::string(); }
+
   // Make an UnencryptedMessageMaker.
   // Message will be serialized, but not encrypted: they will be sent in plain
   // text. This scheme must never be used in production Cobalt.
@@ -58,8 +79,12 @@ class EncryptedMessageMaker {
   // Messages will be encrypted using the scheme corresponding to the key
   // that is passed in. |cobalt_encryption_key_bytes| is a serialized
   // cobalt::CobaltEncryptionKey protobuf message.
+  //
+  // If |batch_encryption| is true and the key is a Tink ECIES-AEAD-HKDF key
+  // with an AES-GCM DEM, NewBatchEncrypter() returns encrypters which use the
+  // HYBRID_TINK_BATCH scheme.
   static lib::statusor::StatusOr<std::unique_ptr<EncryptedMessageMaker>> MakeForObservations(
-      const std::string& cobalt_encryption_key_bytes);
+      const std::string& cobalt_encryption_key_bytes, bool batch_encryption = false);
 
   virtual ~EncryptedMessageMaker() = default;
 };
@@ -74,16 +99,49 @@ class HybridTinkEncryptedMessageMaker : public EncryptedMessageMaker {
   bool Encrypt(const google::protobuf::MessageLite& message,
                EncryptedMessage* encrypted_message) const override;
 
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override;
+
   [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
     return EncryptedMessage::HYBRID_TINK;
   }
 
+ protected:
+  [[nodiscard]] const std::string& context_info() const { return context_info_; }
+  [[nodiscard]] uint32_t key_index() const { return key_index_; }
+
  private:
   std::unique_ptr<::crypto::tink::HybridEncrypt> encrypter_;
   std::string context_info_;
   uint32_t key_index_;
 };
 
+// HybridTinkBatchEncryptedMessageMaker is an implementation of
+// EncryptedMessageMaker which encrypts single messages like
+// HybridTinkEncryptedMessageMaker, and whose batch encrypters use the
+// HYBRID_TINK_BATCH scheme. See EncryptedMessage::HYBRID_TINK_BATCH for
+// details.
+class HybridTinkBatchEncryptedMessageMaker : public HybridTinkEncryptedMessageMaker {
+ public:
+  // The parameters of the key encapsulation and of the AES-GCM encryption.
+  struct BatchParams {
+    std::unique_ptr<const ::crypto::tink::subtle::EciesHkdfSenderKemBoringSsl> kem;
+    ::crypto::tink::subtle::HashType hkdf_hash;
+    std::string hkdf_salt;
+    ::crypto::tink::subtle::EcPointFormat point_format;
+    uint32_t aes_gcm_key_size;
+  };
+
+  HybridTinkBatchEncryptedMessageMaker(std::unique_ptr<::crypto::tink::HybridEncrypt> encrypter,
+                                       std::string context_info, uint32_t key_index,
+                                       BatchParams batch_params);
+
+  [[nodiscard]] std::unique_ptr<EncryptedMessageMaker> NewBatchEncrypter() const override;
+
+ private:
+  BatchParams batch_params_;
+};
+
 // UnencryptedMessageMaker is an implementation of EncryptedMessageMaker that
 // does not perform any encryption.
 class UnencryptedMessageMaker : public EncryptedMessageMaker {
@@ -91,6 +149,9 @@ class UnencryptedMessageMaker : public EncryptedMessageMaker {
   bool Encrypt(const google::protobuf::MessageLite& message,
                EncryptedMessage* encrypted_message) const override;
 
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override;
+
   [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
     return EncryptedMessage::NONE;
   }
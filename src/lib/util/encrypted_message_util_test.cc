@@ -4,9 +4,13 @@
 
 #include "src/lib/util/encrypted_message_util.h"
 
+#include <ctime>
+#include <set>
 #include <string>
 #include <utility>
 
+#include "src/lib/util/testing/hybrid_tink_batch_decrypt.h"
+#include "src/logging.h"
 #include "src/pb/encrypted_message.pb.h"
 #include "src/pb/envelope.pb.h"
 #include "src/pb/key.pb.h"
@@ -85,6 +89,10 @@ class EncryptedMessageMakerTest : public ::testing::Test {
     return decrypted_result.ValueOrDie();
   }
 
+  [[nodiscard]] const ::crypto::tink::KeysetHandle& private_keyset_handle() const {
+    return *keyset_handle_;
+  }
+
  protected:
   void SetUp() override {
     auto status = ::crypto::tink::HybridConfig::Register();
@@ -171,6 +179,108 @@ TEST_F(EncryptedMessageMakerTest, EncryptEnvelope) {
   EXPECT_EQ(metric_id, envelope.batch(0).meta_data().metric_id());
 }
 
+// Try to roundtrip the observations of a batch through a batch encrypter.
+TEST_F(EncryptedMessageMakerTest, BatchEncryptObservations) {
+  uint32_t key_index = 1;
+  auto key_bytes = MakeCobaltEncryptionKeyBytes(GetPublicKeysetBytes(), key_index,
+                                                CobaltEncryptionKey::ANALYZER);
+  auto maker_or_status = EncryptedMessageMaker::MakeForObservations(key_bytes);
+  ASSERT_TRUE(maker_or_status.ok());
+  EXPECT_EQ(nullptr, maker_or_status.ValueOrDie()->NewBatchEncrypter());
+
+  maker_or_status = EncryptedMessageMaker::MakeForObservations(key_bytes, true);
+  ASSERT_TRUE(maker_or_status.ok());
+  auto maker = std::move(maker_or_status.ValueOrDie());
+  auto batch_encrypter = maker->NewBatchEncrypter();
+  ASSERT_NE(nullptr, batch_encrypter);
+  EXPECT_EQ(EncryptedMessage::HYBRID_TINK_BATCH, batch_encrypter->scheme());
+  // The key encapsulation is sent once for the batch, not in each ciphertext.
+  const std::string kem_bytes = batch_encrypter->kem_bytes();
+  EXPECT_FALSE(kem_bytes.empty());
+  EXPECT_TRUE(maker->kem_bytes().empty());
+
+  // Single observations are still encrypted with HYBRID_TINK.
+  Observation2 observation;
+  observation.set_random_id("single");
+  EncryptedMessage encrypted_message;
+  EXPECT_TRUE(maker->Encrypt(observation, &encrypted_message));
+  EXPECT_EQ(EncryptedMessage::NONE, encrypted_message.scheme());
+  observation.Clear();
+  EXPECT_TRUE(
+      observation.ParseFromString(Decrypt(encrypted_message.ciphertext(), kAnalyzerContextInfo)));
+  EXPECT_EQ("single", observation.random_id());
+
+  const size_t kNumObservations = 5;
+  std::set<std::string> ciphertexts;
+  for (size_t i = 0; i < kNumObservations; i++) {
+    observation.set_random_id("obs_id_" + std::to_string(i));
+    ASSERT_TRUE(batch_encrypter->Encrypt(observation, &encrypted_message));
+    EXPECT_EQ(EncryptedMessage::HYBRID_TINK_BATCH, encrypted_message.scheme());
+    EXPECT_EQ(key_index, encrypted_message.key_index());
+    ciphertexts.insert(encrypted_message.ciphertext());
+
+    auto decrypted = testing::DecryptHybridTinkBatch(private_keyset_handle(), kAnalyzerContextInfo,
+                                                     kem_bytes, encrypted_message);
+    ASSERT_TRUE(decrypted.ok());
+    observation.Clear();
+    EXPECT_TRUE(observation.ParseFromString(decrypted.ValueOrDie()));
+    EXPECT_EQ("obs_id_" + std::to_string(i), observation.random_id());
+
+    // The ciphertext is bound to the context info.
+    EXPECT_FALSE(testing::DecryptHybridTinkBatch(private_keyset_handle(), "other", kem_bytes,
+                                                 encrypted_message)
+                     .ok());
+  }
+  EXPECT_EQ(kNumObservations, ciphertexts.size());
+
+  // The ciphertexts only decrypt with the key encapsulation of their batch.
+  EXPECT_FALSE(testing::DecryptHybridTinkBatch(private_keyset_handle(), kAnalyzerContextInfo,
+                                               maker->NewBatchEncrypter()->kem_bytes(),
+                                               encrypted_message)
+                   .ok());
+
+  // A tampered ciphertext does not decrypt.
+  encrypted_message.mutable_ciphertext()->back() ^= 1;
+  EXPECT_FALSE(testing::DecryptHybridTinkBatch(private_keyset_handle(), kAnalyzerContextInfo,
+                                               kem_bytes, encrypted_message)
+                   .ok());
+}
+
+// Measures the CPU time and the size of the ciphertexts of encrypting batches of observations with
+// the HYBRID_TINK and HYBRID_TINK_BATCH schemes, including the key encapsulation which is sent once
+// per batch. Run with --gtest_also_run_disabled_tests.
+TEST_F(EncryptedMessageMakerTest, DISABLED_BatchEncryptionCost) {
+  const int kNumBatches = 100;
+  auto key_bytes =
+      MakeCobaltEncryptionKeyBytes(GetPublicKeysetBytes(), 1, CobaltEncryptionKey::ANALYZER);
+  auto maker = EncryptedMessageMaker::MakeForObservations(key_bytes, true).ConsumeValueOrDie();
+  Observation2 observation;
+  observation.set_random_id("0123456789abcdef");
+  observation.mutable_basic_rappor()->set_data(std::string(16, 'x'));
+
+  for (int batch_size : {1, 10, 100, 1000}) {
+    for (bool batched : {false, true}) {
+      size_t num_bytes = 0;
+      EncryptedMessage encrypted_message;
+      std::clock_t start = std::clock();
+      for (int i = 0; i < kNumBatches; i++) {
+        auto batch_encrypter = batched ? maker->NewBatchEncrypter() : nullptr;
+        const EncryptedMessageMaker* encrypter = batched ? batch_encrypter.get() : maker.get();
+        num_bytes += encrypter->kem_bytes().size();
+        for (int j = 0; j < batch_size; j++) {
+          ASSERT_TRUE(encrypter->Encrypt(observation, &encrypted_message));
+          num_bytes += encrypted_message.ByteSizeLong();
+        }
+      }
+      double cpu_seconds = static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+      int num_observations = kNumBatches * batch_size;
+      LOG(INFO) << (batched ? "HYBRID_TINK_BATCH" : "HYBRID_TINK") << " batch_size=" << batch_size
+                << ": " << cpu_seconds * 1e6 / num_observations << " us/observation, "
+                << num_bytes / num_observations << " bytes/observation";
+    }
+  }
+}
+
 // Expect an error if the key_index field is set to 0 or unset.
 TEST_F(EncryptedMessageMakerTest, ZeroKeyIndex) {
   auto key_bytes =
@@ -0,0 +1,116 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/encryption_worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "src/logging.h"
+#include "src/tracing.h"
+
+namespace cobalt::util {
+
+struct EncryptionWorkerPool::Batch {
+  const EncryptedMessageMaker* encrypter;
+  // The jobs are not accessed through these once all of them have been claimed, so a worker may
+  // still hold the Batch after EncryptAll() has returned.
+  const Job* jobs;
+  size_t num_jobs;
+  // The index of the next job to be claimed.
+  std::atomic<size_t> next_job{0};
+  std::atomic<size_t> num_failed{0};
+  // The number of jobs which are done. Guarded by the lock of |protected_fields_|.
+  size_t num_done = 0;
+};
+
+EncryptionWorkerPool::EncryptionWorkerPool(size_t num_workers) {
+  if (num_workers == 0) {
+    num_workers = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+  }
+  workers_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back([this] { Run(); });
+  }
+}
+
+EncryptionWorkerPool::~EncryptionWorkerPool() {
+  {
+    auto fields = protected_fields_.lock();
+    fields->shut_down = true;
+    fields->work_notifier.notify_all();
+  }
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t EncryptionWorkerPool::EncryptAll(const EncryptedMessageMaker& encrypter,
+                                        const std::vector<Job>& jobs) {
+  TRACE_DURATION("cobalt_core", "EncryptionWorkerPool::EncryptAll");
+  auto batch = std::make_shared<Batch>();
+  batch->encrypter = &encrypter;
+  batch->jobs = jobs.data();
+  batch->num_jobs = jobs.size();
+
+  // A single job is not worth waking a worker up for.
+  if (jobs.size() > 1) {
+    auto fields = protected_fields_.lock();
+    fields->batches.push_back(batch);
+    fields->work_notifier.notify_all();
+  }
+
+  Work(batch.get());
+
+  auto fields = protected_fields_.lock();
+  fields->done_notifier.wait(fields, [&batch] { return batch->num_done == batch->num_jobs; });
+  auto it = std::find(fields->batches.begin(), fields->batches.end(), batch);
+  if (it != fields->batches.end()) {
+    fields->batches.erase(it);
+  }
+  return batch->num_failed;
+}
+
+void EncryptionWorkerPool::Run() {
+  auto fields = protected_fields_.lock();
+  while (true) {
+    fields->work_notifier.wait(fields,
+                               [&fields] { return fields->shut_down || !fields->batches.empty(); });
+    if (fields->shut_down) {
+      return;
+    }
+    std::shared_ptr<Batch> batch = fields->batches.front();
+    fields.unlock();
+    Work(batch.get());
+    fields.lock();
+    // All of the jobs of |batch| have been claimed, so there is nothing left for other workers.
+    if (!fields->batches.empty() && fields->batches.front() == batch) {
+      fields->batches.pop_front();
+    }
+  }
+}
+
+void EncryptionWorkerPool::Work(Batch* batch) {
+  size_t num_done = 0;
+  size_t i;
+  while ((i = batch->next_job++) < batch->num_jobs) {
+    const Job& job = batch->jobs[i];
+    const EncryptedMessageMaker* encrypter = job.encrypter ? job.encrypter : batch->encrypter;
+    if (!encrypter->Encrypt(*job.message, job.encrypted_message)) {
+      batch->num_failed++;
+    }
+    num_done++;
+  }
+  if (num_done == 0) {
+    return;
+  }
+
+  auto fields = protected_fields_.lock();
+  batch->num_done += num_done;
+  if (batch->num_done == batch->num_jobs) {
+    fields->done_notifier.notify_all();
+  }
+}
+
+}  // namespace cobalt::util
@@ -0,0 +1,79 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_UTIL_ENCRYPTION_WORKER_POOL_H_
+#define COBALT_SRC_LIB_UTIL_ENCRYPTION_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "src/lib/util/encrypted_message_util.h"
+#include "src/lib/util/protected_fields.h"
+#include "src/pb/encrypted_message.pb.h"
+
+namespace cobalt::util {
+
+// EncryptionWorkerPool encrypts batches of messages on a fixed set of worker threads.
+//
+// It is used to encrypt the Observations which were stored unencrypted when they are read back to
+// be sent, so that the cost of the public key encryption of each Observation is spread across cores
+// instead of being paid by the threads which log events.
+//
+// This object is thread safe. Several batches may be encrypted concurrently.
+class EncryptionWorkerPool {
+ public:
+  // |num_workers|. The number of worker threads. If 0, one less than the number of cores is used,
+  // since the thread calling EncryptAll() takes part in the work, with a minimum of one.
+  explicit EncryptionWorkerPool(size_t num_workers = 0);
+
+  // Stops and joins the worker threads.
+  ~EncryptionWorkerPool();
+
+  // A message to encrypt, and the EncryptedMessage to populate with the result. Both must stay
+  // valid until the call to EncryptAll() to which the Job is passed returns. If |encrypter| is set,
+  // it is used for this job instead of the one passed to EncryptAll().
+  struct Job {
+    const google::protobuf::MessageLite* message;
+    EncryptedMessage* encrypted_message;
+    const EncryptedMessageMaker* encrypter = nullptr;
+  };
+
+  // Encrypts the message of each of |jobs| with |encrypter|. The jobs are shared between the
+  // workers and the calling thread, and the call returns when all of them are done. |encrypter|
+  // must support concurrent calls to Encrypt(), as the EncryptedMessageMakers of Cobalt do.
+  //
+  // Returns the number of jobs whose encryption failed.
+  size_t EncryptAll(const EncryptedMessageMaker& encrypter, const std::vector<Job>& jobs);
+
+  [[nodiscard]] size_t num_workers() const { return workers_.size(); }
+
+ private:
+  struct Batch;
+
+  // The loop run by each of the worker threads.
+  void Run();
+
+  // Encrypts the jobs of |batch| which have not been claimed by another thread, until there are
+  // none left, and records how many were done.
+  void Work(Batch* batch);
+
+  struct Fields {
+    // The batches which may still have unclaimed jobs, oldest first.
+    std::deque<std::shared_ptr<Batch>> batches;
+    bool shut_down = false;
+    std::condition_variable_any work_notifier;
+    std::condition_variable_any done_notifier;
+  };
+  ProtectedFields<Fields> protected_fields_;
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace cobalt::util
+
+#endif  // COBALT_SRC_LIB_UTIL_ENCRYPTION_WORKER_POOL_H_
@@ -0,0 +1,128 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/encryption_worker_pool.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/pb/encrypted_message.pb.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::util {
+
+namespace {
+
+// An EncryptedMessageMaker which does not encrypt, and fails on messages whose ciphertext is
+// "fail".
+class FakeEncryptedMessageMaker : public EncryptedMessageMaker {
+ public:
+  bool Encrypt(const google::protobuf::MessageLite& message,
+               EncryptedMessage* encrypted_message) const override {
+    return EncryptSerialized(message.SerializeAsString(), encrypted_message);
+  }
+
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override {
+    EncryptedMessage message;
+    message.ParseFromString(serialized_message);
+    if (message.ciphertext() == "fail") {
+      return false;
+    }
+    encrypted_message->set_ciphertext(serialized_message);
+    return true;
+  }
+
+  [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
+    return EncryptedMessage::NONE;
+  }
+};
+
+// Makes |num| messages and a job to encrypt each of them into |encrypted|.
+std::vector<EncryptionWorkerPool::Job> MakeJobs(size_t num, std::vector<EncryptedMessage>* messages,
+                                                std::vector<EncryptedMessage>* encrypted) {
+  messages->resize(num);
+  encrypted->resize(num);
+  std::vector<EncryptionWorkerPool::Job> jobs;
+  for (size_t i = 0; i < num; i++) {
+    (*messages)[i].set_ciphertext("message " + std::to_string(i));
+    jobs.push_back({&(*messages)[i], &(*encrypted)[i]});
+  }
+  return jobs;
+}
+
+}  // namespace
+
+TEST(EncryptionWorkerPool, EncryptsAllJobs) {
+  EncryptionWorkerPool pool(3);
+  EXPECT_EQ(pool.num_workers(), 3u);
+  FakeEncryptedMessageMaker encrypter;
+  for (size_t num_jobs : {0, 1, 2, 1000}) {
+    std::vector<EncryptedMessage> messages;
+    std::vector<EncryptedMessage> encrypted;
+    auto jobs = MakeJobs(num_jobs, &messages, &encrypted);
+    EXPECT_EQ(pool.EncryptAll(encrypter, jobs), 0u);
+    for (size_t i = 0; i < num_jobs; i++) {
+      EXPECT_EQ(encrypted[i].ciphertext(), messages[i].SerializeAsString()) << "i=" << i;
+    }
+  }
+}
+
+TEST(EncryptionWorkerPool, CountsFailures) {
+  EncryptionWorkerPool pool(2);
+  FakeEncryptedMessageMaker encrypter;
+  std::vector<EncryptedMessage> messages;
+  std::vector<EncryptedMessage> encrypted;
+  auto jobs = MakeJobs(100, &messages, &encrypted);
+  messages[10].set_ciphertext("fail");
+  messages[90].set_ciphertext("fail");
+  EXPECT_EQ(pool.EncryptAll(encrypter, jobs), 2u);
+  EXPECT_TRUE(encrypted[10].ciphertext().empty());
+  EXPECT_EQ(encrypted[11].ciphertext(), messages[11].SerializeAsString());
+}
+
+// The encrypter of a job takes precedence over the one passed to EncryptAll().
+TEST(EncryptionWorkerPool, UsesJobEncrypter) {
+  EncryptionWorkerPool pool(2);
+  FakeEncryptedMessageMaker encrypter;
+  std::vector<EncryptedMessage> messages;
+  std::vector<EncryptedMessage> encrypted;
+  auto jobs = MakeJobs(10, &messages, &encrypted);
+  auto unencrypted = EncryptedMessageMaker::MakeUnencrypted();
+  jobs[5].encrypter = unencrypted.get();
+  messages[5].set_ciphertext("fail");
+  EXPECT_EQ(pool.EncryptAll(encrypter, jobs), 0u);
+  EXPECT_EQ(encrypted[5].ciphertext(), messages[5].SerializeAsString());
+}
+
+// Batches submitted concurrently from several threads are all completed.
+TEST(EncryptionWorkerPool, ConcurrentBatches) {
+  EncryptionWorkerPool pool(2);
+  FakeEncryptedMessageMaker encrypter;
+  std::atomic<size_t> num_failed{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int round = 0; round < 50; round++) {
+        std::vector<EncryptedMessage> messages;
+        std::vector<EncryptedMessage> encrypted;
+        auto jobs = MakeJobs(20, &messages, &encrypted);
+        num_failed += pool.EncryptAll(encrypter, jobs);
+        for (size_t i = 0; i < jobs.size(); i++) {
+          if (encrypted[i].ciphertext() != messages[i].SerializeAsString()) {
+            num_failed++;
+          }
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_failed, 0u);
+}
+
+}  // namespace cobalt::util
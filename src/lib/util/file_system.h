@@ -5,10 +5,12 @@
 #ifndef COBALT_SRC_LIB_UTIL_FILE_SYSTEM_H_
 #define COBALT_SRC_LIB_UTIL_FILE_SYSTEM_H_
 
+#include <cstdint>
 #include <istream>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <google/protobuf/io/zero_copy_stream.h>
@@ -108,7 +110,113 @@ class FileSystem {
   virtual lib::statusor::StatusOr<ProtoOutputStreamPtr> NewProtoOutputStream(
       const std::string &file, bool append, int block_size) = 0;
 
+  // FlushProtoOutputStream writes any data buffered by |stream| to the underlying file.
+  //
+  // |stream|. A stream returned by NewProtoOutputStream() on this FileSystem.
+  //
+  // Returns: True if the data was written. The default implementation does not support flushing
+  // and returns false.
+  virtual bool FlushProtoOutputStream(::google::protobuf::io::ZeroCopyOutputStream *stream) {
+    return false;
+  }
+
+  // SyncFile blocks until the data that has been written to |file| is on durable storage.
+  //
+  // |file|. An absolute path to the file to be synced.
+  //
+  // Returns: True if the file was synced. The default implementation does not support syncing and
+  // returns false.
+  virtual bool SyncFile(const std::string &file) { return false; }
+
+  // A read-only view of the contents of a file, returned by MapFile().
+  class MappedFile {
+   public:
+    virtual ~MappedFile() = default;
+
+    [[nodiscard]] virtual std::string_view data() const = 0;
+  };
+
+  // MapFile makes the contents of |file| available in memory. The contents remain valid for the
+  // lifetime of the returned MappedFile, even if |file| is later replaced or deleted.
+  //
+  // |file|. An absolute path to the file to be mapped.
+  //
+  // Returns: A StatusOr with the MappedFile, or a NOT_FOUND status if there is no such file. The
+  // default implementation reads the file into memory with NewProtoInputStream().
+  virtual lib::statusor::StatusOr<std::unique_ptr<MappedFile>> MapFile(const std::string &file) {
+    if (!FileExists(file)) {
+      return Status(StatusCode::NOT_FOUND, "No file found at `" + file + "`.");
+    }
+    auto stream_or = NewProtoInputStream(file);
+    if (!stream_or.ok()) {
+      return stream_or.status();
+    }
+    auto stream = stream_or.ConsumeValueOrDie();
+    auto mapped = std::make_unique<InMemoryFile>();
+    const void *buffer;
+    int size;
+    while (stream->Next(&buffer, &size)) {
+      mapped->contents.append(static_cast<const char *>(buffer), size);
+    }
+    return std::unique_ptr<MappedFile>(std::move(mapped));
+  }
+
+  // A file which is read and written in place, at arbitrary offsets, returned by
+  // NewRandomAccessFile().
+  class RandomAccessFile {
+   public:
+    virtual ~RandomAccessFile() = default;
+
+    // Reads up to |size| bytes at |offset| into |data|. Fewer bytes are read if the file ends
+    // before |offset| + |size|.
+    //
+    // Returns: True unless the read failed.
+    virtual bool Read(uint64_t offset, size_t size, std::string *data) = 0;
+
+    // Writes |data| at |offset|, extending the file if needed.
+    //
+    // Returns: True if all of |data| was written.
+    virtual bool Write(uint64_t offset, std::string_view data) = 0;
+
+    // Extends the file with zeros to at least |size| bytes, allocating its blocks if the
+    // platform allows it, so that later writes do not grow the file.
+    //
+    // Returns: True if the file holds at least |size| bytes.
+    virtual bool Reserve(uint64_t size) = 0;
+
+    // Shrinks the file to |size| bytes, discarding the data which follows. Does nothing if the file
+    // is not larger than |size|.
+    //
+    // Returns: True if the file holds at most |size| bytes.
+    virtual bool Truncate(uint64_t size) = 0;
+
+    // Blocks until the data that has been written to the file is on durable storage.
+    //
+    // Returns: True if the file was synced.
+    virtual bool Sync() = 0;
+  };
+
+  // NewRandomAccessFile opens |file| for reading and writing in place.
+  //
+  // |file|. An absolute path to the file to be opened.
+  // |create|. True if the file should be created if it does not exist.
+  //
+  // Returns: A StatusOr with the RandomAccessFile, or a NOT_FOUND status if there is no such file
+  // and |create| is false. The default implementation does not support random access and returns
+  // an UNIMPLEMENTED status.
+  virtual lib::statusor::StatusOr<std::unique_ptr<RandomAccessFile>> NewRandomAccessFile(
+      const std::string &file, bool create) {
+    return Status(StatusCode::UNIMPLEMENTED, "Random access is not supported.");
+  }
+
   virtual ~FileSystem() = default;
+
+ private:
+  struct InMemoryFile : public MappedFile {
+    [[nodiscard]] std::string_view data() const override { return contents; }
+
+    std::string contents;
+  };
 };
 
 }  // namespace cobalt::util
@@ -0,0 +1,81 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_UTIL_FLAT_SORTED_TABLE_H_
+#define COBALT_SRC_LIB_UTIL_FLAT_SORTED_TABLE_H_
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace cobalt::util {
+
+// FlatSortedTable is a read-only map which is built once from all of its entries and then only
+// looked up. The entries are kept in a single vector sorted by key, so that building the table
+// costs one allocation and one sort, and a lookup is a binary search over contiguous memory.
+//
+// Keys that are expensive to copy, such as strings owned by a proto message, should be stored as
+// views into their owner, which must then outlive the table.
+//
+// Example:
+//
+//   FlatSortedTable<std::string_view, const MetricDefinition*> metrics_by_name(
+//       {{metric.metric_name(), &metric}, ...});
+//   if (auto* metric = metrics_by_name.Find("my_metric")) { ... }
+template <typename Key, typename Value>
+class FlatSortedTable {
+ public:
+  using Entry = std::pair<Key, Value>;
+
+  FlatSortedTable() = default;
+
+  // Builds the table from |entries|, which need not be sorted. If several entries have the same
+  // key the last one is kept, as if they had been assigned to a std::map in order.
+  explicit FlatSortedTable(std::vector<Entry> entries) : entries_(std::move(entries)) {
+    std::stable_sort(entries_.begin(), entries_.end(),
+                     [](const Entry& a, const Entry& b) { return a.first < b.first; });
+    auto out = entries_.begin();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (out != entries_.begin() && std::prev(out)->first == it->first) {
+        *std::prev(out) = std::move(*it);
+      } else {
+        if (out != it) {
+          *out = std::move(*it);
+        }
+        ++out;
+      }
+    }
+    entries_.erase(out, entries_.end());
+    entries_.shrink_to_fit();
+  }
+
+  // Returns the value for |key|, or nullptr if there is none. |key| may be of any type comparable
+  // with Key, such as a std::string when Key is std::string_view.
+  template <typename K>
+  [[nodiscard]] const Value* Find(const K& key) const {
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), key,
+                               [](const Entry& entry, const K& k) { return entry.first < k; });
+    if (it == entries_.end() || key < it->first) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  [[nodiscard]] size_t size() const { return entries_.size(); }
+
+  [[nodiscard]] bool empty() const { return entries_.empty(); }
+
+  void clear() {
+    entries_.clear();
+    entries_.shrink_to_fit();
+  }
+
+ private:
+  std::vector<Entry> entries_;
+};
+
+}  // namespace cobalt::util
+
+#endif  // COBALT_SRC_LIB_UTIL_FLAT_SORTED_TABLE_H_
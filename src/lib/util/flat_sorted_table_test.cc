@@ -0,0 +1,74 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/flat_sorted_table.h"
+
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::util {
+
+TEST(FlatSortedTable, FindsEntries) {
+  FlatSortedTable<uint32_t, int> table({{5, 50}, {1, 10}, {3, 30}});
+  EXPECT_EQ(3u, table.size());
+  ASSERT_NE(nullptr, table.Find(1u));
+  EXPECT_EQ(10, *table.Find(1u));
+  ASSERT_NE(nullptr, table.Find(3u));
+  EXPECT_EQ(30, *table.Find(3u));
+  ASSERT_NE(nullptr, table.Find(5u));
+  EXPECT_EQ(50, *table.Find(5u));
+  EXPECT_EQ(nullptr, table.Find(0u));
+  EXPECT_EQ(nullptr, table.Find(4u));
+  EXPECT_EQ(nullptr, table.Find(6u));
+
+  table.clear();
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(nullptr, table.Find(1u));
+}
+
+// As with assignments to a std::map, the last of several entries with the same key is kept.
+TEST(FlatSortedTable, LastDuplicateWins) {
+  FlatSortedTable<uint32_t, int> table({{2, 20}, {1, 10}, {2, 21}, {1, 11}, {3, 30}, {2, 22}});
+  EXPECT_EQ(3u, table.size());
+  EXPECT_EQ(11, *table.Find(1u));
+  EXPECT_EQ(22, *table.Find(2u));
+  EXPECT_EQ(30, *table.Find(3u));
+}
+
+TEST(FlatSortedTable, StringViewKeys) {
+  std::string alpha = "alpha";
+  std::string beta = "beta";
+  FlatSortedTable<std::string_view, int> table({{beta, 2}, {alpha, 1}});
+  ASSERT_NE(nullptr, table.Find(std::string("alpha")));
+  EXPECT_EQ(1, *table.Find(std::string("alpha")));
+  ASSERT_NE(nullptr, table.Find(std::string_view("beta")));
+  EXPECT_EQ(2, *table.Find(std::string_view("beta")));
+  EXPECT_EQ(nullptr, table.Find(std::string("alph")));
+  EXPECT_EQ(nullptr, table.Find(std::string("gamma")));
+}
+
+TEST(FlatSortedTable, TupleKeys) {
+  FlatSortedTable<std::tuple<uint32_t, uint32_t>, int> table(
+      {{{1, 2}, 12}, {{2, 1}, 21}, {{1, 1}, 11}});
+  EXPECT_EQ(11, *table.Find(std::make_tuple(1u, 1u)));
+  EXPECT_EQ(12, *table.Find(std::make_tuple(1u, 2u)));
+  EXPECT_EQ(21, *table.Find(std::make_tuple(2u, 1u)));
+  EXPECT_EQ(nullptr, table.Find(std::make_tuple(2u, 2u)));
+}
+
+TEST(FlatSortedTable, Empty) {
+  FlatSortedTable<uint32_t, int> table;
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(nullptr, table.Find(1u));
+  FlatSortedTable<uint32_t, int> built(std::vector<std::pair<uint32_t, int>>{});
+  EXPECT_EQ(0u, built.size());
+  EXPECT_EQ(nullptr, built.Find(1u));
+}
+
+}  // namespace cobalt::util
@@ -0,0 +1,190 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/gzip_stream.h"
+
+#include <cstring>
+
+namespace cobalt::util {
+
+using google::protobuf::io::ZeroCopyInputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
+
+namespace {
+
+constexpr int kBufferSize = 64 * 1024;
+// Adding 16 to the window bits selects the gzip format instead of the zlib one.
+constexpr int kGzipWindowBits = 15 + 16;
+constexpr uint8_t kGzipMagic[] = {0x1f, 0x8b};
+
+}  // namespace
+
+bool HasGzipHeader(ZeroCopyInputStream *in) {
+  const void *data;
+  int size;
+  while (in->Next(&data, &size)) {
+    if (size == 0) {
+      continue;
+    }
+    bool has_header = size >= 2 && memcmp(data, kGzipMagic, sizeof(kGzipMagic)) == 0;
+    in->BackUp(size);
+    return has_header;
+  }
+  return false;
+}
+
+GzipOutputStream::GzipOutputStream(ZeroCopyOutputStream *sub_stream, int level)
+    : sub_stream_(sub_stream), input_buffer_(kBufferSize, '\0') {
+  memset(&zstream_, 0, sizeof(zstream_));
+  had_error_ = deflateInit2(&zstream_, level, Z_DEFLATED, kGzipWindowBits, /*memLevel=*/8,
+                            Z_DEFAULT_STRATEGY) != Z_OK;
+}
+
+GzipOutputStream::~GzipOutputStream() { Close(); }
+
+bool GzipOutputStream::Deflate(int flush) {
+  zstream_.next_in = reinterpret_cast<Bytef *>(&input_buffer_[0]);
+  zstream_.avail_in = static_cast<uInt>(input_used_);
+  input_used_ = 0;
+  while (true) {
+    if (zstream_.avail_out == 0) {
+      void *out;
+      int out_size;
+      if (!sub_stream_->Next(&out, &out_size)) {
+        return false;
+      }
+      zstream_.next_out = static_cast<Bytef *>(out);
+      zstream_.avail_out = static_cast<uInt>(out_size);
+    }
+    int result = deflate(&zstream_, flush);
+    if (result == Z_STREAM_END) {
+      return true;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      return false;
+    }
+    if (flush != Z_FINISH && zstream_.avail_in == 0 && zstream_.avail_out > 0) {
+      return true;
+    }
+  }
+}
+
+bool GzipOutputStream::Next(void **data, int *size) {
+  if (had_error_ || closed_) {
+    return false;
+  }
+  if (input_used_ > 0 && !Deflate(Z_NO_FLUSH)) {
+    had_error_ = true;
+    return false;
+  }
+  input_used_ = kBufferSize;
+  byte_count_ += kBufferSize;
+  *data = &input_buffer_[0];
+  *size = kBufferSize;
+  return true;
+}
+
+void GzipOutputStream::BackUp(int count) {
+  input_used_ -= count;
+  byte_count_ -= count;
+}
+
+bool GzipOutputStream::Close() {
+  if (closed_) {
+    return !had_error_;
+  }
+  closed_ = true;
+  if (!had_error_ && !Deflate(Z_FINISH)) {
+    had_error_ = true;
+  }
+  // Return the unused part of the last buffer obtained from |sub_stream_|.
+  if (zstream_.avail_out > 0) {
+    sub_stream_->BackUp(static_cast<int>(zstream_.avail_out));
+    zstream_.avail_out = 0;
+  }
+  deflateEnd(&zstream_);
+  return !had_error_;
+}
+
+GzipInputStream::GzipInputStream(ZeroCopyInputStream *sub_stream)
+    : sub_stream_(sub_stream), output_buffer_(kBufferSize, '\0') {
+  memset(&zstream_, 0, sizeof(zstream_));
+  had_error_ = inflateInit2(&zstream_, kGzipWindowBits) != Z_OK;
+  finished_ = had_error_;
+}
+
+GzipInputStream::~GzipInputStream() {
+  // Return the compressed bytes read past the end of the gzip member.
+  if (zstream_.avail_in > 0) {
+    sub_stream_->BackUp(static_cast<int>(zstream_.avail_in));
+  }
+  inflateEnd(&zstream_);
+}
+
+int GzipInputStream::Inflate() {
+  zstream_.next_out = reinterpret_cast<Bytef *>(&output_buffer_[0]);
+  zstream_.avail_out = kBufferSize;
+  while (!finished_ && zstream_.avail_out > 0) {
+    if (zstream_.avail_in == 0) {
+      const void *in;
+      int in_size;
+      if (!sub_stream_->Next(&in, &in_size)) {
+        // The compressed data ended before the gzip trailer.
+        had_error_ = true;
+        finished_ = true;
+        break;
+      }
+      zstream_.next_in = static_cast<Bytef *>(const_cast<void *>(in));
+      zstream_.avail_in = static_cast<uInt>(in_size);
+    }
+    int result = inflate(&zstream_, Z_NO_FLUSH);
+    if (result == Z_STREAM_END) {
+      finished_ = true;
+    } else if (result != Z_OK && result != Z_BUF_ERROR) {
+      had_error_ = true;
+      finished_ = true;
+    } else if (zstream_.avail_out < kBufferSize) {
+      // Return what is available rather than waiting for a full buffer.
+      break;
+    }
+  }
+  return kBufferSize - static_cast<int>(zstream_.avail_out);
+}
+
+bool GzipInputStream::Next(const void **data, int *size) {
+  if (backed_up_ > 0) {
+    *data = &output_buffer_[output_size_ - backed_up_];
+    *size = backed_up_;
+    backed_up_ = 0;
+    return true;
+  }
+  output_size_ = Inflate();
+  if (output_size_ == 0) {
+    return false;
+  }
+  byte_count_ += output_size_;
+  *data = &output_buffer_[0];
+  *size = output_size_;
+  return true;
+}
+
+void GzipInputStream::BackUp(int count) { backed_up_ = count; }
+
+bool GzipInputStream::Skip(int count) {
+  const void *data;
+  int size;
+  while (count > 0) {
+    if (!Next(&data, &size)) {
+      return false;
+    }
+    if (size > count) {
+      BackUp(size - count);
+      return true;
+    }
+    count -= size;
+  }
+  return true;
+}
+
+}  // namespace cobalt::util
@@ -0,0 +1,93 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_UTIL_GZIP_STREAM_H_
+#define COBALT_SRC_LIB_UTIL_GZIP_STREAM_H_
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <string>
+
+#include <google/protobuf/io/zero_copy_stream.h>
+
+namespace cobalt::util {
+
+// Returns true if the next bytes of |in| are the gzip magic number. Nothing is consumed from |in|.
+bool HasGzipHeader(google::protobuf::io::ZeroCopyInputStream *in);
+
+// GzipOutputStream is a ZeroCopyOutputStream which writes the gzip compression of the data written
+// to it to another ZeroCopyOutputStream.
+//
+// The lite protobuf runtime used by Cobalt does not include google::protobuf::io::GzipOutputStream.
+class GzipOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  // |sub_stream| must outlive this object. |level| is a zlib compression level.
+  explicit GzipOutputStream(google::protobuf::io::ZeroCopyOutputStream *sub_stream,
+                            int level = Z_DEFAULT_COMPRESSION);
+
+  // Calls Close().
+  ~GzipOutputStream() override;
+
+  // Compresses the data which has not been compressed yet and writes the gzip trailer. Returns
+  // false if there was an error at any point. Nothing can be written after Close().
+  bool Close();
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  int64_t ByteCount() const override { return byte_count_; }
+
+ private:
+  // Compresses the buffered input with the given zlib |flush| mode.
+  bool Deflate(int flush);
+
+  google::protobuf::io::ZeroCopyOutputStream *sub_stream_;
+  z_stream zstream_;
+  std::string input_buffer_;
+  // The number of bytes of |input_buffer_| handed out by the last call to Next() and not backed up.
+  int input_used_ = 0;
+  int64_t byte_count_ = 0;
+  bool had_error_ = false;
+  bool closed_ = false;
+};
+
+// GzipInputStream is a ZeroCopyInputStream which reads the decompression of the gzip data read
+// from another ZeroCopyInputStream, decompressing as it goes.
+//
+// Reading stops at the end of the first gzip member. If the compressed data is corrupted or
+// truncated, the data decompressed up to that point is returned and had_error() becomes true.
+class GzipInputStream : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  // |sub_stream| must outlive this object.
+  explicit GzipInputStream(google::protobuf::io::ZeroCopyInputStream *sub_stream);
+
+  ~GzipInputStream() override;
+
+  [[nodiscard]] bool had_error() const { return had_error_; }
+
+  bool Next(const void **data, int *size) override;
+  void BackUp(int count) override;
+  bool Skip(int count) override;
+  int64_t ByteCount() const override { return byte_count_ - backed_up_; }
+
+ private:
+  // Decompresses the next bytes of |sub_stream_| into |output_buffer_|. Returns the number of bytes
+  // produced, or 0 at the end of the data.
+  int Inflate();
+
+  google::protobuf::io::ZeroCopyInputStream *sub_stream_;
+  z_stream zstream_;
+  std::string output_buffer_;
+  // The number of bytes in |output_buffer_| returned by the last call to Next().
+  int output_size_ = 0;
+  // The number of bytes at the end of |output_buffer_| which were backed up.
+  int backed_up_ = 0;
+  int64_t byte_count_ = 0;
+  bool had_error_ = false;
+  bool finished_ = false;
+};
+
+}  // namespace cobalt::util
+
+#endif  // COBALT_SRC_LIB_UTIL_GZIP_STREAM_H_
@@ -0,0 +1,117 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/gzip_stream.h"
+
+#include <string>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::util {
+
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+namespace {
+
+std::string Compress(const std::string &data) {
+  std::string compressed;
+  StringOutputStream out(&compressed);
+  GzipOutputStream gzip_out(&out);
+  {
+    CodedOutputStream coded_out(&gzip_out);
+    coded_out.WriteRaw(data.data(), static_cast<int>(data.size()));
+  }
+  EXPECT_TRUE(gzip_out.Close());
+  return compressed;
+}
+
+// Decompresses |compressed|, reading from the underlying stream |block_size| bytes at a time.
+std::string Decompress(const std::string &compressed, bool *had_error, int block_size = -1) {
+  ArrayInputStream in(compressed.data(), static_cast<int>(compressed.size()), block_size);
+  GzipInputStream gzip_in(&in);
+  std::string data;
+  const void *buffer;
+  int size;
+  while (gzip_in.Next(&buffer, &size)) {
+    data.append(static_cast<const char *>(buffer), size);
+  }
+  *had_error = gzip_in.had_error();
+  return data;
+}
+
+// Returns about |size| bytes of repetitive, compressible text.
+std::string MakeData(size_t size) {
+  std::string data;
+  for (int i = 0; data.size() < size; i++) {
+    data += "observation " + std::to_string(i % 100) + ";";
+  }
+  return data;
+}
+
+}  // namespace
+
+TEST(GzipStream, RoundTrip) {
+  for (size_t size : {0, 10, 100 * 1024, 1024 * 1024}) {
+    std::string data = MakeData(size);
+    std::string compressed = Compress(data);
+    if (size >= 1024) {
+      EXPECT_LT(compressed.size(), data.size());
+    }
+    bool had_error;
+    EXPECT_EQ(data, Decompress(compressed, &had_error));
+    EXPECT_FALSE(had_error);
+    EXPECT_EQ(data, Decompress(compressed, &had_error, /*block_size=*/7));
+    EXPECT_FALSE(had_error);
+  }
+}
+
+TEST(GzipStream, HasGzipHeader) {
+  std::string compressed = Compress("data");
+  ArrayInputStream compressed_in(compressed.data(), static_cast<int>(compressed.size()));
+  EXPECT_TRUE(HasGzipHeader(&compressed_in));
+  // Nothing was consumed.
+  EXPECT_EQ(0, compressed_in.ByteCount());
+
+  std::string raw = "\x02\x20\x01";
+  ArrayInputStream raw_in(raw.data(), static_cast<int>(raw.size()));
+  EXPECT_FALSE(HasGzipHeader(&raw_in));
+
+  ArrayInputStream empty_in(nullptr, 0);
+  EXPECT_FALSE(HasGzipHeader(&empty_in));
+}
+
+// A truncated stream yields the data that could be decompressed and reports an error.
+TEST(GzipStream, Truncated) {
+  std::string data = MakeData(100 * 1024);
+  std::string compressed = Compress(data);
+  bool had_error;
+  std::string decompressed = Decompress(compressed.substr(0, compressed.size() / 2), &had_error);
+  EXPECT_TRUE(had_error);
+  EXPECT_GT(decompressed.size(), 0u);
+  EXPECT_EQ(data.substr(0, decompressed.size()), decompressed);
+}
+
+TEST(GzipStream, BackUpAndSkip) {
+  std::string data = MakeData(1000);
+  std::string compressed = Compress(data);
+  ArrayInputStream in(compressed.data(), static_cast<int>(compressed.size()));
+  GzipInputStream gzip_in(&in);
+  CodedInputStream coded_in(&gzip_in);
+  std::string head;
+  ASSERT_TRUE(coded_in.ReadString(&head, 10));
+  EXPECT_EQ(data.substr(0, 10), head);
+  ASSERT_TRUE(coded_in.Skip(100));
+  std::string tail;
+  ASSERT_TRUE(coded_in.ReadString(&tail, static_cast<int>(data.size()) - 110));
+  EXPECT_EQ(data.substr(110), tail);
+  EXPECT_FALSE(coded_in.Skip(1));
+}
+
+}  // namespace cobalt::util
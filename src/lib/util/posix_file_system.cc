@@ -6,7 +6,9 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <map>
 #include <memory>
@@ -104,4 +106,144 @@ lib::statusor::StatusOr<FileSystem::ProtoOutputStreamPtr> PosixFileSystem::NewPr
   return StatusOr(std::move(stream));
 }
 
+bool PosixFileSystem::FlushProtoOutputStream(google::protobuf::io::ZeroCopyOutputStream *stream) {
+  // All streams returned by NewProtoOutputStream() are FileOutputStreams.
+  return static_cast<google::protobuf::io::FileOutputStream *>(stream)->Flush();
+}
+
+bool PosixFileSystem::SyncFile(const std::string &file) {
+  auto fd = open(file.c_str(), O_WRONLY);
+  if (fd == -1) {
+    return false;
+  }
+  bool synced = fdatasync(fd) == 0;
+  close(fd);
+  return synced;
+}
+
+namespace {
+
+class PosixMappedFile : public FileSystem::MappedFile {
+ public:
+  PosixMappedFile(void *data, size_t size) : data_(data), size_(size) {}
+
+  ~PosixMappedFile() override {
+    if (size_ > 0) {
+      munmap(data_, size_);
+    }
+  }
+
+  [[nodiscard]] std::string_view data() const override {
+    return std::string_view(static_cast<const char *>(data_), size_);
+  }
+
+ private:
+  void *data_;
+  size_t size_;
+};
+
+}  // namespace
+
+StatusOr<std::unique_ptr<FileSystem::MappedFile>> PosixFileSystem::MapFile(
+    const std::string &file) {
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return Status(ErrnoToStatusCode(errno).value_or(StatusCode::UNAVAILABLE),
+                  "Unable to open `" + file + "`.", std::strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return Status(StatusCode::UNAVAILABLE, "Unable to stat `" + file + "`.", std::strerror(errno));
+  }
+  auto size = static_cast<size_t>(st.st_size);
+  // mmap() does not accept an empty mapping.
+  void *data = nullptr;
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  int mmap_errno = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    return Status(StatusCode::UNAVAILABLE, "Unable to map `" + file + "`.",
+                  std::strerror(mmap_errno));
+  }
+  return StatusOr<std::unique_ptr<MappedFile>>(std::make_unique<PosixMappedFile>(data, size));
+}
+
+namespace {
+
+class PosixRandomAccessFile : public FileSystem::RandomAccessFile {
+ public:
+  explicit PosixRandomAccessFile(int fd) : fd_(fd) {}
+
+  ~PosixRandomAccessFile() override { close(fd_); }
+
+  bool Read(uint64_t offset, size_t size, std::string *data) override {
+    data->resize(size);
+    size_t done = 0;
+    while (done < size) {
+      ssize_t n = pread(fd_, &(*data)[done], size - done, static_cast<off_t>(offset + done));
+      if (n <= 0) {
+        data->resize(done);
+        return n == 0;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  bool Write(uint64_t offset, std::string_view data) override {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n =
+          pwrite(fd_, data.data() + done, data.size() - done, static_cast<off_t>(offset + done));
+      if (n < 0) {
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  bool Reserve(uint64_t size) override {
+    struct stat st = {};
+    if (fstat(fd_, &st) != 0) {
+      return false;
+    }
+    if (static_cast<uint64_t>(st.st_size) >= size) {
+      return true;
+    }
+    // Not every file system supports posix_fallocate(), but all of them can extend the file.
+    return posix_fallocate(fd_, 0, static_cast<off_t>(size)) == 0 ||
+           ftruncate(fd_, static_cast<off_t>(size)) == 0;
+  }
+
+  bool Truncate(uint64_t size) override {
+    struct stat st = {};
+    if (fstat(fd_, &st) != 0) {
+      return false;
+    }
+    return static_cast<uint64_t>(st.st_size) <= size ||
+           ftruncate(fd_, static_cast<off_t>(size)) == 0;
+  }
+
+  bool Sync() override { return fdatasync(fd_) == 0; }
+
+ private:
+  int fd_;
+};
+
+}  // namespace
+
+StatusOr<std::unique_ptr<FileSystem::RandomAccessFile>> PosixFileSystem::NewRandomAccessFile(
+    const std::string &file, bool create) {
+  int fd = open(file.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return Status(ErrnoToStatusCode(errno).value_or(StatusCode::UNAVAILABLE),
+                  "Unable to open `" + file + "`.", std::strerror(errno));
+  }
+  return StatusOr<std::unique_ptr<RandomAccessFile>>(std::make_unique<PosixRandomAccessFile>(fd));
+}
+
 }  // namespace cobalt::util
@@ -32,6 +32,15 @@ class PosixFileSystem : public FileSystem {
   lib::statusor::StatusOr<ProtoOutputStreamPtr> NewProtoOutputStream(const std::string &file,
                                                                      bool append,
                                                                      int block_size) override;
+  bool FlushProtoOutputStream(::google::protobuf::io::ZeroCopyOutputStream *stream) override;
+  bool SyncFile(const std::string &file) override;
+
+  // Maps |file| with mmap().
+  lib::statusor::StatusOr<std::unique_ptr<MappedFile>> MapFile(const std::string &file) override;
+
+  // Keeps |file| open, and reads and writes it with pread() and pwrite().
+  lib::statusor::StatusOr<std::unique_ptr<RandomAccessFile>> NewRandomAccessFile(
+      const std::string &file, bool create) override;
 };
 
 }  // namespace cobalt::util
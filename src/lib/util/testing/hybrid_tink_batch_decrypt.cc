@@ -0,0 +1,115 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/lib/util/testing/hybrid_tink_batch_decrypt.h"
+
+#include <openssl/aead.h>
+
+#include "src/lib/util/status.h"
+#include "src/lib/util/status_codes.h"
+#include "third_party/tink/cc/cleartext_keyset_handle.h"
+#include "third_party/tink/cc/subtle/ecies_hkdf_recipient_kem_boringssl.h"
+#include "third_party/tink/cc/util/enums.h"
+#include "third_party/tink/proto/aes_gcm.pb.h"
+#include "third_party/tink/proto/ecies_aead_hkdf.pb.h"
+#include "third_party/tink/proto/tink.pb.h"
+
+namespace cobalt::util::testing {
+
+using ::crypto::tink::util::Enums;
+
+namespace {
+
+constexpr size_t kAesGcmNonceSize = 12;
+
+// Reads a varint from |data| at |*offset|, and advances |*offset| past it.
+bool ReadVarint(const std::string& data, size_t* offset, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *offset < data.size(); shift += 7) {
+    auto byte = static_cast<uint8_t>(data[(*offset)++]);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+lib::statusor::StatusOr<std::string> DecryptHybridTinkBatch(
+    const ::crypto::tink::KeysetHandle& private_keyset_handle, const std::string& context_info,
+    const std::string& kem_bytes, const EncryptedMessage& encrypted_message) {
+  if (encrypted_message.scheme() != EncryptedMessage::HYBRID_TINK_BATCH) {
+    return Status(INVALID_ARGUMENT, "Not a HYBRID_TINK_BATCH message.");
+  }
+
+  const auto& keyset = ::crypto::tink::CleartextKeysetHandle::GetKeyset(private_keyset_handle);
+  google::crypto::tink::EciesAeadHkdfPrivateKey private_key;
+  bool found_primary_key = false;
+  for (const auto& key : keyset.key()) {
+    if (key.key_id() == keyset.primary_key_id()) {
+      found_primary_key = private_key.ParseFromString(key.key_data().value());
+    }
+  }
+  if (!found_primary_key) {
+    return Status(INVALID_ARGUMENT, "The primary key is not an ECIES-AEAD-HKDF private key.");
+  }
+  const auto& params = private_key.public_key().params();
+  google::crypto::tink::AesGcmKeyFormat aes_gcm_key_format;
+  if (!aes_gcm_key_format.ParseFromString(params.dem_params().aead_dem().value())) {
+    return Status(INVALID_ARGUMENT, "The DEM is not AES-GCM.");
+  }
+
+  const std::string& ciphertext = encrypted_message.ciphertext();
+  size_t offset = 0;
+  uint64_t index;
+  if (!ReadVarint(ciphertext, &offset, &index)) {
+    return Status(INVALID_ARGUMENT, "Invalid index.");
+  }
+
+  auto kem_result = ::crypto::tink::subtle::EciesHkdfRecipientKemBoringSsl::New(
+      Enums::ProtoToSubtle(params.kem_params().curve_type()), private_key.key_value());
+  if (!kem_result.ok()) {
+    return Status(INVALID_ARGUMENT, kem_result.status().error_message());
+  }
+  auto key_result = kem_result.ValueOrDie()->GenerateKey(
+      kem_bytes, Enums::ProtoToSubtle(params.kem_params().hkdf_hash_type()),
+      params.kem_params().hkdf_salt(), context_info, aes_gcm_key_format.key_size(),
+      Enums::ProtoToSubtle(params.ec_point_format()));
+  if (!key_result.ok()) {
+    return Status(INVALID_ARGUMENT, key_result.status().error_message());
+  }
+  const auto& key = key_result.ValueOrDie();
+
+  const EVP_AEAD* aead = nullptr;
+  if (key.size() == 16) {
+    aead = EVP_aead_aes_128_gcm();
+  } else if (key.size() == 32) {
+    aead = EVP_aead_aes_256_gcm();
+  }
+  bssl::ScopedEVP_AEAD_CTX ctx;
+  if (aead == nullptr ||
+      EVP_AEAD_CTX_init(ctx.get(), aead, reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                        EVP_AEAD_DEFAULT_TAG_LENGTH, nullptr) != 1) {
+    return Status(INTERNAL, "Unable to set up AES-GCM.");
+  }
+
+  uint8_t nonce[kAesGcmNonceSize] = {};
+  for (size_t i = 0; i < sizeof(index); i++) {
+    nonce[kAesGcmNonceSize - 1 - i] = static_cast<uint8_t>(index >> (8 * i));
+  }
+  std::string plaintext(ciphertext.size() - offset, '\0');
+  size_t plaintext_size;
+  if (EVP_AEAD_CTX_open(ctx.get(), reinterpret_cast<uint8_t*>(&plaintext[0]), &plaintext_size,
+                        plaintext.size(), nonce, sizeof(nonce),
+                        reinterpret_cast<const uint8_t*>(ciphertext.data()) + offset,
+                        ciphertext.size() - offset, nullptr, 0) != 1) {
+    return Status(INVALID_ARGUMENT, "Unable to decrypt the message.");
+  }
+  plaintext.resize(plaintext_size);
+  return plaintext;
+}
+
+}  // namespace cobalt::util::testing
@@ -0,0 +1,30 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LIB_UTIL_TESTING_HYBRID_TINK_BATCH_DECRYPT_H_
+#define COBALT_SRC_LIB_UTIL_TESTING_HYBRID_TINK_BATCH_DECRYPT_H_
+
+#include <string>
+
+#include "src/lib/statusor/statusor.h"
+#include "src/pb/encrypted_message.pb.h"
+#include "third_party/tink/cc/keyset_handle.h"
+
+namespace cobalt::util::testing {
+
+// Decrypts an EncryptedMessage which uses the HYBRID_TINK_BATCH scheme, as the Analyzer does.
+//
+// |private_keyset_handle| The private keyset whose public keyset was used to encrypt the message.
+// Its primary key must be an ECIES-AEAD-HKDF key with an AES-GCM DEM.
+// |context_info| The context info which was used to encrypt the message.
+// |kem_bytes| The key encapsulation of the batch, from the |kem_bytes| of its ObservationBatch.
+//
+// Returns the serialized message.
+lib::statusor::StatusOr<std::string> DecryptHybridTinkBatch(
+    const ::crypto::tink::KeysetHandle& private_keyset_handle, const std::string& context_info,
+    const std::string& kem_bytes, const EncryptedMessage& encrypted_message);
+
+}  // namespace cobalt::util::testing
+
+#endif  // COBALT_SRC_LIB_UTIL_TESTING_HYBRID_TINK_BATCH_DECRYPT_H_
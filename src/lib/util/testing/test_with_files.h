@@ -56,7 +56,7 @@ class TestWithFiles : public ::testing::Test {
 
     folder_made_ = false;
     for (const auto& file : fs_.ListFiles(test_folder_).ConsumeValueOr({})) {
-      fs_.Delete(file);
+      fs_.Delete(test_folder_ + "/" + file);
     }
     fs_.Delete(test_folder_);
   }
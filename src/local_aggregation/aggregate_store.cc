@@ -109,21 +109,27 @@ bool GetSortedAggregationWindowsFromReport(const ReportDefinition& report,
   return true;
 }
 
-// Creates an AggregationConfig from a ProjectContext, MetricDefinition, and
-// ReportDefinition and populates the aggregation_config field of a specified
-// ReportAggregates. Also sets the type of the ReportAggregates based on the
-// ReportDefinition's type.
+// Returns the ReportDefinition with ID |report_id| among the reports of |metric|, or nullptr if
+// there is no such report.
+const ReportDefinition* FindReport(const MetricDefinition& metric, uint32_t report_id) {
+  for (const auto& report : metric.reports()) {
+    if (report.id() == report_id) {
+      return &report;
+    }
+  }
+  return nullptr;
+}
+
+// Creates an AggregationConfig from a MetricDefinition and ReportDefinition and populates the
+// aggregation_config field of a specified ReportAggregates. Also sets the type of the
+// ReportAggregates based on the ReportDefinition's type.
 //
 // Accepts ReportDefinitions with either at least one WindowSize, or at least one
 // OnDeviceAggregationWindow with units in days.
-bool PopulateReportAggregates(const ProjectContext& project_context, const MetricDefinition& metric,
-                              const ReportDefinition& report, ReportAggregates* report_aggregates) {
-  if (report.window_size_size() == 0 && report.aggregation_window_size() == 0) {
-  }
+bool PopulateReportAggregates(const MetricDefinition& metric, const ReportDefinition& report,
+                              ReportAggregates* report_aggregates) {
   AggregationConfig* aggregation_config = report_aggregates->mutable_aggregation_config();
-  *aggregation_config->mutable_project() = project_context.project();
-  *aggregation_config->mutable_metric() = *project_context.GetMetric(metric.id());
-  *aggregation_config->mutable_report() = report;
+  aggregation_config->set_registry_fingerprint(RegistryFingerprint(metric, report));
   if (!GetSortedAggregationWindowsFromReport(report, aggregation_config)) {
     return false;
   }
@@ -162,11 +168,162 @@ void ConvertWindowSizesToAggregationDays(LocalAggregateStore* store) {
   }
 }
 
+// Replace the copies of the Project, MetricDefinition, and ReportDefinition in each
+// AggregationConfig with the fingerprint of the definitions.
+void ReplaceDefinitionsWithFingerprints(LocalAggregateStore* store) {
+  for (auto& [key, aggregates] : *store->mutable_by_report_key()) {
+    auto config = aggregates.mutable_aggregation_config();
+    config->set_registry_fingerprint(RegistryFingerprint(config->metric(), config->report()));
+    config->clear_project();
+    config->clear_metric();
+    config->clear_report();
+  }
+}
+
+// Upgrades the LocalAggregateStore from version 1 to |kCurrentLocalAggregateStoreVersion|.
+Status UpgradeLocalAggregateStoreFromVersion1(LocalAggregateStore* store) {
+  ReplaceDefinitionsWithFingerprints(store);
+  store->set_version(kCurrentLocalAggregateStoreVersion);
+  return kOK;
+}
+
 // Upgrades the LocalAggregateStore from version 0 to |kCurrentLocalAggregateStoreVersion|.
 Status UpgradeLocalAggregateStoreFromVersion0(LocalAggregateStore* store) {
   ConvertWindowSizesToAggregationDays(store);
-  store->set_version(kCurrentLocalAggregateStoreVersion);
-  return kOK;
+  return UpgradeLocalAggregateStoreFromVersion1(store);
+}
+
+// Maps the snapshot in |file| and registers its reports as pending in |pending|. Returns false if
+// there is no usable snapshot in |file|, in which case the store should be read from its
+// ConsistentProtoStore instead.
+template <class StoreProto>
+bool MapIndexedStore(const IndexedStoreFile* file, StoreProto* store, PendingReports* pending) {
+  if (file == nullptr) {
+    return false;
+  }
+  auto mapping_or = file->Map();
+  if (!mapping_or.ok()) {
+    const auto& status = mapping_or.status();
+    if (status.error_code() == StatusCode::NOT_FOUND) {
+      VLOG(4) << "No IndexedStoreFile found at " << file->path()
+              << ". Reading from the ConsistentProtoStore instead.";
+    } else {
+      LOG(ERROR) << "Failed to map " << file->path() << " with status code: " << status.error_code()
+                 << "\nError message: " << status.error_message()
+                 << "\nError details: " << status.error_details()
+                 << "\nReading from the ConsistentProtoStore instead.";
+    }
+    return false;
+  }
+  LoadPendingReports(mapping_or.ConsumeValueOrDie(), store, pending);
+  return true;
+}
+
+// Decodes up to |max_reports| of the reports pending in |fields|, and inserts them into the store
+// |fields->*store|. The lock of |fields| is released while decoding. Returns the number of reports
+// which remain pending.
+template <class ReportProto, class Fields, class StoreProto>
+size_t PrefetchPendingReports(util::ProtectedFields<Fields>* fields, StoreProto Fields::*store,
+                              size_t max_reports) {
+  PendingReports batch;
+  {
+    auto locked = fields->lock();
+    batch.mapping = locked->pending_reports.mapping;
+    for (const auto& payload : locked->pending_reports.payloads) {
+      if (batch.payloads.size() >= max_reports) {
+        break;
+      }
+      batch.payloads.insert(payload);
+    }
+  }
+
+  std::map<std::string, ReportProto> decoded;
+  for (const auto& [report_key, payload] : batch.payloads) {
+    if (!decoded[report_key].ParseFromArray(payload.data(), static_cast<int>(payload.size()))) {
+      LOG(ERROR) << "Failed to parse a lazily loaded report. Dropping its data.";
+      decoded.erase(report_key);
+    }
+  }
+
+  auto locked = fields->lock();
+  auto& pending = locked->pending_reports;
+  for (const auto& [report_key, payload] : batch.payloads) {
+    // The report may have been decoded on first use, or deleted, while the lock was released.
+    auto still_pending = pending.payloads.find(report_key);
+    if (still_pending == pending.payloads.end() ||
+        still_pending->second.data() != payload.data()) {
+      continue;
+    }
+    pending.payloads.erase(still_pending);
+    if (auto report = decoded.find(report_key); report != decoded.end()) {
+      (*((*locked).*store).mutable_by_report_key())[report_key] = std::move(report->second);
+    }
+  }
+  if (pending.payloads.empty()) {
+    pending.mapping.reset();
+  }
+  return pending.payloads.size();
+}
+
+// Deletes the snapshot in |proto_store| once the store it held has been written to an
+// IndexedStoreFile. Otherwise the stale snapshot would stay on disk, and would be read again if the
+// IndexedStoreFile were lost. Deleting a store which has no files is cheap.
+void DeleteMigratedProtoStore(ConsistentProtoStore* proto_store) {
+  auto status = proto_store->Delete();
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to delete a migrated ConsistentProtoStore: " << status.error_message()
+               << "\nError details: " << status.error_details();
+  }
+}
+
+const std::string& OverflowComponent() {
+  static const std::string* overflow_component = new std::string(kOverflowComponent);
+  return *overflow_component;
+}
+
+// Returns the component under which an event for |component| should be aggregated in
+// |by_component| under |limits|, or nullptr if the event should be dropped. If the
+// kReplaceLeastFrequent policy applies, evicts the component with the fewest events from
+// |by_component|, inserts |component| in its place and sets |evicted_component| to the evicted
+// component. Counts the applied policy in |counters|.
+const std::string* ApplyComponentLimits(
+    const ComponentLimits& limits, const std::string& component,
+    google::protobuf::Map<std::string, EventCodeAggregates>* by_component,
+    ComponentLimitCounters* counters, std::optional<std::string>* evicted_component) {
+  if (by_component->count(component) > 0) {
+    return &component;
+  }
+  size_t num_components = by_component->size() - by_component->count(OverflowComponent());
+  if (num_components < limits.max_components_per_report) {
+    return &component;
+  }
+  switch (limits.overflow_policy) {
+    case ComponentOverflowPolicy::kDrop:
+      counters->num_dropped++;
+      return nullptr;
+    case ComponentOverflowPolicy::kBucketAsOther:
+      counters->num_bucketed++;
+      return &OverflowComponent();
+    case ComponentOverflowPolicy::kReplaceLeastFrequent: {
+      auto least_frequent = by_component->end();
+      for (auto it = by_component->begin(); it != by_component->end(); ++it) {
+        if (it->first != OverflowComponent() &&
+            (least_frequent == by_component->end() ||
+             it->second.num_events() < least_frequent->second.num_events())) {
+          least_frequent = it;
+        }
+      }
+      uint64_t num_events = least_frequent->second.num_events();
+      *evicted_component = least_frequent->first;
+      by_component->erase(least_frequent);
+      // The new component inherits the count of the evicted one, so that its count bounds its
+      // actual number of events from above.
+      (*by_component)[component].set_num_events(num_events);
+      counters->num_evicted++;
+      return &component;
+    }
+  }
+  return nullptr;
 }
 
 }  // namespace
@@ -174,18 +331,25 @@ Status UpgradeLocalAggregateStoreFromVersion0(LocalAggregateStore* store) {
 AggregateStore::AggregateStore(const Encoder* encoder, const ObservationWriter* observation_writer,
                                ConsistentProtoStore* local_aggregate_proto_store,
                                ConsistentProtoStore* obs_history_proto_store,
-                               const size_t backfill_days)
+                               const size_t backfill_days,
+                               IndexedStoreFile* local_aggregate_index_file,
+                               IndexedStoreFile* obs_history_index_file)
     : encoder_(encoder),
       observation_writer_(observation_writer),
       local_aggregate_proto_store_(local_aggregate_proto_store),
-      obs_history_proto_store_(obs_history_proto_store) {
+      obs_history_proto_store_(obs_history_proto_store),
+      local_aggregate_index_file_(local_aggregate_index_file),
+      obs_history_index_file_(obs_history_index_file) {
   CHECK_LE(backfill_days, kMaxAllowedBackfillDays)
       << "backfill_days must be less than or equal to " << kMaxAllowedBackfillDays;
   backfill_days_ = backfill_days;
   auto locked_store = protected_aggregate_store_.lock();
   locked_store->empty_local_aggregate_store = MakeNewLocalAggregateStore();
   auto restore_aggregates_status =
-      local_aggregate_proto_store_->Read(&(locked_store->local_aggregate_store));
+      MapIndexedStore(local_aggregate_index_file_, &locked_store->local_aggregate_store,
+                      &locked_store->pending_reports)
+          ? util::Status::OK
+          : local_aggregate_proto_store_->Read(&(locked_store->local_aggregate_store));
   switch (restore_aggregates_status.error_code()) {
     case StatusCode::OK: {
       VLOG(4) << "Read LocalAggregateStore from disk.";
@@ -207,16 +371,25 @@ AggregateStore::AggregateStore(const Encoder* encoder, const ObservationWriter*
       locked_store->local_aggregate_store = MakeNewLocalAggregateStore();
     }
   }
+  // Upgrading a lazily loaded store requires all of its reports to be decoded.
+  if (locked_store->local_aggregate_store.version() != kCurrentLocalAggregateStoreVersion) {
+    MaterializeAllReports(&locked_store->pending_reports, &locked_store->local_aggregate_store);
+  }
   if (auto status = MaybeUpgradeLocalAggregateStore(&(locked_store->local_aggregate_store));
       status != kOK) {
     LOG(ERROR) << "Failed to upgrade LocalAggregateStore to current version with status " << status
                << ".\nProceeding with empty "
                   "LocalAggregateStore.";
     locked_store->local_aggregate_store = MakeNewLocalAggregateStore();
+    locked_store->pending_reports = PendingReports();
   }
 
   auto locked_obs_history = protected_obs_history_.lock();
-  auto restore_history_status = obs_history_proto_store_->Read(&locked_obs_history->obs_history);
+  auto restore_history_status =
+      MapIndexedStore(obs_history_index_file_, &locked_obs_history->obs_history,
+                      &locked_obs_history->pending_reports)
+          ? util::Status::OK
+          : obs_history_proto_store_->Read(&locked_obs_history->obs_history);
   switch (restore_history_status.error_code()) {
     case StatusCode::OK: {
       VLOG(4) << "Read AggregatedObservationHistoryStore from disk.";
@@ -237,40 +410,72 @@ AggregateStore::AggregateStore(const Encoder* encoder, const ObservationWriter*
       locked_obs_history->obs_history = MakeNewObservationHistoryStore();
     }
   }
+  if (locked_obs_history->obs_history.version() != kCurrentObservationHistoryStoreVersion) {
+    MaterializeAllReports(&locked_obs_history->pending_reports, &locked_obs_history->obs_history);
+  }
   if (auto status = MaybeUpgradeObservationHistoryStore(&locked_obs_history->obs_history);
       status != kOK) {
     LOG(ERROR)
         << "Failed to upgrade AggregatedObservationHistoryStore to current version with status "
         << status << ".\nProceeding with empty AggregatedObservationHistoryStore.";
     locked_obs_history->obs_history = MakeNewObservationHistoryStore();
+    locked_obs_history->pending_reports = PendingReports();
   }
 }
 
-Status AggregateStore::MaybeInsertReportConfig(const ProjectContext& project_context,
-                                               const MetricDefinition& metric,
-                                               const ReportDefinition& report) {
-  auto locked = protected_aggregate_store_.lock();
+Status AggregateStore::MaybeInsertReportConfig(
+    std::shared_ptr<const ProjectContext> project_context, const MetricDefinition& metric,
+    const ReportDefinition& report) {
+  if (project_context == nullptr) {
+    return kInvalidArguments;
+  }
   std::string key;
-  if (!PopulateReportKey(project_context.project().customer_id(),
-                         project_context.project().project_id(), metric.id(), report.id(), &key)) {
+  if (!PopulateReportKey(project_context->project().customer_id(),
+                         project_context->project().project_id(), metric.id(), report.id(), &key)) {
+    return kInvalidArguments;
+  }
+  auto locked = protected_aggregate_store_.lock();
+  MaterializeReport(key, &locked->pending_reports, &locked->local_aggregate_store);
+  if (locked->report_definitions.count(key) > 0) {
+    return kOK;
+  }
+
+  // Resolve the definitions from the registry held by |project_context|, so that they remain valid
+  // for as long as the AggregateStore holds a reference to it.
+  const MetricDefinition* live_metric = project_context->GetMetric(metric.id());
+  if (live_metric == nullptr) {
+    LOG(ERROR) << "Metric " << metric.id() << " was not found in "
+               << project_context->FullyQualifiedName();
+    return kInvalidArguments;
+  }
+  const ReportDefinition* live_report = FindReport(*live_metric, report.id());
+  if (live_report == nullptr) {
+    LOG(ERROR) << "Report " << report.id() << " was not found in "
+               << project_context->FullMetricName(*live_metric);
     return kInvalidArguments;
   }
   ReportAggregates report_aggregates;
-  if (locked->local_aggregate_store.by_report_key().count(key) == 0) {
-    if (!PopulateReportAggregates(project_context, metric, report, &report_aggregates)) {
-      return kInvalidArguments;
-    }
-    (*locked->local_aggregate_store.mutable_by_report_key())[key] = report_aggregates;
+  if (!PopulateReportAggregates(*live_metric, *live_report, &report_aggregates)) {
+    return kInvalidArguments;
   }
 
-  // Make sure that the 'empty' store has the key as well.
-  ReportAggregates empty_report_aggregates;
-  if (locked->empty_local_aggregate_store.by_report_key().count(key) == 0) {
-    if (!PopulateReportAggregates(project_context, metric, report, &empty_report_aggregates)) {
-      return kInvalidArguments;
+  for (auto store : {&locked->local_aggregate_store, &locked->empty_local_aggregate_store}) {
+    auto stored_aggregates = store->mutable_by_report_key()->find(key);
+    if (stored_aggregates == store->mutable_by_report_key()->end()) {
+      (*store->mutable_by_report_key())[key] = report_aggregates;
+    } else if (stored_aggregates->second.aggregation_config().registry_fingerprint() !=
+               report_aggregates.aggregation_config().registry_fingerprint()) {
+      VLOG(4) << "The registry definition of report " << live_report->report_name()
+              << " has changed. Updating its AggregationConfig.";
+      if (stored_aggregates->second.type_case() != report_aggregates.type_case()) {
+        stored_aggregates->second = report_aggregates;
+      } else {
+        *stored_aggregates->second.mutable_aggregation_config() =
+            report_aggregates.aggregation_config();
+      }
     }
-    (*locked->empty_local_aggregate_store.mutable_by_report_key())[key] = empty_report_aggregates;
   }
+  locked->report_definitions[key] = {std::move(project_context), live_metric, live_report};
   return kOK;
 }
 
@@ -285,6 +490,7 @@ Status AggregateStore::SetActive(uint32_t customer_id, uint32_t project_id, uint
   }
 
   auto locked = protected_aggregate_store_.lock();
+  MaterializeReport(key, &locked->pending_reports, &locked->local_aggregate_store);
   auto aggregates = locked->local_aggregate_store.mutable_by_report_key()->find(key);
   if (aggregates == locked->local_aggregate_store.mutable_by_report_key()->end()) {
     LOG(ERROR) << "The Local Aggregate Store received an unexpected key.";
@@ -314,7 +520,21 @@ Status AggregateStore::UpdateNumericAggregate(uint32_t customer_id, uint32_t pro
     return kInvalidArguments;
   }
 
+  std::optional<std::string> evicted_component;
+  auto status = UpdateNumericAggregateForReport(report_key, component, event_code, day_index, value,
+                                                &evicted_component);
+  // The history of the evicted component is deleted, so that it does not outgrow the limit.
+  if (evicted_component) {
+    DeletePerDeviceNumericComponentHistory(report_key, *evicted_component);
+  }
+  return status;
+}
+
+Status AggregateStore::UpdateNumericAggregateForReport(
+    const std::string& report_key, const std::string& component, uint64_t event_code,
+    uint32_t day_index, int64_t value, std::optional<std::string>* evicted_component) {
   auto locked = protected_aggregate_store_.lock();
+  MaterializeReport(report_key, &locked->pending_reports, &locked->local_aggregate_store);
   auto aggregates = locked->local_aggregate_store.mutable_by_report_key()->find(report_key);
   if (aggregates == locked->local_aggregate_store.mutable_by_report_key()->end()) {
     LOG(ERROR) << "The Local Aggregate Store received an unexpected key.";
@@ -325,16 +545,31 @@ Status AggregateStore::UpdateNumericAggregate(uint32_t customer_id, uint32_t pro
                   "compatible type.";
     return kInvalidArguments;
   }
+  auto definitions = locked->report_definitions.find(report_key);
+  if (definitions == locked->report_definitions.end()) {
+    LOG(ERROR) << "The Local Aggregate Store has no definition for this report key.";
+    return kInvalidArguments;
+  }
 
+  auto by_component = aggregates->second.mutable_numeric_aggregates()->mutable_by_component();
+  const std::string* stored_component = &component;
+  if (component_limits_.max_components_per_report > 0) {
+    stored_component = ApplyComponentLimits(component_limits_, component, by_component,
+                                            &locked->component_limit_counters[report_key],
+                                            evicted_component);
+    if (stored_component == nullptr) {
+      return kOK;
+    }
+  }
+  auto& component_aggregates = (*by_component)[*stored_component];
+  component_aggregates.set_num_events(component_aggregates.num_events() + 1);
   auto aggregates_by_day =
-      (*(*aggregates->second.mutable_numeric_aggregates()->mutable_by_component())[component]
-            .mutable_by_event_code())[event_code]
-          .mutable_by_day_index();
+      (*component_aggregates.mutable_by_event_code())[event_code].mutable_by_day_index();
   bool has_stored_aggregate = ((*aggregates_by_day).find(day_index) != aggregates_by_day->end());
   auto day_aggregate = (*aggregates_by_day)[day_index].mutable_numeric_daily_aggregate();
 
   auto [status, updated_value] = GetUpdatedAggregate(
-      aggregates->second.aggregation_config().report().aggregation_type(),
+      definitions->second.report->aggregation_type(),
       has_stored_aggregate ? std::optional<int64_t>{day_aggregate->value()} : std::nullopt, value);
   if (status == kOK) {
     day_aggregate->set_value(updated_value);
@@ -344,6 +579,14 @@ Status AggregateStore::UpdateNumericAggregate(uint32_t customer_id, uint32_t pro
   return status;
 }
 
+bool AggregateStore::PrefetchReports(size_t max_reports) {
+  size_t remaining = PrefetchPendingReports<ReportAggregates>(
+      &protected_aggregate_store_, &AggregateStoreFields::local_aggregate_store, max_reports);
+  remaining += PrefetchPendingReports<AggregatedObservationHistory>(
+      &protected_obs_history_, &AggregatedObservationHistoryStoreFields::obs_history, max_reports);
+  return remaining > 0;
+}
+
 RepeatedField<uint32_t> UnpackEventCodesProto(uint64_t packed_event_codes) {
   RepeatedField<uint32_t> fields;
   for (auto code : config::UnpackEventCodes(packed_event_codes)) {
@@ -353,10 +596,27 @@ RepeatedField<uint32_t> UnpackEventCodesProto(uint64_t packed_event_codes) {
 }
 
 Status AggregateStore::BackUpLocalAggregateStore() {
-  // Lock, copy the LocalAggregateStore, and release the lock. Write the copy
-  // to |local_aggregate_proto_store_|.
-  auto local_aggregate_store = CopyLocalAggregateStore();
-  auto status = local_aggregate_proto_store_->Write(local_aggregate_store);
+  util::Status status;
+  if (local_aggregate_index_file_ != nullptr) {
+    // Lock, copy the decoded part of the LocalAggregateStore and the pending reports, and release
+    // the lock. Pending reports are written without being decoded.
+    LocalAggregateStore local_aggregate_store;
+    PendingReports pending_reports;
+    {
+      auto locked = protected_aggregate_store_.lock();
+      local_aggregate_store = locked->local_aggregate_store;
+      pending_reports = locked->pending_reports;
+    }
+    status = WriteIndexedStore(local_aggregate_store, pending_reports, local_aggregate_index_file_);
+    if (status.ok()) {
+      DeleteMigratedProtoStore(local_aggregate_proto_store_);
+    }
+  } else {
+    // Lock, copy the LocalAggregateStore, and release the lock. Write the copy
+    // to |local_aggregate_proto_store_|.
+    auto local_aggregate_store = CopyLocalAggregateStore();
+    status = local_aggregate_proto_store_->Write(local_aggregate_store);
+  }
   if (!status.ok()) {
     LOG(ERROR) << "Failed to back up the LocalAggregateStore with error code: "
                << status.error_code() << "\nError message: " << status.error_message()
@@ -367,8 +627,25 @@ Status AggregateStore::BackUpLocalAggregateStore() {
 }
 
 Status AggregateStore::BackUpObservationHistory() {
-  auto obs_history = protected_obs_history_.lock()->obs_history;
-  auto status = obs_history_proto_store_->Write(obs_history);
+  AggregatedObservationHistoryStore obs_history;
+  PendingReports pending_reports;
+  {
+    auto locked = protected_obs_history_.lock();
+    if (obs_history_index_file_ == nullptr) {
+      MaterializeAllReports(&locked->pending_reports, &locked->obs_history);
+    }
+    obs_history = locked->obs_history;
+    pending_reports = locked->pending_reports;
+  }
+  util::Status status;
+  if (obs_history_index_file_ != nullptr) {
+    status = WriteIndexedStore(obs_history, pending_reports, obs_history_index_file_);
+    if (status.ok()) {
+      DeleteMigratedProtoStore(obs_history_proto_store_);
+    }
+  } else {
+    status = obs_history_proto_store_->Write(obs_history);
+  }
   if (!status.ok()) {
     LOG(ERROR) << "Failed to back up the AggregatedObservationHistoryStore. "
                   "::cobalt::util::Status error code: "
@@ -444,22 +721,32 @@ Status AggregateStore::GarbageCollect(uint32_t day_index_utc, uint32_t day_index
   CHECK_GE(day_index_utc, kMaxAllowedAggregationDays + backfill_days_);
   CHECK_GE(day_index_local, kMaxAllowedAggregationDays + backfill_days_);
 
+  // Reports which are still pending are not decoded: their stale buckets are removed by the first
+  // call after they are decoded, which happens once their ProjectContext is provided.
   auto locked = protected_aggregate_store_.lock();
   for (const auto& [report_key, aggregates] : locked->local_aggregate_store.by_report_key()) {
     uint32_t day_index;
     const auto& config = aggregates.aggregation_config();
-    switch (config.metric().time_zone_policy()) {
-      case MetricDefinition::UTC: {
-        day_index = day_index_utc;
-        break;
-      }
-      case MetricDefinition::LOCAL: {
-        day_index = day_index_local;
-        break;
+    auto definitions = locked->report_definitions.find(report_key);
+    if (definitions == locked->report_definitions.end()) {
+      // The time zone policy of the report's parent metric is unknown until its ProjectContext is
+      // provided. Use the earlier of the two day indices so that no data which might still be
+      // needed is deleted.
+      day_index = std::min(day_index_utc, day_index_local);
+    } else {
+      switch (definitions->second.metric->time_zone_policy()) {
+        case MetricDefinition::UTC: {
+          day_index = day_index_utc;
+          break;
+        }
+        case MetricDefinition::LOCAL: {
+          day_index = day_index_local;
+          break;
+        }
+        default:
+          LOG_FIRST_N(ERROR, 10) << "The TimeZonePolicy of this MetricDefinition is invalid.";
+          continue;
       }
-      default:
-        LOG_FIRST_N(ERROR, 10) << "The TimeZonePolicy of this MetricDefinition is invalid.";
-        continue;
     }
     if (aggregates.aggregation_config().aggregation_window_size() == 0) {
       LOG_FIRST_N(ERROR, 10) << "This ReportDefinition does not have an aggregation window.";
@@ -506,8 +793,43 @@ Status AggregateStore::GarbageCollect(uint32_t day_index_utc, uint32_t day_index
   return kOK;
 }
 
+GenerationBudget::GenerationBudget(size_t max_observations,
+                                   std::chrono::steady_clock::duration max_duration,
+                                   util::SteadyClockInterface* steady_clock)
+    : max_observations_(max_observations),
+      has_deadline_(max_duration > std::chrono::steady_clock::duration::zero()),
+      steady_clock_(steady_clock) {
+  if (has_deadline_) {
+    deadline_ = steady_clock_->now() + max_duration;
+  }
+}
+
+bool GenerationBudget::TryConsume() {
+  if (!exhausted_ && ((max_observations_ > 0 && num_observations_ >= max_observations_) ||
+                      (has_deadline_ && steady_clock_->now() >= deadline_))) {
+    exhausted_ = true;
+  }
+  if (exhausted_) {
+    return false;
+  }
+  num_observations_++;
+  return true;
+}
+
+bool AggregateStore::MayGenerateObservation(GenerationBudget* budget) const {
+  if (budget == nullptr) {
+    return true;
+  }
+  if (!budget->exhausted() && observation_writer_->IsAlmostFull()) {
+    VLOG(4) << "Deferring Observation generation because the ObservationStore is almost full.";
+    budget->Exhaust();
+  }
+  return budget->TryConsume();
+}
+
 Status AggregateStore::GenerateObservations(uint32_t final_day_index_utc,
-                                            uint32_t final_day_index_local) {
+                                            uint32_t final_day_index_local,
+                                            GenerationBudget* budget) {
   if (final_day_index_local == 0u) {
     final_day_index_local = final_day_index_utc;
   }
@@ -516,14 +838,32 @@ Status AggregateStore::GenerateObservations(uint32_t final_day_index_utc,
   CHECK_GE(final_day_index_utc, kMaxAllowedAggregationDays + backfill_days_);
   CHECK_GE(final_day_index_local, kMaxAllowedAggregationDays + backfill_days_);
 
-  // Lock, copy the LocalAggregateStore, and release the lock. Use the copy to
-  // generate observations.
-  auto local_aggregate_store = CopyLocalAggregateStore();
+  // Lock, copy the LocalAggregateStore and the report definitions, and release the lock. Use the
+  // copies to generate observations. Only reports with definitions generate observations, and
+  // MaybeInsertReportConfig() decodes a report before adding its definitions, so the reports which
+  // are still pending are skipped without being decoded. Their histories are decoded one report at
+  // a time, when they are updated.
+  LocalAggregateStore local_aggregate_store;
+  std::map<std::string, ReportDefinitions> report_definitions;
+  {
+    auto locked = protected_aggregate_store_.const_lock();
+    local_aggregate_store = locked->local_aggregate_store;
+    report_definitions = locked->report_definitions;
+  }
   for (const auto& [report_key, aggregates] : local_aggregate_store.by_report_key()) {
+    if (budget != nullptr && budget->exhausted()) {
+      break;
+    }
     const auto& config = aggregates.aggregation_config();
 
-    const auto& metric = config.metric();
-    auto metric_ref = MetricRef(&config.project(), &metric);
+    auto definitions = report_definitions.find(report_key);
+    if (definitions == report_definitions.end()) {
+      VLOG(4) << "Skipping a report whose ProjectContext has not been provided.";
+      continue;
+    }
+    const auto& metric = *definitions->second.metric;
+    const auto& report = *definitions->second.report;
+    auto metric_ref = definitions->second.project_context->RefMetric(&metric);
     uint32_t final_day_index;
     switch (metric.time_zone_policy()) {
       case MetricDefinition::UTC: {
@@ -539,7 +879,6 @@ Status AggregateStore::GenerateObservations(uint32_t final_day_index_utc,
         continue;
     }
 
-    const auto& report = config.report();
     // PopulateReportAggregates ensured that aggregation_window has at least one element, that all
     // aggregation windows are <= kMaxAllowedAggregationDays, and that config.aggregation_window()
     // is sorted in increasing order.
@@ -564,8 +903,13 @@ Status AggregateStore::GenerateObservations(uint32_t final_day_index_utc,
 
         switch (report.report_type()) {
           case ReportDefinition::UNIQUE_N_DAY_ACTIVES: {
-            auto status = GenerateUniqueActivesObservations(metric_ref, report_key, aggregates,
-                                                            num_event_codes, final_day_index);
+            auto status = use_packed_observations_
+                              ? GeneratePackedUniqueActivesObservations(
+                                    metric_ref, report, report_key, aggregates, num_event_codes,
+                                    final_day_index, budget)
+                              : GenerateUniqueActivesObservations(metric_ref, report, report_key,
+                                                                  aggregates, num_event_codes,
+                                                                  final_day_index, budget);
             if (status != kOK) {
               return status;
             }
@@ -583,8 +927,8 @@ Status AggregateStore::GenerateObservations(uint32_t final_day_index_utc,
         switch (report.report_type()) {
           case ReportDefinition::PER_DEVICE_NUMERIC_STATS:
           case ReportDefinition::PER_DEVICE_HISTOGRAM: {
-            auto status = GenerateObsFromNumericAggregates(metric_ref, report_key, aggregates,
-                                                           final_day_index);
+            auto status = GenerateObsFromNumericAggregates(metric_ref, report, report_key,
+                                                           aggregates, final_day_index, budget);
             if (status != kOK) {
               return status;
             }
@@ -633,17 +977,28 @@ bool IsActivityInWindow(uint32_t active_day_index, uint32_t obs_day_index,
 
 }  // namespace
 
+AggregatedObservationHistory AggregateStore::GetReportHistory(const std::string& report_key) const {
+  auto locked = protected_obs_history_.const_lock();
+  auto report_history = locked->obs_history.by_report_key().find(report_key);
+  if (report_history != locked->obs_history.by_report_key().end()) {
+    return report_history->second;
+  }
+  AggregatedObservationHistory history;
+  auto payload = locked->pending_reports.payloads.find(report_key);
+  if (payload != locked->pending_reports.payloads.end() &&
+      !history.ParseFromArray(payload->second.data(), static_cast<int>(payload->second.size()))) {
+    history.Clear();
+  }
+  return history;
+}
+
 uint32_t AggregateStore::GetUniqueActivesLastGeneratedDayIndex(const std::string& report_key,
                                                                uint32_t event_code,
                                                                uint32_t aggregation_days) const {
-  auto obs_history = protected_obs_history_.const_lock()->obs_history;
-  auto report_history = obs_history.by_report_key().find(report_key);
-  if (report_history == obs_history.by_report_key().end()) {
-    return 0u;
-  }
+  auto report_history = GetReportHistory(report_key);
   auto event_code_history =
-      report_history->second.unique_actives_history().by_event_code().find(event_code);
-  if (event_code_history == report_history->second.unique_actives_history().by_event_code().end()) {
+      report_history.unique_actives_history().by_event_code().find(event_code);
+  if (event_code_history == report_history.unique_actives_history().by_event_code().end()) {
     return 0u;
   }
   auto window_history = event_code_history->second.by_window_size().find(aggregation_days);
@@ -658,6 +1013,7 @@ void AggregateStore::SetUniqueActivesLastGeneratedDayIndex(const std::string& re
                                                            uint32_t aggregation_days,
                                                            uint32_t value) {
   auto locked = protected_obs_history_.lock();
+  MaterializeReport(report_key, &locked->pending_reports, &locked->obs_history);
   (*(*(*locked->obs_history.mutable_by_report_key())[report_key]
           .mutable_unique_actives_history()
           ->mutable_by_event_code())[event_code]
@@ -686,10 +1042,12 @@ Status AggregateStore::GenerateSingleUniqueActivesObservation(
 }
 
 Status AggregateStore::GenerateUniqueActivesObservations(const MetricRef metric_ref,
+                                                         const ReportDefinition& report,
                                                          const std::string& report_key,
                                                          const ReportAggregates& report_aggregates,
                                                          uint32_t num_event_codes,
-                                                         uint32_t final_day_index) {
+                                                         uint32_t final_day_index,
+                                                         GenerationBudget* budget) {
   CHECK_GT(final_day_index, backfill_days_);
   // The earliest day index for which we might need to generate an
   // Observation.
@@ -746,9 +1104,11 @@ Status AggregateStore::GenerateUniqueActivesObservations(const MetricRef metric_
             was_active = IsActivityInWindow(active_day_index, obs_day_index, window.days());
           }
         }
-        auto status = GenerateSingleUniqueActivesObservation(
-            metric_ref, &report_aggregates.aggregation_config().report(), obs_day_index, event_code,
-            window, was_active);
+        if (!MayGenerateObservation(budget)) {
+          return kOK;
+        }
+        auto status = GenerateSingleUniqueActivesObservation(metric_ref, &report, obs_day_index,
+                                                             event_code, window, was_active);
         if (status != kOK) {
           return status;
         }
@@ -760,24 +1120,142 @@ Status AggregateStore::GenerateUniqueActivesObservations(const MetricRef metric_
   return kOK;
 }
 
+Status AggregateStore::GenerateSinglePackedUniqueActivesObservation(
+    const MetricRef metric_ref, const ReportDefinition* report, uint32_t obs_day_index,
+    const std::vector<uint32_t>& event_codes, const std::vector<bool>& was_active,
+    const OnDeviceAggregationWindow& window) const {
+  auto encoder_result = encoder_->EncodePackedUniqueActivesObservation(
+      metric_ref, report, obs_day_index, event_codes, was_active, window);
+  if (encoder_result.status != kOK) {
+    return encoder_result.status;
+  }
+  if (encoder_result.observation == nullptr || encoder_result.metadata == nullptr) {
+    LOG(ERROR) << "Failed to encode PackedUniqueActivesObservation";
+    return kOther;
+  }
+
+  auto writer_status = observation_writer_->WriteObservation(*encoder_result.observation,
+                                                             std::move(encoder_result.metadata));
+  if (writer_status != kOK) {
+    return writer_status;
+  }
+  return kOK;
+}
+
+Status AggregateStore::GeneratePackedUniqueActivesObservations(
+    const MetricRef metric_ref, const ReportDefinition& report, const std::string& report_key,
+    const ReportAggregates& report_aggregates, uint32_t num_event_codes, uint32_t final_day_index,
+    GenerationBudget* budget) {
+  CHECK_GT(final_day_index, backfill_days_);
+  // The earliest day index for which we might need to generate an
+  // Observation.
+  auto backfill_period_start = uint32_t(final_day_index - backfill_days_);
+  const auto& by_event_code = report_aggregates.unique_actives_aggregates().by_event_code();
+  auto report_history = GetReportHistory(report_key);
+  const auto& history_by_event_code = report_history.unique_actives_history().by_event_code();
+
+  for (const auto& window : report_aggregates.aggregation_config().aggregation_window()) {
+    // Skip all hourly windows, and all daily windows which are larger than
+    // kMaxAllowedAggregationDays.
+    //
+    // TODO(pesk): Generate observations for hourly windows.
+    if (window.units_case() != OnDeviceAggregationWindow::kDays) {
+      LOG(INFO) << "Skipping unsupported aggregation window.";
+      continue;
+    }
+    if (window.days() > kMaxAllowedAggregationDays) {
+      LOG(WARNING) << "GeneratePackedUniqueActivesObservations ignoring a window "
+                      "size exceeding the maximum allowed value";
+      continue;
+    }
+    // For each event code, the earliest day index for which an Observation has not yet been
+    // generated for this report, event code, and window size. Each packed Observation covers the
+    // event codes whose first needed day index is no later than its own day index.
+    std::vector<uint32_t> first_day_indices(num_event_codes);
+    uint32_t first_day_index = final_day_index + 1;
+    for (uint32_t event_code = 0; event_code < num_event_codes; event_code++) {
+      uint32_t last_gen = 0u;
+      auto event_code_history = history_by_event_code.find(event_code);
+      if (event_code_history != history_by_event_code.end()) {
+        auto window_history = event_code_history->second.by_window_size().find(window.days());
+        if (window_history != event_code_history->second.by_window_size().end()) {
+          last_gen = window_history->second;
+        }
+      }
+      first_day_indices[event_code] = std::max(last_gen + 1, backfill_period_start);
+      first_day_index = std::min(first_day_index, first_day_indices[event_code]);
+    }
+    // The latest day index on which each event code is known to have occurred, so far.
+    std::vector<uint32_t> active_day_indices(num_event_codes, 0u);
+    for (uint32_t obs_day_index = first_day_index; obs_day_index <= final_day_index;
+         obs_day_index++) {
+      std::vector<uint32_t> event_codes;
+      std::vector<bool> was_active;
+      for (uint32_t event_code = 0; event_code < num_event_codes; event_code++) {
+        if (first_day_indices[event_code] > obs_day_index) {
+          continue;
+        }
+        bool active = false;
+        auto daily_aggregates = by_event_code.find(event_code);
+        if (daily_aggregates != by_event_code.end()) {
+          if (IsActivityInWindow(active_day_indices[event_code], obs_day_index, window.days())) {
+            active = true;
+          } else {
+            active_day_indices[event_code] =
+                FirstActiveDayIndexInWindow(daily_aggregates->second, obs_day_index, window.days());
+            active =
+                IsActivityInWindow(active_day_indices[event_code], obs_day_index, window.days());
+          }
+        }
+        event_codes.push_back(event_code);
+        was_active.push_back(active);
+      }
+      if (!MayGenerateObservation(budget)) {
+        return kOK;
+      }
+      auto status = GenerateSinglePackedUniqueActivesObservation(metric_ref, &report, obs_day_index,
+                                                                 event_codes, was_active, window);
+      if (status != kOK) {
+        return status;
+      }
+      for (auto event_code : event_codes) {
+        SetUniqueActivesLastGeneratedDayIndex(report_key, event_code, window.days(),
+                                              obs_day_index);
+      }
+    }
+  }
+  return kOK;
+}
+
 ////////// GenerateObsFromNumericAggregates and helper methods /////////////
 
+namespace {
+
+// The PerDeviceNumericObservations for a single day index and window size which are to be packed
+// into a single PackedPerDeviceNumericObservation.
+struct PackedPerDeviceNumericValues {
+  OnDeviceAggregationWindow window;
+  // The values for which an event was logged during the window.
+  std::vector<Encoder::PerDeviceNumericValue> values;
+  // The pairs (component, event code) whose history is updated once the Observation is written,
+  // including those for which no event was logged during the window.
+  std::vector<std::pair<std::string, uint32_t>> generated;
+};
+
+}  // namespace
+
 uint32_t AggregateStore::GetPerDeviceNumericLastGeneratedDayIndex(const std::string& report_key,
                                                                   const std::string& component,
                                                                   uint32_t event_code,
                                                                   uint32_t aggregation_days) const {
-  auto obs_history = protected_obs_history_.const_lock()->obs_history;
-  const auto& report_history = obs_history.by_report_key().find(report_key);
-  if (report_history == obs_history.by_report_key().end()) {
-    return 0u;
-  }
-  if (!report_history->second.has_per_device_numeric_history()) {
+  auto report_history = GetReportHistory(report_key);
+  if (!report_history.has_per_device_numeric_history()) {
     return 0u;
   }
   const auto& component_history =
-      report_history->second.per_device_numeric_history().by_component().find(component);
+      report_history.per_device_numeric_history().by_component().find(component);
   if (component_history ==
-      report_history->second.per_device_numeric_history().by_component().end()) {
+      report_history.per_device_numeric_history().by_component().end()) {
     return 0u;
   }
   const auto& event_code_history = component_history->second.by_event_code().find(event_code);
@@ -797,6 +1275,7 @@ void AggregateStore::SetPerDeviceNumericLastGeneratedDayIndex(const std::string&
                                                               uint32_t aggregation_days,
                                                               uint32_t value) {
   auto locked = protected_obs_history_.lock();
+  MaterializeReport(report_key, &locked->pending_reports, &locked->obs_history);
   (*(*(*(*locked->obs_history.mutable_by_report_key())[report_key]
             .mutable_per_device_numeric_history()
             ->mutable_by_component())[component]
@@ -804,19 +1283,28 @@ void AggregateStore::SetPerDeviceNumericLastGeneratedDayIndex(const std::string&
         .mutable_by_window_size())[aggregation_days] = value;
 }
 
+void AggregateStore::DeletePerDeviceNumericComponentHistory(const std::string& report_key,
+                                                            const std::string& component) {
+  auto locked = protected_obs_history_.lock();
+  MaterializeReport(report_key, &locked->pending_reports, &locked->obs_history);
+  auto report_history = locked->obs_history.mutable_by_report_key()->find(report_key);
+  if (report_history != locked->obs_history.mutable_by_report_key()->end() &&
+      report_history->second.has_per_device_numeric_history()) {
+    report_history->second.mutable_per_device_numeric_history()->mutable_by_component()->erase(
+        component);
+  }
+}
+
 uint32_t AggregateStore::GetReportParticipationLastGeneratedDayIndex(
     const std::string& report_key) const {
-  auto obs_history = protected_obs_history_.const_lock()->obs_history;
-  const auto& report_history = obs_history.by_report_key().find(report_key);
-  if (report_history == obs_history.by_report_key().end()) {
-    return 0u;
-  }
-  return report_history->second.report_participation_history().last_generated();
+  auto report_history = GetReportHistory(report_key);
+  return report_history.report_participation_history().last_generated();
 }
 
 void AggregateStore::SetReportParticipationLastGeneratedDayIndex(const std::string& report_key,
                                                                  uint32_t value) {
   auto locked = protected_obs_history_.lock();
+  MaterializeReport(report_key, &locked->pending_reports, &locked->obs_history);
   (*locked->obs_history.mutable_by_report_key())[report_key]
       .mutable_report_participation_history()
       ->set_last_generated(value);
@@ -828,8 +1316,32 @@ void AggregateStore::DeleteData() {
   {
     auto locked = protected_aggregate_store_.lock();
     locked->local_aggregate_store = locked->empty_local_aggregate_store;
+    locked->pending_reports = PendingReports();
+  }
+  auto locked = protected_obs_history_.lock();
+  locked->obs_history = MakeNewObservationHistoryStore();
+  locked->pending_reports = PendingReports();
+}
+
+ComponentLimitCounters AggregateStore::GetComponentLimitCounters() const {
+  ComponentLimitCounters total;
+  auto locked = protected_aggregate_store_.const_lock();
+  for (const auto& [report_key, counters] : locked->component_limit_counters) {
+    total.num_dropped += counters.num_dropped;
+    total.num_bucketed += counters.num_bucketed;
+    total.num_evicted += counters.num_evicted;
+  }
+  return total;
+}
+
+ComponentLimitCounters AggregateStore::GetComponentLimitCounters(
+    const std::string& report_key) const {
+  auto locked = protected_aggregate_store_.const_lock();
+  auto counters = locked->component_limit_counters.find(report_key);
+  if (counters == locked->component_limit_counters.end()) {
+    return ComponentLimitCounters();
   }
-  protected_obs_history_.lock()->obs_history = MakeNewObservationHistoryStore();
+  return counters->second;
 }
 
 void AggregateStore::Disable(bool is_disabled) {
@@ -861,6 +1373,28 @@ Status AggregateStore::GenerateSinglePerDeviceNumericObservation(
   return kOK;
 }
 
+Status AggregateStore::GenerateSinglePackedPerDeviceNumericObservation(
+    const MetricRef metric_ref, const ReportDefinition* report, uint32_t obs_day_index,
+    const OnDeviceAggregationWindow& window,
+    const std::vector<Encoder::PerDeviceNumericValue>& values) const {
+  Encoder::Result encoder_result = encoder_->EncodePackedPerDeviceNumericObservation(
+      metric_ref, report, obs_day_index, values, window);
+  if (encoder_result.status != kOK) {
+    return encoder_result.status;
+  }
+  if (encoder_result.observation == nullptr || encoder_result.metadata == nullptr) {
+    LOG(ERROR) << "Failed to encode PackedPerDeviceNumericObservation";
+    return kOther;
+  }
+
+  const auto& writer_status = observation_writer_->WriteObservation(
+      *encoder_result.observation, std::move(encoder_result.metadata));
+  if (writer_status != kOK) {
+    return writer_status;
+  }
+  return kOK;
+}
+
 Status AggregateStore::GenerateSinglePerDeviceHistogramObservation(
     const MetricRef metric_ref, const ReportDefinition* report, uint32_t obs_day_index,
     const std::string& component, uint32_t event_code, const OnDeviceAggregationWindow& window,
@@ -907,13 +1441,22 @@ Status AggregateStore::GenerateSingleReportParticipationObservation(const Metric
 }
 
 Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_ref,
+                                                        const ReportDefinition& report,
                                                         const std::string& report_key,
                                                         const ReportAggregates& report_aggregates,
-                                                        uint32_t final_day_index) {
+                                                        uint32_t final_day_index,
+                                                        GenerationBudget* budget) {
   CHECK_GT(final_day_index, backfill_days_);
   // The first day index for which we might have to generate an Observation.
   auto backfill_period_start = uint32_t(final_day_index - backfill_days_);
 
+  // If packing is enabled for this report, the values found for each day index and window are
+  // collected here, keyed by pairs (day index, window size), and are written as one Observation
+  // per key once all components and event codes have been visited.
+  bool pack_observations = use_packed_observations_ &&
+                           report.report_type() == ReportDefinition::PER_DEVICE_NUMERIC_STATS;
+  std::map<std::pair<uint32_t, uint32_t>, PackedPerDeviceNumericValues> packed_values;
+
   // Generate any necessary PerDeviceNumericObservations for this report.
   for (const auto& [component, event_code_aggregates] :
        report_aggregates.numeric_aggregates().by_component()) {
@@ -964,8 +1507,7 @@ Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_r
             if (day_aggregates != daily_aggregates.by_day_index().end()) {
               found_value_for_day = true;
             }
-            const auto& aggregation_type =
-                report_aggregates.aggregation_config().report().aggregation_type();
+            const auto& aggregation_type = report.aggregation_type();
             switch (aggregation_type) {
               case ReportDefinition::SUM:
                 if (found_value_for_day) {
@@ -995,13 +1537,25 @@ Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_r
             }
             num_days++;
           }
+          if (pack_observations) {
+            auto& packed = packed_values[{obs_day_index, window.days()}];
+            packed.window = window;
+            if (found_value_for_window) {
+              packed.values.push_back(
+                  {component, UnpackEventCodesProto(event_code), window_aggregate});
+            }
+            packed.generated.emplace_back(component, event_code);
+            continue;
+          }
           if (found_value_for_window) {
+            if (!MayGenerateObservation(budget)) {
+              return kOK;
+            }
             Status status;
-            const ReportDefinition* report = &report_aggregates.aggregation_config().report();
-            switch (report->report_type()) {
+            switch (report.report_type()) {
               case ReportDefinition::PER_DEVICE_NUMERIC_STATS: {
                 status = GenerateSinglePerDeviceNumericObservation(
-                    metric_ref, report, obs_day_index, component, event_code, window,
+                    metric_ref, &report, obs_day_index, component, event_code, window,
                     window_aggregate);
                 if (status != kOK) {
                   return status;
@@ -1010,7 +1564,7 @@ Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_r
               }
               case ReportDefinition::PER_DEVICE_HISTOGRAM: {
                 auto status = GenerateSinglePerDeviceHistogramObservation(
-                    metric_ref, report, obs_day_index, component, event_code, window,
+                    metric_ref, &report, obs_day_index, component, event_code, window,
                     window_aggregate);
                 if (status != kOK) {
                   return status;
@@ -1018,7 +1572,7 @@ Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_r
                 break;
               }
               default:
-                LOG(ERROR) << "Unexpected report type " << report->report_type();
+                LOG(ERROR) << "Unexpected report type " << report.report_type();
                 return kInvalidArguments;
             }
           }
@@ -1029,13 +1583,33 @@ Status AggregateStore::GenerateObsFromNumericAggregates(const MetricRef metric_r
       }
     }
   }
+  // Write the packed Observations, in increasing order of day index.
+  for (const auto& [day_and_window, packed] : packed_values) {
+    const auto& [obs_day_index, aggregation_days] = day_and_window;
+    if (!packed.values.empty()) {
+      if (!MayGenerateObservation(budget)) {
+        return kOK;
+      }
+      auto status = GenerateSinglePackedPerDeviceNumericObservation(
+          metric_ref, &report, obs_day_index, packed.window, packed.values);
+      if (status != kOK) {
+        return status;
+      }
+    }
+    for (const auto& [component, event_code] : packed.generated) {
+      SetPerDeviceNumericLastGeneratedDayIndex(report_key, component, event_code, aggregation_days,
+                                               obs_day_index);
+    }
+  }
   // Generate any necessary ReportParticipationObservations for this report.
   auto participation_last_gen = GetReportParticipationLastGeneratedDayIndex(report_key);
   auto participation_first_day_index = std::max(participation_last_gen + 1, backfill_period_start);
   for (auto obs_day_index = participation_first_day_index; obs_day_index <= final_day_index;
        obs_day_index++) {
-    GenerateSingleReportParticipationObservation(
-        metric_ref, &report_aggregates.aggregation_config().report(), obs_day_index);
+    if (!MayGenerateObservation(budget)) {
+      return kOK;
+    }
+    GenerateSingleReportParticipationObservation(metric_ref, &report, obs_day_index);
     SetReportParticipationLastGeneratedDayIndex(report_key, obs_day_index);
   }
   return kOK;
@@ -1053,7 +1627,7 @@ AggregatedObservationHistoryStore AggregateStore::MakeNewObservationHistoryStore
   return store;
 }
 
-// We can upgrade from v0, but no other versions.
+// We can upgrade from v0 and v1, but no other versions.
 Status AggregateStore::MaybeUpgradeLocalAggregateStore(LocalAggregateStore* store) {
   uint32_t version = store->version();
   if (version == kCurrentLocalAggregateStoreVersion) {
@@ -1063,6 +1637,8 @@ Status AggregateStore::MaybeUpgradeLocalAggregateStore(LocalAggregateStore* stor
   switch (version) {
     case 0u:
       return UpgradeLocalAggregateStoreFromVersion0(store);
+    case 1u:
+      return UpgradeLocalAggregateStoreFromVersion1(store);
     default:
       LOG(ERROR) << "Cannot upgrade LocalAggregateStore from version " << version;
       return kInvalidArguments;
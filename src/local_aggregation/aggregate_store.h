@@ -5,13 +5,20 @@
 #ifndef COBALT_SRC_LOCAL_AGGREGATION_AGGREGATE_STORE_H_
 #define COBALT_SRC_LOCAL_AGGREGATION_AGGREGATE_STORE_H_
 
+#include <chrono>
 #include <condition_variable>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include "src/lib/util/clock.h"
 #include "src/lib/util/consistent_proto_store.h"
 #include "src/lib/util/protected_fields.h"
+#include "src/local_aggregation/component_limits.h"
+#include "src/local_aggregation/indexed_store_file.h"
 #include "src/local_aggregation/local_aggregation.pb.h"
 #include "src/logger/encoder.h"
 #include "src/logger/observation_writer.h"
@@ -30,10 +37,45 @@ constexpr uint32_t kMaxAllowedAggregationDays = 365;
 constexpr uint32_t kMaxAllowedAggregationHours = 23;
 
 // The current version number of the LocalAggregateStore.
-constexpr uint32_t kCurrentLocalAggregateStoreVersion = 1;
+constexpr uint32_t kCurrentLocalAggregateStoreVersion = 2;
 // The current version number of the AggregatedObservationHistoryStore.
 constexpr uint32_t kCurrentObservationHistoryStoreVersion = 0;
 
+// A GenerationBudget bounds the work done by a single call to
+// AggregateStore::GenerateObservations(), so that catching up on a long backfill period is spread
+// over several calls instead of happening in a single burst.
+class GenerationBudget {
+ public:
+  // max_observations: the maximum number of Observations to generate. If 0, the number of
+  // Observations is not limited.
+  //
+  // max_duration: the maximum time to spend generating Observations, measured with |steady_clock|
+  // from the construction of the GenerationBudget. If zero, the time is not limited.
+  GenerationBudget(size_t max_observations, std::chrono::steady_clock::duration max_duration,
+                   util::SteadyClockInterface* steady_clock);
+
+  // If the budget is not exhausted, counts one Observation against it and returns true. Otherwise
+  // returns false.
+  bool TryConsume();
+
+  // Marks the budget as exhausted, e.g. because the ObservationStore is almost full.
+  void Exhaust() { exhausted_ = true; }
+
+  // Returns true if generation stopped before all needed Observations were generated.
+  [[nodiscard]] bool exhausted() const { return exhausted_; }
+
+  // Returns the number of Observations counted against the budget.
+  [[nodiscard]] size_t num_observations() const { return num_observations_; }
+
+ private:
+  size_t max_observations_;
+  std::chrono::steady_clock::time_point deadline_;
+  bool has_deadline_;
+  util::SteadyClockInterface* steady_clock_;  // not owned
+  size_t num_observations_ = 0;
+  bool exhausted_ = false;
+};
+
 // The AggregateStore manages an in-memory store of aggregated Event values, indexed by report,
 // day index, and other dimensions specific to the report type (e.g. event code).
 //
@@ -65,18 +107,33 @@ class AggregateStore {
   // generates and sends Observations, in addition to a requested day index.
   // See the comment above GenerateObservations for more detail. The constructor CHECK-fails if a
   // value larger than |kMaxAllowedBackfillDays| is passed.
+  //
+  // local_aggregate_index_file, obs_history_index_file: Optional IndexedStoreFiles to be used
+  // instead of the corresponding ConsistentProtoStores for storing snapshots. If a snapshot exists
+  // in an IndexedStoreFile, the constructor only maps it into memory, and each report is decoded
+  // the first time it is used or by PrefetchReports(). Otherwise the store is read from its
+  // ConsistentProtoStore, and the next backup writes it to the IndexedStoreFile.
   AggregateStore(const logger::Encoder* encoder,
                  const logger::ObservationWriter* observation_writer,
                  util::ConsistentProtoStore* local_aggregate_proto_store,
-                 util::ConsistentProtoStore* obs_history_proto_store, size_t backfill_days = 0);
+                 util::ConsistentProtoStore* obs_history_proto_store, size_t backfill_days = 0,
+                 IndexedStoreFile* local_aggregate_index_file = nullptr,
+                 IndexedStoreFile* obs_history_index_file = nullptr);
 
   // Given a ProjectContext, MetricDefinition, and ReportDefinition checks whether a key with the
   // same customer, project, metric, and report ID already exists in the LocalAggregateStore. If
   // not, creates and inserts a new key and value. Returns kInvalidArguments if
   // creation of the key or value fails, and kOK otherwise.
-  logger::Status MaybeInsertReportConfig(const logger::ProjectContext& project_context,
-                                         const MetricDefinition& metric,
-                                         const ReportDefinition& report);
+  //
+  // The AggregateStore keeps a reference to |project_context| and resolves the definitions of the
+  // metric and report from it whenever they are needed, rather than persisting a copy of them. The
+  // first ProjectContext provided for a given key is the one that is used for the lifetime of the
+  // AggregateStore. If the registry definition of the report differs from the one with which the
+  // stored AggregationConfig was created (e.g. after a registry update), the AggregationConfig is
+  // updated to match the live definition.
+  logger::Status MaybeInsertReportConfig(
+      std::shared_ptr<const logger::ProjectContext> project_context,
+      const MetricDefinition& metric, const ReportDefinition& report);
 
   // Updates the LocalAggregateStore to mark the device as active on the |day_index| day for an
   // event with the given |customer_id|, |project_id|, |metric_id|, |report_id| and |event_code|.
@@ -93,6 +150,10 @@ class AggregateStore {
   // |day_index|. Expects that MaybeInsertReportConfig() has been called previously for the ids
   // being passed. Returns kInvalidArguments if the operation fails, and kOK otherwise.
   //
+  // If |component| is new to the report and the report already holds the maximum number of
+  // components, the event is dropped, aggregated under kOverflowComponent, or replaces the least
+  // frequent component, according to the ComponentLimits. A dropped event returns kOK.
+  //
   // N.B. If the AggregateStore has been disabled (is_disabled_ == true), this method will do
   // nothing, and will always return kOK.
   logger::Status UpdateNumericAggregate(uint32_t customer_id, uint32_t project_id,
@@ -100,13 +161,19 @@ class AggregateStore {
                                         const std::string& component, uint64_t event_code,
                                         uint32_t day_index, int64_t value);
 
-  // Writes a snapshot of the LocalAggregateStore to
-  // |local_aggregate_proto_store_|.
+  // Writes a snapshot of the LocalAggregateStore to |local_aggregate_index_file_| if one was
+  // provided, and to |local_aggregate_proto_store_| otherwise.
   logger::Status BackUpLocalAggregateStore();
 
-  // Writes a snapshot of |obs_history_|to |obs_history_proto_store_|.
+  // Writes a snapshot of |obs_history_| to |obs_history_index_file_| if one was provided, and to
+  // |obs_history_proto_store_| otherwise.
   logger::Status BackUpObservationHistory();
 
+  // Decodes up to |max_reports| of the reports which were loaded lazily from an IndexedStoreFile
+  // and have not been used yet. The reports are decoded without holding the locks of the stores.
+  // Returns true if some reports remain to be decoded.
+  bool PrefetchReports(size_t max_reports);
+
   // Removes from the LocalAggregateStore all daily aggregates that are too
   // old to contribute to their parent report's largest rolling window on the
   // day which is |backfill_days| before |day_index_utc| (if the parent
@@ -120,6 +187,8 @@ class AggregateStore {
   // |day_index_local|) argument with which GarbageCollect() has been called,
   // then the LocalAggregateStore contains the data needed to generate
   // Observations for that report for day index (day_index + k) for any k >= 0.
+  //
+  // Reports which were loaded lazily and have not been decoded yet are skipped.
   logger::Status GarbageCollect(uint32_t day_index_utc, uint32_t day_index_local = 0u);
 
   // Generates one or more Observations for all of the registered locally
@@ -149,8 +218,18 @@ class AggregateStore {
   //
   // Observations are not generated for aggregation windows larger than
   // |kMaxAllowedAggregationDays|. Hourly windows are not yet supported.
+  //
+  // Observations are only generated for reports whose ProjectContext has been provided to
+  // MaybeInsertReportConfig() during the lifetime of this AggregateStore. Other reports are skipped
+  // without updating their history, so any missed Observations are backfilled once the
+  // ProjectContext is provided.
+  //
+  // If |budget| is not null, generation stops once |budget| is exhausted or the ObservationStore
+  // is almost full, and |budget->exhausted()| is set. The history of generated Observations is
+  // updated as each Observation is written, so a later call resumes where this one stopped.
   logger::Status GenerateObservations(uint32_t final_day_index_utc,
-                                      uint32_t final_day_index_local = 0u);
+                                      uint32_t final_day_index_local = 0u,
+                                      GenerationBudget* budget = nullptr);
 
   // Returns the most recent day index for which an Observation was generated
   // for a given UNIQUE_N_DAY_ACTIVES report, event code, and day-based aggregation window,
@@ -204,6 +283,31 @@ class AggregateStore {
   //    information derived from the Metrics Registry, this is not a problem.
   void Disable(bool is_disabled);
 
+  // If |use_packed_observations| is true, GenerateObservations() packs the Observations of each
+  // UNIQUE_N_DAY_ACTIVES and PER_DEVICE_NUMERIC_STATS report for a given day index and aggregation
+  // window into a single PackedUniqueActivesObservation or PackedPerDeviceNumericObservation,
+  // instead of generating one Observation per event code (resp. per pair (component, event code)).
+  // Should be called before Observations are first generated.
+  void UsePackedObservations(bool use_packed_observations) {
+    use_packed_observations_ = use_packed_observations;
+  }
+
+  // Bounds the number of components for which UpdateNumericAggregate() keeps aggregates for each
+  // report. See ComponentLimits. Should be called before events are first logged.
+  void SetComponentLimits(ComponentLimits component_limits) {
+    component_limits_ = component_limits;
+  }
+
+  // Returns the numbers of events which were not stored under their own component, and of
+  // components which were evicted, because of the ComponentLimits, summed over all reports.
+  [[nodiscard]] ComponentLimitCounters GetComponentLimitCounters() const;
+
+  // Returns the numbers of events of the report with key |report_key| which were not stored under
+  // their own component, and of its components which were evicted, because of the
+  // ComponentLimits.
+  [[nodiscard]] ComponentLimitCounters GetComponentLimitCounters(
+      const std::string& report_key) const;
+
  private:
   friend class AggregateStoreTest;
   friend class EventAggregatorTest;
@@ -242,6 +346,23 @@ class AggregateStore {
   logger::Status MaybeUpgradeLocalAggregateStore(LocalAggregateStore* store);
   logger::Status MaybeUpgradeObservationHistoryStore(AggregatedObservationHistoryStore* store);
 
+  // Returns true if another Observation may be generated under |budget|, which may be null. Returns
+  // false and exhausts |budget| if the ObservationStore is almost full.
+  bool MayGenerateObservation(GenerationBudget* budget) const;
+
+  // Updates the aggregates of the report with key |report_key| as UpdateNumericAggregate() does.
+  // Sets |evicted_component| if a component was evicted under the ComponentLimits.
+  logger::Status UpdateNumericAggregateForReport(const std::string& report_key,
+                                                 const std::string& component, uint64_t event_code,
+                                                 uint32_t day_index, int64_t value,
+                                                 std::optional<std::string>* evicted_component);
+
+  // Deletes the history of Observations generated for |component| of the PER_DEVICE_NUMERIC_STATS
+  // or PER_DEVICE_HISTOGRAM report with key |report_key|, after the component was evicted under
+  // the ComponentLimits.
+  void DeletePerDeviceNumericComponentHistory(const std::string& report_key,
+                                              const std::string& component);
+
   // For a fixed report of type UNIQUE_N_DAY_ACTIVES, generates an Observation
   // for each event code of the parent metric, for each day-based aggregation window of the
   // report ending on |final_day_index|, unless an Observation with those parameters was generated
@@ -251,11 +372,16 @@ class AggregateStore {
   //
   // Observations are not generated for aggregation windows larger than
   // |kMaxAllowedAggregationDays|. Hourly windows are not yet supported.
+  //
+  // Returns kOK without generating the remaining Observations once MayGenerateObservation(|budget|)
+  // returns false.
   logger::Status GenerateUniqueActivesObservations(logger::MetricRef metric_ref,
+                                                   const ReportDefinition& report,
                                                    const std::string& report_key,
                                                    const ReportAggregates& report_aggregates,
                                                    uint32_t num_event_codes,
-                                                   uint32_t final_day_index);
+                                                   uint32_t final_day_index,
+                                                   GenerationBudget* budget);
 
   // Helper method called by GenerateUniqueActivesObservations() to generate
   // and write a single Observation.
@@ -265,6 +391,24 @@ class AggregateStore {
                                                         const OnDeviceAggregationWindow& window,
                                                         bool was_active) const;
 
+  // Generates the same Observations as GenerateUniqueActivesObservations(), except that the
+  // Observations for all event codes for a given day index and window size are packed into a
+  // single PackedUniqueActivesObservation. Used if |use_packed_observations_| is true.
+  logger::Status GeneratePackedUniqueActivesObservations(logger::MetricRef metric_ref,
+                                                         const ReportDefinition& report,
+                                                         const std::string& report_key,
+                                                         const ReportAggregates& report_aggregates,
+                                                         uint32_t num_event_codes,
+                                                         uint32_t final_day_index,
+                                                         GenerationBudget* budget);
+
+  // Helper method called by GeneratePackedUniqueActivesObservations() to generate and write a
+  // single PackedUniqueActivesObservation.
+  logger::Status GenerateSinglePackedUniqueActivesObservation(
+      logger::MetricRef metric_ref, const ReportDefinition* report, uint32_t obs_day_index,
+      const std::vector<uint32_t>& event_codes, const std::vector<bool>& was_active,
+      const OnDeviceAggregationWindow& window) const;
+
   // For a fixed report of type PER_DEVICE_NUMERIC_STATS or PER_DEVICE_HISTOGRAM, generates a
   // PerDeviceNumericObservation and PerDeviceHistogramObservation respectively for each
   // tuple (component, event code, aggregation_window) for which a numeric event was logged for that
@@ -282,10 +426,19 @@ class AggregateStore {
   //
   // Observations are not generated for aggregation windows larger than
   // |kMaxAllowedAggregationWindowSize|.
+  //
+  // If |use_packed_observations_| is true and the report is of type PER_DEVICE_NUMERIC_STATS, the
+  // PerDeviceNumericObservations for each day index and window size are packed into a single
+  // PackedPerDeviceNumericObservation.
+  //
+  // Returns kOK without generating the remaining Observations once MayGenerateObservation(|budget|)
+  // returns false.
   logger::Status GenerateObsFromNumericAggregates(logger::MetricRef metric_ref,
+                                                  const ReportDefinition& report,
                                                   const std::string& report_key,
                                                   const ReportAggregates& report_aggregates,
-                                                  uint32_t final_day_index);
+                                                  uint32_t final_day_index,
+                                                  GenerationBudget* budget);
 
   // Helper method called by GenerateObsFromNumericAggregates() to generate and write a single
   // Observation with value |value|. The method will produce a PerDeviceNumericObservation or
@@ -296,6 +449,13 @@ class AggregateStore {
       const std::string& component, uint32_t event_code, const OnDeviceAggregationWindow& window,
       int64_t value) const;
 
+  // Helper method called by GenerateObsFromNumericAggregates() to generate and write a single
+  // PackedPerDeviceNumericObservation with values |values|.
+  logger::Status GenerateSinglePackedPerDeviceNumericObservation(
+      logger::MetricRef metric_ref, const ReportDefinition* report, uint32_t obs_day_index,
+      const OnDeviceAggregationWindow& window,
+      const std::vector<logger::Encoder::PerDeviceNumericValue>& values) const;
+
   // Helper method called by GenerateObsFromNumericAggregates() to generate and write a single
   // Observation with value |value|.
   logger::Status GenerateSinglePerDeviceHistogramObservation(
@@ -310,10 +470,23 @@ class AggregateStore {
                                                               uint32_t obs_day_index) const;
 
   LocalAggregateStore CopyLocalAggregateStore() {
-    auto local_aggregate_store = protected_aggregate_store_.lock()->local_aggregate_store;
-    return local_aggregate_store;
+    auto locked = protected_aggregate_store_.lock();
+    MaterializeAllReports(&locked->pending_reports, &locked->local_aggregate_store);
+    return locked->local_aggregate_store;
   }
 
+  // Returns a copy of the AggregatedObservationHistory of the report with key |report_key|, or an
+  // empty AggregatedObservationHistory if there is none.
+  AggregatedObservationHistory GetReportHistory(const std::string& report_key) const;
+
+  // The live registry definitions of a locally aggregated report. |metric| and |report| point into
+  // the registry held by |project_context|.
+  struct ReportDefinitions {
+    std::shared_ptr<const logger::ProjectContext> project_context;
+    const MetricDefinition* metric;
+    const ReportDefinition* report;
+  };
+
   struct AggregateStoreFields {
     LocalAggregateStore local_aggregate_store;
 
@@ -325,14 +498,37 @@ class AggregateStore {
     // method is called, we can replace local_aggregate_store with empty_local_aggregate_store, and
     // both SetActive and UpdateNumericAggregate will continue to function as expected.
     LocalAggregateStore empty_local_aggregate_store;
+
+    // The live definitions of each report provided to MaybeInsertReportConfig, keyed by report key.
+    // These are not persisted and are not affected by DeleteData.
+    std::map<std::string, ReportDefinitions> report_definitions;
+
+    // The reports of |local_aggregate_store| which were loaded from |local_aggregate_index_file_|
+    // and have not been decoded yet.
+    PendingReports pending_reports;
+
+    // Counts the effects of |component_limits_| on each report, keyed by report key. These are not
+    // persisted.
+    std::map<std::string, ComponentLimitCounters> component_limit_counters;
   };
 
   struct AggregatedObservationHistoryStoreFields {
     AggregatedObservationHistoryStore obs_history;
+
+    // The reports of |obs_history| which were loaded from |obs_history_index_file_| and have not
+    // been decoded yet.
+    PendingReports pending_reports;
   };
 
   bool is_disabled_ = false;
 
+  // Whether to pack the Observations of a report for a given day index and window size into a
+  // single Observation. See UsePackedObservations().
+  bool use_packed_observations_ = false;
+
+  // Bounds the number of components per report. See SetComponentLimits().
+  ComponentLimits component_limits_;
+
   // The number of past days for which the AggregateStore generates and sends Observations, in
   // addition to a requested day index.
   size_t backfill_days_ = 0;
@@ -344,6 +540,8 @@ class AggregateStore {
   // Used for loading and backing up the proto stores to disk.
   util::ConsistentProtoStore* local_aggregate_proto_store_;  // not owned
   util::ConsistentProtoStore* obs_history_proto_store_;      // not owned
+  IndexedStoreFile* local_aggregate_index_file_;             // not owned, may be null
+  IndexedStoreFile* obs_history_index_file_;                 // not owned, may be null
 
   // In memory store of local aggregations and data needed to derive them.
   util::ProtectedFields<AggregateStoreFields> protected_aggregate_store_;
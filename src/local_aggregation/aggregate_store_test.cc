@@ -54,6 +54,7 @@ using logger::testing::MakeAggregationKey;
 using logger::testing::MakeExpectedReportParticipationObservations;
 using logger::testing::MakeNullExpectedUniqueActivesObservations;
 using logger::testing::TestUpdateRecipient;
+using logger::testing::UnpackObservations;
 using util::EncryptedMessageMaker;
 using util::IncrementingSteadyClock;
 using util::IncrementingSystemClock;
@@ -102,12 +103,12 @@ using LoggedValues =
     std::map<std::string,
              std::map<std::string, std::map<uint32_t, std::map<uint32_t, std::vector<int64_t>>>>>;
 
-std::unique_ptr<ProjectContext> GetProjectContextFor(const MetricDefinition& metric) {
+std::shared_ptr<ProjectContext> GetProjectContextFor(const MetricDefinition& metric) {
   auto project_config = std::make_unique<ProjectConfig>();
   project_config->set_project_name("test_project");
   project_config->set_project_id(metric.project_id());
   *project_config->add_metrics() = metric;
-  return std::make_unique<ProjectContext>(metric.customer_id(), "test_customer",
+  return std::make_shared<ProjectContext>(metric.customer_id(), "test_customer",
                                           std::move(project_config));
 }
 
@@ -242,6 +243,15 @@ class AggregateStoreTest : public util::testing::TestWithFiles {
     event_aggregator_mgr_->aggregate_store_->backfill_days_ = num_days;
   }
 
+  void UsePackedObservations() {
+    event_aggregator_mgr_->aggregate_store_->UsePackedObservations(true);
+  }
+
+  void SetComponentLimits(size_t max_components_per_report, ComponentOverflowPolicy policy) {
+    event_aggregator_mgr_->aggregate_store_->SetComponentLimits(
+        {max_components_per_report, policy});
+  }
+
   Status BackUpLocalAggregateStore() {
     return event_aggregator_mgr_->aggregate_store_->BackUpLocalAggregateStore();
   }
@@ -272,11 +282,32 @@ class AggregateStoreTest : public util::testing::TestWithFiles {
     return event_aggregator_mgr_->aggregate_store_->CopyLocalAggregateStore();
   }
 
+  // Returns the aggregation type of the report with key |report_key|, as given by the live report
+  // definition which the AggregateStore resolved from the report's ProjectContext.
+  ReportDefinition::OnDeviceAggregationType GetAggregationType(const std::string& report_key) {
+    auto locked = event_aggregator_mgr_->aggregate_store_->protected_aggregate_store_.lock();
+    return locked->report_definitions.at(report_key).report->aggregation_type();
+  }
+
   Status GenerateObservations(uint32_t final_day_index_utc, uint32_t final_day_index_local = 0u) {
     return event_aggregator_mgr_->aggregate_store_->GenerateObservations(final_day_index_utc,
                                                                          final_day_index_local);
   }
 
+  // Returns the number of reports of |store| which were loaded from an IndexedStoreFile and have
+  // not been decoded yet, in the LocalAggregateStore and the AggregatedObservationHistoryStore
+  // respectively.
+  static size_t NumPendingAggregates(AggregateStore* store) {
+    return store->protected_aggregate_store_.lock()->pending_reports.payloads.size();
+  }
+  static size_t NumPendingHistories(AggregateStore* store) {
+    return store->protected_obs_history_.lock()->pending_reports.payloads.size();
+  }
+
+  static LocalAggregateStore CopyLocalAggregateStore(AggregateStore* store) {
+    return store->CopyLocalAggregateStore();
+  }
+
   bool IsReportInStore(uint32_t customer_id, uint32_t project_id, uint32_t metric_id,
                        uint32_t report_id) {
     std::string key;
@@ -736,8 +767,7 @@ class AggregateStoreTest : public util::testing::TestWithFiles {
       if (report_aggregates->second.type_case() != ReportAggregates::kNumericAggregates) {
         return false;
       }
-      const auto& aggregation_type =
-          report_aggregates->second.aggregation_config().report().aggregation_type();
+      const auto aggregation_type = GetAggregationType(logged_key);
       // Compute the earliest day index that should appear among the aggregates
       // for this report.
       auto earliest_allowed =
@@ -904,7 +934,7 @@ class AggregateStoreTestWithProjectContext : public AggregateStoreTest {
 
   void SetUp() override {
     AggregateStoreTest::SetUp();
-    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context_);
+    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context_);
   }
 
   // Adds an EventOccurredEvent to the local aggregations for the MetricReportId of a locally
@@ -1048,6 +1078,126 @@ TEST_F(AggregateStoreTest, BackUpProtos) {
   EXPECT_EQ(1, fs()->TimesWritten(obs_history_path()));
 }
 
+// An AggregateStore backed by IndexedStoreFiles loads its snapshots lazily: reports are decoded
+// when first used or prefetched, and pending reports survive a backup without being decoded.
+TEST_F(AggregateStoreTest, LoadIndexedStoreFilesLazily) {
+  auto [metric, report] = GetUniqueActivesMetricAndReport(kTestCustomerId, kTestProjectId,
+                                                          kTestMetricId, kTestReportId);
+  auto project_context = GetProjectContextFor(metric);
+  std::string report_key;
+  ReportAggregationKey key_data;
+  key_data.set_customer_id(kTestCustomerId);
+  key_data.set_project_id(kTestProjectId);
+  key_data.set_metric_id(kTestMetricId);
+  key_data.set_report_id(kTestReportId);
+  SerializeToBase64(key_data, &report_key);
+
+  util::ConsistentProtoStore local_aggregate_proto_store(aggregate_store_path(), fs());
+  util::ConsistentProtoStore obs_history_proto_store(obs_history_path(), fs());
+  IndexedStoreFile local_aggregate_index_file(aggregate_store_path() + ".idx", fs());
+  IndexedStoreFile obs_history_index_file(obs_history_path() + ".idx", fs());
+  auto make_store = [&]() {
+    return std::make_unique<AggregateStore>(
+        encoder_.get(), observation_writer_.get(), &local_aggregate_proto_store,
+        &obs_history_proto_store, /*backfill_days=*/0, &local_aggregate_index_file,
+        &obs_history_index_file);
+  };
+
+  auto store = make_store();
+  ASSERT_EQ(kOK, store->MaybeInsertReportConfig(project_context, metric, report));
+  ASSERT_EQ(kOK, store->SetActive(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId,
+                                  kTestEventCode, kTestDayIndex));
+  store->SetReportParticipationLastGeneratedDayIndex(report_key, kTestDayIndex);
+  ASSERT_EQ(kOK, store->BackUpLocalAggregateStore());
+  ASSERT_EQ(kOK, store->BackUpObservationHistory());
+  EXPECT_EQ(0, fs()->TimesWritten(aggregate_store_path()));
+  EXPECT_EQ(0, fs()->TimesWritten(obs_history_path()));
+
+  // Loading only maps the files. Reading the history of a pending report does not decode it, and
+  // a backup writes pending reports back as they are.
+  store = make_store();
+  EXPECT_EQ(1u, NumPendingAggregates(store.get()));
+  EXPECT_EQ(1u, NumPendingHistories(store.get()));
+  EXPECT_EQ(kTestDayIndex, store->GetReportParticipationLastGeneratedDayIndex(report_key));
+  EXPECT_EQ(1u, NumPendingHistories(store.get()));
+  ASSERT_EQ(kOK, store->BackUpLocalAggregateStore());
+  ASSERT_EQ(kOK, store->BackUpObservationHistory());
+
+  // Generating Observations and garbage collection skip the reports which are still pending.
+  ASSERT_EQ(kOK, store->GenerateObservations(kTestDayIndex + kMaxAllowedAggregationDays));
+  ASSERT_EQ(kOK, store->GarbageCollect(kTestDayIndex + kMaxAllowedAggregationDays));
+  EXPECT_EQ(1u, NumPendingAggregates(store.get()));
+  EXPECT_EQ(1u, NumPendingHistories(store.get()));
+
+  // Using a report decodes it.
+  store = make_store();
+  ASSERT_EQ(kOK, store->SetActive(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId,
+                                  kTestEventCode, kTestDayIndex + 1));
+  EXPECT_EQ(0u, NumPendingAggregates(store.get()));
+  auto local_aggregate_store = CopyLocalAggregateStore(store.get());
+  EXPECT_EQ(2u, local_aggregate_store.by_report_key()
+                    .at(report_key)
+                    .unique_actives_aggregates()
+                    .by_event_code()
+                    .at(kTestEventCode)
+                    .by_day_index_size());
+
+  // Prefetching decodes the remaining reports.
+  EXPECT_EQ(1u, NumPendingHistories(store.get()));
+  EXPECT_FALSE(store->PrefetchReports(/*max_reports=*/1));
+  EXPECT_EQ(0u, NumPendingHistories(store.get()));
+  EXPECT_EQ(kTestDayIndex, store->GetReportParticipationLastGeneratedDayIndex(report_key));
+}
+
+// The first backup of an AggregateStore which was read from ConsistentProtoStores writes
+// IndexedStoreFiles and deletes the migrated snapshots.
+TEST_F(AggregateStoreTest, MigrateToIndexedStoreFiles) {
+  auto [metric, report] = GetUniqueActivesMetricAndReport(kTestCustomerId, kTestProjectId,
+                                                          kTestMetricId, kTestReportId);
+  auto project_context = GetProjectContextFor(metric);
+  std::string report_key;
+  ReportAggregationKey key_data;
+  key_data.set_customer_id(kTestCustomerId);
+  key_data.set_project_id(kTestProjectId);
+  key_data.set_metric_id(kTestMetricId);
+  key_data.set_report_id(kTestReportId);
+  SerializeToBase64(key_data, &report_key);
+
+  util::ConsistentProtoStore local_aggregate_proto_store(aggregate_store_path(), fs());
+  util::ConsistentProtoStore obs_history_proto_store(obs_history_path(), fs());
+  {
+    AggregateStore store(encoder_.get(), observation_writer_.get(), &local_aggregate_proto_store,
+                         &obs_history_proto_store);
+    ASSERT_EQ(kOK, store.MaybeInsertReportConfig(project_context, metric, report));
+    ASSERT_EQ(kOK, store.SetActive(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId,
+                                   kTestEventCode, kTestDayIndex));
+    store.SetReportParticipationLastGeneratedDayIndex(report_key, kTestDayIndex);
+    ASSERT_EQ(kOK, store.BackUpLocalAggregateStore());
+    ASSERT_EQ(kOK, store.BackUpObservationHistory());
+  }
+  ASSERT_TRUE(fs()->FileExists(aggregate_store_path()));
+  ASSERT_TRUE(fs()->FileExists(obs_history_path()));
+
+  IndexedStoreFile local_aggregate_index_file(aggregate_store_path() + ".idx", fs());
+  IndexedStoreFile obs_history_index_file(obs_history_path() + ".idx", fs());
+  auto make_store = [&]() {
+    return std::make_unique<AggregateStore>(
+        encoder_.get(), observation_writer_.get(), &local_aggregate_proto_store,
+        &obs_history_proto_store, /*backfill_days=*/0, &local_aggregate_index_file,
+        &obs_history_index_file);
+  };
+  auto store = make_store();
+  EXPECT_EQ(kTestDayIndex, store->GetReportParticipationLastGeneratedDayIndex(report_key));
+  ASSERT_EQ(kOK, store->BackUpLocalAggregateStore());
+  ASSERT_EQ(kOK, store->BackUpObservationHistory());
+  EXPECT_FALSE(fs()->FileExists(aggregate_store_path()));
+  EXPECT_FALSE(fs()->FileExists(obs_history_path()));
+
+  store = make_store();
+  EXPECT_EQ(1u, NumPendingAggregates(store.get()));
+  EXPECT_EQ(kTestDayIndex, store->GetReportParticipationLastGeneratedDayIndex(report_key));
+}
+
 // MaybeUpgradeLocalAggregateStore should return an OK status if the version is current. The store
 // should not change.
 TEST_F(AggregateStoreTest, MaybeUpgradeLocalAggregateStoreCurrent) {
@@ -1069,7 +1219,8 @@ TEST_F(AggregateStoreTest, MaybeUpgradeLocalAggregateStoreUnsupported) {
 
 // It should be possible to upgrade the LocalAggregateStore from v0 to the current version. The
 // version number should be updated and the contents of window_size in each AggregationConfigs
-// should be moved to aggregation_window, preserving their order.
+// should be moved to aggregation_window, preserving their order. The registry fingerprint should be
+// set.
 TEST_F(AggregateStoreTest, MaybeUpgradeLocalAggregateStoreFromV0) {
   const uint32_t kVersionZero = 0;
   const std::vector<uint32_t> kWindowSizes = {1, 7, 30};
@@ -1090,6 +1241,48 @@ TEST_F(AggregateStoreTest, MaybeUpgradeLocalAggregateStoreFromV0) {
     *expected_report_aggregates.mutable_aggregation_config()->add_aggregation_window() =
         MakeDayWindow(window_size);
   }
+  expected_report_aggregates.mutable_aggregation_config()->set_registry_fingerprint(
+      RegistryFingerprint(MetricDefinition(), ReportDefinition()));
+  (*expected_store.mutable_by_report_key())[kKey] = expected_report_aggregates;
+
+  // Upgrade and check that the upgraded store is as expected.
+  EXPECT_EQ(kOK, MaybeUpgradeLocalAggregateStore(&store));
+  EXPECT_EQ(SerializeAsStringDeterministic(expected_store), SerializeAsStringDeterministic(store));
+}
+
+// It should be possible to upgrade the LocalAggregateStore from v1 to the current version. The
+// copies of the Project, MetricDefinition, and ReportDefinition in each AggregationConfig should be
+// replaced by their registry fingerprint, and the aggregation windows and aggregates should be
+// preserved.
+TEST_F(AggregateStoreTest, MaybeUpgradeLocalAggregateStoreFromV1) {
+  const uint32_t kVersionOne = 1;
+  const std::string kKey = "some_report_key";
+  auto [metric, report] = GetUniqueActivesMetricAndReport(kTestCustomerId, kTestProjectId,
+                                                          kTestMetricId, kTestReportId);
+
+  // Make a v1 LocalAggregateStore with one report.
+  auto store = MakeNewLocalAggregateStore(kVersionOne);
+  ReportAggregates report_aggregates;
+  auto* config = report_aggregates.mutable_aggregation_config();
+  config->mutable_project()->set_project_name("test_project");
+  *config->mutable_metric() = metric;
+  *config->mutable_report() = report;
+  *config->add_aggregation_window() = MakeDayWindow(1);
+  auto* by_event_code =
+      report_aggregates.mutable_unique_actives_aggregates()->mutable_by_event_code();
+  (*(*by_event_code)[kTestEventCode].mutable_by_day_index())[kTestDayIndex]
+      .mutable_activity_daily_aggregate()
+      ->set_activity_indicator(true);
+  (*store.mutable_by_report_key())[kKey] = report_aggregates;
+
+  // Make the expected upgraded store.
+  auto expected_store = MakeNewLocalAggregateStore(kCurrentLocalAggregateStoreVersion);
+  ReportAggregates expected_report_aggregates = report_aggregates;
+  auto* expected_config = expected_report_aggregates.mutable_aggregation_config();
+  expected_config->clear_project();
+  expected_config->clear_metric();
+  expected_config->clear_report();
+  expected_config->set_registry_fingerprint(RegistryFingerprint(metric, report));
   (*expected_store.mutable_by_report_key())[kKey] = expected_report_aggregates;
 
   // Upgrade and check that the upgraded store is as expected.
@@ -1123,7 +1316,7 @@ TEST_F(AggregateStoreTest, MaybeInsertReportConfig) {
   auto project_context = GetProjectContextFor(metric);
 
   EXPECT_FALSE(IsReportInStore(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId));
-  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(*project_context, metric, report));
+  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(project_context, metric, report));
   EXPECT_TRUE(IsReportInStore(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId));
 }
 
@@ -1134,8 +1327,8 @@ TEST_F(AggregateStoreTest, MaybeInsertReportConfigTwice) {
   auto project_context = GetProjectContextFor(metric);
 
   EXPECT_FALSE(IsReportInStore(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId));
-  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(*project_context, metric, report));
-  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(*project_context, metric, report));
+  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(project_context, metric, report));
+  ASSERT_EQ(kOK, GetAggregateStore()->MaybeInsertReportConfig(project_context, metric, report));
   EXPECT_TRUE(IsReportInStore(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId));
 }
 
@@ -1148,7 +1341,7 @@ TEST_F(AggregateStoreTest, MaybeInsertReportConfigFail) {
 
   EXPECT_FALSE(IsReportInStore(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId));
   ASSERT_EQ(kInvalidArguments,
-            GetAggregateStore()->MaybeInsertReportConfig(*project_context, metric, report));
+            GetAggregateStore()->MaybeInsertReportConfig(project_context, metric, report));
 }
 
 // The Aggregate store sets the record for an event to active using SetActive.
@@ -1158,7 +1351,7 @@ TEST_F(AggregateStoreTest, SetActive) {
   auto project_context = GetProjectContextFor(metric);
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_FALSE(IsActive(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId,
                         kTestEventCode, kTestDayIndex));
@@ -1175,7 +1368,7 @@ TEST_F(AggregateStoreTest, SetActiveTwice) {
   auto project_context = GetProjectContextFor(metric);
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   EXPECT_FALSE(IsActive(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId,
                         kTestEventCode, kTestDayIndex));
 
@@ -1195,7 +1388,7 @@ TEST_F(AggregateStoreTest, SetActiveFail) {
   auto project_context = GetProjectContextFor(metric);
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   ASSERT_EQ(kInvalidArguments,
             GetAggregateStore()->SetActive(kTestCustomerId, kTestProjectId, kTestMetricId,
                                            kTestReportId, kTestEventCode, kTestDayIndex));
@@ -1212,7 +1405,7 @@ TEST_F(AggregateStoreTest, UpdateAggregationSUM) {
   const int64_t kSecondValue = 7;
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, GetAggregateStore()->UpdateNumericAggregate(
                      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, "",
@@ -1237,7 +1430,7 @@ TEST_F(AggregateStoreTest, UpdateAggregationMAX) {
   const int64_t kSecondValue = 7;
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, GetAggregateStore()->UpdateNumericAggregate(
                      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, "",
@@ -1261,7 +1454,7 @@ TEST_F(AggregateStoreTest, UpdateAggregationMIN) {
   const int64_t kSecondValue = 7;
 
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, GetAggregateStore()->UpdateNumericAggregate(
                      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, "",
@@ -1287,6 +1480,132 @@ TEST_F(AggregateStoreTest, UpdateAggregationFail) {
                                    "", kTestEventCode, kTestDayIndex, /*value*/ 4));
 }
 
+// Once a report holds the maximum number of components, events for new components are dropped
+// under the kDrop policy, while existing components continue to be updated.
+TEST_F(AggregateStoreTest, ComponentLimitDrop) {
+  auto [metric, report] = GetPerDeviceNumericStatsMetricAndReport(
+      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, ReportDefinition::SUM);
+  auto project_context = GetProjectContextFor(metric);
+  EXPECT_EQ(
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
+  SetComponentLimits(2, ComponentOverflowPolicy::kDrop);
+
+  auto update = [this](const std::string& component, int64_t value) {
+    return GetAggregateStore()->UpdateNumericAggregate(kTestCustomerId, kTestProjectId,
+                                                       kTestMetricId, kTestReportId, component,
+                                                       kTestEventCode, kTestDayIndex, value);
+  };
+  auto get_value = [this](const std::string& component) {
+    return GetValue(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, component,
+                    kTestEventCode, kTestDayIndex);
+  };
+  EXPECT_EQ(kOK, update("a", 1));
+  EXPECT_EQ(kOK, update("b", 2));
+  EXPECT_EQ(kOK, update("c", 3));
+  EXPECT_EQ(kOK, update("a", 4));
+
+  EXPECT_EQ(5, get_value("a"));
+  EXPECT_EQ(2, get_value("b"));
+  EXPECT_FALSE(get_value("c").has_value());
+  EXPECT_FALSE(get_value(kOverflowComponent).has_value());
+  auto counters = GetAggregateStore()->GetComponentLimitCounters();
+  EXPECT_EQ(1u, counters.num_dropped);
+  EXPECT_EQ(1u, counters.num_events_rejected());
+  EXPECT_EQ(1u, event_aggregator_mgr_->component_limit_counters().num_dropped);
+}
+
+// Under the kBucketAsOther policy, events for components beyond the limit are aggregated together
+// under kOverflowComponent.
+TEST_F(AggregateStoreTest, ComponentLimitBucketAsOther) {
+  auto [metric, report] = GetPerDeviceNumericStatsMetricAndReport(
+      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, ReportDefinition::SUM);
+  auto project_context = GetProjectContextFor(metric);
+  EXPECT_EQ(
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
+  SetComponentLimits(2, ComponentOverflowPolicy::kBucketAsOther);
+
+  auto update = [this](const std::string& component, int64_t value) {
+    return GetAggregateStore()->UpdateNumericAggregate(kTestCustomerId, kTestProjectId,
+                                                       kTestMetricId, kTestReportId, component,
+                                                       kTestEventCode, kTestDayIndex, value);
+  };
+  auto get_value = [this](const std::string& component) {
+    return GetValue(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, component,
+                    kTestEventCode, kTestDayIndex);
+  };
+  EXPECT_EQ(kOK, update("a", 1));
+  EXPECT_EQ(kOK, update("b", 2));
+  EXPECT_EQ(kOK, update("c", 3));
+  EXPECT_EQ(kOK, update("d", 4));
+  EXPECT_EQ(kOK, update("b", 5));
+
+  EXPECT_EQ(1, get_value("a"));
+  EXPECT_EQ(7, get_value("b"));
+  EXPECT_FALSE(get_value("c").has_value());
+  EXPECT_FALSE(get_value("d").has_value());
+  EXPECT_EQ(7, get_value(kOverflowComponent));
+  auto counters = GetAggregateStore()->GetComponentLimitCounters();
+  EXPECT_EQ(2u, counters.num_bucketed);
+  EXPECT_EQ(2u, counters.num_events_rejected());
+}
+
+// Under the kReplaceLeastFrequent policy, a new component beyond the limit evicts the component
+// with the fewest events, and inherits its event count.
+TEST_F(AggregateStoreTest, ComponentLimitReplaceLeastFrequent) {
+  auto [metric, report] = GetPerDeviceNumericStatsMetricAndReport(
+      kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, ReportDefinition::SUM);
+  auto project_context = GetProjectContextFor(metric);
+  EXPECT_EQ(
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
+  SetComponentLimits(2, ComponentOverflowPolicy::kReplaceLeastFrequent);
+
+  auto update = [this](const std::string& component, int64_t value) {
+    return GetAggregateStore()->UpdateNumericAggregate(kTestCustomerId, kTestProjectId,
+                                                       kTestMetricId, kTestReportId, component,
+                                                       kTestEventCode, kTestDayIndex, value);
+  };
+  auto get_value = [this](const std::string& component) {
+    return GetValue(kTestCustomerId, kTestProjectId, kTestMetricId, kTestReportId, component,
+                    kTestEventCode, kTestDayIndex);
+  };
+  std::string report_key;
+  ReportAggregationKey key_data;
+  key_data.set_customer_id(kTestCustomerId);
+  key_data.set_project_id(kTestProjectId);
+  key_data.set_metric_id(kTestMetricId);
+  key_data.set_report_id(kTestReportId);
+  SerializeToBase64(key_data, &report_key);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(kOK, update("a", 1));
+  }
+  EXPECT_EQ(kOK, update("b", 1));
+  GetAggregateStore()->SetPerDeviceNumericLastGeneratedDayIndex(report_key, "a", kTestEventCode,
+                                                                1, kTestDayIndex);
+  GetAggregateStore()->SetPerDeviceNumericLastGeneratedDayIndex(report_key, "b", kTestEventCode,
+                                                                1, kTestDayIndex);
+  // "b" has the fewest events and is evicted. "c" takes over its count of 1 event.
+  EXPECT_EQ(kOK, update("c", 5));
+  EXPECT_EQ(3, get_value("a"));
+  EXPECT_FALSE(get_value("b").has_value());
+  EXPECT_EQ(5, get_value("c"));
+  // The observation history of "b" is deleted with its aggregates.
+  EXPECT_EQ(kTestDayIndex, GetAggregateStore()->GetPerDeviceNumericLastGeneratedDayIndex(
+                               report_key, "a", kTestEventCode, 1));
+  EXPECT_EQ(0u, GetAggregateStore()->GetPerDeviceNumericLastGeneratedDayIndex(
+                    report_key, "b", kTestEventCode, 1));
+
+  // "c" now has an estimated 2 events, and "a" has 3, so "c" is evicted.
+  EXPECT_EQ(kOK, update("d", 7));
+  EXPECT_EQ(3, get_value("a"));
+  EXPECT_FALSE(get_value("c").has_value());
+  EXPECT_EQ(7, get_value("d"));
+
+  auto counters = GetAggregateStore()->GetComponentLimitCounters();
+  EXPECT_EQ(2u, counters.num_evicted);
+  // Evicted components are not counted as rejected events.
+  EXPECT_EQ(0u, counters.num_events_rejected());
+}
+
 TEST_F(AggregateStoreTest, SetUniqueActivesLastGeneratedDayIndex) {
   const std::string kReportKey = "test_key";
   const int64_t kFirstValue = 3;
@@ -1329,9 +1648,10 @@ TEST_F(AggregateStoreTest, SetReportParticipationLastGeneratedDayIndex) {
 // Events have been logged to the EventAggregator.
 TEST_F(AggregateStoreTest, GenerateObservationsNoEvents) {
   // Provide the all_report_types test registry to the EventAggregator.
-  auto project_context = GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
+  std::shared_ptr<ProjectContext> project_context =
+      GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   // Generate locally aggregated Observations for the current day index.
   EXPECT_EQ(kOK, GenerateObservations(CurrentDayIndex()));
   std::vector<Observation2> observations(0);
@@ -1344,9 +1664,10 @@ TEST_F(AggregateStoreTest, GenerateObservationsNoEvents) {
 // Observations the first time it is called for a given day index.
 TEST_F(AggregateStoreTest, GenerateObservationsTwice) {
   // Provide the all_report_types test registry to the EventAggregator.
-  auto project_context = GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
+  std::shared_ptr<ProjectContext> project_context =
+      GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   // Check that Observations are generated when GenerateObservations is called
   // for the current day index for the first time.
   auto current_day_index = CurrentDayIndex();
@@ -1362,6 +1683,71 @@ TEST_F(AggregateStoreTest, GenerateObservationsTwice) {
   EXPECT_EQ(0u, observation_store_->messages_received.size());
 }
 
+// GenerateObservations stops once its GenerationBudget is exhausted, and later calls resume where
+// it stopped, so that the chunks together generate the same Observations as a single call.
+TEST_F(AggregateStoreTest, GenerateObservationsInChunks) {
+  std::shared_ptr<ProjectContext> project_context =
+      GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
+  EXPECT_EQ(
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
+  auto current_day_index = CurrentDayIndex();
+  IncrementingSteadyClock steady_clock;
+  const size_t kMaxObservationsPerChunk = 5;
+  size_t num_chunks = 0;
+  bool exhausted = true;
+  while (exhausted) {
+    ASSERT_LT(num_chunks, 1000u);
+    GenerationBudget budget(kMaxObservationsPerChunk, std::chrono::steady_clock::duration::zero(),
+                            &steady_clock);
+    ASSERT_EQ(kOK, GetAggregateStore()->GenerateObservations(current_day_index, 0u, &budget));
+    EXPECT_LE(budget.num_observations(), kMaxObservationsPerChunk);
+    exhausted = budget.exhausted();
+    num_chunks++;
+  }
+  EXPECT_GT(num_chunks, 1u);
+  std::vector<Observation2> observations(0);
+  EXPECT_TRUE(FetchAggregatedObservations(
+      &observations, logger::testing::all_report_types::kExpectedAggregationParams,
+      observation_store_.get(), update_recipient_.get()));
+}
+
+// A GenerationBudget with a time limit is exhausted once its deadline has passed.
+TEST_F(AggregateStoreTest, GenerationBudgetDeadline) {
+  IncrementingSteadyClock steady_clock(std::chrono::seconds(1));
+  GenerationBudget budget(0, std::chrono::seconds(3), &steady_clock);
+  EXPECT_TRUE(budget.TryConsume());
+  EXPECT_TRUE(budget.TryConsume());
+  EXPECT_FALSE(budget.TryConsume());
+  EXPECT_TRUE(budget.exhausted());
+  EXPECT_EQ(2u, budget.num_observations());
+}
+
+// GenerateObservations defers generation while the ObservationStore is almost full.
+TEST_F(AggregateStoreTest, GenerateObservationsWhenStoreAlmostFull) {
+  std::shared_ptr<ProjectContext> project_context =
+      GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
+  EXPECT_EQ(
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
+  auto current_day_index = CurrentDayIndex();
+  IncrementingSteadyClock steady_clock;
+
+  observation_store_->almost_full = true;
+  GenerationBudget deferred_budget(0, std::chrono::steady_clock::duration::zero(), &steady_clock);
+  EXPECT_EQ(kOK,
+            GetAggregateStore()->GenerateObservations(current_day_index, 0u, &deferred_budget));
+  EXPECT_TRUE(deferred_budget.exhausted());
+  EXPECT_EQ(0u, observation_store_->messages_received.size());
+
+  observation_store_->almost_full = false;
+  GenerationBudget budget(0, std::chrono::steady_clock::duration::zero(), &steady_clock);
+  EXPECT_EQ(kOK, GetAggregateStore()->GenerateObservations(current_day_index, 0u, &budget));
+  EXPECT_FALSE(budget.exhausted());
+  std::vector<Observation2> observations(0);
+  EXPECT_TRUE(FetchAggregatedObservations(
+      &observations, logger::testing::all_report_types::kExpectedAggregationParams,
+      observation_store_.get(), update_recipient_.get()));
+}
+
 // When the LocalAggregateStore contains one ReportAggregates proto and that
 // proto is empty, GenerateObservations should return success but generate no
 // observations.
@@ -1387,9 +1773,10 @@ TEST_F(AggregateStoreTest, GenerateObservationsFromBadStoreMultiReport) {
   // Read the bad store in to the EventAggregator.
   ResetEventAggregator();
   // Provide the all_report_types test registry to the EventAggregator.
-  auto project_context = GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
+  std::shared_ptr<ProjectContext> project_context =
+      GetTestProject(logger::testing::all_report_types::kCobaltRegistryBase64);
   EXPECT_EQ(
-      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+      kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   EXPECT_EQ(kOK, GenerateObservations(CurrentDayIndex()));
   std::vector<Observation2> observations(0);
   EXPECT_TRUE(FetchAggregatedObservations(
@@ -1776,6 +2163,110 @@ TEST_F(UniqueActivesNoiseFreeAggregateStoreTest, CheckObservationValuesSingleDay
                                              update_recipient_.get()));
 }
 
+// Checks that when packing is enabled, a single PackedUniqueActivesObservation is generated for
+// each UNIQUE_N_DAY_ACTIVES report and window size, and that these decode to the
+// UniqueActivesObservations which are generated without packing. The logging pattern and the
+// expected activity indicators are the same as in CheckObservationValuesSingleDay.
+TEST_F(UniqueActivesNoiseFreeAggregateStoreTest, CheckPackedObservationValuesSingleDay) {
+  const auto& expected_params =
+      logger::testing::unique_actives_noise_free::kExpectedAggregationParams;
+  UsePackedObservations();
+  auto day_index = CurrentDayIndex();
+  // Adds several events to the local aggregations on |day_index|.
+  EXPECT_EQ(kOK, AddUniqueActivesEvent(
+                     logger::testing::unique_actives_noise_free::kFeaturesActiveMetricReportId,
+                     day_index, 0u));
+  EXPECT_EQ(kOK, AddUniqueActivesEvent(
+                     logger::testing::unique_actives_noise_free::kFeaturesActiveMetricReportId,
+                     day_index, 0u));
+  EXPECT_EQ(kOK, AddUniqueActivesEvent(
+                     logger::testing::unique_actives_noise_free::kEventsOccurredMetricReportId,
+                     day_index, 1u));
+  // Generate locally aggregated Observations for |day_index|.
+  EXPECT_EQ(kOK, GenerateObservations(day_index));
+
+  // Expect one Observation per report and window size.
+  size_t expected_num_packed_obs = 0;
+  for (const auto& [metric_report_id, aggregation_days] : expected_params.aggregation_days) {
+    expected_num_packed_obs += aggregation_days.size();
+  }
+  EXPECT_EQ(expected_num_packed_obs, observation_store_->messages_received.size());
+  EXPECT_LT(expected_num_packed_obs, expected_params.daily_num_obs);
+
+  // Form the expected observations.
+  auto expected_obs = MakeNullExpectedUniqueActivesObservations(expected_params, day_index);
+  expected_obs[{logger::testing::unique_actives_noise_free::kFeaturesActiveMetricReportId,
+                day_index}] = {{1, {true, false, false, false, false}},
+                               {7, {true, false, false, false, false}},
+                               {30, {true, false, false, false, false}}};
+  expected_obs[{logger::testing::unique_actives_noise_free::kEventsOccurredMetricReportId,
+                day_index}] = {{1, {false, true, false, false, false}},
+                               {7, {false, true, false, false, false}}};
+
+  // Decode the packed Observations and check the contents of the FakeObservationStore.
+  UnpackObservations(observation_store_.get(), update_recipient_.get());
+  EXPECT_TRUE(CheckUniqueActivesObservations(expected_obs, observation_store_.get(),
+                                             update_recipient_.get()));
+}
+
+// Checks that when packing is enabled, packed Observations are generated for each day of the
+// backfill period, that each packed Observation counts once against a GenerationBudget, and that
+// generation in several chunks yields the same Observations as generation in a single call.
+//
+// Logs an event with event code 1 for the EventsOccurred_UniqueDevices report (with window sizes 1
+// and 7) on the day before the current day, and generates Observations for the current day with 2
+// days of backfill.
+TEST_F(UniqueActivesNoiseFreeAggregateStoreTest, GeneratePackedObservationsWithBackfillInChunks) {
+  const auto& expected_params =
+      logger::testing::unique_actives_noise_free::kExpectedAggregationParams;
+  const size_t kBackfillDays = 2;
+  UsePackedObservations();
+  SetBackfillDays(kBackfillDays);
+  auto day_index = CurrentDayIndex();
+  EXPECT_EQ(kOK, AddUniqueActivesEvent(
+                     logger::testing::unique_actives_noise_free::kEventsOccurredMetricReportId,
+                     day_index - 1, 1u));
+
+  IncrementingSteadyClock steady_clock;
+  const size_t kMaxObservationsPerChunk = 4;
+  size_t num_chunks = 0;
+  bool exhausted = true;
+  while (exhausted) {
+    ASSERT_LT(num_chunks, 1000u);
+    GenerationBudget budget(kMaxObservationsPerChunk, std::chrono::steady_clock::duration::zero(),
+                            &steady_clock);
+    ASSERT_EQ(kOK, GetAggregateStore()->GenerateObservations(day_index, 0u, &budget));
+    EXPECT_LE(budget.num_observations(), kMaxObservationsPerChunk);
+    exhausted = budget.exhausted();
+    num_chunks++;
+  }
+  EXPECT_GT(num_chunks, 1u);
+
+  // Expect one Observation per report, window size and day.
+  size_t expected_num_packed_obs = 0;
+  for (const auto& [metric_report_id, aggregation_days] : expected_params.aggregation_days) {
+    expected_num_packed_obs += aggregation_days.size() * (kBackfillDays + 1);
+  }
+  EXPECT_EQ(expected_num_packed_obs, observation_store_->messages_received.size());
+
+  ExpectedUniqueActivesObservations expected_obs;
+  for (uint32_t obs_day_index = day_index - kBackfillDays; obs_day_index <= day_index;
+       obs_day_index++) {
+    auto null_obs = MakeNullExpectedUniqueActivesObservations(expected_params, obs_day_index);
+    expected_obs.insert(null_obs.begin(), null_obs.end());
+  }
+  expected_obs[{logger::testing::unique_actives_noise_free::kEventsOccurredMetricReportId,
+                day_index - 1}] = {{1, {false, true, false, false, false}},
+                                   {7, {false, true, false, false, false}}};
+  expected_obs[{logger::testing::unique_actives_noise_free::kEventsOccurredMetricReportId,
+                day_index}] = {{1, {false, false, false, false, false}},
+                               {7, {false, true, false, false, false}}};
+
+  UnpackObservations(observation_store_.get(), update_recipient_.get());
+  EXPECT_TRUE(CheckUniqueActivesObservations(expected_obs, observation_store_.get(),
+                                             update_recipient_.get()));
+}
+
 // Checks that UniqueActivesObservations with the expected values are
 // generated when some events have been logged for a UNIQUE_N_DAY_ACTIVES
 // report over multiple days and GenerateObservations() is called each
@@ -2853,6 +3344,67 @@ TEST_F(PerDeviceNumericAggregateStoreTest, CheckObservationValuesSingleDay) {
                                                 observation_store_.get(), update_recipient_.get()));
 }
 
+// Checks that when packing is enabled, a single PackedPerDeviceNumericObservation is generated for
+// each PER_DEVICE_NUMERIC_STATS report and window size for which some event was logged, that
+// ReportParticipationObservations are generated as usual, and that the packed Observations decode
+// to the PerDeviceNumericObservations which are generated without packing.
+TEST_F(PerDeviceNumericAggregateStoreTest, CheckPackedObservationValuesSingleDay) {
+  UsePackedObservations();
+  const auto day_index = CurrentDayIndex();
+  // Add several events to the local aggregations on |day_index|.
+  EXPECT_EQ(kOK, AddPerDeviceEventCountEvent(
+                     logger::testing::per_device_numeric_stats::kConnectionFailuresMetricReportId,
+                     day_index, "component_A", 0u, 5));
+  EXPECT_EQ(kOK, AddPerDeviceEventCountEvent(
+                     logger::testing::per_device_numeric_stats::kConnectionFailuresMetricReportId,
+                     day_index, "component_B", 0u, 5));
+  EXPECT_EQ(kOK, AddPerDeviceEventCountEvent(
+                     logger::testing::per_device_numeric_stats::kConnectionFailuresMetricReportId,
+                     day_index, "component_A", 0u, 5));
+  EXPECT_EQ(kOK, AddPerDeviceEventCountEvent(
+                     logger::testing::per_device_numeric_stats::kConnectionFailuresMetricReportId,
+                     day_index, "component_A", 1u, 5));
+  EXPECT_EQ(kOK, AddPerDeviceElapsedTimeEvent(
+                     logger::testing::per_device_numeric_stats::kStreamingTimeTotalMetricReportId,
+                     day_index, "component_D", 0u, 15));
+  EXPECT_EQ(kOK, AddPerDeviceElapsedTimeEvent(
+                     logger::testing::per_device_numeric_stats::kStreamingTimeTotalMetricReportId,
+                     day_index, "component_D", 1u, 5));
+  // Generate locally aggregated Observations for |day_index|.
+  EXPECT_EQ(kOK, GenerateObservations(day_index));
+
+  // Form the expected Observations.
+  auto expected_report_participation_obs = MakeExpectedReportParticipationObservations(
+      logger::testing::per_device_numeric_stats::kExpectedAggregationParams, day_index);
+  ExpectedPerDeviceNumericObservations expected_per_device_numeric_obs;
+  expected_per_device_numeric_obs[{
+      logger::testing::per_device_numeric_stats::kConnectionFailuresMetricReportId, day_index}][1] =
+      {{"component_A", 0u, 10}, {"component_A", 1u, 5}, {"component_B", 0u, 5}};
+  expected_per_device_numeric_obs[{
+      logger::testing::per_device_numeric_stats::kStreamingTimeTotalMetricReportId, day_index}][1] =
+      {{"component_D", 0u, 15}, {"component_D", 1u, 5}};
+  expected_per_device_numeric_obs[{
+      logger::testing::per_device_numeric_stats::kStreamingTimeTotalMetricReportId, day_index}][7] =
+      {{"component_D", 0u, 15}, {"component_D", 1u, 5}};
+
+  // Expect one packed Observation for each of the 3 pairs (report, window size) above, in addition
+  // to the ReportParticipationObservations.
+  size_t num_packed_obs = 0;
+  for (const auto& message : observation_store_->messages_received) {
+    if (message->unencrypted().has_packed_per_device_numeric()) {
+      num_packed_obs++;
+    }
+  }
+  EXPECT_EQ(3u, num_packed_obs);
+  EXPECT_EQ(expected_report_participation_obs.size() + 3u,
+            observation_store_->messages_received.size());
+
+  UnpackObservations(observation_store_.get(), update_recipient_.get());
+  EXPECT_TRUE(CheckPerDeviceNumericObservations(expected_per_device_numeric_obs,
+                                                expected_report_participation_obs,
+                                                observation_store_.get(), update_recipient_.get()));
+}
+
 // Checks that PerDeviceNumericObservations with the expected values are
 // generated when some events have been logged for an EVENT_COUNT metric with
 // a PER_DEVICE_NUMERIC_STATS report over multiple days and
@@ -4,7 +4,12 @@
 #include "src/local_aggregation/aggregation_utils.h"
 
 #include <optional>
+#include <string>
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "src/lib/crypto_util/hash.h"
 #include "src/logging.h"
 
 namespace cobalt::local_aggregation {
@@ -43,4 +48,50 @@ std::tuple<logger::Status, int64_t> GetUpdatedAggregate(
       return std::make_tuple(kInvalidArguments, 0);
   }
 }
+
+namespace {
+
+// Appends the deterministic serialization of |message| to |out|.
+void AppendDeterministic(const google::protobuf::MessageLite& message, std::string* out) {
+  google::protobuf::io::StringOutputStream output(out);
+  google::protobuf::io::CodedOutputStream coded_output(&output);
+  coded_output.SetSerializationDeterministic(true);
+  message.SerializePartialToCodedStream(&coded_output);
+}
+
+}  // namespace
+
+uint64_t RegistryFingerprint(const MetricDefinition& metric, const ReportDefinition& report) {
+  MetricDefinition relevant_metric;
+  relevant_metric.set_customer_id(metric.customer_id());
+  relevant_metric.set_project_id(metric.project_id());
+  relevant_metric.set_id(metric.id());
+  relevant_metric.set_metric_type(metric.metric_type());
+  relevant_metric.set_time_zone_policy(metric.time_zone_policy());
+  for (const auto& dimension : metric.metric_dimensions()) {
+    auto* relevant_dimension = relevant_metric.add_metric_dimensions();
+    relevant_dimension->set_max_event_code(dimension.max_event_code());
+    // Only the set of event codes is relevant, not their names.
+    for (const auto& event_code : dimension.event_codes()) {
+      (*relevant_dimension->mutable_event_codes())[event_code.first] = "";
+    }
+  }
+
+  std::string bytes;
+  AppendDeterministic(relevant_metric, &bytes);
+  AppendDeterministic(report, &bytes);
+
+  crypto::byte digest[crypto::hash::DIGEST_SIZE];
+  if (!crypto::hash::Hash(reinterpret_cast<const crypto::byte*>(bytes.data()), bytes.size(),
+                          digest)) {
+    LOG(ERROR) << "Failed to compute the registry fingerprint of report " << report.id();
+    return 0u;
+  }
+  uint64_t fingerprint = 0u;
+  for (size_t i = 0; i < sizeof(fingerprint); i++) {
+    fingerprint = (fingerprint << 8) | digest[i];
+  }
+  return fingerprint;
+}
+
 }  // namespace cobalt::local_aggregation
@@ -8,6 +8,7 @@
 
 #include "src/logger/status.h"
 #include "src/registry/aggregation_window.pb.h"
+#include "src/registry/metric_definition.pb.h"
 #include "src/registry/report_definition.pb.h"
 
 namespace cobalt::local_aggregation {
@@ -31,6 +32,12 @@ std::tuple<logger::Status, int64_t> GetUpdatedAggregate(
     ReportDefinition::OnDeviceAggregationType aggregation_type,
     std::optional<int64_t> stored_aggregate, int64_t new_value);
 
+// Computes a fingerprint of the fields of |metric| and |report| which affect the way that the
+// AggregateStore aggregates events and generates Observations for |report|. Fields which are
+// irrelevant to local aggregation, such as event code names and the other reports of |metric|, do
+// not contribute to the fingerprint. The result is stable across processes and may be persisted.
+uint64_t RegistryFingerprint(const MetricDefinition& metric, const ReportDefinition& report);
+
 }  // namespace cobalt::local_aggregation
 
 #endif  // COBALT_SRC_LOCAL_AGGREGATION_AGGREGATION_UTILS_H_
@@ -114,4 +114,76 @@ TEST(AggregationUtilsTest, GetUpdatedAggregateMinWithLargerPriorValue) {
   EXPECT_EQ(kNewValue, updated_value);
 }
 
+/*************************************RegistryFingerprint*****************************************/
+
+namespace {
+
+std::tuple<MetricDefinition, ReportDefinition> MakeMetricAndReport() {
+  ReportDefinition report;
+  report.set_report_name("report");
+  report.set_id(3);
+  report.set_report_type(ReportDefinition::PER_DEVICE_NUMERIC_STATS);
+  report.set_aggregation_type(ReportDefinition::SUM);
+  *report.add_aggregation_window() = MakeDayWindow(7);
+
+  MetricDefinition metric;
+  metric.set_metric_name("metric");
+  metric.set_customer_id(1);
+  metric.set_project_id(2);
+  metric.set_id(3);
+  metric.set_metric_type(MetricDefinition::EVENT_COUNT);
+  auto* dimension = metric.add_metric_dimensions();
+  dimension->set_dimension("dimension");
+  (*dimension->mutable_event_codes())[0] = "zero";
+  (*dimension->mutable_event_codes())[1] = "one";
+  *metric.add_reports() = report;
+  return {metric, report};
+}
+
+}  // namespace
+
+// The fingerprint should be the same for equal definitions.
+TEST(AggregationUtilsTest, RegistryFingerprintIsDeterministic) {
+  auto [metric, report] = MakeMetricAndReport();
+  auto [other_metric, other_report] = MakeMetricAndReport();
+
+  EXPECT_EQ(RegistryFingerprint(metric, report), RegistryFingerprint(other_metric, other_report));
+}
+
+// Changes to the definitions which do not affect local aggregation should not change the
+// fingerprint.
+TEST(AggregationUtilsTest, RegistryFingerprintIgnoresIrrelevantFields) {
+  auto [metric, report] = MakeMetricAndReport();
+  auto fingerprint = RegistryFingerprint(metric, report);
+
+  metric.set_metric_name("renamed_metric");
+  metric.mutable_metric_dimensions(0)->set_dimension("renamed_dimension");
+  (*metric.mutable_metric_dimensions(0)->mutable_event_codes())[1] = "renamed_one";
+  metric.add_reports()->set_id(4);
+
+  EXPECT_EQ(fingerprint, RegistryFingerprint(metric, report));
+}
+
+// Changes to the definitions which affect local aggregation should change the fingerprint.
+TEST(AggregationUtilsTest, RegistryFingerprintChangesWithRelevantFields) {
+  auto [metric, report] = MakeMetricAndReport();
+  auto fingerprint = RegistryFingerprint(metric, report);
+
+  auto local_metric = metric;
+  local_metric.set_time_zone_policy(MetricDefinition::LOCAL);
+  EXPECT_NE(fingerprint, RegistryFingerprint(local_metric, report));
+
+  auto more_event_codes_metric = metric;
+  (*more_event_codes_metric.mutable_metric_dimensions(0)->mutable_event_codes())[2] = "two";
+  EXPECT_NE(fingerprint, RegistryFingerprint(more_event_codes_metric, report));
+
+  auto max_report = report;
+  max_report.set_aggregation_type(ReportDefinition::MAX);
+  EXPECT_NE(fingerprint, RegistryFingerprint(metric, max_report));
+
+  auto more_windows_report = report;
+  *more_windows_report.add_aggregation_window() = MakeDayWindow(30);
+  EXPECT_NE(fingerprint, RegistryFingerprint(metric, more_windows_report));
+}
+
 }  // namespace cobalt::local_aggregation
@@ -0,0 +1,54 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LOCAL_AGGREGATION_COMPONENT_LIMITS_H_
+#define COBALT_SRC_LOCAL_AGGREGATION_COMPONENT_LIMITS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cobalt::local_aggregation {
+
+// What the AggregateStore does with a numeric event whose component is new to a report which
+// already holds aggregates for the maximum number of components.
+enum class ComponentOverflowPolicy {
+  // The event is dropped.
+  kDrop,
+  // The event is aggregated under kOverflowComponent instead of its own component.
+  kBucketAsOther,
+  // The component with the fewest logged events is evicted, together with its aggregates, and the
+  // new component takes its place (the Space-Saving heavy-hitters algorithm).
+  kReplaceLeastFrequent,
+};
+
+// The component under which events are aggregated by the kBucketAsOther policy. This component is
+// not counted towards the limit.
+constexpr char kOverflowComponent[] = "<other>";
+
+// Bounds the number of distinct components for which the AggregateStore keeps aggregates for each
+// PER_DEVICE_NUMERIC_STATS and PER_DEVICE_HISTOGRAM report.
+struct ComponentLimits {
+  // The maximum number of components per report. If 0, the number of components is not limited.
+  size_t max_components_per_report = 0;
+
+  ComponentOverflowPolicy overflow_policy = ComponentOverflowPolicy::kDrop;
+};
+
+// Counts the events whose component was not stored, and the components which were evicted,
+// because of a ComponentLimits. Events and components are counted separately.
+struct ComponentLimitCounters {
+  // Events which were dropped by the kDrop policy.
+  uint64_t num_dropped = 0;
+  // Events which were aggregated under kOverflowComponent by the kBucketAsOther policy.
+  uint64_t num_bucketed = 0;
+  // Components which were evicted by the kReplaceLeastFrequent policy.
+  uint64_t num_evicted = 0;
+
+  // Returns the number of events which were not aggregated under their own component.
+  [[nodiscard]] uint64_t num_events_rejected() const { return num_dropped + num_bucketed; }
+};
+
+}  // namespace cobalt::local_aggregation
+
+#endif  // COBALT_SRC_LOCAL_AGGREGATION_COMPONENT_LIMITS_H_
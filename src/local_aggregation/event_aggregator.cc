@@ -27,9 +27,10 @@ EventAggregator::EventAggregator(AggregateStore* aggregate_store)
 
 // TODO(pesk): update the EventAggregator's view of a Metric
 // or ReportDefinition when appropriate.
-Status EventAggregator::UpdateAggregationConfigs(const ProjectContext& project_context) {
+Status EventAggregator::UpdateAggregationConfigs(
+    const std::shared_ptr<const ProjectContext>& project_context) {
   Status status;
-  for (const auto& metric : project_context.metrics()) {
+  for (const auto& metric : project_context->metrics()) {
     switch (metric.metric_type()) {
       case MetricDefinition::EVENT_OCCURRED: {
         for (const auto& report : metric.reports()) {
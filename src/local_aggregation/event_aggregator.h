@@ -44,7 +44,11 @@ class EventAggregator {
   // previously provided report, then the new report is ignored, even if other
   // properties of the customer, Project, MetricDefinition, or
   // ReportDefinition differ from those of the existing report.
-  logger::Status UpdateAggregationConfigs(const logger::ProjectContext& project_context);
+  //
+  // The AggregateStore keeps a reference to |project_context| in order to resolve the definitions
+  // of its locally aggregated reports when generating Observations.
+  logger::Status UpdateAggregationConfigs(
+      const std::shared_ptr<const logger::ProjectContext>& project_context);
 
   // Adds an Event associated to a report of type UNIQUE_N_DAY_ACTIVES to the
   // AggregateStore.
@@ -19,11 +19,20 @@ using util::ConsistentProtoStore;
 using util::SteadyClock;
 using util::TimeToDayIndex;
 
+namespace {
+
+constexpr char kIndexedStoreSuffix[] = ".idx";
+
+}  // namespace
+
 const std::chrono::seconds EventAggregatorManager::kDefaultAggregateBackupInterval =
     std::chrono::minutes(1);
 const std::chrono::seconds EventAggregatorManager::kDefaultGenerateObsInterval =
     std::chrono::hours(1);
 const std::chrono::seconds EventAggregatorManager::kDefaultGCInterval = std::chrono::hours(24);
+const size_t EventAggregatorManager::kDefaultGenerateObsMaxObservations = 5000;
+const std::chrono::seconds EventAggregatorManager::kDefaultGenerateObsMaxDuration =
+    std::chrono::seconds(5);
 
 EventAggregatorManager::EventAggregatorManager(const CobaltConfig& cfg, util::FileSystem* fs,
                                                const logger::Encoder* encoder,
@@ -31,13 +40,23 @@ EventAggregatorManager::EventAggregatorManager(const CobaltConfig& cfg, util::Fi
     : encoder_(encoder),
       observation_writer_(observation_writer),
       backfill_days_(cfg.local_aggregation_backfill_days),
+      use_packed_observations_(cfg.use_packed_local_aggregation_observations),
+      component_limits_(cfg.local_aggregation_component_limits),
       aggregate_backup_interval_(kDefaultAggregateBackupInterval),
       generate_obs_interval_(kDefaultGenerateObsInterval),
       gc_interval_(kDefaultGCInterval),
+      generate_obs_max_observations_(kDefaultGenerateObsMaxObservations),
+      generate_obs_max_duration_(kDefaultGenerateObsMaxDuration),
       owned_local_aggregate_proto_store_(
           new ConsistentProtoStore(cfg.local_aggregate_proto_store_path, fs)),
       owned_obs_history_proto_store_(
           new ConsistentProtoStore(cfg.obs_history_proto_store_path, fs)) {
+  if (cfg.use_indexed_local_aggregate_store) {
+    owned_local_aggregate_index_file_ = std::make_unique<IndexedStoreFile>(
+        cfg.local_aggregate_proto_store_path + kIndexedStoreSuffix, fs);
+    owned_obs_history_index_file_ = std::make_unique<IndexedStoreFile>(
+        cfg.obs_history_proto_store_path + kIndexedStoreSuffix, fs);
+  }
   Reset();
 }
 
@@ -64,6 +83,13 @@ void EventAggregatorManager::ShutDown() {
 }
 
 void EventAggregatorManager::Run(std::unique_ptr<util::SystemClockInterface> system_clock) {
+  // Decode the reports which were loaded lazily from disk before starting the periodic tasks, a
+  // batch at a time so that loggers are not blocked for long.
+  while (aggregate_store_->PrefetchReports(kPrefetchBatchSize)) {
+    if (protected_worker_thread_controller_.const_lock()->shut_down) {
+      break;
+    }
+  }
   std::chrono::steady_clock::time_point steady_time = steady_clock_->now();
   // Schedule Observation generation to happen in the first cycle.
   next_generate_obs_ = steady_time;
@@ -118,15 +144,27 @@ void EventAggregatorManager::DoScheduledTasks(std::chrono::system_clock::time_po
   uint32_t min_allowed_day_index = kMaxAllowedAggregationDays + backfill_days_;
   bool skip_tasks =
       (yesterday_utc < min_allowed_day_index || yesterday_local_time < min_allowed_day_index);
-  if (steady_time >= next_generate_obs_) {
-    next_generate_obs_ += generate_obs_interval_;
+  if (steady_time >= next_generate_obs_ || generate_obs_incomplete_) {
+    if (steady_time >= next_generate_obs_) {
+      next_generate_obs_ += generate_obs_interval_;
+    }
+    generate_obs_incomplete_ = false;
     if (skip_tasks) {
       LOG_FIRST_N(ERROR, 10) << "EventAggregator is skipping Observation generation because the "
                                 "current day index is too small.";
     } else {
-      auto obs_status = aggregate_store_->GenerateObservations(yesterday_utc, yesterday_local_time);
+      GenerationBudget budget(generate_obs_max_observations_, generate_obs_max_duration_,
+                              steady_clock_.get());
+      auto obs_status =
+          aggregate_store_->GenerateObservations(yesterday_utc, yesterday_local_time, &budget);
       if (obs_status == kOK) {
+        // Persist the progress made so far, so that a restart resumes rather than repeats it.
         aggregate_store_->BackUpObservationHistory();
+        if (budget.exhausted()) {
+          VLOG(4) << "EventAggregator generated " << budget.num_observations()
+                  << " Observations and will resume generation on its next run.";
+          generate_obs_incomplete_ = true;
+        }
       } else {
         LOG(ERROR) << "GenerateObservations failed with status: " << obs_status;
       }
@@ -167,7 +205,10 @@ void EventAggregatorManager::TriggerBackups() {
 void EventAggregatorManager::Reset() {
   aggregate_store_ = std::make_unique<AggregateStore>(
       encoder_, observation_writer_, owned_local_aggregate_proto_store_.get(),
-      owned_obs_history_proto_store_.get(), backfill_days_);
+      owned_obs_history_proto_store_.get(), backfill_days_, owned_local_aggregate_index_file_.get(),
+      owned_obs_history_index_file_.get());
+  aggregate_store_->UsePackedObservations(use_packed_observations_);
+  aggregate_store_->SetComponentLimits(component_limits_);
 
   event_aggregator_ = std::make_unique<EventAggregator>(aggregate_store_.get());
   steady_clock_ = std::make_unique<SteadyClock>();
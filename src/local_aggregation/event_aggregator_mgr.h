@@ -44,7 +44,8 @@ namespace local_aggregation {
 // (1) Calls BackUp*() to back up the EventAggregator's state to the file system.
 // (2) Calls GenerateObservations() with the previous day's day index to generate all Observations
 // for rolling windows ending on that day index, as well as any missing Observations for a specified
-// number of days in the past.
+// number of days in the past. Each call is bounded by a GenerationBudget; if the budget runs out
+// (or the ObservationStore is almost full) generation resumes on the next run of the loop.
 // (3) Calls GarbageCollect() to delete daily aggregates which are not needed to compute aggregates
 // for any windows of interest in the future.
 class EventAggregatorManager {
@@ -100,6 +101,12 @@ class EventAggregatorManager {
   // only useful in testing to verify that the worker thread is not running too frequently.
   uint64_t num_runs() const { return num_runs_; }
 
+  // Returns the number of events and components which were not aggregated under their own
+  // component because of the ComponentLimits of the CobaltConfig.
+  ComponentLimitCounters component_limit_counters() const {
+    return aggregate_store_->GetComponentLimitCounters();
+  }
+
   void Disable(bool is_disabled) { aggregate_store_->Disable(is_disabled); }
   void DeleteData() {
     aggregate_store_->DeleteData();
@@ -129,8 +136,10 @@ class EventAggregatorManager {
   void Run(std::unique_ptr<util::SystemClockInterface> system_clock);
 
   // Helper method called by Run(). If |next_generate_obs_| is less than or equal to |steady_time|,
-  // calls AggregateStore::GenerateObservations() with the day index of the previous day from
-  // |system_time| in each of UTC and local time, and then backs up the history of generated
+  // or if the previous call did not generate all needed Observations, calls
+  // AggregateStore::GenerateObservations() with the day index of the previous day from
+  // |system_time| in each of UTC and local time and a budget of |generate_obs_max_observations_|
+  // Observations and |generate_obs_max_duration_|, and then backs up the history of generated
   // Observations. If |next_gc_| is less than or equal to |steady_time|, calls
   // AggregateStore::GarbageCollect() with the day index of the previous day from |system_time| in
   // each of UTC and local time and then backs up the LocalAggregateStore. In each case, an error is
@@ -164,10 +173,18 @@ class EventAggregatorManager {
   const logger::Encoder* encoder_;
   const logger::ObservationWriter* observation_writer_;
   size_t backfill_days_ = 0;
+  bool use_packed_observations_ = false;
+  ComponentLimits component_limits_;
   std::chrono::seconds aggregate_backup_interval_;
   std::chrono::seconds generate_obs_interval_;
   std::chrono::seconds gc_interval_;
 
+  size_t generate_obs_max_observations_;
+  std::chrono::steady_clock::duration generate_obs_max_duration_;
+  // True if the last call to GenerateObservations() ran out of budget before generating all needed
+  // Observations.
+  bool generate_obs_incomplete_ = false;
+
   std::chrono::steady_clock::time_point next_generate_obs_;
   std::chrono::steady_clock::time_point next_gc_;
   std::unique_ptr<util::SteadyClockInterface> steady_clock_;
@@ -175,11 +192,19 @@ class EventAggregatorManager {
   std::unique_ptr<AggregateStore> aggregate_store_;
   std::unique_ptr<util::ConsistentProtoStore> owned_local_aggregate_proto_store_;
   std::unique_ptr<util::ConsistentProtoStore> owned_obs_history_proto_store_;
+  // Null unless |use_indexed_local_aggregate_store| is set in the CobaltConfig.
+  std::unique_ptr<IndexedStoreFile> owned_local_aggregate_index_file_;
+  std::unique_ptr<IndexedStoreFile> owned_obs_history_index_file_;
   std::unique_ptr<EventAggregator> event_aggregator_;
 
   static const std::chrono::seconds kDefaultAggregateBackupInterval;
   static const std::chrono::seconds kDefaultGenerateObsInterval;
   static const std::chrono::seconds kDefaultGCInterval;
+  static const size_t kDefaultGenerateObsMaxObservations;
+  static const std::chrono::seconds kDefaultGenerateObsMaxDuration;
+
+  // The maximum number of lazily loaded reports which the worker thread decodes at a time.
+  static constexpr size_t kPrefetchBatchSize = 16;
 
   std::thread worker_thread_;
   util::ProtectedFields<WorkerThreadController> protected_worker_thread_controller_;
@@ -277,9 +277,9 @@ TEST_F(EventAggregatorManagerTest, UpdateAggregationConfigs) {
   event_aggregator_mgr->Start(GetTestSystemClock());
 
   // Provide the EventAggregator with the all_report_types registry.
-  auto project_context = GetTestProject(kCobaltRegistryBase64);
+  std::shared_ptr<ProjectContext> project_context = GetTestProject(kCobaltRegistryBase64);
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   // Check that the number of key-value pairs in the LocalAggregateStore is
   // now equal to the number of locally aggregated reports in the
   // all_report_types registry.
@@ -295,7 +295,7 @@ TEST_F(EventAggregatorManagerTest, LogEventsAfterDelete) {
   // Provide the EventAggregator with the all_report_types registry.
   std::shared_ptr<ProjectContext> project_context = GetTestProject(kCobaltRegistryBase64);
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, AddUniqueActivesEvent(event_aggregator_mgr.get(), project_context,
                                        kDeviceBootsMetricReportId, day_index, /*event_code*/ 0u));
@@ -332,7 +332,7 @@ TEST_F(EventAggregatorManagerTest, DeleteData) {
   // Provide the EventAggregator with the all_report_types registry.
   std::shared_ptr<ProjectContext> project_context = GetTestProject(kCobaltRegistryBase64);
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, AddUniqueActivesEvent(event_aggregator_mgr.get(), project_context,
                                        kDeviceBootsMetricReportId, day_index, /*event_code*/ 0u));
@@ -357,7 +357,7 @@ TEST_F(EventAggregatorManagerTest, Disable) {
   // Provide the EventAggregator with the all_report_types registry.
   std::shared_ptr<ProjectContext> project_context = GetTestProject(kCobaltRegistryBase64);
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   event_aggregator_mgr->Disable(true);
 
@@ -395,7 +395,7 @@ TEST_F(EventAggregatorManagerTest, LogEvents) {
   // Provide the EventAggregator with the all_report_types registry.
   std::shared_ptr<ProjectContext> project_context = GetTestProject(kCobaltRegistryBase64);
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
 
   EXPECT_EQ(kOK, AddUniqueActivesEvent(event_aggregator_mgr.get(), project_context,
                                        kDeviceBootsMetricReportId, day_index, /*event_code*/ 0u));
@@ -462,7 +462,7 @@ TEST_F(EventAggregatorManagerTest, Run) {
   TriggerAndWaitForDoScheduledTasks(event_aggregator_mgr.get());
 
   EXPECT_EQ(kOK,
-            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(*project_context));
+            event_aggregator_mgr->GetEventAggregator()->UpdateAggregationConfigs(project_context));
   EXPECT_EQ(kOK, AddUniqueActivesEvent(event_aggregator_mgr.get(), project_context, expected_id,
                                        day_index, /*event_code*/ 1));
   EXPECT_EQ(kOK, AddUniqueActivesEvent(event_aggregator_mgr.get(), project_context, expected_id,
@@ -149,6 +149,13 @@ class EventAggregatorTest : public util::testing::TestWithFiles {
     return event_aggregator_mgr_->aggregate_store_->CopyLocalAggregateStore();
   }
 
+  // Returns the aggregation type of the report with key |report_key|, as given by the live report
+  // definition which the AggregateStore resolved from the report's ProjectContext.
+  ReportDefinition::OnDeviceAggregationType GetAggregationType(const std::string& report_key) {
+    auto locked = event_aggregator_mgr_->aggregate_store_->protected_aggregate_store_.lock();
+    return locked->report_definitions.at(report_key).report->aggregation_type();
+  }
+
   void TriggerAndWaitForDoScheduledTasks() {
     {
       // Acquire the lock to manually trigger the scheduled tasks.
@@ -530,8 +537,7 @@ class EventAggregatorTest : public util::testing::TestWithFiles {
       if (report_aggregates->second.type_case() != ReportAggregates::kNumericAggregates) {
         return false;
       }
-      const auto& aggregation_type =
-          report_aggregates->second.aggregation_config().report().aggregation_type();
+      const auto aggregation_type = GetAggregationType(logged_key);
       // Compute the earliest day index that should appear among the aggregates
       // for this report.
       auto earliest_allowed =
@@ -698,7 +704,7 @@ class EventAggregatorTestWithProjectContext : public EventAggregatorTest {
 
   void SetUp() override {
     EventAggregatorTest::SetUp();
-    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context_);
+    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context_);
   }
 
   // Adds an EventOccurredEvent to the local aggregations for the MetricReportId of a locally
@@ -823,10 +829,10 @@ TEST_F(EventAggregatorTest, UpdateAggregationConfigs) {
   // Check that the LocalAggregateStore is empty.
   EXPECT_EQ(0u, CopyLocalAggregateStore().by_report_key().size());
   // Provide the unique_actives test registry to the EventAggregator.
-  auto unique_actives_project_context =
+  std::shared_ptr<ProjectContext> unique_actives_project_context =
       GetTestProject(logger::testing::unique_actives::kCobaltRegistryBase64);
   EXPECT_EQ(kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(
-                     *unique_actives_project_context));
+                     unique_actives_project_context));
   // Check that the number of key-value pairs in the LocalAggregateStore is
   // now equal to the number of locally aggregated reports in the unique_actives
   // test registry.
@@ -861,20 +867,20 @@ TEST_F(EventAggregatorTest, UpdateAggregationConfigs) {
 // existing report with the same ReportAggregationKey.
 TEST_F(EventAggregatorTest, UpdateAggregationConfigsWithSameKey) {
   // Provide the unique_actives test registry to the EventAggregator.
-  auto unique_actives_project_context =
+  std::shared_ptr<ProjectContext> unique_actives_project_context =
       GetTestProject(logger::testing::unique_actives::kCobaltRegistryBase64);
   EXPECT_EQ(kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(
-                     *unique_actives_project_context));
+                     unique_actives_project_context));
   // Check that the number of key-value pairs in the LocalAggregateStore is
   // now equal to the number of locally aggregated reports in the unique_actives
   // test registry.
   EXPECT_EQ(logger::testing::unique_actives::kExpectedAggregationParams.metric_report_ids.size(),
             CopyLocalAggregateStore().by_report_key().size());
   // Provide the unique_actives_noise_free test registry to the EventAggregator.
-  auto unique_actives_noise_free_project_context =
+  std::shared_ptr<ProjectContext> unique_actives_noise_free_project_context =
       GetTestProject(logger::testing::unique_actives_noise_free::kCobaltRegistryBase64);
   EXPECT_EQ(kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(
-                     *unique_actives_noise_free_project_context));
+                     unique_actives_noise_free_project_context));
   // Check that the number of key-value pairs in the LocalAggregateStore is
   // now equal to the number of distinct MetricReportIds of locally
   // aggregated reports in the union of the unique_actives and
@@ -918,7 +924,7 @@ TEST_F(EventAggregatorTest, LogBadEvents) {
   std::shared_ptr<ProjectContext> unique_actives_project_context =
       GetTestProject(logger::testing::unique_actives::kCobaltRegistryBase64);
   EXPECT_EQ(kOK, event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(
-                     *unique_actives_project_context));
+                     unique_actives_project_context));
   // Attempt to log a UniqueActivesEvent for
   // |kEventsOccurredMetricReportId|, which is not in the unique_actives
   // registry. Check that the result is |kInvalidArguments|.
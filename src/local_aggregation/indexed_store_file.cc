@@ -0,0 +1,116 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/local_aggregation/indexed_store_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "src/lib/statusor/status_macros.h"
+#include "src/local_aggregation/local_aggregation.pb.h"
+
+namespace cobalt::local_aggregation {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using lib::statusor::StatusOr;
+using util::Status;
+using util::StatusCode;
+
+namespace {
+
+constexpr char kTmpSuffix[] = ".tmp";
+
+// Identifies a file as an IndexedStoreFile, and the layout of the file.
+constexpr char kMagic[] = "CBTIDX01";
+constexpr size_t kMagicSize = sizeof(kMagic) - 1;
+// The size of the magic string and of the little-endian header size which follows it.
+constexpr size_t kPrefixSize = kMagicSize + sizeof(uint64_t);
+
+}  // namespace
+
+IndexedStoreFile::IndexedStoreFile(std::string path, util::FileSystem* fs)
+    : path_(std::move(path)), tmp_path_(path_ + kTmpSuffix), fs_(fs) {}
+
+StatusOr<std::shared_ptr<const IndexedStoreMapping>> IndexedStoreFile::Map() const {
+  CB_ASSIGN_OR_RETURN(auto file, fs_->MapFile(path_));
+  std::string_view data = file->data();
+  size_t size = data.size();
+  if (size < kPrefixSize) {
+    return Status(StatusCode::INVALID_ARGUMENT, "`" + path_ + "` is too small.");
+  }
+  std::shared_ptr<IndexedStoreMapping> mapping(new IndexedStoreMapping(std::move(file)));
+
+  const auto* bytes = reinterpret_cast<const uint8_t*>(data.data());
+  if (memcmp(bytes, kMagic, kMagicSize) != 0) {
+    return Status(StatusCode::INVALID_ARGUMENT, "`" + path_ + "` is not an IndexedStoreFile.");
+  }
+  uint64_t header_size;
+  CodedInputStream::ReadLittleEndian64FromArray(bytes + kMagicSize, &header_size);
+  if (header_size > size - kPrefixSize) {
+    return Status(StatusCode::INVALID_ARGUMENT, "The header of `" + path_ + "` is truncated.");
+  }
+  IndexedStoreHeader header;
+  if (!header.ParseFromArray(bytes + kPrefixSize, static_cast<int>(header_size))) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Unable to parse the header of `" + path_ + "`.");
+  }
+
+  const auto* payloads = reinterpret_cast<const char*>(bytes + kPrefixSize + header_size);
+  size_t payloads_size = size - kPrefixSize - header_size;
+  for (const auto& entry : header.entries()) {
+    if (entry.offset() > payloads_size || entry.size() > payloads_size - entry.offset()) {
+      return Status(StatusCode::INVALID_ARGUMENT, "`" + path_ + "` is truncated.");
+    }
+    mapping->reports_.emplace(entry.report_key(),
+                              std::string_view(payloads + entry.offset(), entry.size()));
+  }
+  mapping->version_ = header.version();
+  return std::shared_ptr<const IndexedStoreMapping>(std::move(mapping));
+}
+
+Status IndexedStoreFile::Write(uint32_t version,
+                               const std::map<std::string, std::string_view>& reports) {
+  IndexedStoreHeader header;
+  header.set_version(version);
+  uint64_t offset = 0;
+  for (const auto& [report_key, payload] : reports) {
+    auto entry = header.add_entries();
+    entry->set_report_key(report_key);
+    entry->set_offset(offset);
+    entry->set_size(payload.size());
+    offset += payload.size();
+  }
+  std::string serialized_header;
+  header.SerializeToString(&serialized_header);
+
+  {
+    CB_ASSIGN_OR_RETURN(auto outstream, fs_->NewProtoOutputStream(tmp_path_));
+    CodedOutputStream out(outstream.get());
+    out.WriteRaw(kMagic, kMagicSize);
+    out.WriteLittleEndian64(serialized_header.size());
+    out.WriteString(serialized_header);
+    for (const auto& [report_key, payload] : reports) {
+      out.WriteRaw(payload.data(), static_cast<int>(payload.size()));
+    }
+    out.Trim();
+    if (out.HadError()) {
+      return Status(StatusCode::DATA_LOSS, "Unable to write to `" + tmp_path_ + "`.");
+    }
+  }
+
+  // Without a sync, a crash shortly after the rename could leave |path_| empty or truncated.
+  if (!fs_->SyncFile(tmp_path_)) {
+    return Status(StatusCode::DATA_LOSS, "Unable to sync `" + tmp_path_ + "`.");
+  }
+  if (!fs_->Rename(tmp_path_, path_)) {
+    return Status(StatusCode::DATA_LOSS, "Unable to rename `" + tmp_path_ + "` => `" + path_ + "`.",
+                  strerror(errno));
+  }
+  return Status::OK;
+}
+
+}  // namespace cobalt::local_aggregation
@@ -0,0 +1,153 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_LOCAL_AGGREGATION_INDEXED_STORE_FILE_H_
+#define COBALT_SRC_LOCAL_AGGREGATION_INDEXED_STORE_FILE_H_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "src/lib/statusor/statusor.h"
+#include "src/lib/util/file_system.h"
+#include "src/lib/util/status.h"
+#include "src/logging.h"
+
+namespace cobalt::local_aggregation {
+
+// A read-only memory mapping of an IndexedStoreFile, made with FileSystem::MapFile().
+//
+// The report payloads returned by reports() point into the mapping, and remain valid for the
+// lifetime of the IndexedStoreMapping.
+class IndexedStoreMapping {
+ public:
+  IndexedStoreMapping(const IndexedStoreMapping&) = delete;
+  IndexedStoreMapping& operator=(const IndexedStoreMapping&) = delete;
+
+  // The version number of the snapshotted store.
+  [[nodiscard]] uint32_t version() const { return version_; }
+
+  // The serialized report payloads of the snapshotted store, keyed by report key.
+  [[nodiscard]] const std::map<std::string, std::string_view>& reports() const { return reports_; }
+
+ private:
+  friend class IndexedStoreFile;
+
+  explicit IndexedStoreMapping(std::unique_ptr<util::FileSystem::MappedFile> file)
+      : file_(std::move(file)) {}
+
+  std::unique_ptr<util::FileSystem::MappedFile> file_;
+  uint32_t version_ = 0;
+  std::map<std::string, std::string_view> reports_;
+};
+
+// An IndexedStoreFile holds a snapshot of a LocalAggregateStore or an
+// AggregatedObservationHistoryStore in a format that can be loaded without decoding it.
+//
+// The file consists of an 8-byte magic string, the size of the header as a little-endian 64-bit
+// integer, a serialized IndexedStoreHeader, and the serialized ReportAggregates (resp.
+// AggregatedObservationHistory) of each report at the offsets listed in the header. Loading the
+// file only maps it into memory and parses the header; each report can then be decoded the first
+// time it is needed.
+//
+// Writes go to a temporary file which is synced and then renamed over |path|, so a reader always
+// sees either the previous or the new snapshot, even after a crash. Existing mappings remain valid
+// after a Write.
+class IndexedStoreFile {
+ public:
+  IndexedStoreFile(std::string path, util::FileSystem* fs);
+
+  // Maps the file into memory and parses its header, without decoding any of the report payloads.
+  //
+  // Returns NOT_FOUND if there is no file at |path|, and INVALID_ARGUMENT if the file is not a
+  // well-formed IndexedStoreFile.
+  [[nodiscard]] lib::statusor::StatusOr<std::shared_ptr<const IndexedStoreMapping>> Map() const;
+
+  // Replaces the contents of the file with a snapshot of a store at version |version| whose
+  // serialized reports are |reports|, keyed by report key.
+  util::Status Write(uint32_t version, const std::map<std::string, std::string_view>& reports);
+
+  [[nodiscard]] const std::string& path() const { return path_; }
+
+ private:
+  const std::string path_;
+  const std::string tmp_path_;
+  util::FileSystem* fs_;  // not owned
+};
+
+// The reports of a store loaded from an IndexedStoreFile which have not been decoded yet.
+struct PendingReports {
+  // Keeps the memory referenced by |payloads| mapped.
+  std::shared_ptr<const IndexedStoreMapping> mapping;
+  // The serialized reports which have not been decoded yet, keyed by report key.
+  std::map<std::string, std::string_view> payloads;
+};
+
+// Registers the reports of |mapping| as pending in |pending|, and resets |store| to an empty store
+// with the version of the snapshot. |StoreProto| is LocalAggregateStore or
+// AggregatedObservationHistoryStore.
+template <class StoreProto>
+void LoadPendingReports(std::shared_ptr<const IndexedStoreMapping> mapping, StoreProto* store,
+                        PendingReports* pending) {
+  store->Clear();
+  store->set_version(mapping->version());
+  pending->payloads = mapping->reports();
+  pending->mapping = pending->payloads.empty() ? nullptr : std::move(mapping);
+}
+
+// If the report with key |report_key| is pending in |pending|, decodes it into
+// |store->by_report_key()| and removes it from |pending|. A report whose payload fails to parse is
+// dropped. Returns false if a payload failed to parse, and true otherwise.
+template <class StoreProto>
+bool MaterializeReport(const std::string& report_key, PendingReports* pending, StoreProto* store) {
+  auto payload = pending->payloads.find(report_key);
+  if (payload == pending->payloads.end()) {
+    return true;
+  }
+  auto& report = (*store->mutable_by_report_key())[report_key];
+  bool parsed =
+      report.ParseFromArray(payload->second.data(), static_cast<int>(payload->second.size()));
+  if (!parsed) {
+    LOG(ERROR) << "Failed to parse a lazily loaded report. Dropping its data.";
+    store->mutable_by_report_key()->erase(report_key);
+  }
+  pending->payloads.erase(payload);
+  if (pending->payloads.empty()) {
+    pending->mapping.reset();
+  }
+  return parsed;
+}
+
+// Decodes all of the reports which are pending in |pending| into |store|. Returns false if any
+// payload failed to parse.
+template <class StoreProto>
+bool MaterializeAllReports(PendingReports* pending, StoreProto* store) {
+  bool parsed = true;
+  while (!pending->payloads.empty()) {
+    std::string report_key = pending->payloads.begin()->first;
+    parsed &= MaterializeReport(report_key, pending, store);
+  }
+  return parsed;
+}
+
+// Writes a snapshot of |store| to |file|. The decoded reports of |store| are serialized, while the
+// reports which are still pending in |pending| are copied to the file without being decoded.
+template <class StoreProto>
+util::Status WriteIndexedStore(const StoreProto& store, const PendingReports& pending,
+                               IndexedStoreFile* file) {
+  std::map<std::string, std::string> serialized;
+  std::map<std::string, std::string_view> reports = pending.payloads;
+  for (const auto& [report_key, report] : store.by_report_key()) {
+    std::string& serialized_report = serialized[report_key];
+    report.SerializeToString(&serialized_report);
+    reports[report_key] = serialized_report;
+  }
+  return file->Write(store.version(), reports);
+}
+
+}  // namespace cobalt::local_aggregation
+
+#endif  // COBALT_SRC_LOCAL_AGGREGATION_INDEXED_STORE_FILE_H_
@@ -0,0 +1,238 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/local_aggregation/indexed_store_file.h"
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "src/lib/util/consistent_proto_store.h"
+#include "src/lib/util/posix_file_system.h"
+#include "src/lib/util/testing/test_with_files.h"
+#include "src/local_aggregation/local_aggregation.pb.h"
+#include "src/logging.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::local_aggregation {
+
+namespace {
+
+constexpr uint32_t kVersion = 2;
+
+// Map fields make SerializeAsString() order-dependent, so messages are compared in the
+// deterministic serialization.
+template <typename T>
+std::string SerializeAsStringDeterministic(const T& message) {
+  std::string s;
+  {
+    google::protobuf::io::StringOutputStream output(&s);
+    google::protobuf::io::CodedOutputStream out(&output);
+    out.SetSerializationDeterministic(true);
+    message.SerializePartialToCodedStream(&out);
+  }
+  return s;
+}
+
+// Returns a ReportAggregates for a UNIQUE_N_DAY_ACTIVES report in which the device was active for
+// each of |num_event_codes| event codes on each of |num_days| days.
+ReportAggregates MakeUniqueActivesAggregates(uint32_t num_event_codes, uint32_t num_days) {
+  ReportAggregates aggregates;
+  auto by_event_code = aggregates.mutable_unique_actives_aggregates()->mutable_by_event_code();
+  for (uint32_t event_code = 0; event_code < num_event_codes; event_code++) {
+    auto by_day_index = (*by_event_code)[event_code].mutable_by_day_index();
+    for (uint32_t day_index = 0; day_index < num_days; day_index++) {
+      (*by_day_index)[day_index].mutable_activity_daily_aggregate()->set_activity_indicator(true);
+    }
+  }
+  return aggregates;
+}
+
+// Returns a LocalAggregateStore whose serialized size is at least |min_bytes|.
+LocalAggregateStore MakeStoreOfSize(size_t min_bytes) {
+  LocalAggregateStore store;
+  store.set_version(kVersion);
+  auto report = MakeUniqueActivesAggregates(/*num_event_codes=*/10, /*num_days=*/365);
+  size_t num_reports = min_bytes / report.ByteSizeLong() + 1;
+  for (size_t i = 0; i < num_reports; i++) {
+    (*store.mutable_by_report_key())["report_" + std::to_string(i)] = report;
+  }
+  return store;
+}
+
+// A FileSystem which maps files with the default implementation of FileSystem::MapFile(), and whose
+// SyncFile() can be made to fail.
+class ReadingFileSystem : public util::PosixFileSystem {
+ public:
+  lib::statusor::StatusOr<std::unique_ptr<MappedFile>> MapFile(const std::string& file) override {
+    num_maps++;
+    return FileSystem::MapFile(file);
+  }
+
+  bool SyncFile(const std::string& file) override {
+    return fail_sync ? false : PosixFileSystem::SyncFile(file);
+  }
+
+  int num_maps = 0;
+  bool fail_sync = false;
+};
+
+template <class Duration>
+int64_t ToMicroseconds(Duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+}  // namespace
+
+class IndexedStoreFileTest : public util::testing::TestWithFiles {
+ protected:
+  std::string index_path() { return test_folder() + "/indexed_store"; }
+};
+
+TEST_F(IndexedStoreFileTest, MapMissingFile) {
+  IndexedStoreFile file(index_path(), fs());
+  EXPECT_EQ(util::StatusCode::NOT_FOUND, file.Map().status().error_code());
+}
+
+TEST_F(IndexedStoreFileTest, MapCorruptFile) {
+  {
+    std::ofstream out(index_path());
+    out << "This is not an IndexedStoreFile";
+  }
+  IndexedStoreFile file(index_path(), fs());
+  EXPECT_EQ(util::StatusCode::INVALID_ARGUMENT, file.Map().status().error_code());
+}
+
+TEST_F(IndexedStoreFileTest, WriteAndMap) {
+  IndexedStoreFile file(index_path(), fs());
+  ASSERT_TRUE(file.Write(kVersion, {{"key_a", "payload_a"}, {"key_b", ""}}).ok());
+
+  auto mapping_or = file.Map();
+  ASSERT_TRUE(mapping_or.ok());
+  auto mapping = mapping_or.ConsumeValueOrDie();
+  EXPECT_EQ(kVersion, mapping->version());
+  std::map<std::string, std::string_view> expected = {{"key_a", "payload_a"}, {"key_b", ""}};
+  EXPECT_EQ(expected, mapping->reports());
+}
+
+// A mapping remains valid after the file is overwritten.
+TEST_F(IndexedStoreFileTest, MappingOutlivesWrite) {
+  IndexedStoreFile file(index_path(), fs());
+  ASSERT_TRUE(file.Write(kVersion, {{"key", "old"}}).ok());
+  auto old_mapping = file.Map().ConsumeValueOrDie();
+  ASSERT_TRUE(file.Write(kVersion, {{"key", "new"}}).ok());
+
+  EXPECT_EQ("old", old_mapping->reports().at("key"));
+  EXPECT_EQ("new", file.Map().ConsumeValueOrDie()->reports().at("key"));
+}
+
+// The file is read through the FileSystem, which need not support memory mapping.
+TEST_F(IndexedStoreFileTest, MapThroughFileSystem) {
+  ReadingFileSystem reading_fs;
+  IndexedStoreFile file(index_path(), &reading_fs);
+  EXPECT_EQ(util::StatusCode::NOT_FOUND, file.Map().status().error_code());
+  ASSERT_TRUE(file.Write(kVersion, {{"key_a", "payload_a"}, {"key_b", ""}}).ok());
+
+  auto mapping_or = file.Map();
+  ASSERT_TRUE(mapping_or.ok());
+  std::map<std::string, std::string_view> expected = {{"key_a", "payload_a"}, {"key_b", ""}};
+  EXPECT_EQ(expected, mapping_or.ValueOrDie()->reports());
+  EXPECT_EQ(2, reading_fs.num_maps);
+}
+
+// If the new snapshot cannot be synced, it does not replace the previous one.
+TEST_F(IndexedStoreFileTest, WriteFailsIfSyncFails) {
+  ReadingFileSystem reading_fs;
+  IndexedStoreFile file(index_path(), &reading_fs);
+  ASSERT_TRUE(file.Write(kVersion, {{"key", "old"}}).ok());
+  reading_fs.fail_sync = true;
+  EXPECT_FALSE(file.Write(kVersion, {{"key", "new"}}).ok());
+  EXPECT_EQ("old", file.Map().ConsumeValueOrDie()->reports().at("key"));
+}
+
+// Reports are decoded on demand, and pending reports are written back without being decoded.
+TEST_F(IndexedStoreFileTest, LazyRoundTrip) {
+  LocalAggregateStore store;
+  store.set_version(kVersion);
+  (*store.mutable_by_report_key())["key_a"] = MakeUniqueActivesAggregates(2, 3);
+  (*store.mutable_by_report_key())["key_b"] = MakeUniqueActivesAggregates(3, 2);
+  IndexedStoreFile file(index_path(), fs());
+  ASSERT_TRUE(WriteIndexedStore(store, PendingReports(), &file).ok());
+
+  LocalAggregateStore loaded;
+  PendingReports pending;
+  LoadPendingReports(file.Map().ConsumeValueOrDie(), &loaded, &pending);
+  EXPECT_EQ(kVersion, loaded.version());
+  EXPECT_EQ(0u, loaded.by_report_key().size());
+  EXPECT_EQ(2u, pending.payloads.size());
+
+  EXPECT_TRUE(MaterializeReport("key_a", &pending, &loaded));
+  EXPECT_EQ(1u, loaded.by_report_key().size());
+  EXPECT_EQ(1u, pending.payloads.size());
+  EXPECT_NE(nullptr, pending.mapping);
+
+  ASSERT_TRUE(WriteIndexedStore(loaded, pending, &file).ok());
+  LocalAggregateStore reloaded;
+  PendingReports reloaded_pending;
+  LoadPendingReports(file.Map().ConsumeValueOrDie(), &reloaded, &reloaded_pending);
+  EXPECT_TRUE(MaterializeAllReports(&reloaded_pending, &reloaded));
+  EXPECT_TRUE(reloaded_pending.payloads.empty());
+  EXPECT_EQ(nullptr, reloaded_pending.mapping);
+  EXPECT_EQ(SerializeAsStringDeterministic(store), SerializeAsStringDeterministic(reloaded));
+}
+
+TEST_F(IndexedStoreFileTest, MaterializeCorruptReport) {
+  IndexedStoreFile file(index_path(), fs());
+  ASSERT_TRUE(file.Write(kVersion, {{"key", "\xff\xff\xff"}}).ok());
+
+  LocalAggregateStore loaded;
+  PendingReports pending;
+  LoadPendingReports(file.Map().ConsumeValueOrDie(), &loaded, &pending);
+  EXPECT_FALSE(MaterializeReport("key", &pending, &loaded));
+  EXPECT_EQ(0u, loaded.by_report_key().size());
+  EXPECT_TRUE(pending.payloads.empty());
+}
+
+// Compares the time taken to load LocalAggregateStores of 1 MB, 10 MB and 50 MB from a
+// ConsistentProtoStore with the time taken to map them from an IndexedStoreFile and to decode all
+// of their reports afterwards. Run with --gtest_also_run_disabled_tests.
+TEST_F(IndexedStoreFileTest, DISABLED_StartupTime) {
+  for (size_t megabytes : {1, 10, 50}) {
+    LocalAggregateStore store = MakeStoreOfSize(megabytes * 1024 * 1024);
+    util::ConsistentProtoStore proto_store(test_folder() + "/proto_store", fs());
+    ASSERT_TRUE(proto_store.Write(store).ok());
+    IndexedStoreFile file(index_path(), fs());
+    ASSERT_TRUE(WriteIndexedStore(store, PendingReports(), &file).ok());
+
+    auto start = std::chrono::steady_clock::now();
+    LocalAggregateStore read_store;
+    ASSERT_TRUE(proto_store.Read(&read_store).ok());
+    auto read_time = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    LocalAggregateStore mapped_store;
+    PendingReports pending;
+    auto mapping_or = file.Map();
+    ASSERT_TRUE(mapping_or.ok());
+    LoadPendingReports(mapping_or.ConsumeValueOrDie(), &mapped_store, &pending);
+    auto map_time = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(MaterializeAllReports(&pending, &mapped_store));
+    auto materialize_time = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(read_store.by_report_key_size(), mapped_store.by_report_key_size());
+    LOG(INFO) << megabytes << " MB store with " << store.by_report_key_size()
+              << " reports: ConsistentProtoStore::Read took " << ToMicroseconds(read_time)
+              << " us, IndexedStoreFile::Map took " << ToMicroseconds(map_time)
+              << " us, decoding all reports took " << ToMicroseconds(materialize_time) << " us.";
+  }
+}
+
+}  // namespace cobalt::local_aggregation
@@ -6,6 +6,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "src/algorithms/rappor/rappor_config_helper.h"
 #include "src/algorithms/rappor/rappor_encoder.h"
@@ -172,6 +173,41 @@ Encoder::Result Encoder::EncodeUniqueActivesObservation(
   return result;
 }
 
+Encoder::Result Encoder::EncodePackedUniqueActivesObservation(
+    MetricRef metric, const ReportDefinition* report, uint32_t day_index,
+    const std::vector<uint32_t>& event_codes, const std::vector<bool>& was_active,
+    const OnDeviceAggregationWindow& aggregation_window) const {
+  TRACE_DURATION("cobalt_core", "Encoder::EncodePackedUniqueActivesObservation");
+
+  auto result = MakeObservation(metric, report, day_index);
+  if (event_codes.empty() || event_codes.size() != was_active.size()) {
+    LOG(ERROR) << "Expected one activity indicator for each of at least one event codes for: "
+               << "Report " << report->report_name() << " for metric " << metric.metric_name()
+               << " in project " << metric.ProjectDebugString() << ".";
+    result.status = kInvalidArguments;
+    return result;
+  }
+  auto* packed_observation = result.observation->mutable_packed_unique_actives();
+  *packed_observation->mutable_aggregation_window() = aggregation_window;
+  for (auto event_code : event_codes) {
+    packed_observation->add_event_codes(event_code);
+  }
+
+  rappor::BasicRapporConfig basic_rappor_config;
+  basic_rappor_config.prob_rr = RapporConfigHelper::kProbRR;
+  basic_rappor_config.categories.set_indexed(static_cast<uint32_t>(event_codes.size()));
+  float prob_bit_flip = RapporConfigHelper::ProbBitFlip(*report, metric.FullyQualifiedName());
+  basic_rappor_config.prob_0_becomes_1 = prob_bit_flip;
+  basic_rappor_config.prob_1_stays_1 = 1.0f - prob_bit_flip;
+
+  BasicRapporEncoder basic_rappor_encoder(basic_rappor_config, client_secret_);
+  result.status = TranslateBasicRapporEncoderStatus(
+      metric, report,
+      basic_rappor_encoder.EncodeIndicators(was_active,
+                                            packed_observation->mutable_basic_rappor_obs()));
+  return result;
+}
+
 Encoder::Result Encoder::EncodePerDeviceNumericObservation(
     MetricRef metric, const ReportDefinition* report, uint32_t day_index,
     const std::string& component, const RepeatedField<uint32_t>& event_codes, int64_t value,
@@ -185,6 +221,37 @@ Encoder::Result Encoder::EncodePerDeviceNumericObservation(
   return result;
 }
 
+Encoder::Result Encoder::EncodePackedPerDeviceNumericObservation(
+    MetricRef metric, const ReportDefinition* report, uint32_t day_index,
+    const std::vector<PerDeviceNumericValue>& values,
+    const OnDeviceAggregationWindow& aggregation_window) const {
+  TRACE_DURATION("cobalt_core", "Encoder::EncodePackedPerDeviceNumericObservation");
+
+  auto result = MakeObservation(metric, report, day_index);
+  if (values.empty()) {
+    LOG(ERROR) << "Expected at least one value for: Report " << report->report_name()
+               << " for metric " << metric.metric_name() << " in project "
+               << metric.ProjectDebugString() << ".";
+    result.status = kInvalidArguments;
+    return result;
+  }
+  auto* packed_observation = result.observation->mutable_packed_per_device_numeric();
+  *packed_observation->mutable_aggregation_window() = aggregation_window;
+  for (const auto& value : values) {
+    auto* integer_event_observation = packed_observation->add_integer_event_obs();
+    integer_event_observation->set_event_code(config::PackEventCodes(value.event_codes));
+    if (!HashComponentNameIfNotEmpty(value.component,
+                                     integer_event_observation->mutable_component_name_hash())) {
+      LOG(ERROR) << "Hashing the component name failed for: Report " << report->report_name()
+                 << " for metric " << metric.metric_name() << " in project "
+                 << metric.ProjectDebugString() << ".";
+      result.status = kOther;
+    }
+    integer_event_observation->set_value(value.value);
+  }
+  return result;
+}
+
 Encoder::Result Encoder::EncodePerDeviceHistogramObservation(
     MetricRef metric, const ReportDefinition* report, uint32_t day_index,
     const std::string& component, const RepeatedField<uint32_t>& event_codes, int64_t value,
@@ -236,6 +236,27 @@ class Encoder {
                                         uint32_t day_index, uint32_t event_code, bool was_active,
                                         const OnDeviceAggregationWindow& aggregation_window) const;
 
+  // Encodes an Observation of type PackedUniqueActivesObservation, which
+  // carries the activity indicators of several event codes for the same day
+  // and aggregation window.
+  //
+  // metric, report, day_index, aggregation_window: As for
+  // EncodeUniqueActivesObservation().
+  //
+  // event_codes: The event codes represented by the Observation.
+  //
+  // was_active: The activity indicators of the event codes, in the order of
+  // |event_codes|. Each indicator is encoded as one bit of a
+  // BasicRapporObservation, with the same noise as the single bit encoded by
+  // EncodeUniqueActivesObservation().
+  //
+  // Returns kInvalidArguments if |event_codes| is empty or if the sizes of
+  // |event_codes| and |was_active| differ.
+  Result EncodePackedUniqueActivesObservation(
+      MetricRef metric, const ReportDefinition* report, uint32_t day_index,
+      const std::vector<uint32_t>& event_codes, const std::vector<bool>& was_active,
+      const OnDeviceAggregationWindow& aggregation_window) const;
+
   // Encodes an Observation of type PerDeviceNumericObservation.
   //
   // metric: Provides access to the names and IDs of the customer, project and
@@ -266,6 +287,30 @@ class Encoder {
       const std::string& component, const google::protobuf::RepeatedField<uint32_t>& event_codes,
       int64_t value, const OnDeviceAggregationWindow& aggregation_window) const;
 
+  // The aggregated value of a single pair (component, event codes), to be
+  // encoded by EncodePackedPerDeviceNumericObservation().
+  struct PerDeviceNumericValue {
+    std::string component;
+    google::protobuf::RepeatedField<uint32_t> event_codes;
+    int64_t value;
+  };
+
+  // Encodes an Observation of type PackedPerDeviceNumericObservation, which
+  // carries the aggregated values of several pairs (component, event codes) for
+  // the same day and aggregation window.
+  //
+  // metric, report, day_index, aggregation_window: As for
+  // EncodePerDeviceNumericObservation().
+  //
+  // values: Each element populates one IntegerEventObservation of the
+  // PackedPerDeviceNumericObservation, in the same way as the
+  // |component|, |event_codes| and |value| arguments of
+  // EncodePerDeviceNumericObservation(). Must not be empty.
+  Result EncodePackedPerDeviceNumericObservation(
+      MetricRef metric, const ReportDefinition* report, uint32_t day_index,
+      const std::vector<PerDeviceNumericValue>& values,
+      const OnDeviceAggregationWindow& aggregation_window) const;
+
   // Encodes an Observation of type PerDeviceNumericHistogramObservation.
   //
   // metric: Provides access to the names and IDs of the customer, project and
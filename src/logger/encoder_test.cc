@@ -336,6 +336,45 @@ TEST_F(EncoderTest, EncodeUniqueActivesObservation) {
   EXPECT_EQ(1u, inactive_obs.basic_rappor_obs().data().size());
 }
 
+TEST_F(EncoderTest, EncodePackedUniqueActivesObservation) {
+  const char kMetricName[] = "DeviceBoots";
+  const char kReportName[] = "DeviceBoots_UniqueDevices";
+  const uint32_t kExpectedMetricId = 9;
+  const std::vector<uint32_t> kEventCodes = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  auto pair = GetMetricAndReport(kMetricName, kReportName);
+
+  // Encode a valid PackedUniqueActivesObservation for 9 event codes for a 7-day window.
+  auto result = encoder_->EncodePackedUniqueActivesObservation(
+      project_context_->RefMetric(pair.first), pair.second, kDayIndex, kEventCodes,
+      {true, false, false, true, false, false, false, false, true},
+      MakeDayWindow(kAggregationDays));
+  CheckResult(result, kExpectedMetricId, kDeviceBootsDeviceBootsUniqueDevicesReportId, kDayIndex);
+  // In the SystemProfile only the OS and ARCH should be set.
+  CheckSystemProfile(result, SystemProfile::FUCHSIA, SystemProfile::ARM_64, "", "");
+  ASSERT_TRUE(result.observation->has_packed_unique_actives());
+  const auto& packed_obs = result.observation->packed_unique_actives();
+  ASSERT_EQ(OnDeviceAggregationWindow::kDays, packed_obs.aggregation_window().units_case());
+  EXPECT_EQ(kAggregationDays, packed_obs.aggregation_window().days());
+  ASSERT_EQ(kEventCodes.size(), static_cast<size_t>(packed_obs.event_codes_size()));
+  for (size_t i = 0; i < kEventCodes.size(); i++) {
+    EXPECT_EQ(kEventCodes[i], packed_obs.event_codes(static_cast<int>(i)));
+  }
+  // One bit per event code.
+  ASSERT_TRUE(packed_obs.has_basic_rappor_obs());
+  EXPECT_EQ(2u, packed_obs.basic_rappor_obs().data().size());
+
+  // The number of activity indicators must match the number of event codes.
+  auto result_mismatched = encoder_->EncodePackedUniqueActivesObservation(
+      project_context_->RefMetric(pair.first), pair.second, kDayIndex, kEventCodes, {true, false},
+      MakeDayWindow(kAggregationDays));
+  EXPECT_EQ(kInvalidArguments, result_mismatched.status);
+
+  auto result_empty = encoder_->EncodePackedUniqueActivesObservation(
+      project_context_->RefMetric(pair.first), pair.second, kDayIndex, {}, {},
+      MakeDayWindow(kAggregationDays));
+  EXPECT_EQ(kInvalidArguments, result_empty.status);
+}
+
 TEST_F(EncoderTest, EncodePerDeviceNumericObservation) {
   const char kMetricName[] = "ConnectionFailures";
   const char kReportName[] = "ConnectionFailures_PerDeviceCount";
@@ -367,6 +406,45 @@ TEST_F(EncoderTest, EncodePerDeviceNumericObservation) {
   EXPECT_EQ(kCount, integer_obs.value());
 }
 
+TEST_F(EncoderTest, EncodePackedPerDeviceNumericObservation) {
+  const char kMetricName[] = "ConnectionFailures";
+  const char kReportName[] = "ConnectionFailures_PerDeviceCount";
+  const uint32_t kExpectedMetricId = 10;
+  auto pair = GetMetricAndReport(kMetricName, kReportName);
+
+  std::vector<Encoder::PerDeviceNumericValue> values(2);
+  values[0].component = "Some Component";
+  *values[0].event_codes.Add() = 0;
+  values[0].value = 1728;
+  values[1].component = "";
+  *values[1].event_codes.Add() = 1;
+  values[1].value = 42;
+
+  auto result = encoder_->EncodePackedPerDeviceNumericObservation(
+      project_context_->RefMetric(pair.first), pair.second, kDayIndex, values,
+      MakeDayWindow(kAggregationDays));
+  CheckResult(result, kExpectedMetricId,
+              kConnectionFailuresConnectionFailuresPerDeviceCountReportId, kDayIndex);
+  // In the SystemProfile only the OS and ARCH should be set.
+  CheckSystemProfile(result, SystemProfile::FUCHSIA, SystemProfile::ARM_64, "", "");
+  ASSERT_TRUE(result.observation->has_packed_per_device_numeric());
+  const auto& packed_obs = result.observation->packed_per_device_numeric();
+  ASSERT_EQ(OnDeviceAggregationWindow::kDays, packed_obs.aggregation_window().units_case());
+  EXPECT_EQ(kAggregationDays, packed_obs.aggregation_window().days());
+  ASSERT_EQ(2, packed_obs.integer_event_obs_size());
+  EXPECT_EQ(0u, packed_obs.integer_event_obs(0).event_code());
+  EXPECT_EQ(32u, packed_obs.integer_event_obs(0).component_name_hash().size());
+  EXPECT_EQ(1728, packed_obs.integer_event_obs(0).value());
+  EXPECT_EQ(1u, packed_obs.integer_event_obs(1).event_code());
+  EXPECT_TRUE(packed_obs.integer_event_obs(1).component_name_hash().empty());
+  EXPECT_EQ(42, packed_obs.integer_event_obs(1).value());
+
+  auto result_empty = encoder_->EncodePackedPerDeviceNumericObservation(
+      project_context_->RefMetric(pair.first), pair.second, kDayIndex, {},
+      MakeDayWindow(kAggregationDays));
+  EXPECT_EQ(kInvalidArguments, result_empty.status);
+}
+
 TEST_F(EncoderTest, EncodePerDeviceNumericHistogramObservation) {
   const char kMetricName[] = "ConnectionFailures";
   const char kReportName[] = "ConnectionFailures_PerDeviceHistogram";
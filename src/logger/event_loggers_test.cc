@@ -102,7 +102,7 @@ class EventLoggersTest : public util::testing::TestWithFiles {
     mock_clock_ = std::make_unique<IncrementingSystemClock>(std::chrono::system_clock::duration(0));
     mock_clock_->set_time(std::chrono::system_clock::time_point(std::chrono::seconds(kYear)));
     project_context_ = GetTestProject(registry_base64);
-    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context_);
+    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context_);
     logger_ = std::make_unique<EventLoggerClass>(encoder_.get(),
                                                  event_aggregator_mgr_->GetEventAggregator(),
                                                  observation_writer_.get(), system_data_.get());
@@ -1335,7 +1335,7 @@ class EventLoggersAddEventTest : public util::testing::TestWithFiles {
 
     event_aggregator_mgr_ = std::make_unique<TestEventAggregatorManager>(cfg, fs(), encoder_.get(),
                                                                          observation_writer_.get());
-    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(*project_context_);
+    event_aggregator_mgr_->GetEventAggregator()->UpdateAggregationConfigs(project_context_);
   }
 
   std::unique_ptr<EventLogger> GetEventLoggerForMetricType(
@@ -35,7 +35,7 @@ class InternalMetrics {
 
   // cobalt_internal::metrics::per_device_bytes_uploaded is logged when the
   // Clearcut Uploader attempts or succeeds to upload observations from the
-  // device.
+  // device. |byte_count| is the number of bytes sent, after any compression.
   virtual void BytesUploaded(PerDeviceBytesUploadedMetricDimensionStatus upload_status,
                              int64_t byte_count) = 0;
 
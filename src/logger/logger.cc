@@ -66,7 +66,7 @@ Logger::Logger(std::unique_ptr<ProjectContext> project_context, const Encoder* e
     // We were not provided with a metrics logger. We must create one.
     internal_metrics_ = std::make_unique<NoOpInternalMetrics>();
   }
-  if (event_aggregator_->UpdateAggregationConfigs(*project_context_) != kOK) {
+  if (event_aggregator_->UpdateAggregationConfigs(project_context_) != kOK) {
     LOG(ERROR) << "Failed to provide aggregation configurations to the "
                   "EventAggregator.";
   }
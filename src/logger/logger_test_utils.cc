@@ -81,9 +81,7 @@ AggregationConfig MakeAggregationConfig(const ProjectContext& project_context,
   for (const auto& report : metric->reports()) {
     if (metric_report_id.second == report.id()) {
       found_report_id = true;
-      *config.mutable_project() = project_context.project();
-      *config.mutable_metric() = *metric;
-      *config.mutable_report() = report;
+      config.set_registry_fingerprint(local_aggregation::RegistryFingerprint(*metric, report));
       std::vector<uint32_t> aggregation_days;
       for (const auto& window_size : report.window_size()) {
         aggregation_days.push_back(window_size);
@@ -523,5 +521,80 @@ bool CheckPerDeviceNumericObservations(
   return expected_report_participation_obs.empty();
 }
 
+std::vector<UniqueActivesObservation> UnpackUniqueActivesObservation(
+    const PackedUniqueActivesObservation& packed) {
+  std::vector<UniqueActivesObservation> unpacked;
+  const std::string& data = packed.basic_rappor_obs().data();
+  for (int i = 0; i < packed.event_codes_size(); i++) {
+    // Bits are indexed from the right, i.e. the least-significant bit.
+    size_t byte_index = i / 8;
+    if (byte_index >= data.size()) {
+      break;
+    }
+    bool bit = ((data[data.size() - (byte_index + 1)] >> (i % 8)) & 1) != 0;
+    UniqueActivesObservation observation;
+    *observation.mutable_aggregation_window() = packed.aggregation_window();
+    observation.set_event_code(packed.event_codes(i));
+    observation.mutable_basic_rappor_obs()->set_data(std::string(1, bit ? '\x01' : '\x00'));
+    unpacked.push_back(observation);
+  }
+  return unpacked;
+}
+
+std::vector<PerDeviceNumericObservation> UnpackPerDeviceNumericObservation(
+    const PackedPerDeviceNumericObservation& packed) {
+  std::vector<PerDeviceNumericObservation> unpacked;
+  for (const auto& integer_event_obs : packed.integer_event_obs()) {
+    PerDeviceNumericObservation observation;
+    *observation.mutable_integer_event_obs() = integer_event_obs;
+    *observation.mutable_aggregation_window() = packed.aggregation_window();
+    unpacked.push_back(observation);
+  }
+  return unpacked;
+}
+
+void UnpackObservations(FakeObservationStore* observation_store,
+                        TestUpdateRecipient* update_recipient) {
+  std::vector<std::unique_ptr<::cobalt::observation_store::StoredObservation>> messages;
+  std::vector<std::unique_ptr<ObservationMetadata>> metadata;
+  for (size_t i = 0; i < observation_store->messages_received.size(); i++) {
+    std::vector<Observation2> unpacked;
+    const auto& message = observation_store->messages_received[i];
+    if (message != nullptr && message->has_unencrypted()) {
+      const auto& observation = message->unencrypted();
+      if (observation.has_packed_unique_actives()) {
+        for (const auto& unique_actives :
+             UnpackUniqueActivesObservation(observation.packed_unique_actives())) {
+          unpacked.emplace_back();
+          unpacked.back().set_random_id(observation.random_id());
+          *unpacked.back().mutable_unique_actives() = unique_actives;
+        }
+      } else if (observation.has_packed_per_device_numeric()) {
+        for (const auto& per_device_numeric :
+             UnpackPerDeviceNumericObservation(observation.packed_per_device_numeric())) {
+          unpacked.emplace_back();
+          unpacked.back().set_random_id(observation.random_id());
+          *unpacked.back().mutable_per_device_numeric() = per_device_numeric;
+        }
+      }
+    }
+    if (unpacked.empty()) {
+      messages.push_back(std::move(observation_store->messages_received[i]));
+      metadata.push_back(std::move(observation_store->metadata_received[i]));
+      continue;
+    }
+    for (const auto& observation : unpacked) {
+      auto stored = std::make_unique<::cobalt::observation_store::StoredObservation>();
+      *stored->mutable_unencrypted() = observation;
+      messages.push_back(std::move(stored));
+      metadata.push_back(
+          std::make_unique<ObservationMetadata>(*observation_store->metadata_received[i]));
+    }
+    update_recipient->invocation_count += static_cast<int>(unpacked.size()) - 1;
+  }
+  observation_store->messages_received = std::move(messages);
+  observation_store->metadata_received = std::move(metadata);
+}
+
 }  // namespace logger::testing
 }  // namespace cobalt
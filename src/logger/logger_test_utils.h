@@ -100,6 +100,11 @@ class FakeObservationStore : public ::cobalt::observation_store::ObservationStor
     return kOk;
   }
 
+  bool IsAlmostFull() const override { return almost_full; }
+
+  // The value returned by IsAlmostFull().
+  bool almost_full = false;  // NOLINT
+
   std::vector<std::unique_ptr<::cobalt::observation_store::StoredObservation>>
       messages_received;                                                // NOLINT
   std::vector<std::unique_ptr<ObservationMetadata>> metadata_received;  // NOLINT
@@ -270,6 +275,26 @@ bool CheckPerDeviceNumericObservations(
     ExpectedReportParticipationObservations expected_report_participation_obs,
     FakeObservationStore* observation_store, TestUpdateRecipient* update_recipient);
 
+// Decodes a PackedUniqueActivesObservation into the UniqueActivesObservations which it represents,
+// one per event code, in the order of its |event_codes|. This mirrors the decoding performed by
+// the Analyzer.
+std::vector<UniqueActivesObservation> UnpackUniqueActivesObservation(
+    const PackedUniqueActivesObservation& packed);
+
+// Decodes a PackedPerDeviceNumericObservation into the PerDeviceNumericObservations which it
+// represents, in the order of its |integer_event_obs|. This mirrors the decoding performed by the
+// Analyzer.
+std::vector<PerDeviceNumericObservation> UnpackPerDeviceNumericObservation(
+    const PackedPerDeviceNumericObservation& packed);
+
+// Replaces each unencrypted PackedUniqueActivesObservation and PackedPerDeviceNumericObservation
+// in a FakeObservationStore by the Observations which it represents, each with a copy of the
+// metadata of the packed Observation, and updates the invocation count of |update_recipient| as if
+// those Observations had been written individually. This allows the Check*Observations() methods
+// to be used on packed Observations.
+void UnpackObservations(FakeObservationStore* observation_store,
+                        TestUpdateRecipient* update_recipient);
+
 }  // namespace testing
 }  // namespace logger
 }  // namespace cobalt
@@ -34,7 +34,11 @@ Status ObservationWriter::WriteObservation(const Observation2 &observation,
     store_status = observation_store_->StoreObservation(std::make_unique<Observation2>(observation),
                                                         std::move(metadata));
   }
-  if (store_status != ObservationStoreWriterInterface::kOk) {
+  if (store_status == ObservationStoreWriterInterface::kStoredNotDurable) {
+    // The observation will still be uploaded, so it is not reported as a failure to be retried.
+    LOG_FIRST_N(WARNING, 10) << "ObservationStore::StoreObservation() stored an observation but "
+                                "could not sync it";
+  } else if (store_status != ObservationStoreWriterInterface::kOk) {
     LOG_FIRST_N(ERROR, 10) << "ObservationStore::StoreObservation() failed with status "
                            << store_status;
     return kOther;
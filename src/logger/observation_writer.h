@@ -34,8 +34,9 @@ class ObservationWriter {
   //
   // |observation_encrypter| This is used to encrypt Observations to the public key of Cobalt's
   // Analyzer prior to writing them into the Observation Store. If this value is equal to nullptr,
-  // then Observations will not be encrypted before being added to the Observation Store. Otherwise,
-  // this must remain valid as long as the ObservationWriter is being used.
+  // then Observations will not be encrypted before being added to the Observation Store, and are
+  // instead encrypted when they are read back from it. Otherwise, this must remain valid as long as
+  // the ObservationWriter is being used.
   ObservationWriter(observation_store::ObservationStoreWriterInterface* observation_store,
                     observation_store::ObservationStoreUpdateRecipient* update_recipient,
                     util::EncryptedMessageMaker* observation_encrypter = nullptr)
@@ -50,6 +51,9 @@ class ObservationWriter {
   [[nodiscard]] Status WriteObservation(const Observation2& observation,
                                         std::unique_ptr<ObservationMetadata> metadata) const;
 
+  // Returns true when the Observation Store is close to being full.
+  [[nodiscard]] bool IsAlmostFull() const { return observation_store_->IsAlmostFull(); }
+
  private:
   observation_store::ObservationStoreWriterInterface* observation_store_;
   observation_store::ObservationStoreUpdateRecipient* update_recipient_;
@@ -5,6 +5,7 @@
 #include "src/logger/project_context.h"
 
 #include <sstream>
+#include <vector>
 
 #include "src/logging.h"
 
@@ -62,11 +63,15 @@ ProjectContext::ProjectContext(uint32_t customer_id, const std::string& customer
   }
   PopulateProject(customer_id, project_config_->project_id(), customer_name,
                   project_config_->project_name(), &project_);
+  std::vector<decltype(metrics_by_name_)::Entry> metrics_by_name;
+  std::vector<decltype(metrics_by_id_)::Entry> metrics_by_id;
+  metrics_by_name.reserve(project_config_->metrics_size());
+  metrics_by_id.reserve(project_config_->metrics_size());
   for (const auto& metric : project_config_->metrics()) {
     if (metric.customer_id() == project_.customer_id() &&
         metric.project_id() == project_.project_id()) {
-      metrics_by_name_[metric.metric_name()] = &metric;
-      metrics_by_id_[metric.id()] = &metric;
+      metrics_by_name.emplace_back(metric.metric_name(), &metric);
+      metrics_by_id.emplace_back(metric.id(), &metric);
     } else {
       LOG(ERROR) << "ProjectContext constructor found a MetricDefinition "
                     "for the wrong project. Expected customer "
@@ -76,22 +81,18 @@ ProjectContext::ProjectContext(uint32_t customer_id, const std::string& customer
                  << " project_id=" << metric.project_id();
     }
   }
+  metrics_by_name_ = decltype(metrics_by_name_)(std::move(metrics_by_name));
+  metrics_by_id_ = decltype(metrics_by_id_)(std::move(metrics_by_id));
 }
 
 const MetricDefinition* ProjectContext::GetMetric(const uint32_t metric_id) const {
-  auto iter = metrics_by_id_.find(metric_id);
-  if (iter == metrics_by_id_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found = metrics_by_id_.Find(metric_id);
+  return found == nullptr ? nullptr : *found;
 }
 
 const MetricDefinition* ProjectContext::GetMetric(const std::string& metric_name) const {
-  auto iter = metrics_by_name_.find(metric_name);
-  if (iter == metrics_by_name_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found = metrics_by_name_.Find(std::string_view(metric_name));
+  return found == nullptr ? nullptr : *found;
 }
 
 MetricRef ProjectContext::RefMetric(const MetricDefinition* metric_definition) const {
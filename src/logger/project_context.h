@@ -5,14 +5,15 @@
 #ifndef COBALT_SRC_LOGGER_PROJECT_CONTEXT_H_
 #define COBALT_SRC_LOGGER_PROJECT_CONTEXT_H_
 
-#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 
 #include <google/protobuf/repeated_field.h>
 
 #include "src/lib/statusor/statusor.h"
+#include "src/lib/util/flat_sorted_table.h"
 #include "src/logger/status.h"
 #include "src/registry/cobalt_registry.pb.h"
 #include "src/registry/metric_definition.pb.h"
@@ -154,8 +155,9 @@ class ProjectContext {
   // access |project_config_|.
   const std::unique_ptr<ProjectConfig> maybe_null_project_config_;
 
-  std::map<const std::string, const MetricDefinition*> metrics_by_name_;
-  std::map<const uint32_t, const MetricDefinition*> metrics_by_id_;
+  // The names are views into |project_config_|.
+  util::FlatSortedTable<std::string_view, const MetricDefinition*> metrics_by_name_;
+  util::FlatSortedTable<uint32_t, const MetricDefinition*> metrics_by_id_;
 };
 
 }  // namespace logger
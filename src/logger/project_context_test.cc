@@ -4,11 +4,17 @@
 
 #include "src/logger/project_context.h"
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <random>
+#include <sstream>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "src/logger/test_registries/project_context_test_registry.cb.h"
+#include "src/logging.h"
 #include "src/registry/project_configs.h"
 #include "third_party/abseil-cpp/absl/strings/escaping.h"
 #include "third_party/googletest/googletest/include/gtest/gtest.h"
@@ -98,4 +104,59 @@ TEST_F(ProjectContextTest, ConstructWithUnownedProjectConfig) {
   CheckProjectContextA1(*project_context);
 }
 
+// Measures the time taken to look up each metric of a project of 10k metrics by name and by ID.
+// Run with --gtest_also_run_disabled_tests.
+TEST(ProjectContextBenchmark, DISABLED_GetMetricTime) {
+  const uint32_t kNumMetrics = 10000;
+  const int kNumRounds = 20;
+  auto project_config = std::make_unique<ProjectConfig>();
+  project_config->set_project_id(kProjectA1Id);
+  project_config->set_project_name(kProjectA1);
+  std::vector<std::string> metric_names;
+  std::vector<uint32_t> metric_ids;
+  for (uint32_t id = 1; id <= kNumMetrics; id++) {
+    std::ostringstream name;
+    name << "Metric" << id;
+    metric_names.push_back(name.str());
+    metric_ids.push_back(id);
+    auto* metric = project_config->add_metrics();
+    metric->set_customer_id(kCustomerAId);
+    metric->set_project_id(kProjectA1Id);
+    metric->set_id(id);
+    metric->set_metric_name(name.str());
+  }
+
+  // The metrics are looked up in a random order, as they would be by loggers.
+  std::shuffle(metric_names.begin(), metric_names.end(), std::mt19937());
+  std::shuffle(metric_ids.begin(), metric_ids.end(), std::mt19937());
+
+  auto start = std::chrono::steady_clock::now();
+  ProjectContext project_context(kCustomerAId, kCustomerA, std::move(project_config));
+  std::chrono::duration<double, std::micro> construction_time =
+      std::chrono::steady_clock::now() - start;
+
+  size_t num_found = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumRounds; i++) {
+    for (const auto& name : metric_names) {
+      num_found += project_context.GetMetric(name) != nullptr;
+    }
+  }
+  std::chrono::duration<double, std::nano> by_name_time = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumRounds; i++) {
+    for (uint32_t id : metric_ids) {
+      num_found += project_context.GetMetric(id) != nullptr;
+    }
+  }
+  std::chrono::duration<double, std::nano> by_id_time = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(2 * kNumRounds * kNumMetrics, num_found);
+  LOG(INFO) << kNumMetrics << " metrics: construction took " << construction_time.count()
+            << " us, GetMetric(name) took " << by_name_time.count() / (kNumRounds * kNumMetrics)
+            << " ns, GetMetric(id) took " << by_id_time.count() / (kNumRounds * kNumMetrics)
+            << " ns.";
+}
+
 }  // namespace cobalt::logger
@@ -23,6 +23,7 @@
 #define VLOG(verboselevel) FX_VLOGST(verboselevel, "core")
 #define LOG(level) FX_LOGST(level, "core")
 #define LOG_FIRST_N(verboselevel, n) FX_LOGST_FIRST_N(verboselevel, n, "core")
+#define VLOG_IS_ON(verboselevel) FX_VLOG_IS_ON(verboselevel)
 
 #define CHECK(condition) FX_CHECKT(condition, "core")
 #define CHECK_EQ(val1, val2) FX_CHECKT((val1 == val2), "core")
@@ -59,6 +59,7 @@ ObservationStore::StoreStatus EnvelopeMaker::StoreObservation(
 
 const Envelope& EnvelopeMaker::GetEnvelope(util::EncryptedMessageMaker* encrypter) {
   envelope_.Clear();
+  ObservationEncrypter observation_encrypter(encrypter, encryption_worker_pool_);
 
   auto num_batches = batch_map_.size();
   for (auto i = 0; i < num_batches; i++) {
@@ -71,16 +72,16 @@ const Envelope& EnvelopeMaker::GetEnvelope(util::EncryptedMessageMaker* encrypte
     ObservationBatch* observation_batch = envelope_.mutable_batch(i);
     *observation_batch->mutable_meta_data() = batch.second->meta_data();
     for (const auto& obs : batch.second->observation()) {
-      auto obs_out = observation_batch->add_encrypted_observation();
       if (obs.has_encrypted()) {
-        *obs_out = obs.encrypted();
+        *observation_batch->add_encrypted_observation() = obs.encrypted();
       } else if (obs.has_unencrypted()) {
-        if (!encrypter->Encrypt(obs.unencrypted(), obs_out)) {
-          LOG_FIRST_N(ERROR, 10) << "ERROR: Unable to encrypt observation on read.";
-        }
+        observation_encrypter.Add(&obs.unencrypted(), observation_batch);
+      } else {
+        observation_batch->add_encrypted_observation();
       }
     }
   }
+  observation_encrypter.Finish();
 
   return envelope_;
 }
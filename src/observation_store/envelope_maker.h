@@ -52,6 +52,10 @@ class EnvelopeMaker : public ObservationStore::EnvelopeHolder {
 
   const Envelope& GetEnvelope(util::EncryptedMessageMaker* encrypter) override;
 
+  // Sets the EncryptionWorkerPool used by GetEnvelope() to encrypt the Observations which were
+  // stored unencrypted. See ObservationStore::SetEncryptionWorkerPool().
+  void SetEncryptionWorkerPool(util::EncryptionWorkerPool* pool) { encryption_worker_pool_ = pool; }
+
   bool Empty() const { return batch_map_.empty(); }
 
   void Clear() {
@@ -89,6 +93,8 @@ class EnvelopeMaker : public ObservationStore::EnvelopeHolder {
 
   const size_t max_bytes_each_observation_;
   const size_t max_num_bytes_;
+
+  util::EncryptionWorkerPool* encryption_worker_pool_ = nullptr;
 };
 
 }  // namespace cobalt::observation_store
@@ -4,6 +4,8 @@
 
 #include "src/observation_store/envelope_maker.h"
 
+#include <set>
+#include <string>
 #include <utility>
 
 #include "src/logging.h"
@@ -23,6 +25,42 @@ constexpr uint32_t kThirdMetricId = 3;
 
 // This is the day index for Friday Dec 2, 2016
 const uint32_t kUtcDayIndex = 17137;
+
+// An EncryptedMessageMaker which does not encrypt, and whose batch encrypters each have their own
+// key encapsulation.
+class FakeBatchEncryptedMessageMaker : public util::EncryptedMessageMaker {
+ public:
+  explicit FakeBatchEncryptedMessageMaker(std::string kem_bytes = "")
+      : kem_bytes_(std::move(kem_bytes)) {}
+
+  bool Encrypt(const google::protobuf::MessageLite& message,
+               EncryptedMessage* encrypted_message) const override {
+    return unencrypted_->Encrypt(message, encrypted_message);
+  }
+
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override {
+    return unencrypted_->EncryptSerialized(std::move(serialized_message), encrypted_message);
+  }
+
+  [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
+    return EncryptedMessage::NONE;
+  }
+
+  [[nodiscard]] std::unique_ptr<util::EncryptedMessageMaker> NewBatchEncrypter() const override {
+    return std::make_unique<FakeBatchEncryptedMessageMaker>("kem" +
+                                                            std::to_string(num_batches_++));
+  }
+
+  [[nodiscard]] std::string kem_bytes() const override { return kem_bytes_; }
+
+ private:
+  std::unique_ptr<util::EncryptedMessageMaker> unencrypted_ =
+      util::EncryptedMessageMaker::MakeUnencrypted();
+  std::string kem_bytes_;
+  mutable int num_batches_ = 0;
+};
+
 }  // namespace
 
 class EnvelopeMakerTest : public ::testing::Test {
@@ -410,4 +448,27 @@ TEST_F(EnvelopeMakerTest, CanReadWriteUnencrypted) {
   ASSERT_EQ(read_env.batch(0).encrypted_observation(0).ciphertext(), encrypted_obs->ciphertext());
 }
 
+// The key encapsulation of a batch encrypter is set once on the ObservationBatch it encrypts.
+TEST_F(EnvelopeMakerTest, SetsBatchKemBytes) {
+  for (uint32_t metric_id : {10, 10, 11}) {
+    auto observation = std::make_unique<StoredObservation>();
+    observation->mutable_unencrypted()->set_random_id("test123");
+    auto metadata = std::make_unique<ObservationMetadata>();
+    metadata->set_customer_id(kCustomerId);
+    metadata->set_project_id(kProjectId);
+    metadata->set_metric_id(metric_id);
+    ASSERT_EQ(ObservationStore::kOk,
+              envelope_maker_->StoreObservation(std::move(observation), std::move(metadata)));
+  }
+
+  FakeBatchEncryptedMessageMaker encrypter;
+  const auto& read_env = envelope_maker_->GetEnvelope(&encrypter);
+  ASSERT_EQ(read_env.batch_size(), 2);
+  std::set<std::string> kem_bytes;
+  for (const auto& batch : read_env.batch()) {
+    kem_bytes.insert(batch.kem_bytes());
+  }
+  EXPECT_EQ(kem_bytes, std::set<std::string>({"kem0", "kem1"}));
+}
+
 }  // namespace cobalt::observation_store
@@ -4,11 +4,17 @@
 
 #include "src/observation_store/file_observation_store.h"
 
+#include <zlib.h>
+
+#include <algorithm>
 #include <ctime>
 #include <iomanip>
 #include <regex>
+#include <thread>
 #include <utility>
 
+#include "google/protobuf/io/coded_stream.h"
+#include "src/lib/util/gzip_stream.h"
 #include "src/logger/logger_interface.h"
 #include "src/logging.h"
 #include "src/observation_store/observation_store_internal.pb.h"
@@ -17,12 +23,17 @@
 
 namespace cobalt::observation_store {
 
-using lib::statusor::StatusOr;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::ZeroCopyInputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
 using util::FileSystem;
-using util::Status;
-using util::StatusCode;
 
 constexpr char kActiveFileName[] = "in_progress.data";
+constexpr char kManifestFileName[] = "manifest.pb";
+constexpr char kManifestTmpSuffix[] = ".tmp";
+// A finalized file is compressed to this file, which then replaces it.
+constexpr char kCompressedTmpFileName[] = "compressed.tmp";
 // The first part of the filename is 13 digits representing the milliseconds
 // since the unix epoch. The millisecond timestamp became 13 digits in
 // September 2001, and won't be 14 digits until 2286.
@@ -33,20 +44,85 @@ const std::regex kFinalizedFileRegex(R"(\d{13}-\d{10}.data)");
 constexpr uint32_t kTimestampWidth = 13;
 constexpr uint64_t kMinRandomNumber = 1000000000;
 constexpr uint64_t kMaxRandomNumber = 9999999999;
+// A writer buffer is at most this fraction of max_bytes_per_envelope.
+constexpr size_t kMinWriterBuffersPerFile = 4;
+
+namespace {
+
+uint32_t Crc32(const std::string &data) {
+  return crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef *>(data.data()),
+               static_cast<uInt>(data.size()));
+}
+
+// Returns |record| framed by its size and its CRC-32 as little-endian 32-bit integers.
+std::string FrameRecord(const FileObservationStoreRecord &record) {
+  std::string payload = record.SerializeAsString();
+  std::string framed(8, '\0');
+  auto *header = reinterpret_cast<uint8_t *>(&framed[0]);
+  CodedOutputStream::WriteLittleEndian32ToArray(static_cast<uint32_t>(payload.size()), header);
+  CodedOutputStream::WriteLittleEndian32ToArray(Crc32(payload), header + 4);
+  framed.append(payload);
+  return framed;
+}
+
+// Writes a record framed by FrameRecord() to |out|.
+bool WriteFramedRecord(const std::string &framed_record, ZeroCopyOutputStream *out) {
+  CodedOutputStream coded_out(out);
+  coded_out.WriteString(framed_record);
+  return !coded_out.HadError();
+}
+
+// The result of reading a framed record.
+enum class FramedReadResult {
+  kOk,
+  // The record was complete, but its checksum did not match its contents.
+  kCorrupt,
+  // The end of the file was reached, either cleanly or in the middle of a torn record.
+  kEnd,
+};
+
+FramedReadResult ReadFramedRecord(CodedInputStream *in, size_t file_size,
+                                  FileObservationStoreRecord *record) {
+  uint32_t size;
+  uint32_t crc;
+  std::string payload;
+  // |file_size| bounds the size of a valid record, if it is known.
+  if (!in->ReadLittleEndian32(&size) || !in->ReadLittleEndian32(&crc) ||
+      (file_size > 0 && size > file_size) || !in->ReadString(&payload, static_cast<int>(size))) {
+    return FramedReadResult::kEnd;
+  }
+  if (Crc32(payload) != crc || !record->ParseFromString(payload)) {
+    return FramedReadResult::kCorrupt;
+  }
+  return FramedReadResult::kOk;
+}
+
+}  // namespace
 
 FileObservationStore::FileObservationStore(size_t max_bytes_per_observation,
                                            size_t max_bytes_per_envelope, size_t max_bytes_total,
                                            FileSystem *fs, std::string root_directory,
                                            std::string name,
-                                           logger::LoggerInterface *internal_logger)
+                                           logger::LoggerInterface *internal_logger,
+                                           bool use_manifest)
     : ObservationStore(max_bytes_per_observation, max_bytes_per_envelope, max_bytes_total),
+      writer_buffer_size_(
+          std::min(kWriterBufferSize, max_bytes_per_envelope / kMinWriterBuffersPerFile)),
       fs_(fs),
       root_directory_(std::move(root_directory)),
       active_file_name_(FullPath(kActiveFileName)),
+      manifest_file_name_(FullPath(kManifestFileName)),
       name_(std::move(name)),
+      use_manifest_(use_manifest),
       internal_metrics_(logger::InternalMetrics::NewWithLogger(internal_logger)) {
   CHECK(fs_);
 
+  size_t num_writer_shards =
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxWriterShards);
+  for (size_t i = 0; i < num_writer_shards; i++) {
+    writer_shards_.push_back(std::make_unique<WriterShard>());
+  }
+
   // Check if root_directory_ already exists.
   if (!fs_->ListFiles(root_directory_).ok()) {
     // If it doesn't exist, create it here.
@@ -58,10 +134,9 @@ FileObservationStore::FileObservationStore(size_t max_bytes_per_observation,
   {
     auto fields = protected_fields_.lock();
     fields->finalized_bytes = 0;
-
-    for (const auto &file : ListFinalizedFiles()) {
-      fields->finalized_bytes += fs_->FileSize(FullPath(file)).ConsumeValueOr(0);
-    }
+    LoadIndex(&fields);
+    // Left behind if the process terminated while compressing a file.
+    fs_->Delete(FullPath(kCompressedTmpFileName));
 
     // If there exists an active file, it likely means that the process
     // terminated unexpectedly last time. In this case, the file should be
@@ -73,6 +148,119 @@ FileObservationStore::FileObservationStore(size_t max_bytes_per_observation,
     // place.
     FinalizeActiveFile(&fields);
   }
+  CompressPendingFiles();
+}
+
+FileObservationStore::~FileObservationStore() {
+  FlushWriterBuffers();
+  if (use_manifest_) {
+    auto fields = protected_fields_.lock();
+    WriteManifest(&fields);
+  }
+}
+
+void FileObservationStore::LoadIndex(util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  if (use_manifest_ && fs_->FileExists(manifest_file_name_)) {
+    FileObservationStoreManifest manifest;
+    bool parsed = false;
+    {
+      auto iis_or = fs_->NewProtoInputStream(manifest_file_name_);
+      if (iis_or.ok()) {
+        parsed = manifest.ParseFromZeroCopyStream(iis_or.ValueOrDie().get());
+      }
+    }
+    // The manifest only describes the state of the store at the time it was written. Deleting it
+    // ensures that it is not trusted again after this store has modified the directory.
+    fs_->Delete(manifest_file_name_);
+    if (parsed) {
+      VLOG(4) << name_ << ": Loaded " << manifest.finalized_files_size()
+              << " finalized files from the manifest.";
+      for (const auto &file : manifest.finalized_files()) {
+        // Manifests written before the uncompressed size was recorded only have the size on disk.
+        size_t size = file.uncompressed_size() > 0 ? file.uncompressed_size()
+                                                   : ReadUncompressedSize(file.name(), file.size());
+        AddFinalizedFile(fields, file.name(), {size, file.size()});
+      }
+      return;
+    }
+    LOG(WARNING) << name_ << ": Unable to read the manifest `" << manifest_file_name_
+                 << "`. Listing the directory instead.";
+  }
+
+  for (const auto &file : ListFinalizedFiles()) {
+    size_t disk_size = fs_->FileSize(FullPath(file)).ConsumeValueOr(0);
+    AddFinalizedFile(fields, file, {ReadUncompressedSize(file, disk_size), disk_size});
+  }
+}
+
+void FileObservationStore::WriteManifest(util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+
+  FileObservationStoreManifest manifest;
+  for (const auto *files : {&f->finalized_files, &f->files_taken}) {
+    for (const auto &[file_name, file_sizes] : *files) {
+      auto file = manifest.add_finalized_files();
+      file->set_name(file_name);
+      file->set_size(file_sizes.disk_size);
+      file->set_uncompressed_size(file_sizes.size);
+    }
+  }
+
+  std::string tmp_file_name = manifest_file_name_ + kManifestTmpSuffix;
+  {
+    auto stream_or = fs_->NewProtoOutputStream(tmp_file_name);
+    if (!stream_or.ok() || !manifest.SerializeToZeroCopyStream(stream_or.ValueOrDie().get())) {
+      LOG(WARNING) << name_ << ": Unable to write the manifest `" << tmp_file_name << "`";
+      return;
+    }
+  }
+  if (!fs_->Rename(tmp_file_name, manifest_file_name_)) {
+    LOG(WARNING) << name_ << ": Unable to rename `" << tmp_file_name << "` => `"
+                 << manifest_file_name_ << "`";
+  }
+}
+
+void FileObservationStore::AddFinalizedFile(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                                            const std::string &file_name, FileSizes sizes) {
+  auto &f = *fields;
+  f->finalized_files[file_name] = sizes;
+  f->finalized_bytes += sizes.disk_size;
+  UpdateSize(fields);
+}
+
+size_t FileObservationStore::ReadUncompressedSize(const std::string &file_name,
+                                                  size_t disk_size) {
+  // The gzip trailer ends with the size of the uncompressed data modulo 2^32, which is exact since
+  // a file is never much larger than max_bytes_per_envelope.
+  constexpr size_t kGzipSizeFieldSize = 4;
+  if (disk_size <= kGzipSizeFieldSize) {
+    return disk_size;
+  }
+  auto in_or = fs_->NewProtoInputStream(FullPath(file_name));
+  if (!in_or.ok()) {
+    return disk_size;
+  }
+  auto in = in_or.ConsumeValueOrDie();
+  if (!util::HasGzipHeader(in.get())) {
+    return disk_size;
+  }
+  CodedInputStream coded_in(in.get());
+  uint32_t uncompressed_size;
+  if (!coded_in.Skip(static_cast<int>(disk_size - kGzipSizeFieldSize)) ||
+      !coded_in.ReadLittleEndian32(&uncompressed_size)) {
+    LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to read the size of `" << file_name << "`";
+    return disk_size;
+  }
+  return uncompressed_size;
+}
+
+void FileObservationStore::UpdateSize(util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  size_t bytes = f->finalized_bytes;
+  if (f->active_file) {
+    bytes += f->active_file->ByteCount();
+  }
+  size_.store(bytes);
 }
 
 ObservationStore::StoreStatus FileObservationStore::StoreObservation(
@@ -82,17 +270,11 @@ ObservationStore::StoreStatus FileObservationStore::StoreObservation(
   }
 
   TRACE_DURATION("cobalt_core", "FileObservationStore::StoreObservation");
-  auto fields = protected_fields_.lock();
 
   size_t obs_size = observation->ByteSizeLong();
   internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Attempted,
                                  obs_size, metadata->customer_id(), metadata->project_id());
 
-  auto active_file = GetActiveFile(&fields);
-  if (active_file == nullptr) {
-    return kWriteFailed;
-  }
-
   auto metadata_str = metadata->SerializeAsString();
   auto report_id = metadata->report_id();
 
@@ -107,6 +289,53 @@ ObservationStore::StoreStatus FileObservationStore::StoreObservation(
           << metadata->project_id() << "," << metadata->metric_id() << "), size=" << obs_size
           << ".";
 
+  // The observation is serialized and checksummed before taking the lock, so that concurrent
+  // writers only contend for the append itself.
+  FileObservationStoreRecord stored_message;
+  if (observation->has_encrypted()) {
+    stored_message.mutable_encrypted_observation()->Swap(observation->mutable_encrypted());
+  } else if (observation->has_unencrypted()) {
+    stored_message.mutable_unencrypted_observation()->Swap(observation->mutable_unencrypted());
+  } else {
+    LOG(ERROR) << "Recieved StoredObservation of unexpected type.";
+    return kWriteFailed;
+  }
+  std::string framed_observation = FrameRecord(stored_message);
+
+  WriterShard &shard = ShardForThisThread();
+  std::unique_lock<std::mutex> shard_lock(shard.mutex);
+  if (buffer_writes_) {
+    size_t estimated_new_byte_count = Size() + obs_size;
+    if (estimated_new_byte_count > max_bytes_total_) {
+      VLOG(4) << name_ << ": The observation store is full. estimated_new_byte_count="
+              << estimated_new_byte_count << " > " << max_bytes_total_ << ".";
+      return kStoreFull;
+    }
+    uint32_t customer_id = metadata->customer_id();
+    uint32_t project_id = metadata->project_id();
+    bool finalized = false;
+    StoreStatus status =
+        BufferObservation(&shard, framed_observation, obs_size, std::move(metadata),
+                          std::move(metadata_str), &finalized);
+    shard_lock.unlock();
+    if (status == kOk) {
+      internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Succeeded,
+                                     obs_size, customer_id, project_id);
+    }
+    if (finalized) {
+      CompressPendingFiles();
+    }
+    return status;
+  }
+  shard_lock.unlock();
+
+  auto fields = protected_fields_.lock();
+
+  auto active_file = GetActiveFile(&fields);
+  if (active_file == nullptr) {
+    return kWriteFailed;
+  }
+
   size_t estimated_new_byte_count = fields->finalized_bytes + active_file->ByteCount() + obs_size;
   if (estimated_new_byte_count > max_bytes_total_) {
     VLOG(4) << name_ << ": The observation store is full. estimated_new_byte_count="
@@ -118,8 +347,9 @@ ObservationStore::StoreStatus FileObservationStore::StoreObservation(
     VLOG(5) << name_ << ": Writing observation metadata.";
     FileObservationStoreRecord stored_metadata;
     stored_metadata.mutable_meta_data()->Swap(metadata.get());
-    if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(stored_metadata, active_file)) {
+    if (!WriteFramedRecord(FrameRecord(stored_metadata), active_file)) {
       LOG(WARNING) << name_ << ": Unable to write metadata to `" << active_file_name_ << "`";
+      UpdateSize(&fields);
       return kWriteFailed;
     }
     // Swap needed to report the customer id and project id to the internal metrics.
@@ -128,19 +358,15 @@ ObservationStore::StoreStatus FileObservationStore::StoreObservation(
     fields->last_written_metadata = metadata_str;
   }
 
-  FileObservationStoreRecord stored_message;
-  if (observation->has_encrypted()) {
-    stored_message.mutable_encrypted_observation()->Swap(observation->mutable_encrypted());
-  } else if (observation->has_unencrypted()) {
-    stored_message.mutable_unencrypted_observation()->Swap(observation->mutable_unencrypted());
-  } else {
-    LOG(ERROR) << "Recieved StoredObservation of unexpected type.";
-    return kWriteFailed;
-  }
-  if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(stored_message, active_file)) {
+  bool written = WriteFramedRecord(framed_observation, active_file);
+  UpdateSize(&fields);
+  if (!written) {
     LOG(WARNING) << "Unable to write encrypted_observation to `" << active_file_name_ << "`";
     return kWriteFailed;
   }
+  uint64_t record = ++fields->last_appended_record;
+  fields->bytes_since_sync += obs_size;
+  bool finalized = false;
 
   if (active_file->ByteCount() >= static_cast<int64_t>(max_bytes_per_envelope_)) {
     VLOG(4) << name_ << ": In-progress file contains " << active_file->ByteCount()
@@ -150,44 +376,346 @@ ObservationStore::StoreStatus FileObservationStore::StoreObservation(
       LOG(WARNING) << "Unable to finalize `" << active_file_name_;
       return kWriteFailed;
     }
+    finalized = true;
   }
 
-  num_obs_per_report_[report_id]++;
+  fields->observation_counts[report_id]++;
   internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Succeeded,
                                  obs_size, metadata->customer_id(), metadata->project_id());
-  return kOk;
+
+  StoreStatus status = kOk;
+  switch (fields->sync_policy.mode) {
+    case SyncPolicy::kNone:
+      break;
+    case SyncPolicy::kInterval:
+      if (!fields->sync_in_progress && std::chrono::steady_clock::now() - fields->last_sync_time >=
+                                           fields->sync_policy.interval) {
+        SyncRecords(&fields, record);
+      }
+      break;
+    case SyncPolicy::kBytes:
+      if (!fields->sync_in_progress && fields->bytes_since_sync >= fields->sync_policy.bytes) {
+        SyncRecords(&fields, record);
+      }
+      break;
+    case SyncPolicy::kEveryBatch:
+      // The observation was stored but is not durable, which this policy promises the caller.
+      if (!SyncRecords(&fields, record)) {
+        status = kStoredNotDurable;
+      }
+      break;
+  }
+
+  if (finalized) {
+    fields.unlock();
+    CompressPendingFiles();
+  }
+  return status;
+}
+
+FileObservationStore::WriterShard &FileObservationStore::ShardForThisThread() {
+  return *writer_shards_[std::hash<std::thread::id>()(std::this_thread::get_id()) %
+                         writer_shards_.size()];
+}
+
+ObservationStore::StoreStatus FileObservationStore::BufferObservation(
+    WriterShard *shard, const std::string &framed_observation, size_t observation_size,
+    std::unique_ptr<ObservationMetadata> metadata, std::string metadata_str, bool *finalized) {
+  WriterBuffer &buffer = shard->buffer;
+  size_t buffer_size = buffer.records.size();
+  // The buffer may be appended after the records of any other buffer, so it always starts with a
+  // metadata record.
+  if (buffer.records.empty() || metadata_str != buffer.last_metadata) {
+    FileObservationStoreRecord stored_metadata;
+    stored_metadata.mutable_meta_data()->Swap(metadata.get());
+    buffer.records.append(FrameRecord(stored_metadata));
+    metadata->Swap(stored_metadata.mutable_meta_data());
+    if (buffer_size == 0) {
+      buffer.first_metadata = metadata_str;
+      buffer.first_metadata_size = buffer.records.size();
+    }
+    buffer.last_metadata = std::move(metadata_str);
+  }
+  buffer.records.append(framed_observation);
+  buffer.num_records++;
+  buffer.observation_bytes += observation_size;
+  buffered_bytes_ += buffer.records.size() - buffer_size;
+  shard->observation_counts[metadata->report_id()]++;
+
+  if (buffer.records.size() < writer_buffer_size_) {
+    return kOk;
+  }
+  auto fields = protected_fields_.lock();
+  return AppendWriterBuffer(&fields, &buffer, finalized) ? kOk : kWriteFailed;
+}
+
+bool FileObservationStore::AppendWriterBuffer(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields, WriterBuffer *buffer,
+    bool *finalized) {
+  auto &f = *fields;
+  size_t buffer_size = buffer->records.size();
+  WriterBuffer records;
+  std::swap(records, *buffer);
+
+  auto active_file = GetActiveFile(fields);
+  bool written = active_file != nullptr;
+  if (written) {
+    // The first metadata record is only needed if the active file ends with different metadata.
+    size_t skip = f->metadata_written && f->last_written_metadata == records.first_metadata
+                      ? records.first_metadata_size
+                      : 0;
+    CodedOutputStream coded_out(active_file);
+    coded_out.WriteRaw(records.records.data() + skip, static_cast<int>(buffer_size - skip));
+    written = !coded_out.HadError();
+  }
+  UpdateSize(fields);
+  buffered_bytes_ -= buffer_size;
+  if (!written) {
+    LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to write " << records.num_records
+                             << " buffered observations to `" << active_file_name_ << "`";
+    return false;
+  }
+  f->metadata_written = true;
+  f->last_written_metadata = std::move(records.last_metadata);
+  f->last_appended_record += records.num_records;
+  f->bytes_since_sync += records.observation_bytes;
+
+  if (active_file->ByteCount() >= static_cast<int64_t>(max_bytes_per_envelope_)) {
+    VLOG(4) << name_ << ": In-progress file contains " << active_file->ByteCount()
+            << " bytes (>= " << max_bytes_per_envelope_ << "). Finalizing it.";
+    if (FinalizeActiveFile(fields)) {
+      *finalized = true;
+    }
+  }
+  return true;
+}
+
+void FileObservationStore::FlushWriterBuffers() {
+  bool finalized = false;
+  for (auto &shard : writer_shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    if (!shard->buffer.records.empty()) {
+      auto fields = protected_fields_.lock();
+      AppendWriterBuffer(&fields, &shard->buffer, &finalized);
+    }
+  }
+  if (finalized) {
+    CompressPendingFiles();
+  }
+}
+
+void FileObservationStore::AddObservationCounts(ObservationCounts *counts) const {
+  for (const auto &shard : writer_shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    for (const auto &[report_id, count] : shard->observation_counts) {
+      (*counts)[report_id] += count;
+    }
+  }
+  auto fields = protected_fields_.const_lock();
+  for (const auto &[report_id, count] : fields->observation_counts) {
+    (*counts)[report_id] += count;
+  }
+}
+
+void FileObservationStore::ClearObservationCounts() {
+  for (auto &shard : writer_shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    shard->observation_counts.clear();
+  }
+  protected_fields_.lock()->observation_counts.clear();
+}
+
+void FileObservationStore::SetSyncPolicy(SyncPolicy sync_policy) {
+  // The observations buffered so far are appended to the active file, so that the policy applies
+  // to them. A writer checks |buffer_writes_| with the mutex of its shard held, so no observation
+  // is buffered after its shard has been flushed.
+  buffer_writes_ = sync_policy.mode == SyncPolicy::kNone;
+  FlushWriterBuffers();
+  auto fields = protected_fields_.lock();
+  fields->sync_policy = sync_policy;
+}
+
+void FileObservationStore::SetCompressFinalizedFiles(bool compress) {
+  auto fields = protected_fields_.lock();
+  fields->compress_finalized_files = compress;
+}
+
+bool FileObservationStore::SyncRecords(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                                       uint64_t record) {
+  auto &f = *fields;
+
+  while (f->last_synced_record < record) {
+    if (f->sync_in_progress) {
+      // Another caller is syncing a batch of records. If that batch does not include |record|, the
+      // next iteration syncs a new batch.
+      f->sync_notifier.wait(f);
+      continue;
+    }
+
+    // Lead a new batch made up of every record appended so far. The records are flushed to the file
+    // while holding the lock, but the sync itself happens without it so that other callers can
+    // keep appending records for the next batch.
+    uint64_t batch_end = f->last_appended_record;
+    if (f->active_file == nullptr || !fs_->FlushProtoOutputStream(f->active_file.get())) {
+      LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to flush `" << active_file_name_ << "`";
+      return false;
+    }
+    f->sync_in_progress = true;
+    f.unlock();
+    bool synced = fs_->SyncFile(active_file_name_);
+    f.lock();
+    f->sync_in_progress = false;
+    f->sync_notifier.notify_all();
+
+    // If the active file was finalized during the sync, FinalizeActiveFile() synced the batch.
+    if (synced && f->last_synced_record < batch_end) {
+      MarkSynced(fields, batch_end);
+    } else if (f->last_synced_record < batch_end) {
+      LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to sync `" << active_file_name_ << "`";
+      return false;
+    }
+  }
+  return true;
+}
+
+void FileObservationStore::MarkSynced(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                                      uint64_t record) {
+  auto &f = *fields;
+  f->last_synced_record = record;
+  f->bytes_since_sync = 0;
+  f->last_sync_time = std::chrono::steady_clock::now();
 }
 
 bool FileObservationStore::FinalizeActiveFile(
-    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields, bool compress) {
   VLOG(6) << name_ << ": FinalizeActiveFile()";
   auto &f = *fields;
 
+  // Make the records of the current file durable before it is finalized, unless durability was not
+  // requested.
+  if (f->sync_policy.mode != SyncPolicy::kNone && f->active_file != nullptr &&
+      f->last_synced_record < f->last_appended_record) {
+    if (fs_->FlushProtoOutputStream(f->active_file.get()) && fs_->SyncFile(active_file_name_)) {
+      MarkSynced(fields, f->last_appended_record);
+    } else {
+      LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to sync `" << active_file_name_ << "`";
+    }
+  }
+
   // Close the current file (if it is open).
   f->active_file = nullptr;
   f->metadata_written = false;
+  UpdateSize(fields);
 
-  auto filesize = fs_->FileSize(active_file_name_);
-  if (filesize.ok()) {
-    if (filesize.ConsumeValueOrDie() == 0) {
-      // File exists, but is empty. Let's just delete it instead of renaming.
-      fs_->Delete(active_file_name_);
-      return false;
-    }
-  } else {
-    // if !filesize.ok(), the file likely doesn't even exist.
+  auto filesize_or = fs_->FileSize(active_file_name_);
+  if (!filesize_or.ok()) {
+    // if !filesize_or.ok(), the file likely doesn't even exist.
+    return false;
+  }
+  size_t filesize = filesize_or.ConsumeValueOrDie();
+  if (filesize == 0) {
+    // File exists, but is empty. Let's just delete it instead of renaming.
+    fs_->Delete(active_file_name_);
     return false;
   }
 
-  auto new_name = FullPath(filename_generator_.GenerateFilename());
-  if (!fs_->Rename(active_file_name_, new_name)) {
+  auto new_file_name = filename_generator_.GenerateFilename();
+  if (!fs_->Rename(active_file_name_, FullPath(new_file_name))) {
     return false;
   }
 
-  f->finalized_bytes += fs_->FileSize(new_name).ConsumeValueOr(0);
+  AddFinalizedFile(fields, new_file_name, {filesize, filesize});
+  // The file is compressed after it is renamed, so that a crash at any point leaves either the
+  // uncompressed or the compressed file under its finalized name, but never both.
+  if (compress && f->compress_finalized_files) {
+    f->files_to_compress.push_back(new_file_name);
+  }
   return true;
 }
 
+void FileObservationStore::CompressPendingFiles() {
+  auto fields = protected_fields_.lock();
+  if (fields->compression_in_progress) {
+    // The files queued by this caller are compressed by the caller which is already compressing.
+    return;
+  }
+  fields->compression_in_progress = true;
+  while (!fields->files_to_compress.empty()) {
+    std::string file_name = std::move(fields->files_to_compress.front());
+    fields->files_to_compress.pop_front();
+    auto file = fields->finalized_files.find(file_name);
+    if (file == fields->finalized_files.end()) {
+      // The file was taken or deleted after it was finalized.
+      continue;
+    }
+    size_t file_size = file->second.size;
+    bool sync = fields->sync_policy.mode != SyncPolicy::kNone;
+
+    fields.unlock();
+    size_t compressed_size = WriteCompressedFile(file_name, file_size, sync);
+    fields.lock();
+    if (compressed_size == 0) {
+      continue;
+    }
+
+    // The file is only replaced if it is still waiting in the store, so that a file which has been
+    // uploaded and deleted in the meantime is not brought back, and a file which is being read is
+    // not replaced underneath its reader.
+    std::string tmp_file_name = FullPath(kCompressedTmpFileName);
+    file = fields->finalized_files.find(file_name);
+    if (file == fields->finalized_files.end() || !fs_->Rename(tmp_file_name, FullPath(file_name))) {
+      fs_->Delete(tmp_file_name);
+      continue;
+    }
+    VLOG(5) << name_ << ": Compressed `" << file_name << "` from " << file_size << " to "
+            << compressed_size << " bytes.";
+    fields->finalized_bytes -= file->second.disk_size - compressed_size;
+    file->second.disk_size = compressed_size;
+    UpdateSize(&fields);
+  }
+  fields->compression_in_progress = false;
+}
+
+size_t FileObservationStore::WriteCompressedFile(const std::string &file_name, size_t file_size,
+                                                 bool sync) {
+  std::string tmp_file_name = FullPath(kCompressedTmpFileName);
+  {
+    auto in_or = fs_->NewProtoInputStream(FullPath(file_name));
+    auto out_or = fs_->NewProtoOutputStream(tmp_file_name);
+    if (!in_or.ok() || !out_or.ok()) {
+      LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to compress `" << file_name << "`";
+      return 0;
+    }
+    auto in = in_or.ConsumeValueOrDie();
+    auto out = out_or.ConsumeValueOrDie();
+    util::GzipOutputStream gzip_out(out.get());
+    bool copied;
+    {
+      CodedOutputStream coded_out(&gzip_out);
+      const void *data;
+      int size;
+      while (in->Next(&data, &size)) {
+        coded_out.WriteRaw(data, size);
+      }
+      copied = !coded_out.HadError();
+    }
+    if (!gzip_out.Close() || !copied) {
+      LOG_FIRST_N(WARNING, 10) << name_ << ": Unable to write `" << tmp_file_name << "`";
+      out = nullptr;
+      fs_->Delete(tmp_file_name);
+      return 0;
+    }
+  }
+
+  size_t compressed_size = fs_->FileSize(tmp_file_name).ConsumeValueOr(0);
+  if (compressed_size == 0 || compressed_size >= file_size ||
+      (sync && !fs_->SyncFile(tmp_file_name))) {
+    fs_->Delete(tmp_file_name);
+    return 0;
+  }
+  return compressed_size;
+}
+
 FileObservationStore::FilenameGenerator::FilenameGenerator()
     : FilenameGenerator([]() {
         return std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -226,6 +754,15 @@ google::protobuf::io::ZeroCopyOutputStream *FileObservationStore::GetActiveFile(
       return nullptr;
     }
     f->active_file = stream_or.ConsumeValueOrDie();
+
+    // Mark the file as made up of framed records.
+    FileObservationStoreRecord header;
+    header.set_crc_framed(true);
+    if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(header, f->active_file.get())) {
+      LOG_FIRST_N(ERROR, 10) << "Failed to write to `" << active_file_name_ << "`";
+      f->active_file = nullptr;
+      return nullptr;
+    }
   }
   return f->active_file.get();
 }
@@ -241,57 +778,66 @@ std::vector<std::string> FileObservationStore::ListFinalizedFiles() const {
   return retval;
 }
 
-StatusOr<std::string> FileObservationStore::GetOldestFinalizedFile(
-    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
-  auto &f = *fields;
-
-  std::string found_file_name;
-  for (const auto &file : ListFinalizedFiles()) {
-    if (f->files_taken.find(file) == f->files_taken.end()) {
-      if (found_file_name.empty()) {
-        found_file_name = file;
-      } else {
-        // We compare the file names to try to find the oldest one. This works
-        // because file names are prefixed with the timestamp when they were
-        // finalized and that timestamp is always 13 digits long.
-        //
-        // A lexigraphic order of fixed length number strings is identical to
-        // ordering their numerical values.
-        auto result = strcmp(file.c_str(), found_file_name.c_str());
-        if (result < 0) {
-          found_file_name = file;
-        }
-      }
-    }
+std::unique_ptr<ObservationStore::EnvelopeHolder> FileObservationStore::TakeNextEnvelopeHolder(
+    size_t max_bytes) {
+  if (protected_fields_.const_lock()->finalized_files.empty()) {
+    // The buffered observations are needed to make up an envelope.
+    FlushWriterBuffers();
   }
-  if (found_file_name.empty()) {
-    return Status(StatusCode::NOT_FOUND, "No finalized file");
-  }
-  return found_file_name;
-}
-
-std::unique_ptr<ObservationStore::EnvelopeHolder> FileObservationStore::TakeNextEnvelopeHolder() {
   auto fields = protected_fields_.lock();
 
-  auto oldest_file_name_or = GetOldestFinalizedFile(&fields);
-  if (!oldest_file_name_or.ok()) {
+  bool finalized = false;
+  if (fields->finalized_files.empty()) {
     if (!fields->active_file || fields->active_file->ByteCount() == 0) {
       // Active file isn't open or is empty. Return nullptr.
       return nullptr;
     }
-    if (!FinalizeActiveFile(&fields)) {
+    // The file is about to be handed out, so compressing it would only have it decompressed again
+    // as soon as it is read.
+    if (!FinalizeActiveFile(&fields, /*compress=*/false)) {
       // Finalizing the active file failed, no envelope to return.
       return nullptr;
     }
-    oldest_file_name_or = GetOldestFinalizedFile(&fields);
-    if (!oldest_file_name_or.ok()) {
-      return nullptr;
-    }
+    finalized = true;
   }
 
-  auto oldest_file_name = oldest_file_name_or.ConsumeValueOrDie();
-  fields->files_taken.insert(oldest_file_name);
-  return std::make_unique<FileEnvelopeHolder>(fs_, this, root_directory_, oldest_file_name);
+  // File names are prefixed with the timestamp when they were finalized, and
+  // that timestamp is always 13 digits long, so the files in the index are
+  // ordered oldest first.
+  std::vector<std::map<std::string, FileSizes>::iterator> candidates;
+  std::vector<size_t> sizes;
+  for (auto it = fields->finalized_files.begin();
+       it != fields->finalized_files.end() && candidates.size() < kPackingLookahead; ++it) {
+    candidates.push_back(it);
+    sizes.push_back(it->second.size);
+  }
+  std::unique_ptr<FileEnvelopeHolder> holder;
+  for (size_t index : PackEnvelope(sizes, max_bytes)) {
+    auto file = fields->finalized_files.extract(candidates[index]);
+    auto file_holder = std::make_unique<FileEnvelopeHolder>(fs_, this, root_directory_, file.key(),
+                                                            file.mapped().size);
+    fields->files_taken.insert(std::move(file));
+    if (holder) {
+      holder->MergeWith(std::move(file_holder));
+    } else {
+      holder = std::move(file_holder);
+    }
+  }
+  if (holder == nullptr) {
+    // The file which was just finalized did not fit, and stays in the store.
+    if (finalized && fields->compress_finalized_files) {
+      for (const auto &[file_name, file_sizes] : fields->finalized_files) {
+        fields->files_to_compress.push_back(file_name);
+      }
+      fields.unlock();
+      CompressPendingFiles();
+    }
+    return nullptr;
+  }
+  VLOG(5) << name_ << ": Took " << holder->files().size() << " files of " << holder->Size()
+          << " bytes.";
+  CountEnvelopeTaken(holder->Size());
+  return holder;
 }
 
 void FileObservationStore::ReturnEnvelopeHolder(
@@ -300,21 +846,22 @@ void FileObservationStore::ReturnEnvelopeHolder(
       static_cast<FileObservationStore::FileEnvelopeHolder *>(envelope.release()));
 
   auto fields = protected_fields_.lock();
-  for (const auto &file_name : env->file_names()) {
-    fields->files_taken.erase(file_name);
+  for (const auto &[file_name, file_size] : env->files()) {
+    auto taken = fields->files_taken.extract(file_name);
+    if (!taken.empty()) {
+      // A file which was handed out uncompressed now stays in the store. It is compressed along
+      // with the next finalized file, rather than by the caller returning it.
+      if (fields->compress_finalized_files && taken.mapped().disk_size == taken.mapped().size) {
+        fields->files_to_compress.push_back(taken.key());
+      }
+      fields->finalized_files.insert(std::move(taken));
+    }
   }
   env->clear();
 }
 
 size_t FileObservationStore::Size() const {
-  auto fields = protected_fields_.const_lock();
-  auto bytes = fields->finalized_bytes;
-  VLOG(4) << name_ << "::Size(): finalized_bytes=" << bytes;
-  if (fields->active_file) {
-    bytes += fields->active_file->ByteCount();
-  } else {
-    VLOG(4) << name_ << "::Size(): there is no active file.";
-  }
+  auto bytes = size_.load() + buffered_bytes_.load();
   VLOG(4) << name_ << "::Size(): total_bytes=" << bytes;
   return bytes;
 }
@@ -322,11 +869,20 @@ size_t FileObservationStore::Size() const {
 bool FileObservationStore::Empty() const { return Size() == 0; }
 
 FileObservationStore::FileEnvelopeHolder::~FileEnvelopeHolder() {
+  // A holder which was merged into another one, or returned to the store, owns no files. It may be
+  // destroyed while the store is locked, by TakeNextEnvelopeHolder().
+  if (files_.empty()) {
+    return;
+  }
   auto fields = store_->protected_fields_.lock();
-  for (const auto &file_name : file_names_) {
-    fields->finalized_bytes -= fs_->FileSize(FullPath(file_name)).ConsumeValueOr(0);
+  for (const auto &[file_name, file_size] : files_) {
+    auto taken = fields->files_taken.extract(file_name);
+    if (!taken.empty()) {
+      fields->finalized_bytes -= taken.mapped().disk_size;
+    }
     fs_->Delete(FullPath(file_name));
   }
+  store_->UpdateSize(&fields);
 }
 
 void FileObservationStore::FileEnvelopeHolder::MergeWith(
@@ -334,91 +890,182 @@ void FileObservationStore::FileEnvelopeHolder::MergeWith(
   std::unique_ptr<FileEnvelopeHolder> file_container(
       static_cast<FileEnvelopeHolder *>(container.release()));
 
-  file_names_.insert(file_container->file_names_.begin(), file_container->file_names_.end());
+  files_.insert(file_container->files_.begin(), file_container->files_.end());
+  size_ += file_container->size_;
 
-  file_container->file_names_.clear();
+  file_container->clear();
 
   envelope_.Clear();
-  cached_file_size_ = 0;
   envelope_read_ = false;
 }
 
-const Envelope &FileObservationStore::FileEnvelopeHolder::GetEnvelope(
-    util::EncryptedMessageMaker *encrypter) {
-  if (envelope_read_) {
-    return envelope_;
+std::string FileObservationStore::FileEnvelopeHolder::ContentKey() const {
+  std::string key;
+  for (const auto &[file_name, file_size] : files_) {
+    key += file_name;
+    key += '\n';
   }
+  return key;
+}
 
+void FileObservationStore::FileEnvelopeHolder::ReadFile(
+    const std::string &file_name, size_t stored_size, ObservationEncrypter *encrypter,
+    Envelope *envelope, std::unordered_map<std::string, ObservationBatch *> *batch_map) {
   std::string serialized_metadata;
-  std::unordered_map<std::string, ObservationBatch *> batch_map;
-  ObservationBatch *current_batch;
+  ObservationBatch *current_batch = nullptr;
+
+  // Adds the contents of |stored| to |envelope|. Returns false if |stored| is not a metadata or
+  // observation record.
+  auto add_record = [&](FileObservationStoreRecord *stored) {
+    if (stored->has_meta_data()) {
+      std::unique_ptr<ObservationMetadata> current_metadata(stored->release_meta_data());
+      current_metadata->SerializeToString(&serialized_metadata);
+
+      auto iter = batch_map->find(serialized_metadata);
+      if (iter != batch_map->end()) {
+        current_batch = iter->second;
+      } else {
+        current_batch = envelope->add_batch();
+        current_batch->set_allocated_meta_data(current_metadata.release());
+        (*batch_map)[serialized_metadata] = current_batch;
+      }
+      return true;
+    }
+    if (!stored->has_encrypted_observation() && !stored->has_unencrypted_observation()) {
+      return false;
+    }
+    if (current_batch == nullptr) {
+      // The metadata of this observation was lost to corruption.
+      return true;
+    }
+    if (stored->has_encrypted_observation()) {
+      current_batch->add_encrypted_observation()->Swap(stored->mutable_encrypted_observation());
+    } else {
+      encrypter->Add(std::unique_ptr<Observation2>(stored->release_unencrypted_observation()),
+                     current_batch);
+    }
+    return true;
+  };
 
   FileObservationStoreRecord stored;
 
-  for (const auto &file_name : file_names_) {
-    auto iis_or = fs_->NewProtoInputStream(FullPath(file_name));
-    if (!iis_or.ok()) {
-      LOG(ERROR) << "WARNING: Trying to open `" << FullPath(file_name)
-                 << "` failed with error: " << iis_or.status().error_message();
-      continue;
+  // The size of the file, if it is known, bounds the size of its records.
+  size_t file_size = stored_size;
+  auto iis_or = fs_->NewProtoInputStream(FullPath(file_name));
+  if (!iis_or.ok()) {
+    LOG(ERROR) << "WARNING: Trying to open `" << FullPath(file_name)
+               << "` failed with error: " << iis_or.status().error_message();
+    return;
+  }
+  auto iis = iis_or.ConsumeValueOrDie();
+  ZeroCopyInputStream *file_in = iis.get();
+  std::unique_ptr<util::GzipInputStream> gzip_in;
+  if (util::HasGzipHeader(file_in)) {
+    gzip_in = std::make_unique<util::GzipInputStream>(file_in);
+    file_in = gzip_in.get();
+    // The size of the decompressed file is not known.
+    file_size = 0;
+  }
+  CodedInputStream in(file_in);
+
+  bool clean_eof;
+  if (!google::protobuf::util::ParseDelimitedFromCodedStream(&stored, &in, &clean_eof)) {
+    if (!clean_eof) {
+      VLOG(1) << "WARNING: Trying to read from `" << file_name
+              << "` encountered a corrupted message. Skipping the file.";
     }
-    auto iis = iis_or.ConsumeValueOrDie();
-
-    bool clean_eof;
-    while (
-        google::protobuf::util::ParseDelimitedFromZeroCopyStream(&stored, iis.get(), &clean_eof)) {
-      if (stored.has_meta_data()) {
-        std::unique_ptr<ObservationMetadata> current_metadata(stored.release_meta_data());
-        current_metadata->SerializeToString(&serialized_metadata);
-
-        auto iter = batch_map.find(serialized_metadata);
-        if (iter != batch_map.end()) {
-          current_batch = iter->second;
-        } else {
-          current_batch = envelope_.add_batch();
-          current_batch->set_allocated_meta_data(current_metadata.release());
-          batch_map[serialized_metadata] = current_batch;
-        }
-      } else if (stored.has_encrypted_observation()) {
-        current_batch->add_encrypted_observation()->Swap(stored.mutable_encrypted_observation());
-      } else if (stored.has_unencrypted_observation()) {
-        if (!encrypter->Encrypt(stored.unencrypted_observation(),
-                                current_batch->add_encrypted_observation())) {
-          LOG_FIRST_N(ERROR, 10) << "ERROR: Unable to encrypt observation on read.";
-        }
-      } else {
+    return;
+  }
+
+  if (stored.contents_case() != FileObservationStoreRecord::kCrcFramed) {
+    // The file was written with length-delimited records. A corrupted record hides the position
+    // of the records which follow it, so the rest of the file is skipped.
+    do {
+      if (!add_record(&stored)) {
         clean_eof = false;
         break;
       }
-    }
+    } while (google::protobuf::util::ParseDelimitedFromCodedStream(&stored, &in, &clean_eof));
 
     if (!clean_eof) {
       VLOG(1) << "WARNING: Trying to read from `" << file_name
-              << "` encountered a corrupted message. Returning the envelope that "
-                 "has been read so far.";
-      break;
+              << "` encountered a corrupted message. Skipping the rest of the file.";
     }
+    return;
   }
 
+  // The file was written with framed records. A record whose checksum does not match is skipped,
+  // and a torn record at the end of the file, left by a crash during a write, is ignored.
+  size_t num_corrupt_records = 0;
+  FramedReadResult result;
+  while ((result = ReadFramedRecord(&in, file_size, &stored)) != FramedReadResult::kEnd) {
+    if (result == FramedReadResult::kCorrupt || !add_record(&stored)) {
+      num_corrupt_records++;
+      // The observations which follow may belong to the metadata of the corrupted record.
+      current_batch = nullptr;
+    }
+  }
+  if (num_corrupt_records > 0) {
+    VLOG(1) << "WARNING: Skipped " << num_corrupt_records << " corrupted records in `"
+            << file_name << "`.";
+  }
+  if (static_cast<size_t>(in.CurrentPosition()) < file_size ||
+      (gzip_in != nullptr && gzip_in->had_error())) {
+    VLOG(1) << "WARNING: Ignoring a torn record at the end of `" << file_name << "`.";
+  }
+}
+
+const Envelope &FileObservationStore::FileEnvelopeHolder::GetEnvelope(
+    util::EncryptedMessageMaker *encrypter) {
+  if (envelope_read_) {
+    return envelope_;
+  }
+
+  ObservationEncrypter observation_encrypter(encrypter, store_->encryption_worker_pool());
+  std::unordered_map<std::string, ObservationBatch *> batch_map;
+  for (const auto &[file_name, file_size] : files_) {
+    ReadFile(file_name, file_size, &observation_encrypter, &envelope_, &batch_map);
+  }
+  observation_encrypter.Finish();
+
   envelope_read_ = true;
   return envelope_;
 }
 
-size_t FileObservationStore::FileEnvelopeHolder::Size() {
-  if (cached_file_size_ != 0) {
-    return cached_file_size_;
+void FileObservationStore::FileEnvelopeHolder::SerializeEnvelope(
+    util::EncryptedMessageMaker *encrypter, std::string *serialized,
+    std::vector<BatchSummary> *batches) {
+  if (envelope_read_) {
+    EnvelopeHolder::SerializeEnvelope(encrypter, serialized, batches);
+    return;
   }
 
-  cached_file_size_ = 0;
-  for (const auto &file_name : file_names_) {
-    cached_file_size_ += fs_->FileSize(FullPath(file_name)).ConsumeValueOr(0);
+  // The files are read and serialized one at a time, so that only the observations of one file are
+  // held in memory besides |serialized|. The serializations of Envelopes concatenate to the
+  // serialization of an Envelope holding all of their batches.
+  serialized->reserve(serialized->size() + size_);
+  ObservationEncrypter observation_encrypter(encrypter, store_->encryption_worker_pool());
+  Envelope file_envelope;
+  std::unordered_map<std::string, ObservationBatch *> batch_map;
+  for (const auto &[file_name, file_size] : files_) {
+    ReadFile(file_name, file_size, &observation_encrypter, &file_envelope, &batch_map);
+    observation_encrypter.Finish();
+    AppendEnvelope(file_envelope, serialized, batches);
+    file_envelope.Clear();
+    batch_map.clear();
   }
-  return cached_file_size_;
 }
 
+size_t FileObservationStore::FileEnvelopeHolder::Size() { return size_; }
+
 void FileObservationStore::DeleteData() {
   LOG(INFO) << "FileObservationStore: Deleting stored data";
 
+  for (auto &shard : writer_shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    buffered_bytes_ -= shard->buffer.records.size();
+    shard->buffer = WriterBuffer();
+  }
   auto fields = protected_fields_.lock();
 
   FinalizeActiveFile(&fields);
@@ -426,8 +1073,11 @@ void FileObservationStore::DeleteData() {
   fields->metadata_written = false;
   fields->last_written_metadata = "";
   fields->active_file = nullptr;
+  fields->finalized_files = {};
   fields->files_taken = {};
+  fields->files_to_compress = {};
   fields->finalized_bytes = 0;
+  UpdateSize(&fields);
 
   auto files = fs_->ListFiles(root_directory_).ConsumeValueOr({});
   for (const auto &file : files) {
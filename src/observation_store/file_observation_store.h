@@ -5,21 +5,25 @@
 #ifndef COBALT_SRC_OBSERVATION_STORE_FILE_OBSERVATION_STORE_H_
 #define COBALT_SRC_OBSERVATION_STORE_FILE_OBSERVATION_STORE_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <random>
-#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "google/protobuf/io/zero_copy_stream.h"
-#include "src/lib/statusor/statusor.h"
 #include "src/lib/util/file_system.h"
 #include "src/lib/util/protected_fields.h"
 #include "src/logger/internal_metrics.h"
 #include "src/observation_store/envelope_maker.h"
 #include "src/observation_store/observation_store.h"
+#include "src/observation_store/sync_policy.h"
 #include "third_party/protobuf/src/google/protobuf/io/zero_copy_stream_impl.h"
 
 namespace cobalt::observation_store {
@@ -27,6 +31,22 @@ namespace cobalt::observation_store {
 // FileObservationStore is an implementation of ObservationStore that persists
 // observations to a file system.
 //
+// Each file starts with a marker record, followed by records which are each framed by their size
+// and CRC-32. A record with a bad checksum is skipped when reading, and a torn record at the end of
+// a file, left by a crash in the middle of a write, is ignored. Files written before framing was
+// introduced consist of length-delimited records and are still readable.
+//
+// Unless a SyncPolicy is set, concurrent writers do not append their observations to the active
+// file one at a time. Each writer appends its records to the buffer of one of several writer
+// shards, chosen by thread, and the buffer is appended to the active file as a whole once it is
+// full, or when its observations are needed by TakeNextEnvelopeHolder(). The buffered observations
+// count towards the size of the store, but are lost if the process terminates before they are
+// appended.
+//
+// The store keeps an in-memory index of the finalized files and their sizes, which is built once
+// at construction time. Files added to the root directory by anything other than the store
+// afterwards are only picked up the next time a store is constructed.
+//
 // The store returns FileEnvelopeHolders from calls to TakeNextEnvelopeHolder().
 // As long as there are FileEnvelopeHolders that have not been returned or
 // deleted, the store should not be destroyed.
@@ -37,7 +57,7 @@ class FileObservationStore : public ObservationStore {
   // FileEnvelopeHolder is an implementation of
   // ObservationStore::EnvelopeHolder.
   //
-  // It represents the envelope as a list of filenames. The observations are not
+  // It represents the envelope as a list of filenames and their sizes. The observations are not
   // actually read into memory until a call to GetEnvelope() is made.
   //
   // Note: This object is not thread safe.
@@ -53,13 +73,16 @@ class FileObservationStore : public ObservationStore {
     // (e.g. /system/data/cobalt_legacy)
     //
     // |file_name|. The file name for the file containing the observations.
+    //
+    // |file_size|. The size in bytes of the file, as recorded in the index of the store.
     FileEnvelopeHolder(util::FileSystem *fs, FileObservationStore *store,
-                       std::string root_directory, const std::string &file_name)
+                       std::string root_directory, const std::string &file_name, size_t file_size)
         : fs_(fs),
           store_(store),
           root_directory_(std::move(root_directory)),
-          file_names_({file_name}),
-          envelope_read_(false) {
+          files_({{file_name, file_size}}),
+          envelope_read_(false),
+          size_(file_size) {
       CHECK(store_);
     }
 
@@ -67,24 +90,44 @@ class FileObservationStore : public ObservationStore {
 
     void MergeWith(std::unique_ptr<EnvelopeHolder> container) override;
     const Envelope &GetEnvelope(util::EncryptedMessageMaker *encrypter) override;
+    // Reads and serializes the files one at a time. Observations with the same metadata in
+    // different files are serialized in separate ObservationBatches.
+    void SerializeEnvelope(util::EncryptedMessageMaker *encrypter, std::string *serialized,
+                           std::vector<BatchSummary> *batches) override;
     size_t Size() override;
-    const std::set<std::string> &file_names() { return file_names_; }
-    void clear() { file_names_.clear(); }
+    // The names of the files, which are never reused and whose contents do not change once they
+    // are finalized.
+    [[nodiscard]] std::string ContentKey() const override;
+    // The names of the files of this envelope, mapped to their sizes.
+    const std::map<std::string, size_t> &files() { return files_; }
+    void clear() {
+      files_.clear();
+      size_ = 0;
+    }
 
    private:
     std::string FullPath(const std::string &filename) const;
 
+    // Adds the observations of the file |file_name|, whose size in the index of the store is
+    // |stored_size|, to |envelope|. The observations stored unencrypted are added to |encrypter|.
+    // |batch_map| maps the serialized metadata of the batches of |envelope| to the batches, and is
+    // updated with the batches that are added.
+    void ReadFile(const std::string &file_name, size_t stored_size, ObservationEncrypter *encrypter,
+                  Envelope *envelope,
+                  std::unordered_map<std::string, ObservationBatch *> *batch_map);
+
     util::FileSystem *fs_;
     FileObservationStore *store_;
     const std::string root_directory_;
 
-    // file_names contains a set of file names that contain observations.
-    // These files should all be read into |envelope| when GetEnvelope is
+    // files_ maps the names of the files that contain observations to their
+    // sizes. These files should all be read into |envelope| when GetEnvelope is
     // called.
-    std::set<std::string> file_names_;
+    std::map<std::string, size_t> files_;
     bool envelope_read_;
     Envelope envelope_;
-    size_t cached_file_size_ = 0;
+    // The total size of |files_|.
+    size_t size_;
   };
 
  public:
@@ -118,10 +161,17 @@ class FileObservationStore : public ObservationStore {
   //
   // |name| is used in log messages to distinguish this instance of
   // FileObservationStore.
+  //
+  // |use_manifest|. If true, the index of finalized files is saved to a manifest file in
+  // |root_directory| when the store is destroyed, and the next store constructed on the same
+  // directory loads the index from that manifest instead of listing the directory and reading the
+  // size of every file. The manifest is deleted as soon as it is loaded, so a store which did not
+  // shut down cleanly falls back to listing the directory.
   FileObservationStore(size_t max_bytes_per_observation, size_t max_bytes_per_envelope,
                        size_t max_bytes_total, util::FileSystem *fs, std::string root_directory,
                        std::string name = "FileObservationStore",
-                       logger::LoggerInterface *internal_logger = nullptr);
+                       logger::LoggerInterface *internal_logger = nullptr,
+                       bool use_manifest = false);
 
   // DEPRECATED: Use non-owned FileSystem
   FileObservationStore(size_t max_bytes_per_observation, size_t max_bytes_per_envelope,
@@ -134,10 +184,13 @@ class FileObservationStore : public ObservationStore {
     owned_fs_ = std::move(owned_fs);
   }
 
+  ~FileObservationStore() override;
+
   using ObservationStore::StoreObservation;
   StoreStatus StoreObservation(std::unique_ptr<StoredObservation> observation,
                                std::unique_ptr<ObservationMetadata> metadata) override;
-  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder() override;
+  using ObservationStore::TakeNextEnvelopeHolder;
+  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder(size_t max_bytes) override;
   void ReturnEnvelopeHolder(std::unique_ptr<EnvelopeHolder> envelopes) override;
 
   size_t Size() const override;
@@ -145,15 +198,42 @@ class FileObservationStore : public ObservationStore {
 
   void DeleteData() override;
 
+  // Sets the policy for syncing stored observations to durable storage. The default is
+  // SyncPolicy::kNone. With any other policy, observations are appended to the active file as they
+  // are stored instead of being buffered by writer shards. Syncing requires
+  // FileSystem::FlushProtoOutputStream() and FileSystem::SyncFile() to be supported by the
+  // FileSystem.
+  void SetSyncPolicy(SyncPolicy sync_policy);
+
+  // If |compress| is true, each file is gzip-compressed after it is finalized, unless that does not
+  // make it smaller. The compression happens without holding the lock of the store, by the caller
+  // which finalized the file. A file finalized by TakeNextEnvelopeHolder() is handed out without
+  // being compressed, and is only compressed if it stays in the store because it did not fit in the
+  // EnvelopeHolder or was returned. Compressed files are decompressed as they are read by
+  // GetEnvelope(), and count towards max_bytes_total with their compressed size, but towards the
+  // size of an envelope with their uncompressed size. Files written with and without compression
+  // can be mixed in the same store.
+  void SetCompressFinalizedFiles(bool compress);
+
   void ResetInternalMetrics(logger::LoggerInterface *internal_logger) override {
     internal_metrics_ = logger::InternalMetrics::NewWithLogger(internal_logger);
   }
 
   // ListFinalizedFiles lists all files in root directory that match the format
   // <13-digit timestamp>-<7 digit random number>.data
+  //
+  // This lists the directory, and is not used by the store after construction.
   std::vector<std::string> ListFinalizedFiles() const;
 
  private:
+  // The sizes of a finalized file.
+  struct FileSizes {
+    // The size of the records of the file, which is what they add to an envelope.
+    size_t size;
+    // The size of the file on disk, which is smaller than |size| if the file is compressed.
+    size_t disk_size;
+  };
+
   struct Fields {
     bool metadata_written;
     // last_written_metadata is a string encoding of the last metadata written
@@ -161,28 +241,158 @@ class FileObservationStore : public ObservationStore {
     // metadata, it is not necessary to write it again.
     std::string last_written_metadata;
     std::unique_ptr<google::protobuf::io::ZeroCopyOutputStream> active_file;
-    // files_taken lists the filenames that have been "Taken" from the store.
-    // These should not be used to construct EnvelopeHolders for
-    // TakeNextEnvelopeHolder(). If an EnvelopeHolder is returned, the
-    // associated file names should also be removed from this list.
-    std::set<std::string> files_taken;
-    // The total size in bytes of the finalized files. This should be kept up to
-    // date as files are added to/removed from the store.
+    // finalized_files maps the names of the finalized files which have not
+    // been "Taken" from the store to their sizes. File names are prefixed with
+    // a fixed-width timestamp, so the first entry is the oldest file.
+    std::map<std::string, FileSizes> finalized_files;
+    // files_taken maps the filenames that have been "Taken" from the store to
+    // their sizes. If an EnvelopeHolder is returned, the associated files are
+    // moved back to |finalized_files|.
+    std::map<std::string, FileSizes> files_taken;
+    // The total size in bytes on disk of the finalized files, whether taken or
+    // not. This should be kept up to date as files are added to/removed from
+    // the store.
     size_t finalized_bytes;
+
+    SyncPolicy sync_policy;
+    // Records appended to the active file are numbered consecutively. These are
+    // the numbers of the last appended record and of the last record known to
+    // be on durable storage.
+    uint64_t last_appended_record = 0;
+    uint64_t last_synced_record = 0;
+    // The size of the observations appended since the last sync.
+    size_t bytes_since_sync = 0;
+    std::chrono::steady_clock::time_point last_sync_time;
+    // True while a caller of SyncRecords() is syncing a batch of records
+    // without holding the lock.
+    bool sync_in_progress = false;
+    // Notified when a batch of records has been synced.
+    std::condition_variable_any sync_notifier;
+
+    bool compress_finalized_files = false;
+    // The names of the finalized files waiting to be compressed, oldest first.
+    std::deque<std::string> files_to_compress;
+    // True while a caller of CompressPendingFiles() is compressing a file without holding the lock.
+    bool compression_in_progress = false;
+
+    // The counts of the observations which were appended directly to the active file.
+    ObservationCounts observation_counts;
+  };
+
+  // Framed records waiting to be appended to the active file together.
+  struct WriterBuffer {
+    // Framed metadata and observation records. The first record is always a metadata record.
+    std::string records;
+    // The serialized metadata of the first and last metadata records in |records|, and the size of
+    // the first one, which is not appended if the active file already ends with the same metadata.
+    std::string first_metadata;
+    std::string last_metadata;
+    size_t first_metadata_size = 0;
+    // The number of observation records in |records|, and the size of their observations.
+    uint64_t num_records = 0;
+    size_t observation_bytes = 0;
   };
 
+  // The buffer of the writers which are mapped to this shard, the counts of the observations which
+  // they added to the store, and the lock which guards them. A shard's mutex may be held while
+  // locking |protected_fields_|, but not the other way around.
+  struct WriterShard {
+    std::mutex mutex;
+    WriterBuffer buffer;
+    ObservationCounts observation_counts;
+  };
+
+  static constexpr size_t kMaxWriterShards = 16;
+  // The largest size at which a writer buffer is appended to the active file.
+  static constexpr size_t kWriterBufferSize = 16 * 1024;
+
   util::ProtectedFields<Fields> protected_fields_;
 
-  // GetOldestFinalizedFile returns a file name for the oldest file in the
-  // store.
-  lib::statusor::StatusOr<std::string> GetOldestFinalizedFile(
-      util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+  // The size of the store, not counting the writer buffers, updated whenever it changes so that
+  // Size() does not need the lock.
+  std::atomic<size_t> size_{0};
+
+  std::vector<std::unique_ptr<WriterShard>> writer_shards_;
+  // True if observations are stored through the writer buffers, which is only the case under
+  // SyncPolicy::kNone. Read and changed with the mutex of a writer shard held.
+  std::atomic<bool> buffer_writes_{true};
+  // The total size of the writer buffers.
+  std::atomic<size_t> buffered_bytes_{0};
+  // The size at which a writer buffer is appended to the active file, which leaves room for several
+  // buffers in a file.
+  const size_t writer_buffer_size_;
+
+  void AddObservationCounts(ObservationCounts *counts) const override;
+  void ClearObservationCounts() override;
+
+  // Returns the writer shard used by the calling thread.
+  WriterShard &ShardForThisThread();
+
+  // Adds the framed observation record |framed_observation|, whose observation has size
+  // |observation_size|, to the buffer of |shard|, preceded by a record for |metadata| if needed.
+  // Appends the buffer to the active file if that makes it full, and sets |finalized| if this
+  // finalized the active file. Must be called with the mutex of |shard| held.
+  StoreStatus BufferObservation(WriterShard *shard, const std::string &framed_observation,
+                                size_t observation_size,
+                                std::unique_ptr<ObservationMetadata> metadata,
+                                std::string metadata_str, bool *finalized);
+
+  // Appends the records of |buffer| to the active file and clears |buffer|, then finalizes the
+  // active file if it is full and sets |finalized|. A file therefore exceeds max_bytes_per_envelope
+  // by less than one buffer. Returns false if the records could not be written, in which case they
+  // are lost.
+  bool AppendWriterBuffer(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                          WriterBuffer *buffer, bool *finalized);
+
+  // Appends the buffer of every writer shard to the active file. Must be called without holding
+  // the lock of the store.
+  void FlushWriterBuffers();
+
+  // Populates |finalized_files| from the manifest if |use_manifest_| is true and a manifest exists,
+  // and otherwise by listing the root directory.
+  void LoadIndex(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Writes the index of finalized files to the manifest.
+  void WriteManifest(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Blocks until every record up to |record| is on durable storage. If no other caller is syncing
+  // the active file, this caller syncs all of the records appended so far as one batch, releasing
+  // the lock of |fields| during the sync. Returns false if the records could not be synced.
+  bool SyncRecords(util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t record);
+
+  // Records that every record up to |record| is on durable storage.
+  void MarkSynced(util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t record);
+
+  // Recomputes |size_| from |finalized_bytes| and the size of the active file.
+  void UpdateSize(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Adds a finalized file to the index.
+  void AddFinalizedFile(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                        const std::string &file_name, FileSizes sizes);
+
+  // Returns the size of the records of the finalized file |file_name|, whose size on disk is
+  // |disk_size|. This is read from the trailer of the file if it is compressed.
+  size_t ReadUncompressedSize(const std::string &file_name, size_t disk_size);
 
   // FullPath returns the absolute path to the filename by prefixing the file
   // name with the root directory.
   std::string FullPath(const std::string &filename) const;
 
-  bool FinalizeActiveFile(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+  // Closes the active file and adds it to the finalized files. Unless |compress| is false, the file
+  // is queued for compression if |compress_finalized_files| is set.
+  bool FinalizeActiveFile(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                          bool compress = true);
+
+  // Compresses the files of |files_to_compress| which have not been taken, one at a time and
+  // without holding the lock. Each file is replaced with its gzip compression, if that is smaller
+  // and the file has not been taken or deleted in the meantime. Returns immediately if another
+  // caller is already compressing the files. Must be called without holding the lock.
+  void CompressPendingFiles();
+
+  // Writes the gzip compression of the finalized file |file_name| of size |file_size| to the
+  // temporary file, syncing it if |sync| is true. Returns the size of the compressed file, or 0 if
+  // it was not written or is not smaller than |file_size|, in which case it has been deleted.
+  size_t WriteCompressedFile(const std::string &file_name, size_t file_size, bool sync);
 
   // GetActiveFile returns a pointer to the current OstreamOutputStream. If the
   // file is not yet opened, it will be opened by this function.
@@ -196,7 +406,9 @@ class FileObservationStore : public ObservationStore {
   util::FileSystem *fs_;
   const std::string root_directory_;
   const std::string active_file_name_;
+  const std::string manifest_file_name_;
   const std::string name_;
+  const bool use_manifest_;
   FilenameGenerator filename_generator_;
 
   std::unique_ptr<logger::InternalMetrics> internal_metrics_;
@@ -6,7 +6,9 @@
 
 #include <fstream>
 #include <random>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/util/delimited_message_util.h"
 #include "src/lib/util/posix_file_system.h"
@@ -43,6 +45,16 @@ std::string GetTestDirName(const std::string &base) {
   return fname.str();
 }
 
+// A PosixFileSystem whose SyncFile() can be made to fail.
+class SyncFailingFileSystem : public PosixFileSystem {
+ public:
+  bool SyncFile(const std::string &file) override {
+    return !fail_sync && PosixFileSystem::SyncFile(file);
+  }
+
+  bool fail_sync = false;
+};
+
 class FileObservationStoreTest : public ::testing::Test {
  public:
   FileObservationStoreTest()
@@ -51,9 +63,12 @@ class FileObservationStoreTest : public ::testing::Test {
     MakeStore();
   }
 
-  void MakeStore() {
-    store_ = std::make_unique<FileObservationStore>(kMaxBytesPerObservation, kMaxBytesPerEnvelope,
-                                                    kMaxBytesTotal, &fs_, test_dir_name_);
+  void MakeStore(bool use_manifest = false) {
+    // Destroy the previous store first, so that it can write its manifest.
+    store_ = nullptr;
+    store_ = std::make_unique<FileObservationStore>(
+        kMaxBytesPerObservation, kMaxBytesPerEnvelope, kMaxBytesTotal, &fs_, test_dir_name_,
+        "FileObservationStore", /*internal_logger=*/nullptr, use_manifest);
   }
 
   void TearDown() override {
@@ -78,7 +93,7 @@ class FileObservationStoreTest : public ::testing::Test {
   }
 
  protected:
-  PosixFileSystem fs_;
+  SyncFailingFileSystem fs_;
   std::string test_dir_name_;
   std::unique_ptr<FileObservationStore> store_;
   std::unique_ptr<util::EncryptedMessageMaker> encrypt_;
@@ -218,7 +233,7 @@ TEST_F(FileObservationStoreTest, AddWhileEnvelopeTaken) {
   // Note that kNumObservationsThatWillFit is discovered by experiment
   // since the precise size of an observation is awkward to arrange since
   // it depends on protobuf serialization.
-  constexpr int kNumObservationsThatWillFit = 96;
+  constexpr int kNumObservationsThatWillFit = 88;
 
   // Fill the store until its full.
   for (int i = 0; i < kNumObservationsThatWillFit; i++) {
@@ -252,7 +267,7 @@ TEST_F(FileObservationStoreTest, StoreFull) {
   // Note that kNumObservationsThatWillFit is discovered by experiment
   // since the precise size of an observation is awkward to arrange since
   // it depends on protobuf serialization.
-  constexpr int kNumObservationsThatWillFit = 96;
+  constexpr int kNumObservationsThatWillFit = 88;
 
   // Fill the store until its full.
   for (int i = 0; i < kNumObservationsThatWillFit; i++) {
@@ -281,8 +296,8 @@ TEST_F(FileObservationStoreTest, StoreFull) {
   // we take one envelope. At some point in this process we expect the
   // store to become full. Again these constants are determined by
   // experimentation.
-  constexpr int kExpectedFullIteration = 18;
-  constexpr int kExpectedFullStep = 6;
+  constexpr int kExpectedFullIteration = 16;
+  constexpr int kExpectedFullStep = 8;
   constexpr int kNumStepsPerIteration = 10;
 
   int iteration = 0;
@@ -348,6 +363,9 @@ TEST_F(FileObservationStoreTest, IgnoresUnexpectedFiles) {
 
   { std::ofstream empty_valid(test_dir_name_ + "/1234567890123-1234567890.data"); }
   EXPECT_EQ(store_->ListFinalizedFiles().size(), 1u);
+  // Files are indexed when the store starts.
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+  MakeStore();
   EXPECT_NE(store_->TakeNextEnvelopeHolder(), nullptr);
 }
 
@@ -356,6 +374,7 @@ TEST_F(FileObservationStoreTest, HandlesCorruptFiles) {
     std::ofstream file(test_dir_name_ + "/1234567890123-1234567890.data");
     file << "CORRUPT DATA!!!";
   }
+  MakeStore();
   EXPECT_EQ(store_->ListFinalizedFiles().size(), 1u);
   auto env = store_->TakeNextEnvelopeHolder();
   ASSERT_NE(env, nullptr);
@@ -465,6 +484,7 @@ TEST_F(FileObservationStoreTest, CanReadWriteUnencrypted) {
     google::protobuf::util::SerializeDelimitedToZeroCopyStream(stored_observation, &outstream);
   }
 
+  MakeStore();
   ASSERT_EQ(store_->ListFinalizedFiles().size(), 1u);
   auto envelope = store_->TakeNextEnvelopeHolder();
   ASSERT_NE(envelope, nullptr);
@@ -476,6 +496,446 @@ TEST_F(FileObservationStoreTest, CanReadWriteUnencrypted) {
   ASSERT_EQ(read_env.batch(0).encrypted_observation(0).ciphertext(), encrypted_obs->ciphertext());
 }
 
+// With an EncryptionWorkerPool, the observations stored unencrypted are encrypted by the pool when
+// the envelope is read, and stay in the order in which they were stored.
+TEST_F(FileObservationStoreTest, EncryptsOnReadWithWorkerPool) {
+  util::EncryptionWorkerPool pool(2);
+  store_->SetEncryptionWorkerPool(&pool);
+  std::vector<std::string> expected;
+  for (int i = 0; i < 10; i++) {
+    auto observation = std::make_unique<Observation2>();
+    observation->set_random_id("test" + std::to_string(i));
+    expected.push_back(observation->SerializeAsString());
+
+    auto metadata = std::make_unique<ObservationMetadata>();
+    metadata->set_customer_id(kCustomerId);
+    metadata->set_project_id(kProjectId);
+    metadata->set_metric_id(kMetricId);
+    ASSERT_EQ(ObservationStore::kOk,
+              store_->StoreObservation(std::move(observation), std::move(metadata)));
+  }
+
+  auto envelope = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(envelope, nullptr);
+  const auto &read_env = envelope->GetEnvelope(encrypt_.get());
+  ASSERT_EQ(read_env.batch_size(), 1);
+  ASSERT_EQ(read_env.batch(0).encrypted_observation_size(), 10);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(read_env.batch(0).encrypted_observation(i).ciphertext(), expected[i]);
+  }
+  // The pool must outlive the store.
+  envelope = nullptr;
+  MakeStore();
+}
+
+// Envelopes are taken oldest first, and their sizes and the size of the store come from the index.
+TEST_F(FileObservationStoreTest, TakesOldestFileFirst) {
+  // No two of the files fit together in an envelope.
+  const size_t kFileSize = kMaxBytesPerEnvelope / 2 + 1;
+  for (const auto &file_name : {"0000000000002-1234567890.data", "0000000000001-1234567890.data",
+                                "0000000000003-1234567890.data"}) {
+    std::ofstream file(test_dir_name_ + "/" + file_name);
+    file << std::string(kFileSize, 'x');
+  }
+  MakeStore();
+  EXPECT_EQ(store_->Size(), 3 * kFileSize);
+
+  auto first = store_->TakeNextEnvelopeHolder();
+  auto second = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_EQ(first->Size(), second->Size());
+
+  // Returning an envelope makes it the oldest available envelope again.
+  store_->ReturnEnvelopeHolder(std::move(first));
+  first = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(first, nullptr);
+  first->MergeWith(std::move(second));
+  EXPECT_EQ(first->Size(), 2 * kFileSize);
+
+  // Deleting the merged envelope removes both files from the store.
+  first = nullptr;
+  EXPECT_EQ(store_->Size(), kFileSize);
+  EXPECT_EQ(store_->ListFinalizedFiles().size(), 1u);
+  EXPECT_NE(store_->TakeNextEnvelopeHolder(), nullptr);
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+}
+
+// An envelope which is returned and taken again has the same content key, and one holding other
+// files has a different one.
+TEST_F(FileObservationStoreTest, ContentKeyIdentifiesFiles) {
+  const size_t kFileSize = kMaxBytesPerEnvelope / 2 + 1;
+  for (const auto &file_name : {"0000000000001-1234567890.data", "0000000000002-1234567890.data"}) {
+    std::ofstream file(test_dir_name_ + "/" + file_name);
+    file << std::string(kFileSize, 'x');
+  }
+  MakeStore();
+
+  auto first = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(first, nullptr);
+  std::string first_key = first->ContentKey();
+  EXPECT_FALSE(first_key.empty());
+  store_->ReturnEnvelopeHolder(std::move(first));
+
+  first = store_->TakeNextEnvelopeHolder();
+  auto second = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_EQ(first->ContentKey(), first_key);
+  EXPECT_NE(second->ContentKey(), first_key);
+  store_->ReturnEnvelopeHolder(std::move(first));
+  store_->ReturnEnvelopeHolder(std::move(second));
+}
+
+// Small files are packed together up to kMaxBytesPerEnvelope. The oldest file is always taken
+// first, together with the largest of the newer files which still fit.
+TEST_F(FileObservationStoreTest, PacksSmallFiles) {
+  const std::vector<std::pair<std::string, size_t>> files = {
+      {"0000000000001-1234567890.data", 100},
+      {"0000000000002-1234567890.data", 350},
+      {"0000000000003-1234567890.data", 150},
+      {"0000000000004-1234567890.data", 250},
+  };
+  for (const auto &[file_name, file_size] : files) {
+    std::ofstream file(test_dir_name_ + "/" + file_name);
+    file << std::string(file_size, 'x');
+  }
+  MakeStore();
+
+  // The files of 100 and 250 bytes. The file of 350 bytes does not fit with the oldest one.
+  auto holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  EXPECT_EQ(holder->Size(), 350u);
+  holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  EXPECT_EQ(holder->Size(), 350u);
+  holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  EXPECT_EQ(holder->Size(), 150u);
+  holder = nullptr;
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+  EXPECT_DOUBLE_EQ(store_->average_envelope_fill_ratio(), 850.0 / (3 * kMaxBytesPerEnvelope));
+}
+
+// A store which uses a manifest loads its index from the manifest written by the previous store,
+// instead of listing the directory.
+TEST_F(FileObservationStoreTest, LoadsIndexFromManifest) {
+  MakeStore(/*use_manifest=*/true);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(100));
+  }
+  auto finalized_files = store_->ListFinalizedFiles();
+  ASSERT_GT(finalized_files.size(), 1u);
+  size_t size = store_->Size();
+
+  // The manifest is written when the store is destroyed.
+  store_ = nullptr;
+  ASSERT_TRUE(fs_.FileExists(test_dir_name_ + "/manifest.pb"));
+
+  // A file which is not listed in the manifest is not picked up.
+  { std::ofstream unlisted(test_dir_name_ + "/0000000000001-1234567890.data"); }
+  MakeStore(/*use_manifest=*/true);
+  EXPECT_FALSE(fs_.FileExists(test_dir_name_ + "/manifest.pb"));
+  EXPECT_EQ(store_->Size(), size);
+
+  size_t num_envelopes = 0;
+  while (auto holder = store_->TakeNextEnvelopeHolder()) {
+    EXPECT_GT(holder->GetEnvelope(encrypt_.get()).batch_size(), 0);
+    num_envelopes++;
+  }
+  // The in-progress file is finalized when the second store starts.
+  EXPECT_EQ(num_envelopes, finalized_files.size() + 1);
+  EXPECT_EQ(store_->Size(), 0u);
+}
+
+// Without a manifest, for example after a crash, a store which uses a manifest lists the
+// directory.
+TEST_F(FileObservationStoreTest, ListsDirectoryWithoutManifest) {
+  { std::ofstream file(test_dir_name_ + "/0000000000001-1234567890.data"); }
+  MakeStore(/*use_manifest=*/true);
+  EXPECT_NE(store_->TakeNextEnvelopeHolder(), nullptr);
+}
+
+// A record with a bad checksum is skipped, and reading resumes at the next metadata record instead
+// of discarding the rest of the file. A torn record at the end of a file is ignored.
+TEST_F(FileObservationStoreTest, SkipsCorruptRecordsAndTornTail) {
+  const size_t kObservationSize = 50;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kObservationSize));
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kObservationSize));
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kObservationSize, kMetricId + 1));
+  // Restart the store, finalizing the in-progress file.
+  MakeStore();
+  auto files = store_->ListFinalizedFiles();
+  ASSERT_EQ(files.size(), 1u);
+  std::string path = test_dir_name_ + "/" + files[0];
+
+  // The sizes of the last metadata record and of each observation record, including their 8-byte
+  // frames.
+  FileObservationStoreRecord metadata_record;
+  metadata_record.mutable_meta_data()->set_customer_id(kCustomerId);
+  metadata_record.mutable_meta_data()->set_project_id(kProjectId);
+  metadata_record.mutable_meta_data()->set_metric_id(kMetricId + 1);
+  size_t metadata_record_size = metadata_record.ByteSizeLong() + 8;
+  FileObservationStoreRecord observation_record;
+  observation_record.mutable_encrypted_observation()->set_ciphertext(
+      std::string(kObservationSize - 4, 'x'));
+  size_t observation_record_size = observation_record.ByteSizeLong() + 8;
+  {
+    // Corrupt the last byte of the second observation, and append a torn record.
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(-static_cast<std::streamoff>(metadata_record_size + observation_record_size + 1),
+               std::ios::end);
+    file.put('y');
+    file.seekp(0, std::ios::end);
+    file.write("\x10\x00\x00", 3);
+  }
+
+  MakeStore();
+  auto holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  auto envelope = holder->GetEnvelope(encrypt_.get());
+  ASSERT_EQ(envelope.batch_size(), 2);
+  EXPECT_EQ(envelope.batch(0).meta_data().metric_id(), kMetricId);
+  EXPECT_EQ(envelope.batch(0).encrypted_observation_size(), 1);
+  EXPECT_EQ(envelope.batch(1).meta_data().metric_id(), kMetricId + 1);
+  EXPECT_EQ(envelope.batch(1).encrypted_observation_size(), 1);
+}
+
+// Compressed files count towards the size of the store with their compressed size, and are read
+// back transparently, alongside uncompressed files and across a restart. Envelopes are packed by
+// the uncompressed size of the files, whether it is loaded from the manifest or from the files.
+TEST_F(FileObservationStoreTest, CompressesFinalizedFiles) {
+  for (bool use_manifest : {false, true}) {
+    MakeStore(use_manifest);
+    store_->SetCompressFinalizedFiles(true);
+    for (int i = 0; i < 8; i++) {
+      EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+    }
+    ASSERT_EQ(store_->ListFinalizedFiles().size(), 2u);
+    size_t compressed_size = store_->Size();
+    EXPECT_LT(compressed_size, 4 * kMaxBytesPerObservation);
+
+    store_->SetCompressFinalizedFiles(false);
+    for (int i = 0; i < 4; i++) {
+      EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+    }
+    EXPECT_GT(store_->Size(), compressed_size + 4 * kMaxBytesPerObservation);
+
+    MakeStore(use_manifest);
+    // Each file holds a full envelope, so the compressed files are not packed together.
+    for (int i = 0; i < 3; i++) {
+      auto holder = store_->TakeNextEnvelopeHolder();
+      ASSERT_NE(holder, nullptr);
+      EXPECT_GE(holder->Size(), kMaxBytesPerEnvelope);
+      const auto &envelope = holder->GetEnvelope(encrypt_.get());
+      ASSERT_EQ(envelope.batch_size(), 1);
+      ASSERT_EQ(envelope.batch(0).encrypted_observation_size(), 4);
+      EXPECT_EQ(envelope.batch(0).encrypted_observation(0).ciphertext(),
+                std::string(kMaxBytesPerObservation - 4, 'x'));
+    }
+    EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+    EXPECT_EQ(store_->Size(), 0u);
+  }
+}
+
+// A file finalized to be taken right away is handed out uncompressed, and only compressed once it
+// is returned to the store.
+TEST_F(FileObservationStoreTest, CompressesTakenFilesOnlyWhenReturned) {
+  store_->SetCompressFinalizedFiles(true);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  size_t uncompressed_size = store_->Size();
+  auto holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  ASSERT_EQ(holder->GetEnvelope(encrypt_.get()).batch(0).encrypted_observation_size(), 2);
+  store_->ReturnEnvelopeHolder(std::move(holder));
+  EXPECT_EQ(store_->Size(), uncompressed_size);
+
+  // The returned file is compressed by the caller which finalizes the next file.
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  ASSERT_EQ(store_->ListFinalizedFiles().size(), 2u);
+  EXPECT_LT(store_->Size(), uncompressed_size);
+}
+
+// SerializeEnvelope() serializes the same observations as GetEnvelope(), one file at a time.
+TEST_F(FileObservationStoreTest, SerializeEnvelope) {
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation, kMetricId + i % 2));
+  }
+  auto holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  auto second = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(second, nullptr);
+  holder->MergeWith(std::move(second));
+
+  std::string serialized;
+  std::vector<ObservationStore::EnvelopeHolder::BatchSummary> batches;
+  holder->SerializeEnvelope(encrypt_.get(), &serialized, &batches);
+  Envelope streamed;
+  ASSERT_TRUE(streamed.ParseFromString(serialized));
+  // Each of the two files holds observations of two metrics.
+  ASSERT_EQ(streamed.batch_size(), 4);
+  ASSERT_EQ(batches.size(), 4u);
+  size_t num_observations = 0;
+  for (int i = 0; i < streamed.batch_size(); i++) {
+    EXPECT_EQ(batches[i].customer_id, kCustomerId);
+    EXPECT_EQ(batches[i].project_id, kProjectId);
+    EXPECT_EQ(batches[i].size, streamed.batch(i).ByteSizeLong());
+    num_observations += streamed.batch(i).encrypted_observation_size();
+  }
+
+  // GetEnvelope() merges the batches with the same metadata across files.
+  const auto &envelope = holder->GetEnvelope(encrypt_.get());
+  ASSERT_EQ(envelope.batch_size(), 2);
+  EXPECT_EQ(num_observations, static_cast<size_t>(envelope.batch(0).encrypted_observation_size() +
+                                                  envelope.batch(1).encrypted_observation_size()));
+
+  // Once the envelope has been read, it is the one which is serialized.
+  serialized.clear();
+  batches.clear();
+  holder->SerializeEnvelope(encrypt_.get(), &serialized, &batches);
+  EXPECT_EQ(serialized, envelope.SerializeAsString());
+  EXPECT_EQ(batches.size(), 2u);
+}
+
+// With SyncPolicy::kBytes, the stored observations are flushed to the file once the threshold is
+// reached.
+TEST_F(FileObservationStoreTest, SyncAfterBytes) {
+  SyncPolicy policy;
+  policy.mode = SyncPolicy::kBytes;
+  policy.bytes = 150;
+  store_->SetSyncPolicy(policy);
+  std::string active_file = test_dir_name_ + "/in_progress.data";
+
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+  EXPECT_LT(fs_.FileSize(active_file).ConsumeValueOr(0), store_->Size());
+
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+  EXPECT_EQ(fs_.FileSize(active_file).ConsumeValueOr(0), store_->Size());
+}
+
+// With SyncPolicy::kEveryBatch, each observation is on disk when StoreObservation() returns, and
+// concurrent writers are all accounted for.
+TEST_F(FileObservationStoreTest, SyncEveryBatchWithConcurrentWriters) {
+  SyncPolicy policy;
+  policy.mode = SyncPolicy::kEveryBatch;
+  store_->SetSyncPolicy(policy);
+  std::string active_file = test_dir_name_ + "/in_progress.data";
+
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+  EXPECT_EQ(fs_.FileSize(active_file).ConsumeValueOr(0), store_->Size());
+
+  const int kNumThreads = 8;
+  const int kObservationsPerThread = 20;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this] {
+      for (int j = 0; j < kObservationsPerThread; j++) {
+        EXPECT_EQ(ObservationStore::kOk, AddObservation(20));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  int num_observations = 0;
+  while (auto holder = store_->TakeNextEnvelopeHolder()) {
+    for (const auto &batch : holder->GetEnvelope(encrypt_.get()).batch()) {
+      num_observations += batch.encrypted_observation_size();
+    }
+  }
+  EXPECT_EQ(num_observations, 1 + kNumThreads * kObservationsPerThread);
+}
+
+// With SyncPolicy::kEveryBatch, StoreObservation() reports a failure to sync its observation. The
+// observation is still stored and counted.
+TEST_F(FileObservationStoreTest, SyncEveryBatchFailure) {
+  SyncPolicy policy;
+  policy.mode = SyncPolicy::kEveryBatch;
+  store_->SetSyncPolicy(policy);
+
+  fs_.fail_sync = true;
+  EXPECT_EQ(ObservationStore::kStoredNotDurable, AddObservation(60));
+  fs_.fail_sync = false;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+  EXPECT_EQ(store_->num_observations_added(), 2u);
+
+  // With a policy which does not promise durability, a failed sync is not reported.
+  policy.mode = SyncPolicy::kBytes;
+  policy.bytes = 1;
+  store_->SetSyncPolicy(policy);
+  fs_.fail_sync = true;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(60));
+}
+
+// Without a SyncPolicy, the observations of concurrent writers are buffered by writer shards. They
+// count towards the size of the store, are counted per report, and are appended to the active file
+// when the store is destroyed.
+TEST_F(FileObservationStoreTest, BufferedObservationsFromConcurrentWriters) {
+  const size_t kLargeMaxBytesPerEnvelope = 100000;
+  store_ = std::make_unique<FileObservationStore>(kMaxBytesPerObservation,
+                                                  kLargeMaxBytesPerEnvelope, kMaxBytesTotal * 10,
+                                                  &fs_, test_dir_name_);
+
+  const int kNumThreads = 8;
+  const int kObservationsPerThread = 20;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this] {
+      for (int j = 0; j < kObservationsPerThread; j++) {
+        EXPECT_EQ(ObservationStore::kOk, AddObservation(20, kMetricId + j % 2));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_GT(store_->Size(), kNumThreads * kObservationsPerThread * 20u);
+  EXPECT_EQ(store_->num_observations_added(), kNumThreads * kObservationsPerThread);
+
+  MakeStore();
+  int num_observations = 0;
+  while (auto holder = store_->TakeNextEnvelopeHolder()) {
+    for (const auto &batch : holder->GetEnvelope(encrypt_.get()).batch()) {
+      num_observations += batch.encrypted_observation_size();
+    }
+  }
+  EXPECT_EQ(num_observations, kNumThreads * kObservationsPerThread);
+}
+
+// Measures the throughput of StoreObservation() with 1 to 32 concurrent writers. Run with
+// --gtest_also_run_disabled_tests.
+TEST_F(FileObservationStoreTest, DISABLED_WriterThroughput) {
+  const int kNumObservations = 64000;
+  const size_t kThroughputMaxBytesPerEnvelope = 64 * 1024;
+  for (int num_writers : {1, 2, 4, 8, 16, 32}) {
+    store_->DeleteData();
+    store_ = std::make_unique<FileObservationStore>(
+        kMaxBytesPerObservation, kThroughputMaxBytesPerEnvelope,
+        kNumObservations * kMaxBytesPerObservation, &fs_, test_dir_name_);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_writers; i++) {
+      threads.emplace_back([this, num_writers] {
+        for (int j = 0; j < kNumObservations / num_writers; j++) {
+          AddObservation(kMaxBytesPerObservation);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << "writers=" << num_writers << ": "
+              << static_cast<int64_t>(kNumObservations / elapsed.count()) << " observations/s";
+  }
+}
+
 TEST(FilenameGenerator, PadsTimestamp) {
   EXPECT_THAT(FileObservationStore::FilenameGenerator([] { return 1234; }).GenerateFilename(),
               MatchesRegex(R"(0000000001234-[0-9]{10}.data)"));
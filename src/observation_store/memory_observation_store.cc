@@ -4,6 +4,9 @@
 
 #include "src/observation_store/memory_observation_store.h"
 
+#include <algorithm>
+#include <functional>
+#include <thread>
 #include <utility>
 
 #include "src/logger/logger_interface.h"
@@ -20,12 +23,25 @@ constexpr float kSendThresholdPercent = 0.6;
 MemoryObservationStore::MemoryObservationStore(size_t max_bytes_per_observation,
                                                size_t max_bytes_per_envelope,
                                                size_t max_bytes_total,
-                                               logger::LoggerInterface* internal_logger)
+                                               logger::LoggerInterface* internal_logger,
+                                               size_t num_shards)
     : ObservationStore(max_bytes_per_observation, max_bytes_per_envelope, max_bytes_total),
       envelope_send_threshold_size_(size_t(kSendThresholdPercent * max_bytes_per_envelope_)),
-      current_envelope_(new EnvelopeMaker(max_bytes_per_observation, max_bytes_per_envelope)),
       finalized_envelopes_size_(0),
-      internal_metrics_(logger::InternalMetrics::NewWithLogger(internal_logger)) {}
+      size_(0),
+      internal_metrics_(logger::InternalMetrics::NewWithLogger(internal_logger)) {
+  if (num_shards == 0) {
+    num_shards = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxShards);
+  }
+  for (size_t i = 0; i < num_shards; i++) {
+    shards_.push_back(std::make_unique<Shard>());
+    shards_.back()->current_envelope = NewEnvelopeMaker();
+  }
+}
+
+MemoryObservationStore::Shard& MemoryObservationStore::ShardForThisThread() {
+  return *shards_[std::hash<std::thread::id>()(std::this_thread::get_id()) % shards_.size()];
+}
 
 ObservationStore::StoreStatus MemoryObservationStore::StoreObservation(
     std::unique_ptr<StoredObservation> observation, std::unique_ptr<ObservationMetadata> metadata) {
@@ -33,49 +49,61 @@ ObservationStore::StoreStatus MemoryObservationStore::StoreObservation(
     return kOk;
   }
 
-  std::unique_lock<std::mutex> lock(envelope_mutex_);
-
   internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Attempted,
-                                 SizeLocked(), metadata->customer_id(), metadata->project_id());
+                                 Size(), metadata->customer_id(), metadata->project_id());
 
-  if (SizeLocked() > max_bytes_total_) {
+  if (Size() > max_bytes_total_) {
     VLOG(4) << "MemoryObservationStore::StoreObservation(): Rejecting "
                "observation because the store is full. ("
-            << SizeLocked() << " > " << max_bytes_total_ << ")";
+            << Size() << " > " << max_bytes_total_ << ")";
     return kStoreFull;
   }
 
-  auto status_peek = current_envelope_->CanAddObservation(*observation);
+  uint32_t customer_id = metadata->customer_id();
+  uint32_t project_id = metadata->project_id();
+  auto report_id = metadata->report_id();
+
+  Shard& shard = ShardForThisThread();
+  std::unique_lock<std::mutex> shard_lock(shard.mutex);
+
+  auto status_peek = shard.current_envelope->CanAddObservation(*observation);
 
   if (status_peek == kStoreFull) {
     VLOG(4) << "MemoryObservationStore::StoreObservation(): Current "
                "envelope would return kStoreFull. Swapping it out for "
                "a new EnvelopeMaker";
-    AddEnvelopeToSend(std::move(current_envelope_));
-    current_envelope_ = NewEnvelopeMaker();
+    std::unique_lock<std::mutex> lock(envelope_mutex_);
+    AddEnvelopeToSend(std::move(shard.current_envelope));
+    shard.current_envelope = NewEnvelopeMaker();
   }
 
-  uint32_t customer_id = metadata->customer_id();
-  uint32_t project_id = metadata->project_id();
-  auto report_id = metadata->report_id();
+  size_t size_before = shard.current_envelope->Size();
+  auto status =
+      shard.current_envelope->StoreObservation(std::move(observation), std::move(metadata));
+  size_ += shard.current_envelope->Size() - size_before;
+  if (status == kOk) {
+    shard.observation_counts[report_id]++;
+  }
+  shard_lock.unlock();
 
-  auto status = current_envelope_->StoreObservation(std::move(observation), std::move(metadata));
   if (status == kOk) {
-    num_obs_per_report_[report_id]++;
     internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Succeeded,
-                                   SizeLocked(), customer_id, project_id);
+                                   Size(), customer_id, project_id);
   }
   return status;
 }
 
 std::unique_ptr<EnvelopeMaker> MemoryObservationStore::NewEnvelopeMaker() {
-  return std::make_unique<EnvelopeMaker>(max_bytes_per_observation_, max_bytes_per_envelope_);
+  auto envelope_maker =
+      std::make_unique<EnvelopeMaker>(max_bytes_per_observation_, max_bytes_per_envelope_);
+  envelope_maker->SetEncryptionWorkerPool(encryption_worker_pool());
+  return envelope_maker;
 }
 
-std::unique_ptr<ObservationStore::EnvelopeHolder>
-MemoryObservationStore::TakeOldestEnvelopeHolderLocked() {
-  auto retval = std::move(finalized_envelopes_.front());
-  finalized_envelopes_.pop_front();
+std::unique_ptr<ObservationStore::EnvelopeHolder> MemoryObservationStore::TakeEnvelopeHolderLocked(
+    size_t index) {
+  auto retval = std::move(finalized_envelopes_[index]);
+  finalized_envelopes_.erase(finalized_envelopes_.begin() + static_cast<std::ptrdiff_t>(index));
   if (retval->Size() > finalized_envelopes_size_) {
     finalized_envelopes_size_ = 0;
   } else {
@@ -93,56 +121,93 @@ void MemoryObservationStore::AddEnvelopeToSend(std::unique_ptr<EnvelopeHolder> h
   }
 }
 
-std::unique_ptr<ObservationStore::EnvelopeHolder> MemoryObservationStore::TakeNextEnvelopeHolder() {
-  std::unique_lock<std::mutex> lock(envelope_mutex_);
-
+std::unique_ptr<ObservationStore::EnvelopeHolder> MemoryObservationStore::TakeNextEnvelopeHolder(
+    size_t max_bytes) {
   auto retval = NewEnvelopeMaker();
   size_t retval_size = 0;
-  while (!finalized_envelopes_.empty() &&
-         (retval_size == 0 ||
-          (retval_size + finalized_envelopes_.front()->Size() <= max_bytes_per_envelope_))) {
-    retval->MergeWith(TakeOldestEnvelopeHolderLocked());
+  {
+    std::unique_lock<std::mutex> lock(envelope_mutex_);
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < finalized_envelopes_.size() && i < kPackingLookahead; i++) {
+      sizes.push_back(finalized_envelopes_[i]->Size());
+    }
+    // The chosen envelopes are removed from the last to the first so that the indices of the others
+    // stay valid, and are merged oldest first.
+    auto chosen = PackEnvelope(sizes, max_bytes);
+    if (chosen.empty() && !sizes.empty()) {
+      // The oldest envelope does not fit, and newer observations are not sent ahead of it.
+      return nullptr;
+    }
+    std::vector<std::unique_ptr<EnvelopeHolder>> holders(chosen.size());
+    for (size_t i = chosen.size(); i-- > 0;) {
+      holders[i] = TakeEnvelopeHolderLocked(chosen[i]);
+    }
+    for (auto& holder : holders) {
+      retval->MergeWith(std::move(holder));
+    }
     retval_size = retval->Size();
   }
 
-  if (retval_size + current_envelope_->Size() <= max_bytes_per_envelope_) {
-    retval->MergeWith(std::move(current_envelope_));
-    current_envelope_ = NewEnvelopeMaker();
+  // The envelopes under construction are merged in as long as they fit. Only one shard is locked at
+  // a time, so writers on the other shards are not blocked.
+  size_t budget = std::min(max_bytes, max_bytes_per_envelope_);
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    if (!shard->current_envelope->Empty() &&
+        retval_size + shard->current_envelope->Size() <= budget) {
+      retval->MergeWith(std::move(shard->current_envelope));
+      shard->current_envelope = NewEnvelopeMaker();
+      retval_size = retval->Size();
+    }
   }
 
   if (retval->Size() == 0) {
     return nullptr;
   }
 
+  size_ -= retval->Size();
+  CountEnvelopeTaken(retval->Size());
   return retval;
 }
 
 void MemoryObservationStore::ReturnEnvelopeHolder(
     std::unique_ptr<ObservationStore::EnvelopeHolder> envelope) {
   std::unique_lock<std::mutex> lock(envelope_mutex_);
+  size_ += envelope->Size();
   AddEnvelopeToSend(std::move(envelope));
 }
 
-size_t MemoryObservationStore::SizeLocked() const {
-  return current_envelope_->Size() + finalized_envelopes_size_;
-}
+size_t MemoryObservationStore::Size() const { return size_; }
 
-size_t MemoryObservationStore::Size() const {
-  std::unique_lock<std::mutex> lock(envelope_mutex_);
-  return SizeLocked();
+bool MemoryObservationStore::Empty() const { return size_ == 0; }
+
+void MemoryObservationStore::AddObservationCounts(ObservationCounts* counts) const {
+  for (const auto& shard : shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    for (const auto& [report_id, count] : shard->observation_counts) {
+      (*counts)[report_id] += count;
+    }
+  }
 }
 
-bool MemoryObservationStore::Empty() const {
-  std::unique_lock<std::mutex> lock(envelope_mutex_);
-  return current_envelope_->Empty() && finalized_envelopes_.empty();
+void MemoryObservationStore::ClearObservationCounts() {
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    shard->observation_counts.clear();
+  }
 }
 
 void MemoryObservationStore::DeleteData() {
   LOG(INFO) << "MemoryObservationStore: Deleting stored data";
 
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> shard_lock(shard->mutex);
+    size_ -= shard->current_envelope->Size();
+    shard->current_envelope = NewEnvelopeMaker();
+  }
   std::unique_lock<std::mutex> lock(envelope_mutex_);
-  current_envelope_ = NewEnvelopeMaker();
   finalized_envelopes_.clear();
+  size_ -= finalized_envelopes_size_;
   finalized_envelopes_size_ = 0;
 }
 
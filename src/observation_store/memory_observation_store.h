@@ -5,8 +5,11 @@
 #ifndef COBALT_SRC_OBSERVATION_STORE_MEMORY_OBSERVATION_STORE_H_
 #define COBALT_SRC_OBSERVATION_STORE_MEMORY_OBSERVATION_STORE_H_
 
+#include <atomic>
 #include <deque>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "src/logger/internal_metrics.h"
 #include "src/observation_store/envelope_maker.h"
@@ -16,16 +19,27 @@ namespace cobalt {
 namespace observation_store {
 
 // MemoryObservationStore is an ObservationStore that stores its data in memory.
+//
+// Observations are added to one of several envelopes under construction, chosen by the writing
+// thread, so that concurrent writers rarely contend for the same lock. These envelopes are merged
+// when they are taken. The size of the store is kept in an atomic counter, so Size(), Empty() and
+// IsAlmostFull() do not take any lock.
 class MemoryObservationStore : public ObservationStore {
  public:
+  // |num_shards|. The number of envelopes under construction. If 0, the number of hardware threads
+  // is used, up to kMaxShards.
   MemoryObservationStore(size_t max_bytes_per_observation, size_t max_bytes_per_envelope,
                          size_t max_bytes_total,
-                         logger::LoggerInterface* internal_logger = nullptr);
+                         logger::LoggerInterface* internal_logger = nullptr,
+                         size_t num_shards = 0);
+
+  static constexpr size_t kMaxShards = 16;
 
   using ObservationStore::StoreObservation;
   StoreStatus StoreObservation(std::unique_ptr<StoredObservation> observation,
                                std::unique_ptr<ObservationMetadata> metadata) override;
-  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder() override;
+  using ObservationStore::TakeNextEnvelopeHolder;
+  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder(size_t max_bytes) override;
   void ReturnEnvelopeHolder(std::unique_ptr<EnvelopeHolder> envelopes) override;
 
   size_t Size() const override;
@@ -38,20 +52,40 @@ class MemoryObservationStore : public ObservationStore {
   }
 
  private:
+  // An envelope under construction, the counts of the Observations added through this shard, and
+  // the lock which guards them.
+  struct Shard {
+    std::mutex mutex;
+    std::unique_ptr<EnvelopeMaker> current_envelope;
+    ObservationCounts observation_counts;
+  };
+
+  void AddObservationCounts(ObservationCounts* counts) const override;
+  void ClearObservationCounts() override;
+
   std::unique_ptr<EnvelopeMaker> NewEnvelopeMaker();
-  size_t SizeLocked() const;
-  void ReturnEnvelopeHolderLocked(std::unique_ptr<EnvelopeHolder> envelope);
 
-  std::unique_ptr<EnvelopeHolder> TakeOldestEnvelopeHolderLocked();
+  // Returns the shard used by the calling thread.
+  Shard& ShardForThisThread();
+
+  // Removes the finalized envelope at |index| in |finalized_envelopes_| and returns it. Must be
+  // called with |envelope_mutex_| held.
+  std::unique_ptr<EnvelopeHolder> TakeEnvelopeHolderLocked(size_t index);
+  // Must be called with |envelope_mutex_| held.
   void AddEnvelopeToSend(std::unique_ptr<EnvelopeHolder> holder, bool back = true);
 
   const size_t envelope_send_threshold_size_;
 
+  // A shard's mutex may be held while acquiring |envelope_mutex_|, but not the other way around.
+  std::vector<std::unique_ptr<Shard>> shards_;
+
   mutable std::mutex envelope_mutex_;
-  std::unique_ptr<EnvelopeMaker> current_envelope_;
   std::deque<std::unique_ptr<EnvelopeHolder>> finalized_envelopes_;
   size_t finalized_envelopes_size_;
 
+  // The total size of the envelopes in |shards_| and |finalized_envelopes_|.
+  std::atomic<size_t> size_;
+
   std::unique_ptr<logger::InternalMetrics> internal_metrics_;
 };
 
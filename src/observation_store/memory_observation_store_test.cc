@@ -4,6 +4,11 @@
 
 #include "src/observation_store/memory_observation_store.h"
 
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "src/logging.h"
 #include "third_party/googletest/googletest/include/gtest/gtest.h"
 
 namespace cobalt::observation_store {
@@ -33,6 +38,11 @@ class MemoryObservationStoreTest : public ::testing::Test {
   // and such that MemoryObservationStore will consider the size of the
   // Observation to be equal to  |num_bytes|.
   ObservationStore::StoreStatus AddObservation(size_t num_bytes, uint32_t metric_id = kMetricId) {
+    return AddObservationTo(store_.get(), num_bytes, metric_id);
+  }
+
+  static ObservationStore::StoreStatus AddObservationTo(ObservationStore *store, size_t num_bytes,
+                                                        uint32_t metric_id = kMetricId) {
     auto message = std::make_unique<EncryptedMessage>();
     // We subtract 1 from |num_bytes| because MemoryObservationStore adds one
     // to its definition of size.
@@ -42,7 +52,7 @@ class MemoryObservationStoreTest : public ::testing::Test {
     metadata->set_customer_id(kCustomerId);
     metadata->set_project_id(kProjectId);
     metadata->set_metric_id(metric_id);
-    return store_->StoreObservation(std::move(message), std::move(metadata));
+    return store->StoreObservation(std::move(message), std::move(metadata));
   }
 
  protected:
@@ -91,4 +101,128 @@ TEST_F(MemoryObservationStoreTest, DeleteData) {
   EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
 }
 
+// Returned envelopes which are too small are packed together when they are taken again, oldest
+// first, even if the second oldest one does not fit with the oldest one.
+TEST_F(MemoryObservationStoreTest, PacksSmallEnvelopes) {
+  std::vector<std::unique_ptr<ObservationStore::EnvelopeHolder>> holders;
+  for (int num_observations : {2, 7, 5}) {
+    for (int i = 0; i < num_observations; i++) {
+      EXPECT_EQ(ObservationStore::kOk, AddObservation(50));
+    }
+    holders.push_back(store_->TakeNextEnvelopeHolder());
+    ASSERT_NE(holders.back(), nullptr);
+  }
+  for (auto &holder : holders) {
+    store_->ReturnEnvelopeHolder(std::move(holder));
+  }
+
+  // The envelopes of 2 and 5 observations, then the one of 7 observations.
+  for (int num_observations : {7, 7}) {
+    auto holder = store_->TakeNextEnvelopeHolder();
+    ASSERT_NE(holder, nullptr);
+    EXPECT_EQ(holder->Size(), 350u);
+    const auto &envelope = holder->GetEnvelope(encrypt_.get());
+    ASSERT_EQ(envelope.batch_size(), 1);
+    EXPECT_EQ(envelope.batch(0).encrypted_observation_size(), num_observations);
+  }
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+
+  // The envelopes of 100, 350 and 250 bytes were taken before being packed.
+  EXPECT_DOUBLE_EQ(store_->average_envelope_fill_ratio(),
+                   1400.0 / (5 * kMaxBytesPerEnvelope));  // NOLINT readability-magic-numbers
+}
+
+// An envelope is only taken within a size limit if the oldest envelope fits, and it is packed to
+// fit. An envelope which does not fit is left in its place.
+TEST_F(MemoryObservationStoreTest, TakesWithinSizeLimit) {
+  std::vector<std::unique_ptr<ObservationStore::EnvelopeHolder>> holders;
+  for (int num_observations : {2, 7}) {
+    for (int i = 0; i < num_observations; i++) {
+      EXPECT_EQ(ObservationStore::kOk, AddObservation(50));
+    }
+    holders.push_back(store_->TakeNextEnvelopeHolder());
+    ASSERT_NE(holders.back(), nullptr);
+  }
+  for (auto &holder : holders) {
+    store_->ReturnEnvelopeHolder(std::move(holder));
+  }
+
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(50), nullptr);
+  auto holder = store_->TakeNextEnvelopeHolder(200);
+  ASSERT_NE(holder, nullptr);
+  EXPECT_EQ(holder->Size(), 100u);
+  holder = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(holder, nullptr);
+  EXPECT_EQ(holder->Size(), 350u);
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+
+  // The envelopes which were not taken are not counted.
+  EXPECT_DOUBLE_EQ(store_->average_envelope_fill_ratio(),
+                   900.0 / (4 * kMaxBytesPerEnvelope));  // NOLINT readability-magic-numbers
+}
+
+// Concurrent writers on different shards are all accounted for, and their envelopes are merged
+// when they are taken.
+TEST_F(MemoryObservationStoreTest, ConcurrentWriters) {
+  const int kNumThreads = 8;
+  const int kObservationsPerThread = 10;
+  store_ = std::make_unique<MemoryObservationStore>(kMaxBytesPerObservation, kMaxBytesPerEnvelope,
+                                                    kMaxBytesTotal, /*internal_logger=*/nullptr,
+                                                    /*num_shards=*/4);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this] {
+      for (int j = 0; j < kObservationsPerThread; j++) {
+        EXPECT_EQ(ObservationStore::kOk, AddObservation(20));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(store_->num_observations_added(),
+            static_cast<uint64_t>(kNumThreads * kObservationsPerThread));
+  EXPECT_FALSE(store_->Empty());
+
+  int num_observations = 0;
+  while (auto holder = store_->TakeNextEnvelopeHolder()) {
+    EXPECT_LE(holder->Size(), kMaxBytesPerEnvelope);
+    for (const auto &batch : holder->GetEnvelope(encrypt_.get()).batch()) {
+      num_observations += batch.encrypted_observation_size();
+    }
+  }
+  EXPECT_EQ(num_observations, kNumThreads * kObservationsPerThread);
+  EXPECT_EQ(store_->Size(), 0u);
+  EXPECT_TRUE(store_->Empty());
+}
+
+// Measures the throughput of StoreObservation() with 1 to 32 concurrent writers, with a single
+// shard and with the default number of shards. Run with --gtest_also_run_disabled_tests.
+TEST_F(MemoryObservationStoreTest, DISABLED_WriterThroughput) {
+  const int kNumObservations = 320000;
+  for (size_t num_shards : {1, 0}) {
+    for (int num_writers : {1, 2, 4, 8, 16, 32}) {
+      MemoryObservationStore store(kMaxBytesPerObservation, kMaxBytesPerEnvelope,
+                                   kNumObservations * kMaxBytesPerObservation,
+                                   /*internal_logger=*/nullptr, num_shards);
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for (int i = 0; i < num_writers; i++) {
+        threads.emplace_back([&store, num_writers] {
+          for (int j = 0; j < kNumObservations / num_writers; j++) {
+            AddObservationTo(&store, kMaxBytesPerObservation);
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      LOG(INFO) << "num_shards=" << num_shards << " writers=" << num_writers << ": "
+                << static_cast<int64_t>(kNumObservations / elapsed.count())
+                << " observations/s";
+    }
+  }
+}
+
 }  // namespace cobalt::observation_store
@@ -4,6 +4,7 @@
 
 #include "src/observation_store/observation_store.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "src/logging.h"
@@ -27,6 +28,68 @@ ObservationStore::ObservationStore(size_t max_bytes_per_observation, size_t max_
   CHECK_LE(0, max_bytes_per_envelope_);
 }
 
+const util::EncryptedMessageMaker* ObservationEncrypter::GetEncrypter(ObservationBatch* batch) {
+  auto iter = batch_encrypters_.find(batch);
+  if (iter == batch_encrypters_.end()) {
+    iter = batch_encrypters_.emplace(batch, encrypter_->NewBatchEncrypter()).first;
+    if (iter->second) {
+      batch->set_kem_bytes(iter->second->kem_bytes());
+    }
+  }
+  if (iter->second) {
+    return iter->second.get();
+  }
+  return encrypter_;
+}
+
+void ObservationEncrypter::Add(const Observation2* observation, ObservationBatch* batch) {
+  const util::EncryptedMessageMaker* encrypter = GetEncrypter(batch);
+  EncryptedMessage* encrypted_observation = batch->add_encrypted_observation();
+  if (pool_ != nullptr) {
+    jobs_.push_back({observation, encrypted_observation, encrypter});
+  } else if (!encrypter->Encrypt(*observation, encrypted_observation)) {
+    LOG_FIRST_N(ERROR, 10) << "ERROR: Unable to encrypt observation on read.";
+  }
+}
+
+void ObservationEncrypter::Add(std::unique_ptr<Observation2> observation,
+                               ObservationBatch* batch) {
+  Add(observation.get(), batch);
+  if (pool_ != nullptr) {
+    owned_observations_.push_back(std::move(observation));
+  }
+}
+
+void ObservationEncrypter::Finish() {
+  if (!jobs_.empty()) {
+    size_t num_failed = pool_->EncryptAll(*encrypter_, jobs_);
+    if (num_failed > 0) {
+      LOG_FIRST_N(ERROR, 10) << "ERROR: Unable to encrypt " << num_failed
+                             << " observations on read.";
+    }
+  }
+  jobs_.clear();
+  owned_observations_.clear();
+  batch_encrypters_.clear();
+}
+
+void ObservationStore::EnvelopeHolder::SerializeEnvelope(util::EncryptedMessageMaker* encrypter,
+                                                         std::string* serialized,
+                                                         std::vector<BatchSummary>* batches) {
+  AppendEnvelope(GetEnvelope(encrypter), serialized, batches);
+}
+
+void ObservationStore::EnvelopeHolder::AppendEnvelope(const Envelope& envelope,
+                                                      std::string* serialized,
+                                                      std::vector<BatchSummary>* batches) {
+  // AppendToString() caches the sizes of the batches.
+  envelope.AppendToString(serialized);
+  for (const auto& batch : envelope.batch()) {
+    batches->push_back({batch.meta_data().customer_id(), batch.meta_data().project_id(),
+                        static_cast<size_t>(batch.GetCachedSize())});
+  }
+}
+
 bool ObservationStore::IsAlmostFull() const { return Size() > almost_full_threshold_; }
 
 std::string ObservationStore::StatusDebugString(StoreStatus status) {
@@ -42,12 +105,17 @@ std::string ObservationStore::StatusDebugString(StoreStatus status) {
 
     case kWriteFailed:
       return "kWriteFailed";
+
+    case kStoredNotDurable:
+      return "kStoredNotDurable";
   }
 }
 
 uint64_t ObservationStore::num_observations_added() const {
+  ObservationCounts counts;
+  AddObservationCounts(&counts);
   uint64_t num_obs = 0;
-  for (const auto &count : num_obs_per_report_) {
+  for (const auto &count : counts) {
     num_obs += count.second;
   }
   return num_obs;
@@ -55,10 +123,12 @@ uint64_t ObservationStore::num_observations_added() const {
 
 std::vector<uint64_t> ObservationStore::num_observations_added_for_reports(
     const std::vector<uint32_t> &report_ids) const {
+  ObservationCounts counts;
+  AddObservationCounts(&counts);
   std::vector<uint64_t> num_obs;
   for (const auto &id : report_ids) {
-    const auto &count = num_obs_per_report_.find(id);
-    if (count != num_obs_per_report_.end()) {
+    const auto &count = counts.find(id);
+    if (count != counts.end()) {
       num_obs.push_back(count->second);
     } else {
       num_obs.push_back(0);
@@ -67,7 +137,52 @@ std::vector<uint64_t> ObservationStore::num_observations_added_for_reports(
   return num_obs;
 }
 
-void ObservationStore::ResetObservationCounter() { num_obs_per_report_.clear(); }
+void ObservationStore::ResetObservationCounter() { ClearObservationCounts(); }
+
+std::vector<size_t> ObservationStore::PackEnvelope(const std::vector<size_t> &sizes,
+                                                   size_t max_bytes) const {
+  std::vector<size_t> chosen;
+  if (sizes.empty() || sizes[0] > max_bytes) {
+    return chosen;
+  }
+  max_bytes = std::min(max_bytes, max_bytes_per_envelope_);
+  size_t num_candidates = std::min(sizes.size(), kPackingLookahead);
+  std::vector<bool> is_chosen(num_candidates, false);
+  chosen.push_back(0);
+  is_chosen[0] = true;
+  size_t total_size = sizes[0];
+  while (true) {
+    size_t best = num_candidates;
+    for (size_t i = 1; i < num_candidates; i++) {
+      if (!is_chosen[i] && total_size + sizes[i] <= max_bytes &&
+          (best == num_candidates || sizes[i] > sizes[best])) {
+        best = i;
+      }
+    }
+    if (best == num_candidates) {
+      break;
+    }
+    chosen.push_back(best);
+    is_chosen[best] = true;
+    total_size += sizes[best];
+  }
+  std::sort(chosen.begin(), chosen.end());
+  return chosen;
+}
+
+void ObservationStore::CountEnvelopeTaken(size_t envelope_size) {
+  num_envelopes_taken_++;
+  envelope_bytes_taken_ += std::min(envelope_size, max_bytes_per_envelope_);
+}
+
+double ObservationStore::average_envelope_fill_ratio() const {
+  uint64_t num_envelopes = num_envelopes_taken_;
+  if (num_envelopes == 0 || max_bytes_per_envelope_ == 0) {
+    return 0;
+  }
+  return static_cast<double>(envelope_bytes_taken_) /
+         (static_cast<double>(num_envelopes) * static_cast<double>(max_bytes_per_envelope_));
+}
 
 void ObservationStore::Disable(bool is_disabled) {
   LOG(INFO) << "ObservationStore: " << (is_disabled ? "Disabling" : "Enabling")
@@ -5,13 +5,18 @@
 #ifndef COBALT_SRC_OBSERVATION_STORE_OBSERVATION_STORE_H_
 #define COBALT_SRC_OBSERVATION_STORE_OBSERVATION_STORE_H_
 
+#include <atomic>
 #include <deque>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "src/lib/util/encrypted_message_util.h"
+#include "src/lib/util/encryption_worker_pool.h"
 #include "src/logger/logger_interface.h"
 #include "src/observation_store/observation_store_internal.pb.h"
 #include "src/pb/envelope.pb.h"
@@ -39,6 +44,11 @@ class ObservationStoreWriterInterface {
     // The Observation was not added to the store because of an unspecified
     // writing error. It may be a file system error, or some other reason.
     kWriteFailed,
+    // The Observation was added to the store and will be uploaded, but it
+    // could not be synced as SyncPolicy::kEveryBatch promises, so it may be
+    // lost if the device restarts. It must not be stored again, which would
+    // upload it twice.
+    kStoredNotDurable,
   };
 
   // StoreObservation takes a (possibly encrypted) observation, and its associated metadata and
@@ -66,6 +76,51 @@ class ObservationStoreWriterInterface {
 
   virtual StoreStatus StoreObservation(std::unique_ptr<StoredObservation> observation,
                                        std::unique_ptr<ObservationMetadata> metadata) = 0;
+
+  // Returns true when the store is close to being full. Writers whose work can be deferred, such as
+  // the generation of backfilled Observations, should stop writing until this returns false.
+  [[nodiscard]] virtual bool IsAlmostFull() const { return false; }
+};
+
+// ObservationEncrypter encrypts the Observations which were stored unencrypted, as an Envelope is
+// read from an ObservationStore.
+//
+// Without an EncryptionWorkerPool, each Observation is encrypted as soon as it is added. With one,
+// the encryptions are deferred until Finish() is called and are then spread across the workers of
+// the pool.
+//
+// If the EncryptedMessageMaker supports batch encryption, the Observations of each ObservationBatch
+// are encrypted with an EncryptedMessageMaker returned by its NewBatchEncrypter(), whose key
+// encapsulation is set once on the ObservationBatch.
+class ObservationEncrypter {
+ public:
+  // |encrypter| must not be null. |pool| may be null.
+  ObservationEncrypter(util::EncryptedMessageMaker* encrypter, util::EncryptionWorkerPool* pool)
+      : encrypter_(encrypter), pool_(pool) {}
+
+  // Encrypts |observation| into a new encrypted observation of |batch|. Both must stay valid until
+  // Finish() returns.
+  void Add(const Observation2* observation, ObservationBatch* batch);
+
+  // Encrypts |observation|, which is kept until Finish() returns, into a new encrypted observation
+  // of |batch|, which must stay valid until then.
+  void Add(std::unique_ptr<Observation2> observation, ObservationBatch* batch);
+
+  // Completes the encryptions of the Observations which have been added. The ObservationEncrypter
+  // may be reused afterwards.
+  void Finish();
+
+ private:
+  // Returns the EncryptedMessageMaker to use for the Observations of |batch|.
+  const util::EncryptedMessageMaker* GetEncrypter(ObservationBatch* batch);
+
+  util::EncryptedMessageMaker* encrypter_;
+  util::EncryptionWorkerPool* pool_;
+  std::vector<util::EncryptionWorkerPool::Job> jobs_;
+  std::vector<std::unique_ptr<Observation2>> owned_observations_;
+  // The batch encrypters, by ObservationBatch. A null value means that |encrypter_| is used.
+  std::unordered_map<const ObservationBatch*, std::unique_ptr<util::EncryptedMessageMaker>>
+      batch_encrypters_;
 };
 
 // ObservationStore is an abstract interface to an underlying store of encrypted observations and
@@ -111,10 +166,43 @@ class ObservationStore : public ObservationStoreWriterInterface {
     // TODO(fxb/3842): Make ObservationStore *only* store unencrypted observations.
     virtual const Envelope& GetEnvelope(util::EncryptedMessageMaker* encrypter) = 0;
 
+    // The customer and project of one ObservationBatch of a serialized Envelope, and the size of
+    // its serialization.
+    struct BatchSummary {
+      uint32_t customer_id;
+      uint32_t project_id;
+      size_t size;
+    };
+
+    // Appends to |serialized| the serialization of an Envelope holding the observations of this
+    // EnvelopeHolder, and appends to |batches| a summary of each of its ObservationBatches.
+    // |encrypter| is used as in GetEnvelope().
+    //
+    // The default implementation serializes the result of GetEnvelope(). Implementations may
+    // instead build the serialization incrementally from the stored data, in which case the
+    // observations of one ObservationMetadata may be split across several ObservationBatches.
+    virtual void SerializeEnvelope(util::EncryptedMessageMaker* encrypter, std::string* serialized,
+                                   std::vector<BatchSummary>* batches);
+
     // Returns an estimated size on the wire of the resulting Envelope owned by
     // thes EnvelopeHolder.
     virtual size_t Size() = 0;
 
+    // Returns a key which identifies the stored data of this EnvelopeHolder. An EnvelopeHolder
+    // which is taken from the store after this one was returned, and which has the same key, holds
+    // the same observations. This lets the ShippingManager reuse the encrypted upload of an
+    // Envelope whose upload failed. The key is made of lines which each name a unit of stored
+    // data, so that two EnvelopeHolders whose keys share a line hold some of the same observations.
+    // Returns an empty string if the data cannot be identified this way, which is what the default
+    // implementation does.
+    [[nodiscard]] virtual std::string ContentKey() const { return ""; }
+
+   protected:
+    // Appends the serialization of |envelope| to |serialized| and a summary of each of its
+    // ObservationBatches to |batches|.
+    static void AppendEnvelope(const Envelope& envelope, std::string* serialized,
+                               std::vector<BatchSummary>* batches);
+
    private:
     EnvelopeHolder(const EnvelopeHolder&) = delete;
     EnvelopeHolder& operator=(const EnvelopeHolder&) = delete;
@@ -158,7 +246,15 @@ class ObservationStore : public ObservationStoreWriterInterface {
   // store. If there are no more EnvelopeHolders available, this will return
   // nullptr. A given EnvelopeHolder will only be returned from this function
   // *once* unless it is subsequently returned using ReturnEnvelopeHolder.
-  virtual std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder() = 0;
+  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder() {
+    return TakeNextEnvelopeHolder(std::numeric_limits<size_t>::max());
+  }
+
+  // Like TakeNextEnvelopeHolder(), but the EnvelopeHolder is packed to hold at most |max_bytes|.
+  // Returns nullptr, leaving the store as it was, if the oldest data in the store is larger than
+  // |max_bytes|. This lets a caller fill a budget without taking EnvelopeHolders that it would
+  // have to return.
+  virtual std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder(size_t max_bytes) = 0;
 
   // ReturnEnvelopeHolder takes an EnvelopeHolder and adds it back to the store
   // so that it may be returned by a later call to TakeNextEnvelopeHolder(). Use
@@ -171,7 +267,7 @@ class ObservationStore : public ObservationStoreWriterInterface {
 
   // Returns true when the size of the data in the ObservationStore exceeds 60%
   // of max_bytes_total.
-  [[nodiscard]] bool IsAlmostFull() const;
+  [[nodiscard]] bool IsAlmostFull() const override;
 
   // Returns an approximation of the size of all the data in the store.
   [[nodiscard]] virtual size_t Size() const = 0;
@@ -192,6 +288,15 @@ class ObservationStore : public ObservationStoreWriterInterface {
   // ObservationStore.
   void ResetObservationCounter();
 
+  // Returns the average, over the EnvelopeHolders taken from the store, of the ratio of their size
+  // to max_bytes_per_envelope. An EnvelopeHolder larger than max_bytes_per_envelope counts as full.
+  // Returns 0 if no EnvelopeHolder has been taken.
+  [[nodiscard]] double average_envelope_fill_ratio() const;
+
+  // The number of finalized units of data, oldest first, among which TakeNextEnvelopeHolder()
+  // chooses the ones to pack together into an EnvelopeHolder.
+  static constexpr size_t kPackingLookahead = 8;
+
   // Disable allows enabling/disabling the ObservationStore. When the store is disabled,
   // StoreObservation() will return kOk but the observation will not be stored.
   void Disable(bool is_disabled);
@@ -204,7 +309,17 @@ class ObservationStore : public ObservationStoreWriterInterface {
   // to Size() or TakeNextEnvelopeHolder() will return 0 and nullptr respectively.
   virtual void DeleteData() = 0;
 
+  // Sets the EncryptionWorkerPool used to encrypt the Observations which were stored unencrypted,
+  // when the EnvelopeHolders taken from the store are read. If it is null, which is the default,
+  // they are encrypted one at a time on the reading thread. |pool| must outlive the store and the
+  // EnvelopeHolders taken from it.
+  void SetEncryptionWorkerPool(util::EncryptionWorkerPool* pool) { encryption_worker_pool_ = pool; }
+
  protected:
+  [[nodiscard]] util::EncryptionWorkerPool* encryption_worker_pool() const {
+    return encryption_worker_pool_;
+  }
+
   // NOLINTNEXTLINE misc-non-private-member-variables-in-classes
   const size_t max_bytes_per_observation_;
   // NOLINTNEXTLINE misc-non-private-member-variables-in-classes
@@ -213,11 +328,36 @@ class ObservationStore : public ObservationStoreWriterInterface {
   const size_t max_bytes_total_;
   // NOLINTNEXTLINE misc-non-private-member-variables-in-classes
   const size_t almost_full_threshold_;
-  // NOLINTNEXTLINE misc-non-private-member-variables-in-classes
-  std::map<uint32_t, uint64_t> num_obs_per_report_;
+
+  // The number of Observations that have been added to the store, by report ID.
+  using ObservationCounts = std::map<uint32_t, uint64_t>;
+
+  // Adds the counts of Observations that have been added to the store to |counts|. Each
+  // implementation keeps its counts under the locks which its writers already hold, such as one per
+  // shard, so that counting an Observation does not make writers contend for a lock of their own.
+  virtual void AddObservationCounts(ObservationCounts* counts) const = 0;
+
+  // Resets the counts of Observations that have been added to the store.
+  virtual void ClearObservationCounts() = 0;
+
+  // Chooses which finalized units of data to pack together into the next EnvelopeHolder, given the
+  // |sizes| of the units, oldest first. Returns the indices of the chosen units, in increasing
+  // order. The oldest unit is always chosen if it is at most |max_bytes|, so that no data waits
+  // behind newer data for longer than it takes to send the units ahead of it; otherwise nothing is
+  // chosen. Then, of the first kPackingLookahead units, the largest that still fits within
+  // |max_bytes| and max_bytes_per_envelope is added until none fits.
+  [[nodiscard]] std::vector<size_t> PackEnvelope(const std::vector<size_t>& sizes,
+                                                 size_t max_bytes) const;
+
+  // Records that an EnvelopeHolder of |envelope_size| bytes was taken from the store, for
+  // average_envelope_fill_ratio(). This may be called concurrently.
+  void CountEnvelopeTaken(size_t envelope_size);
 
  private:
   bool is_disabled_ = false;
+  std::atomic<uint64_t> num_envelopes_taken_{0};
+  std::atomic<uint64_t> envelope_bytes_taken_{0};
+  std::atomic<util::EncryptionWorkerPool*> encryption_worker_pool_{nullptr};
 };
 
 }  // namespace observation_store
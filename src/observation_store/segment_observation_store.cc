@@ -0,0 +1,796 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/observation_store/segment_observation_store.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "src/logger/logger_interface.h"
+#include "src/logging.h"
+#include "src/observation_store/observation_store_internal.pb.h"
+#include "src/tracing.h"
+
+namespace cobalt::observation_store {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+constexpr char kManifestFileName[] = "manifest";
+constexpr char kSegmentPrefix[] = "segment-";
+constexpr char kSparePrefix[] = "spare-";
+constexpr char kSegmentSuffix[] = ".seg";
+// The number of digits of the segment number in the name of a segment file.
+constexpr size_t kSegmentNumberWidth = 20;
+// The number of recycled segment files kept for reuse. Others are deleted.
+constexpr size_t kMaxSpareSegments = 2;
+// The size of the header of a record: its size and its CRC-32.
+constexpr size_t kRecordHeaderSize = 8;
+// The size of the header of a chunk: its state, its size and its CRC-32.
+constexpr size_t kChunkHeaderSize = 12;
+// The states recorded in a chunk header. The header of the open chunk is not written yet.
+constexpr uint32_t kChunkClosed = 1;
+constexpr uint32_t kChunkDeleted = 2;
+
+namespace {
+
+bool StartsWith(const std::string &s, const std::string &prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Returns the CRC-32 of |position|, as a little-endian 64-bit integer, followed by |size| bytes of
+// |payload|. Covering the position makes the stale records of a recycled segment fail the check.
+uint32_t RecordCrc(uint64_t position, const uint8_t *payload, size_t size) {
+  uint8_t position_bytes[sizeof(uint64_t)];
+  CodedOutputStream::WriteLittleEndian64ToArray(position, position_bytes);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, position_bytes, sizeof(position_bytes));
+  return crc32(crc, payload, static_cast<uInt>(size));
+}
+
+// Appends |record| to |buffer|, framed for the position |position| in the log.
+void AppendRecord(const FileObservationStoreRecord &record, uint64_t position,
+                  std::string *buffer) {
+  std::string payload = record.SerializeAsString();
+  uint8_t header[kRecordHeaderSize];
+  CodedOutputStream::WriteLittleEndian32ToArray(static_cast<uint32_t>(payload.size()), header);
+  CodedOutputStream::WriteLittleEndian32ToArray(
+      RecordCrc(position, reinterpret_cast<const uint8_t *>(payload.data()), payload.size()),
+      header + 4);
+  buffer->append(reinterpret_cast<const char *>(header), kRecordHeaderSize);
+  buffer->append(payload);
+}
+
+// Returns the size of the framed record at |offset| in |data|, whose first byte lies at |position|
+// in the log, or 0 if there is no valid record there.
+size_t ValidRecordSize(const std::string &data, size_t offset, uint64_t position) {
+  if (offset > data.size() || data.size() - offset < kRecordHeaderSize) {
+    return 0;
+  }
+  const auto *header = reinterpret_cast<const uint8_t *>(data.data() + offset);
+  uint32_t payload_size;
+  uint32_t crc;
+  CodedInputStream::ReadLittleEndian32FromArray(header, &payload_size);
+  CodedInputStream::ReadLittleEndian32FromArray(header + 4, &crc);
+  if (payload_size == 0 || payload_size > data.size() - offset - kRecordHeaderSize) {
+    return 0;
+  }
+  if (RecordCrc(position, header + kRecordHeaderSize, payload_size) != crc) {
+    return 0;
+  }
+  return kRecordHeaderSize + payload_size;
+}
+
+// Writes the header of the chunk at |position| in the log, which lies at |offset| of |file|.
+bool WriteChunkHeader(util::FileSystem::RandomAccessFile *file, uint64_t offset, uint64_t position,
+                      uint32_t state, uint64_t size) {
+  uint8_t header[kChunkHeaderSize];
+  CodedOutputStream::WriteLittleEndian32ToArray(state, header);
+  CodedOutputStream::WriteLittleEndian32ToArray(static_cast<uint32_t>(size), header + 4);
+  CodedOutputStream::WriteLittleEndian32ToArray(RecordCrc(position, header, 8), header + 8);
+  return file->Write(offset,
+                     std::string_view(reinterpret_cast<const char *>(header), kChunkHeaderSize));
+}
+
+// Reads the header of the chunk at |offset| in |data|, whose first byte lies at |position| in the
+// log. Returns false if there is no valid header there, as for the open chunk.
+bool ReadChunkHeader(const std::string &data, size_t offset, uint64_t position, uint32_t *state,
+                     uint64_t *size) {
+  if (offset > data.size() || data.size() - offset < kChunkHeaderSize) {
+    return false;
+  }
+  const auto *header = reinterpret_cast<const uint8_t *>(data.data() + offset);
+  uint32_t chunk_size;
+  uint32_t crc;
+  CodedInputStream::ReadLittleEndian32FromArray(header, state);
+  CodedInputStream::ReadLittleEndian32FromArray(header + 4, &chunk_size);
+  CodedInputStream::ReadLittleEndian32FromArray(header + 8, &crc);
+  if (RecordCrc(position, header, 8) != crc || chunk_size < kChunkHeaderSize ||
+      chunk_size > data.size() - offset) {
+    return false;
+  }
+  *size = chunk_size;
+  return *state == kChunkClosed || *state == kChunkDeleted;
+}
+
+}  // namespace
+
+SegmentObservationStore::SegmentObservationStore(size_t max_bytes_per_observation,
+                                                 size_t max_bytes_per_envelope,
+                                                 size_t max_bytes_total, util::FileSystem *fs,
+                                                 std::string root_directory, size_t segment_size,
+                                                 logger::LoggerInterface *internal_logger)
+    : ObservationStore(max_bytes_per_observation, max_bytes_per_envelope, max_bytes_total),
+      fs_(fs),
+      root_directory_(std::move(root_directory)),
+      segment_size_(std::max(segment_size, 2 * max_bytes_per_envelope)),
+      manifest_store_(root_directory_ + "/" + kManifestFileName, fs_),
+      internal_metrics_(logger::InternalMetrics::NewWithLogger(internal_logger)) {
+  CHECK(fs_);
+
+  if (!fs_->ListFiles(root_directory_).ok()) {
+    CHECK(fs_->MakeDirectory(root_directory_));
+  }
+
+  auto fields = protected_fields_.lock();
+  Recover(&fields);
+}
+
+SegmentObservationStore::~SegmentObservationStore() {
+  auto fields = protected_fields_.lock();
+  if (fields->sync_policy.mode != SyncPolicy::kNone) {
+    SyncTo(&fields, fields->tail);
+  }
+  fields->tail_file = nullptr;
+  fields->unsynced_files.clear();
+  WriteManifest(&fields);
+}
+
+std::string SegmentObservationStore::SegmentPath(uint64_t segment) const {
+  std::string number = std::to_string(segment);
+  return root_directory_ + "/" + kSegmentPrefix +
+         std::string(kSegmentNumberWidth - std::min(kSegmentNumberWidth, number.size()), '0') +
+         number + kSegmentSuffix;
+}
+
+std::string SegmentObservationStore::SparePath(uint64_t segment) const {
+  return root_directory_ + "/" + kSparePrefix + std::to_string(segment) + kSegmentSuffix;
+}
+
+std::vector<std::string> SegmentObservationStore::ListSegmentFiles() const {
+  std::vector<std::string> segment_files;
+  auto files_or = fs_->ListFiles(root_directory_);
+  if (!files_or.ok()) {
+    return segment_files;
+  }
+  for (auto &file : files_or.ConsumeValueOrDie()) {
+    if (EndsWith(file, kSegmentSuffix)) {
+      segment_files.push_back(std::move(file));
+    }
+  }
+  std::sort(segment_files.begin(), segment_files.end());
+  return segment_files;
+}
+
+void SegmentObservationStore::Recover(util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+
+  SegmentObservationStoreManifest manifest;
+  auto status = manifest_store_.Read(&manifest);
+  bool has_manifest = status.ok();
+  for (const auto &file : ListSegmentFiles()) {
+    if (StartsWith(file, kSegmentPrefix)) {
+      f->segments.insert(std::stoull(file.substr(strlen(kSegmentPrefix), kSegmentNumberWidth)));
+    } else if (StartsWith(file, kSparePrefix) && has_manifest &&
+               f->spare_segments.size() < kMaxSpareSegments) {
+      f->spare_segments.push_back(root_directory_ + "/" + file);
+    } else {
+      // Without a manifest the positions of the log may be reused, so the stale records of a spare
+      // segment could be mistaken for new ones.
+      fs_->Delete(root_directory_ + "/" + file);
+    }
+  }
+
+  uint64_t position = 0;
+  if (has_manifest) {
+    for (const auto &chunk : manifest.chunks()) {
+      if (f->segments.count(chunk.start() / segment_size_) > 0) {
+        f->available_chunks[chunk.start()] = {chunk.start(), chunk.size()};
+        f->closed_bytes += chunk.size();
+      }
+    }
+    position = manifest.open_chunk_start();
+  } else {
+    if (!f->segments.empty()) {
+      LOG(WARNING) << "No valid manifest in `" << root_directory_ << "`: "
+                   << status.error_message() << ". Rebuilding it from the segments.";
+      // The log continues in the last segment.
+      f->tail_segment = *f->segments.rbegin();
+      for (auto segment : f->segments) {
+        if (segment != f->tail_segment) {
+          RecoverSegment(fields, segment * segment_size_);
+        }
+      }
+      position = f->tail_segment * segment_size_;
+    }
+  }
+
+  f->tail_segment = position / segment_size_;
+  if (f->segments.count(f->tail_segment) > 0) {
+    RecoverSegment(fields, position);
+  } else {
+    f->open_chunk_start = f->tail = position;
+  }
+  f->synced_tail = f->tail;
+  CloseOpenChunk(fields);
+  ReclaimSegments(fields);
+  WriteManifest(fields);
+}
+
+void SegmentObservationStore::RecoverSegment(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t position) {
+  auto &f = *fields;
+  uint64_t segment = position / segment_size_;
+  uint64_t segment_offset = position % segment_size_;
+  auto file = OpenSegment(fields, segment);
+  std::string data;
+  if (file == nullptr || !file->Read(segment_offset, segment_size_ - segment_offset, &data)) {
+    LOG_FIRST_N(ERROR, 10) << "Unable to read segment " << segment << " of `" << root_directory_
+                           << "`.";
+    data.clear();
+  }
+
+  size_t offset = 0;
+  uint32_t state;
+  uint64_t size;
+  while (ReadChunkHeader(data, offset, position + offset, &state, &size)) {
+    if (state == kChunkClosed) {
+      f->available_chunks[position + offset] = {position + offset, size};
+      f->closed_bytes += size;
+    }
+    offset += size;
+  }
+
+  // The records appended to the open chunk are recovered by reading from its start until the first
+  // record that is not valid: either the zeros of the preallocated segment, a torn record, or a
+  // stale record of a recycled segment.
+  size_t scanned = offset + kChunkHeaderSize;
+  size_t record_size;
+  while ((record_size = ValidRecordSize(data, scanned, position + scanned)) > 0) {
+    scanned += record_size;
+  }
+  Chunk open_chunk = {position + offset, 0};
+  if (scanned > offset + kChunkHeaderSize) {
+    open_chunk.size = scanned - offset;
+    VLOG(4) << "Recovered " << open_chunk.size << " bytes of observations in `" << root_directory_
+            << "`.";
+  }
+  if (segment == f->tail_segment) {
+    f->open_chunk_start = open_chunk.start;
+    f->tail = open_chunk.start + open_chunk.size;
+  } else if (open_chunk.size > 0) {
+    if (!WriteChunkHeader(file.get(), segment_offset + offset, open_chunk.start, kChunkClosed,
+                          open_chunk.size)) {
+      LOG_FIRST_N(WARNING, 10) << "Unable to close a chunk in segment " << segment << " of `"
+                               << root_directory_ << "`.";
+    }
+    f->available_chunks[open_chunk.start] = open_chunk;
+    f->closed_bytes += open_chunk.size;
+  }
+}
+
+void SegmentObservationStore::CloseOpenChunk(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  if (f->tail == f->open_chunk_start) {
+    return;
+  }
+  Chunk chunk = {f->open_chunk_start, f->tail - f->open_chunk_start};
+  // If the header cannot be written, the chunk is still found in the manifest.
+  if ((f->tail_file == nullptr && !OpenTailSegment(fields)) ||
+      !WriteChunkHeader(f->tail_file.get(), chunk.start % segment_size_, chunk.start,
+                        kChunkClosed, chunk.size)) {
+    LOG_FIRST_N(WARNING, 10) << "Unable to close a chunk in segment " << f->tail_segment << " of `"
+                             << root_directory_ << "`.";
+  }
+  f->available_chunks[chunk.start] = chunk;
+  f->closed_bytes += chunk.size;
+  f->open_chunk_start = f->tail;
+  f->metadata_written = false;
+  WriteManifest(fields);
+}
+
+bool SegmentObservationStore::AdvanceToNextSegment(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  CloseOpenChunk(fields);
+  // The records of the previous segment are synced with those of the next one.
+  if (f->tail_file != nullptr && f->sync_policy.mode != SyncPolicy::kNone &&
+      f->synced_tail < f->tail) {
+    f->unsynced_files.push_back(std::move(f->tail_file));
+  }
+  f->tail_file = nullptr;
+  f->tail_segment++;
+  f->open_chunk_start = f->tail = f->tail_segment * segment_size_;
+  f->metadata_written = false;
+  // The manifest must point at the new segment before anything is written to it, so that recovery
+  // does not scan the previous one.
+  WriteManifest(fields);
+  return OpenTailSegment(fields);
+}
+
+bool SegmentObservationStore::OpenTailSegment(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  std::string path = SegmentPath(f->tail_segment);
+  if (f->segments.count(f->tail_segment) == 0 && !f->spare_segments.empty()) {
+    if (fs_->Rename(f->spare_segments.back(), path)) {
+      VLOG(5) << "Reusing `" << f->spare_segments.back() << "` as `" << path << "`.";
+    }
+    f->spare_segments.pop_back();
+  }
+
+  auto file_or = fs_->NewRandomAccessFile(path, /*create=*/true);
+  if (!file_or.ok()) {
+    LOG_FIRST_N(ERROR, 10) << "Unable to open segment `" << path
+                           << "`: " << file_or.status().error_message();
+    return false;
+  }
+  f->segments.insert(f->tail_segment);
+
+  // Preallocating the segment keeps appends from growing the file, and fills it with the zeros
+  // which mark the end of the log.
+  auto file = file_or.ConsumeValueOrDie();
+  if (!file->Reserve(segment_size_)) {
+    LOG_FIRST_N(ERROR, 10) << "Unable to allocate segment `" << path << "`.";
+    return false;
+  }
+  f->tail_file = std::move(file);
+  return true;
+}
+
+std::shared_ptr<util::FileSystem::RandomAccessFile> SegmentObservationStore::OpenSegment(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t segment) {
+  auto &f = *fields;
+  if (segment == f->tail_segment && f->tail_file != nullptr) {
+    return f->tail_file;
+  }
+  auto file_or = fs_->NewRandomAccessFile(SegmentPath(segment), /*create=*/false);
+  if (!file_or.ok()) {
+    return nullptr;
+  }
+  return file_or.ConsumeValueOrDie();
+}
+
+void SegmentObservationStore::WriteManifest(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  SegmentObservationStoreManifest manifest;
+  for (const auto *chunks : {&f->available_chunks, &f->taken_chunks}) {
+    for (const auto &[start, chunk] : *chunks) {
+      auto *stored_chunk = manifest.add_chunks();
+      stored_chunk->set_start(chunk.start);
+      stored_chunk->set_size(chunk.size);
+    }
+  }
+  manifest.set_open_chunk_start(f->open_chunk_start);
+  auto status = manifest_store_.Write(manifest);
+  if (!status.ok()) {
+    LOG_FIRST_N(ERROR, 10) << "Unable to write the manifest of `" << root_directory_
+                           << "`: " << status.error_message();
+  }
+}
+
+void SegmentObservationStore::ReclaimSegments(
+    util::ProtectedFields<Fields>::LockedFieldsPtr *fields) {
+  auto &f = *fields;
+  auto has_live_chunk = [this](const std::map<uint64_t, Chunk> &chunks, uint64_t segment) {
+    auto it = chunks.lower_bound(segment * segment_size_);
+    return it != chunks.end() && it->first < (segment + 1) * segment_size_;
+  };
+
+  for (auto it = f->segments.begin(); it != f->segments.end();) {
+    uint64_t segment = *it;
+    if (segment == f->tail_segment || has_live_chunk(f->available_chunks, segment) ||
+        has_live_chunk(f->taken_chunks, segment)) {
+      ++it;
+      continue;
+    }
+    if (f->spare_segments.size() < kMaxSpareSegments &&
+        fs_->Rename(SegmentPath(segment), SparePath(segment))) {
+      f->spare_segments.push_back(SparePath(segment));
+    } else {
+      fs_->Delete(SegmentPath(segment));
+    }
+    it = f->segments.erase(it);
+  }
+}
+
+bool SegmentObservationStore::SyncTo(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                                     uint64_t position) {
+  auto &f = *fields;
+  while (f->synced_tail < position) {
+    if (f->sync_in_progress) {
+      // Another caller is syncing. If its sync does not reach |position|, the next iteration starts
+      // a new one.
+      f->sync_notifier.wait(f);
+      continue;
+    }
+
+    uint64_t batch_end = f->tail;
+    auto previous_files = std::move(f->unsynced_files);
+    f->unsynced_files.clear();
+    auto tail_file = f->tail_file;
+    f->sync_in_progress = true;
+    f.unlock();
+    bool synced = true;
+    for (const auto &file : previous_files) {
+      synced = file->Sync() && synced;
+    }
+    if (tail_file != nullptr) {
+      synced = tail_file->Sync() && synced;
+    }
+    f.lock();
+    f->sync_in_progress = false;
+    f->sync_notifier.notify_all();
+
+    if (!synced) {
+      LOG_FIRST_N(WARNING, 10) << "Unable to sync the segments of `" << root_directory_ << "`.";
+      // The previous segments are synced again by the next attempt.
+      for (auto &file : previous_files) {
+        f->unsynced_files.push_back(std::move(file));
+      }
+      return false;
+    }
+    f->synced_tail = std::max(f->synced_tail, batch_end);
+    f->bytes_since_sync = 0;
+    f->last_sync_time = std::chrono::steady_clock::now();
+  }
+  return true;
+}
+
+bool SegmentObservationStore::MaybeSync(util::ProtectedFields<Fields>::LockedFieldsPtr *fields,
+                                        uint64_t position) {
+  auto &f = *fields;
+  switch (f->sync_policy.mode) {
+    case SyncPolicy::kNone:
+      break;
+    case SyncPolicy::kInterval:
+      if (!f->sync_in_progress &&
+          std::chrono::steady_clock::now() - f->last_sync_time >= f->sync_policy.interval) {
+        SyncTo(fields, position);
+      }
+      break;
+    case SyncPolicy::kBytes:
+      if (!f->sync_in_progress && f->bytes_since_sync >= f->sync_policy.bytes) {
+        SyncTo(fields, position);
+      }
+      break;
+    case SyncPolicy::kEveryBatch:
+      return SyncTo(fields, position);
+  }
+  return true;
+}
+
+void SegmentObservationStore::SetSyncPolicy(SyncPolicy sync_policy) {
+  auto fields = protected_fields_.lock();
+  fields->sync_policy = sync_policy;
+  fields->last_sync_time = std::chrono::steady_clock::now();
+}
+
+ObservationStore::StoreStatus SegmentObservationStore::StoreObservation(
+    std::unique_ptr<StoredObservation> observation, std::unique_ptr<ObservationMetadata> metadata) {
+  if (IsDisabled()) {
+    return kOk;
+  }
+
+  TRACE_DURATION("cobalt_core", "SegmentObservationStore::StoreObservation");
+  auto fields = protected_fields_.lock();
+
+  size_t obs_size = observation->ByteSizeLong();
+  uint32_t customer_id = metadata->customer_id();
+  uint32_t project_id = metadata->project_id();
+  auto report_id = metadata->report_id();
+  internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Attempted,
+                                 obs_size, customer_id, project_id);
+
+  if (obs_size > max_bytes_per_observation_) {
+    LOG(WARNING) << "An observation that was too big was passed in to "
+                    "SegmentObservationStore::StoreObservation(): "
+                 << obs_size;
+    return kObservationTooBig;
+  }
+
+  size_t estimated_new_byte_count =
+      fields->closed_bytes + (fields->tail - fields->open_chunk_start) + obs_size;
+  if (estimated_new_byte_count > max_bytes_total_) {
+    VLOG(4) << "The observation store is full. estimated_new_byte_count="
+            << estimated_new_byte_count << " > " << max_bytes_total_ << ".";
+    return kStoreFull;
+  }
+
+  FileObservationStoreRecord stored_message;
+  if (observation->has_encrypted()) {
+    stored_message.mutable_encrypted_observation()->Swap(observation->mutable_encrypted());
+  } else if (observation->has_unencrypted()) {
+    stored_message.mutable_unencrypted_observation()->Swap(observation->mutable_unencrypted());
+  } else {
+    LOG(ERROR) << "Recieved StoredObservation of unexpected type.";
+    return kWriteFailed;
+  }
+  FileObservationStoreRecord stored_metadata;
+  std::string metadata_str = metadata->SerializeAsString();
+  stored_metadata.mutable_meta_data()->Swap(metadata.get());
+
+  // A chunk never spans two segments, so the records move to the next segment if they do not fit
+  // in what is left of this one. Both records are framed for the segment they are written to. The
+  // records of a new chunk follow the space left for its header.
+  size_t max_records_size = kChunkHeaderSize + 2 * kRecordHeaderSize +
+                            stored_metadata.ByteSizeLong() + stored_message.ByteSizeLong();
+  if (fields->tail_file == nullptr && !OpenTailSegment(&fields)) {
+    return kWriteFailed;
+  }
+  if (fields->tail - fields->tail_segment * segment_size_ + max_records_size > segment_size_ &&
+      !AdvanceToNextSegment(&fields)) {
+    return kWriteFailed;
+  }
+  uint64_t records_start = fields->tail;
+  if (fields->tail == fields->open_chunk_start) {
+    records_start += kChunkHeaderSize;
+  }
+
+  std::string records;
+  if (!fields->metadata_written || metadata_str != fields->last_written_metadata) {
+    AppendRecord(stored_metadata, records_start, &records);
+  }
+  AppendRecord(stored_message, records_start + records.size(), &records);
+  if (!fields->tail_file->Write(records_start - fields->tail_segment * segment_size_, records)) {
+    LOG_FIRST_N(WARNING, 10) << "Unable to write to segment " << fields->tail_segment << " of `"
+                             << root_directory_ << "`.";
+    return kWriteFailed;
+  }
+  fields->tail = records_start + records.size();
+  fields->bytes_since_sync += records.size();
+  fields->metadata_written = true;
+  fields->last_written_metadata = std::move(metadata_str);
+  uint64_t record_end = fields->tail;
+
+  if (fields->tail - fields->open_chunk_start >= max_bytes_per_envelope_) {
+    CloseOpenChunk(&fields);
+  }
+
+  fields->observation_counts[report_id]++;
+  internal_metrics_->BytesStored(logger::PerProjectBytesStoredMetricDimensionStatus::Succeeded,
+                                 obs_size, customer_id, project_id);
+
+  // The observation was stored but is not durable, which SyncPolicy::kEveryBatch promises.
+  if (!MaybeSync(&fields, record_end)) {
+    return kStoredNotDurable;
+  }
+  return kOk;
+}
+
+std::unique_ptr<ObservationStore::EnvelopeHolder> SegmentObservationStore::TakeNextEnvelopeHolder(
+    size_t max_bytes) {
+  auto fields = protected_fields_.lock();
+  if (fields->available_chunks.empty()) {
+    CloseOpenChunk(&fields);
+  }
+  if (fields->available_chunks.empty()) {
+    return nullptr;
+  }
+  // The available chunks are ordered by their position in the log, so oldest first.
+  std::vector<std::map<uint64_t, Chunk>::iterator> candidates;
+  std::vector<size_t> sizes;
+  for (auto it = fields->available_chunks.begin();
+       it != fields->available_chunks.end() && candidates.size() < kPackingLookahead; ++it) {
+    candidates.push_back(it);
+    sizes.push_back(it->second.size);
+  }
+  std::unique_ptr<SegmentEnvelopeHolder> holder;
+  for (size_t index : PackEnvelope(sizes, max_bytes)) {
+    auto node = fields->available_chunks.extract(candidates[index]);
+    auto chunk_holder = std::make_unique<SegmentEnvelopeHolder>(this, node.mapped());
+    fields->taken_chunks.insert(std::move(node));
+    if (holder) {
+      holder->MergeWith(std::move(chunk_holder));
+    } else {
+      holder = std::move(chunk_holder);
+    }
+  }
+  if (holder == nullptr) {
+    return nullptr;
+  }
+  CountEnvelopeTaken(holder->Size());
+  return holder;
+}
+
+void SegmentObservationStore::ReturnEnvelopeHolder(
+    std::unique_ptr<ObservationStore::EnvelopeHolder> envelope) {
+  std::unique_ptr<SegmentEnvelopeHolder> holder(
+      static_cast<SegmentEnvelopeHolder *>(envelope.release()));
+  auto fields = protected_fields_.lock();
+  for (const auto &chunk : holder->chunks()) {
+    auto node = fields->taken_chunks.extract(chunk.start);
+    if (!node.empty()) {
+      fields->available_chunks.insert(std::move(node));
+    }
+  }
+  holder->clear();
+}
+
+void SegmentObservationStore::DeleteChunks(const std::vector<Chunk> &chunks) {
+  auto fields = protected_fields_.lock();
+  std::vector<Chunk> deleted_chunks;
+  for (const auto &chunk : chunks) {
+    if (fields->taken_chunks.erase(chunk.start) > 0) {
+      fields->closed_bytes -= chunk.size;
+      deleted_chunks.push_back(chunk);
+    }
+  }
+  WriteManifest(&fields);
+  ReclaimSegments(&fields);
+
+  // The chunks of the segments which are still in use are marked deleted in their headers, so that
+  // a rebuild of the manifest does not restore them.
+  std::shared_ptr<util::FileSystem::RandomAccessFile> file;
+  uint64_t file_segment = 0;
+  for (const auto &chunk : deleted_chunks) {
+    uint64_t segment = chunk.start / segment_size_;
+    if (fields->segments.count(segment) == 0) {
+      continue;
+    }
+    if (file == nullptr || file_segment != segment) {
+      file = OpenSegment(&fields, segment);
+      file_segment = segment;
+    }
+    if (file == nullptr || !WriteChunkHeader(file.get(), chunk.start % segment_size_, chunk.start,
+                                             kChunkDeleted, chunk.size)) {
+      LOG_FIRST_N(WARNING, 10) << "Unable to mark a chunk deleted in segment " << segment << " of `"
+                               << root_directory_ << "`.";
+    }
+  }
+}
+
+bool SegmentObservationStore::ReadChunk(const Chunk &chunk, std::string *data) const {
+  std::string path = SegmentPath(chunk.start / segment_size_);
+  auto file_or = fs_->NewRandomAccessFile(path, /*create=*/false);
+  if (!file_or.ok()) {
+    LOG(ERROR) << "WARNING: Trying to open `" << path << "` failed.";
+    return false;
+  }
+  return file_or.ValueOrDie()->Read(chunk.start % segment_size_ + kChunkHeaderSize,
+                                    chunk.size - kChunkHeaderSize, data);
+}
+
+size_t SegmentObservationStore::Size() const {
+  auto fields = protected_fields_.const_lock();
+  return fields->closed_bytes + (fields->tail - fields->open_chunk_start);
+}
+
+bool SegmentObservationStore::Empty() const { return Size() == 0; }
+
+void SegmentObservationStore::AddObservationCounts(ObservationCounts *counts) const {
+  auto fields = protected_fields_.const_lock();
+  for (const auto &[report_id, count] : fields->observation_counts) {
+    (*counts)[report_id] += count;
+  }
+}
+
+void SegmentObservationStore::ClearObservationCounts() {
+  protected_fields_.lock()->observation_counts.clear();
+}
+
+void SegmentObservationStore::DeleteData() {
+  LOG(INFO) << "SegmentObservationStore: Deleting stored data";
+
+  auto fields = protected_fields_.lock();
+  fields->tail_file = nullptr;
+  fields->unsynced_files.clear();
+  for (const auto &file : ListSegmentFiles()) {
+    fs_->Delete(root_directory_ + "/" + file);
+  }
+  fields->available_chunks.clear();
+  fields->taken_chunks.clear();
+  fields->closed_bytes = 0;
+  fields->segments.clear();
+  fields->spare_segments.clear();
+  // Positions are never reused, so that the chunks of outstanding EnvelopeHolders cannot be
+  // mistaken for new ones.
+  fields->tail_segment++;
+  fields->open_chunk_start = fields->tail = fields->tail_segment * segment_size_;
+  fields->synced_tail = fields->tail;
+  fields->metadata_written = false;
+  fields->last_written_metadata.clear();
+  WriteManifest(&fields);
+}
+
+SegmentObservationStore::SegmentEnvelopeHolder::~SegmentEnvelopeHolder() {
+  if (!chunks_.empty()) {
+    store_->DeleteChunks(chunks_);
+  }
+}
+
+void SegmentObservationStore::SegmentEnvelopeHolder::MergeWith(
+    std::unique_ptr<EnvelopeHolder> container) {
+  std::unique_ptr<SegmentEnvelopeHolder> other(
+      static_cast<SegmentEnvelopeHolder *>(container.release()));
+  chunks_.insert(chunks_.end(), other->chunks_.begin(), other->chunks_.end());
+  size_ += other->size_;
+  envelope_read_ = false;
+  envelope_.Clear();
+  other->clear();
+}
+
+const Envelope &SegmentObservationStore::SegmentEnvelopeHolder::GetEnvelope(
+    util::EncryptedMessageMaker *encrypter) {
+  if (envelope_read_) {
+    return envelope_;
+  }
+
+  std::string serialized_metadata;
+  std::unordered_map<std::string, ObservationBatch *> batch_map;
+  ObservationEncrypter observation_encrypter(encrypter, store_->encryption_worker_pool());
+  FileObservationStoreRecord stored;
+  std::string data;
+
+  for (const auto &chunk : chunks_) {
+    if (!store_->ReadChunk(chunk, &data)) {
+      continue;
+    }
+    uint64_t records_start = chunk.start + kChunkHeaderSize;
+    ObservationBatch *current_batch = nullptr;
+    size_t offset = 0;
+    size_t record_size;
+    // The chunk was closed after its records were written, so a record which is not valid was
+    // corrupted on disk. Its size cannot be trusted, so the rest of the chunk is skipped.
+    while (offset < data.size()) {
+      record_size = ValidRecordSize(data, offset, records_start + offset);
+      if (record_size == 0) {
+        VLOG(1) << "WARNING: The chunk at " << chunk.start << " in `" << store_->root_directory_
+                << "` is corrupted. Skipping the rest of it.";
+        break;
+      }
+      if (!stored.ParseFromArray(data.data() + offset + kRecordHeaderSize,
+                                 static_cast<int>(record_size - kRecordHeaderSize))) {
+        current_batch = nullptr;
+      } else if (stored.has_meta_data()) {
+        std::unique_ptr<ObservationMetadata> current_metadata(stored.release_meta_data());
+        current_metadata->SerializeToString(&serialized_metadata);
+        auto iter = batch_map.find(serialized_metadata);
+        if (iter != batch_map.end()) {
+          current_batch = iter->second;
+        } else {
+          current_batch = envelope_.add_batch();
+          current_batch->set_allocated_meta_data(current_metadata.release());
+          batch_map[serialized_metadata] = current_batch;
+        }
+      } else if (current_batch == nullptr) {
+        // The metadata of this observation was lost to corruption.
+      } else if (stored.has_encrypted_observation()) {
+        current_batch->add_encrypted_observation()->Swap(stored.mutable_encrypted_observation());
+      } else if (stored.has_unencrypted_observation()) {
+        observation_encrypter.Add(
+            std::unique_ptr<Observation2>(stored.release_unencrypted_observation()), current_batch);
+      }
+      offset += record_size;
+    }
+  }
+  observation_encrypter.Finish();
+
+  envelope_read_ = true;
+  return envelope_;
+}
+
+}  // namespace cobalt::observation_store
@@ -0,0 +1,231 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_OBSERVATION_STORE_SEGMENT_OBSERVATION_STORE_H_
+#define COBALT_SRC_OBSERVATION_STORE_SEGMENT_OBSERVATION_STORE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "src/lib/util/consistent_proto_store.h"
+#include "src/lib/util/file_system.h"
+#include "src/lib/util/protected_fields.h"
+#include "src/logger/internal_metrics.h"
+#include "src/observation_store/observation_store.h"
+#include "src/observation_store/sync_policy.h"
+
+namespace cobalt::observation_store {
+
+// SegmentObservationStore is an implementation of ObservationStore that persists observations to a
+// log of fixed-size, preallocated segment files.
+//
+// Observations are appended at the tail of the log as records framed by their size and a CRC-32,
+// which also covers the position of the record in the log. The log is divided into chunks of about
+// max_bytes_per_envelope bytes, each starting with a metadata record, and each envelope is made of
+// one or more chunks, read back as a byte range of a segment. A chunk never spans two segments.
+//
+// Each chunk begins with a header, also covered by a CRC-32 of its position, which is written when
+// the chunk is closed and overwritten when the chunk is deleted. A manifest, written with a
+// ConsistentProtoStore whenever a chunk is closed or deleted, lists the live chunks and the start
+// of the open chunk at the tail of the log. On startup the chunks closed after the manifest was
+// written are found from their headers, and the open chunk is recovered by reading records from its
+// start until the first one that fails its checksum, so a torn record left by a crash is dropped
+// without losing the records that precede it. If the manifest is lost or corrupt, the live chunks
+// of every segment are rebuilt from the chunk headers in the same way.
+//
+// Segments whose chunks have all been deleted are recycled for the tail of the log, so that
+// steady-state operation does not create or delete files. Size() is constant time.
+//
+// As long as there are EnvelopeHolders that have not been returned or deleted, the store should
+// not be destroyed.
+//
+// This object is thread safe.
+class SegmentObservationStore : public ObservationStore {
+ private:
+  // A range of the log which begins with a metadata record.
+  struct Chunk {
+    // The position of the chunk in the log. The chunk lies in segment |start / segment_size_|.
+    uint64_t start;
+    uint64_t size;
+  };
+
+  // SegmentEnvelopeHolder is an implementation of ObservationStore::EnvelopeHolder.
+  //
+  // It represents the envelope as a list of chunks. The observations are not read into memory until
+  // a call to GetEnvelope() is made.
+  //
+  // Note: This object is not thread safe.
+  class SegmentEnvelopeHolder : public EnvelopeHolder {
+   public:
+    SegmentEnvelopeHolder(SegmentObservationStore *store, Chunk chunk)
+        : store_(store), chunks_({chunk}), size_(chunk.size) {}
+
+    ~SegmentEnvelopeHolder() override;
+
+    void MergeWith(std::unique_ptr<EnvelopeHolder> container) override;
+    const Envelope &GetEnvelope(util::EncryptedMessageMaker *encrypter) override;
+    size_t Size() override { return size_; }
+
+    const std::vector<Chunk> &chunks() { return chunks_; }
+    void clear() {
+      chunks_.clear();
+      size_ = 0;
+    }
+
+   private:
+    SegmentObservationStore *store_;
+    std::vector<Chunk> chunks_;
+    size_t size_;
+    bool envelope_read_ = false;
+    Envelope envelope_;
+  };
+
+ public:
+  static constexpr size_t kDefaultSegmentSize = 1024 * 1024;
+
+  // |fs|. An implementation of FileSystem used for the segment files and the manifest. It must
+  // support NewRandomAccessFile().
+  //
+  // |root_directory|. The absolute path to the directory where the segments and the manifest are
+  // written.
+  //
+  // |segment_size|. The size of each segment file. It is raised to 2 * max_bytes_per_envelope if it
+  // is smaller.
+  SegmentObservationStore(size_t max_bytes_per_observation, size_t max_bytes_per_envelope,
+                          size_t max_bytes_total, util::FileSystem *fs, std::string root_directory,
+                          size_t segment_size = kDefaultSegmentSize,
+                          logger::LoggerInterface *internal_logger = nullptr);
+
+  ~SegmentObservationStore() override;
+
+  using ObservationStore::StoreObservation;
+  StoreStatus StoreObservation(std::unique_ptr<StoredObservation> observation,
+                               std::unique_ptr<ObservationMetadata> metadata) override;
+  using ObservationStore::TakeNextEnvelopeHolder;
+  std::unique_ptr<EnvelopeHolder> TakeNextEnvelopeHolder(size_t max_bytes) override;
+  void ReturnEnvelopeHolder(std::unique_ptr<EnvelopeHolder> envelope) override;
+
+  size_t Size() const override;
+  bool Empty() const override;
+
+  void DeleteData() override;
+
+  // Sets the policy for syncing the log to durable storage. The default is SyncPolicy::kNone. Syncs
+  // happen without holding the lock of the store, and the observations stored during a sync are
+  // synced together by the next one.
+  void SetSyncPolicy(SyncPolicy sync_policy);
+
+  void ResetInternalMetrics(logger::LoggerInterface *internal_logger) override {
+    internal_metrics_ = logger::InternalMetrics::NewWithLogger(internal_logger);
+  }
+
+  // Returns the names of the segment files in the root directory, including spare segments.
+  std::vector<std::string> ListSegmentFiles() const;
+
+ private:
+  struct Fields {
+    // The closed chunks which have not been taken, keyed by start position.
+    std::map<uint64_t, Chunk> available_chunks;
+    // The closed chunks which have been taken by an EnvelopeHolder, keyed by start position.
+    std::map<uint64_t, Chunk> taken_chunks;
+    // The total size of |available_chunks| and |taken_chunks|.
+    size_t closed_bytes = 0;
+
+    // The position at which the open chunk starts, and the position of the next record.
+    uint64_t open_chunk_start = 0;
+    uint64_t tail = 0;
+    // The metadata of the last observation written to the open chunk, serialized.
+    bool metadata_written = false;
+    std::string last_written_metadata;
+
+    // The segment which contains |tail|, and the file for it if it is open.
+    uint64_t tail_segment = 0;
+    std::shared_ptr<util::FileSystem::RandomAccessFile> tail_file;
+    // The segment files in the root directory, by segment number.
+    std::set<uint64_t> segments;
+    // The names of the recycled segment files waiting to be reused.
+    std::vector<std::string> spare_segments;
+
+    SyncPolicy sync_policy;
+    size_t bytes_since_sync = 0;
+    std::chrono::steady_clock::time_point last_sync_time;
+    // The log is durable up to |synced_tail|. The previous tail segments which may hold records
+    // after it are kept open until they are synced.
+    uint64_t synced_tail = 0;
+    std::vector<std::shared_ptr<util::FileSystem::RandomAccessFile>> unsynced_files;
+    // Whether a sync is running without the lock. Notified when it ends.
+    bool sync_in_progress = false;
+    std::condition_variable_any sync_notifier;
+
+    ObservationCounts observation_counts;
+  };
+
+  void AddObservationCounts(ObservationCounts *counts) const override;
+  void ClearObservationCounts() override;
+
+  // Restores the chunks listed in the manifest, or rebuilds them from the chunk headers if there is
+  // no valid manifest, recovers the open chunk, and removes or recycles segment files which no
+  // longer hold live chunks.
+  void Recover(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Reads the chunk headers of a segment from |position| to the end of the log in that segment,
+  // and makes the closed chunks available. The valid records which follow the last header become
+  // the open chunk if |position| lies in the tail segment, and are closed as a chunk otherwise.
+  void RecoverSegment(util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t position);
+
+  // Closes the open chunk if it holds any records, making it available to TakeNextEnvelopeHolder().
+  void CloseOpenChunk(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Moves the tail to the start of the next segment, reusing a spare segment file if there is one.
+  bool AdvanceToNextSegment(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Opens the tail segment, creating and preallocating it if needed.
+  bool OpenTailSegment(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Writes the live chunks and the start of the open chunk to the manifest.
+  void WriteManifest(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Removes |chunks| from the store, and recycles the segments which no longer hold live chunks.
+  void DeleteChunks(const std::vector<Chunk> &chunks);
+
+  // Recycles or deletes the segment files before the tail segment which hold no live chunks.
+  void ReclaimSegments(util::ProtectedFields<Fields>::LockedFieldsPtr *fields);
+
+  // Syncs the log up to |position| if required by the sync policy after an observation was stored.
+  // Returns false if the policy requires the observation to be durable and the sync failed.
+  bool MaybeSync(util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t position);
+
+  // Syncs the log up to at least |position|. The lock is released during the sync, and a caller
+  // which finds a sync in progress waits for it, so that concurrent callers share syncs. Returns
+  // false if the sync failed.
+  bool SyncTo(util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t position);
+
+  // Returns the open file of |segment|, which is the tail file for the tail segment, or nullptr.
+  std::shared_ptr<util::FileSystem::RandomAccessFile> OpenSegment(
+      util::ProtectedFields<Fields>::LockedFieldsPtr *fields, uint64_t segment);
+
+  // Reads the records of |chunk|, which follow its header, into |data|. Returns false if the
+  // segment could not be read.
+  bool ReadChunk(const Chunk &chunk, std::string *data) const;
+
+  std::string SegmentPath(uint64_t segment) const;
+  std::string SparePath(uint64_t segment) const;
+
+  util::ProtectedFields<Fields> protected_fields_;
+  util::FileSystem *fs_;
+  const std::string root_directory_;
+  const size_t segment_size_;
+  util::ConsistentProtoStore manifest_store_;
+
+  std::unique_ptr<logger::InternalMetrics> internal_metrics_;
+};
+
+}  // namespace cobalt::observation_store
+
+#endif  // COBALT_SRC_OBSERVATION_STORE_SEGMENT_OBSERVATION_STORE_H_
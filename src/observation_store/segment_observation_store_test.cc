@@ -0,0 +1,309 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/observation_store/segment_observation_store.h"
+
+#include <fstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "src/lib/util/posix_file_system.h"
+#include "src/logging.h"
+#include "src/observation_store/observation_store.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::observation_store {
+
+using util::PosixFileSystem;
+
+namespace {
+
+const uint32_t kCustomerId = 11;
+const uint32_t kProjectId = 12;
+const uint32_t kMetricId = 13;
+
+const size_t kMaxBytesPerObservation = 100;
+const size_t kMaxBytesPerEnvelope = 400;
+const size_t kMaxBytesTotal = 10000;
+// Holds two chunks of four kMaxBytesPerObservation observations.
+const size_t kSegmentSize = 1000;
+
+constexpr char test_dir_base[] = "/tmp/sos_test";
+
+std::string GetTestDirName(const std::string &base) {
+  std::stringstream fname;
+  fname << base << "_"
+        << std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+               .count();
+  return fname.str();
+}
+
+class SegmentObservationStoreTest : public ::testing::Test {
+ public:
+  SegmentObservationStoreTest()
+      : test_dir_name_(GetTestDirName(test_dir_base)),
+        encrypt_(util::EncryptedMessageMaker::MakeUnencrypted()) {
+    MakeStore();
+  }
+
+  // Destroys the store, if any, and creates a new one on the same directory.
+  void MakeStore() {
+    store_ = nullptr;
+    store_ = std::make_unique<SegmentObservationStore>(kMaxBytesPerObservation,
+                                                       kMaxBytesPerEnvelope, kMaxBytesTotal, &fs_,
+                                                       test_dir_name_, kSegmentSize);
+  }
+
+  void TearDown() override {
+    store_->DeleteData();
+    store_ = nullptr;
+    fs_.Delete(test_dir_name_ + "/manifest");
+    fs_.Delete(test_dir_name_);
+  }
+
+  ObservationStore::StoreStatus AddObservation(size_t num_bytes, uint32_t metric_id = kMetricId) {
+    auto message = std::make_unique<EncryptedMessage>();
+    CHECK(num_bytes > 4);
+    message->set_ciphertext(std::string(num_bytes - 4, 'x'));
+    auto metadata = std::make_unique<ObservationMetadata>();
+    metadata->set_customer_id(kCustomerId);
+    metadata->set_project_id(kProjectId);
+    metadata->set_metric_id(metric_id);
+    return store_->StoreObservation(std::move(message), std::move(metadata));
+  }
+
+  // Takes and deletes all envelopes, and returns the number of observations they held.
+  int TakeAllObservations() {
+    int num_observations = 0;
+    while (auto holder = store_->TakeNextEnvelopeHolder()) {
+      for (const auto &batch : holder->GetEnvelope(encrypt_.get()).batch()) {
+        num_observations += batch.encrypted_observation_size();
+      }
+    }
+    return num_observations;
+  }
+
+  std::string SegmentPath(size_t index) {
+    auto files = store_->ListSegmentFiles();
+    CHECK(index < files.size());
+    return test_dir_name_ + "/" + files[index];
+  }
+
+ protected:
+  PosixFileSystem fs_;
+  std::string test_dir_name_;
+  std::unique_ptr<SegmentObservationStore> store_;
+  std::unique_ptr<util::EncryptedMessageMaker> encrypt_;
+};
+
+}  // namespace
+
+TEST_F(SegmentObservationStoreTest, AddRetrieveFullEnvelope) {
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  EXPECT_GT(store_->Size(), 4 * kMaxBytesPerObservation);
+
+  auto envelope = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(envelope, nullptr);
+  auto read_env = envelope->GetEnvelope(encrypt_.get());
+  ASSERT_EQ(read_env.batch_size(), 1);
+  EXPECT_EQ(read_env.batch(0).encrypted_observation_size(), 4);
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+
+  envelope = nullptr;
+  EXPECT_TRUE(store_->Empty());
+}
+
+TEST_F(SegmentObservationStoreTest, AddRetrieveSingleObservation) {
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(50));
+  // The open chunk is closed by TakeNextEnvelopeHolder.
+  auto envelope = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(envelope, nullptr);
+  EXPECT_EQ(envelope->GetEnvelope(encrypt_.get()).batch(0).encrypted_observation_size(), 1);
+}
+
+TEST_F(SegmentObservationStoreTest, ReturnEnvelopeHolder) {
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  auto first = store_->TakeNextEnvelopeHolder();
+  auto second = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(second, nullptr);
+  first->MergeWith(std::move(second));
+  EXPECT_EQ(first->GetEnvelope(encrypt_.get()).batch(0).encrypted_observation_size(), 8);
+  store_->ReturnEnvelopeHolder(std::move(first));
+
+  EXPECT_EQ(TakeAllObservations(), 8);
+  EXPECT_TRUE(store_->Empty());
+}
+
+TEST_F(SegmentObservationStoreTest, StoreFull) {
+  ObservationStore::StoreStatus status;
+  while ((status = AddObservation(kMaxBytesPerObservation)) == ObservationStore::kOk) {
+  }
+  EXPECT_EQ(status, ObservationStore::kStoreFull);
+  EXPECT_LE(store_->Size(), kMaxBytesTotal);
+}
+
+TEST_F(SegmentObservationStoreTest, DeleteData) {
+  for (int i = 0; i < 6; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  auto envelope = store_->TakeNextEnvelopeHolder();
+  EXPECT_NE(store_->Size(), 0);
+
+  store_->DeleteData();
+  EXPECT_EQ(store_->Size(), 0);
+  EXPECT_EQ(store_->TakeNextEnvelopeHolder(), nullptr);
+  EXPECT_TRUE(store_->ListSegmentFiles().empty());
+
+  // Deleting the holder of a chunk that was already deleted does not affect new observations.
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  envelope = nullptr;
+  EXPECT_EQ(TakeAllObservations(), 1);
+}
+
+// Both the closed chunks and the records of the open chunk survive a restart.
+TEST_F(SegmentObservationStoreTest, PersistsAcrossRestart) {
+  for (int i = 0; i < 6; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  size_t size = store_->Size();
+
+  MakeStore();
+  EXPECT_EQ(store_->Size(), size);
+  EXPECT_EQ(TakeAllObservations(), 6);
+}
+
+// Chunks deleted out of order stay deleted after a restart, and returned ones are kept.
+TEST_F(SegmentObservationStoreTest, OutOfOrderDeleteAndRestart) {
+  for (int i = 0; i < 12; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  auto first = store_->TakeNextEnvelopeHolder();
+  auto second = store_->TakeNextEnvelopeHolder();
+  auto third = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(third, nullptr);
+  second = nullptr;
+  store_->ReturnEnvelopeHolder(std::move(first));
+  store_->ReturnEnvelopeHolder(std::move(third));
+
+  MakeStore();
+  EXPECT_EQ(TakeAllObservations(), 8);
+}
+
+// A record torn by a crash, and whatever follows it, is dropped on recovery, but the records that
+// precede it are kept.
+TEST_F(SegmentObservationStoreTest, DropsTornRecordOnRecovery) {
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  size_t size = store_->Size();
+  std::string segment_path = SegmentPath(0);
+  store_ = nullptr;
+
+  {
+    std::fstream segment(segment_path, std::ios::in | std::ios::out | std::ios::binary);
+    segment.seekp(static_cast<std::streamoff>(size - 1));
+    segment.put('y');
+    // Garbage after the tail of the log is ignored.
+    segment.seekp(static_cast<std::streamoff>(size + 10));
+    segment.write("garbage", 7);
+  }
+
+  MakeStore();
+  EXPECT_LT(store_->Size(), size);
+  EXPECT_EQ(TakeAllObservations(), 1);
+
+  // New records are appended after the recovered ones.
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  MakeStore();
+  EXPECT_EQ(TakeAllObservations(), 1);
+}
+
+// Without a manifest, the chunks are rebuilt from their headers in the segments. Deleted chunks
+// stay deleted, and both returned chunks and the records of the open chunk are kept.
+TEST_F(SegmentObservationStoreTest, RebuildsLostManifest) {
+  // Three closed chunks over two segments, and two observations in the open chunk.
+  for (int i = 0; i < 14; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  size_t size = store_->Size();
+  auto first = store_->TakeNextEnvelopeHolder();
+  auto second = store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(second, nullptr);
+  size_t second_size = second->Size();
+  second = nullptr;
+  store_->ReturnEnvelopeHolder(std::move(first));
+  store_ = nullptr;
+  ASSERT_TRUE(fs_.Delete(test_dir_name_ + "/manifest"));
+
+  MakeStore();
+  EXPECT_EQ(store_->Size(), size - second_size);
+  EXPECT_EQ(TakeAllObservations(), 10);
+}
+
+// A corrupt manifest is rebuilt like a lost one.
+TEST_F(SegmentObservationStoreTest, RebuildsCorruptManifest) {
+  for (int i = 0; i < 6; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  }
+  store_ = nullptr;
+  {
+    std::ofstream manifest(test_dir_name_ + "/manifest", std::ios::binary | std::ios::trunc);
+    manifest << "This is not a manifest";
+  }
+
+  MakeStore();
+  EXPECT_EQ(TakeAllObservations(), 6);
+
+  // Once rebuilt, the manifest is used again.
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+  MakeStore();
+  EXPECT_EQ(TakeAllObservations(), 1);
+}
+
+// With SyncPolicy::kEveryBatch, concurrent writers share syncs and are all accounted for.
+TEST_F(SegmentObservationStoreTest, SyncEveryBatchWithConcurrentWriters) {
+  SyncPolicy policy;
+  policy.mode = SyncPolicy::kEveryBatch;
+  store_->SetSyncPolicy(policy);
+
+  const int kNumThreads = 8;
+  const int kObservationsPerThread = 10;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this] {
+      for (int j = 0; j < kObservationsPerThread; j++) {
+        EXPECT_EQ(ObservationStore::kOk, AddObservation(20));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(TakeAllObservations(), kNumThreads * kObservationsPerThread);
+}
+
+// Segments whose chunks have all been deleted are reused, so the number of segment files stays
+// bounded however many observations go through the store.
+TEST_F(SegmentObservationStoreTest, RecyclesSegments) {
+  for (int round = 0; round < 50; round++) {
+    for (int i = 0; i < 4; i++) {
+      ASSERT_EQ(ObservationStore::kOk, AddObservation(kMaxBytesPerObservation));
+    }
+    ASSERT_EQ(TakeAllObservations(), 4) << "round=" << round;
+    // The tail segment and at most two spare segments.
+    EXPECT_LE(store_->ListSegmentFiles().size(), 3u);
+  }
+  EXPECT_TRUE(store_->Empty());
+
+  MakeStore();
+  EXPECT_TRUE(store_->Empty());
+  EXPECT_EQ(TakeAllObservations(), 0);
+}
+
+}  // namespace cobalt::observation_store
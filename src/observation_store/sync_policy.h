@@ -0,0 +1,43 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_OBSERVATION_STORE_SYNC_POLICY_H_
+#define COBALT_SRC_OBSERVATION_STORE_SYNC_POLICY_H_
+
+#include <chrono>
+#include <cstddef>
+
+namespace cobalt::observation_store {
+
+// SyncPolicy determines when a file-backed ObservationStore syncs the observations it has written
+// to durable storage, trading durability against write throughput.
+struct SyncPolicy {
+  enum Mode {
+    // Observations are never explicitly synced. They reach the file system when the write buffer
+    // fills up or the file is finalized, and durable storage whenever the OS flushes its caches.
+    kNone,
+    // The observations written so far are synced by the first StoreObservation() call which finds
+    // that |interval| has elapsed since the last sync.
+    kInterval,
+    // The observations written so far are synced by the first StoreObservation() call which finds
+    // that at least |bytes| have been written since the last sync.
+    kBytes,
+    // StoreObservation() only returns once its observation has been synced. Observations stored
+    // concurrently are synced together by a single flush and sync (group commit). If the sync
+    // fails, the observation is still stored and StoreObservation() returns kStoredNotDurable.
+    kEveryBatch,
+  };
+
+  Mode mode = kNone;
+
+  // Used by kInterval.
+  std::chrono::milliseconds interval = std::chrono::seconds(1);
+
+  // Used by kBytes.
+  size_t bytes = 0;
+};
+
+}  // namespace cobalt::observation_store
+
+#endif  // COBALT_SRC_OBSERVATION_STORE_SYNC_POLICY_H_
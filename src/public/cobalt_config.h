@@ -8,9 +8,12 @@
 #include <memory>
 
 #include "src/lib/clearcut/http_client.h"
+#include "src/lib/clearcut/uploader.h"
 #include "src/lib/util/clock.h"
 #include "src/lib/util/file_system.h"
+#include "src/local_aggregation/component_limits.h"
 #include "src/logger/project_context.h"
+#include "src/observation_store/sync_policy.h"
 #include "src/registry/metric_definition.pb.h"
 #include "src/system_data/client_secret.h"
 #include "src/system_data/configuration_data.h"
@@ -128,6 +131,11 @@ struct CobaltConfig {
   // of file backed.
   bool use_memory_observation_store = false;
 
+  // |use_segment_observation_store|: If true and |use_memory_observation_store| is false, the
+  // ObservationStore used will be a SegmentObservationStore, which appends observations to a log of
+  // preallocated segment files in |observation_store_directory|, instead of a FileObservationStore.
+  bool use_segment_observation_store = false;
+
   // These three values are provided to the ObservationStore.
   //
   //|max_bytes_per_event|: Attempting to log an event that is larger than this value will result in
@@ -153,6 +161,36 @@ struct CobaltConfig {
   // path to the directory the observation_store will use to store observations.
   std::string observation_store_directory;
 
+  // |use_observation_store_manifest|: If true and |use_memory_observation_store| is false, the
+  // index of the finalized observation files is saved to a manifest in
+  // |observation_store_directory| at shutdown, so that the next startup does not need to list the
+  // directory and read the size of each file.
+  bool use_observation_store_manifest = false;
+
+  // |observation_store_sync_policy|: If |use_memory_observation_store| is false, determines when
+  // stored observations are synced to durable storage. By default they are never explicitly synced.
+  observation_store::SyncPolicy observation_store_sync_policy;
+
+  // |compress_observation_store_files|: If true and the file backed FileObservationStore is used,
+  // each observation file is gzip-compressed when it is finalized, and |max_bytes_total| applies to
+  // the compressed sizes.
+  bool compress_observation_store_files = false;
+
+  // |defer_observation_encryption|: If true, Observations are written to the ObservationStore
+  // unencrypted, and are encrypted to the Analyzer when they are read back to be sent, by a pool of
+  // |num_encryption_workers| threads. This takes the public key encryption of each Observation off
+  // the threads which log events. If |num_encryption_workers| is 0, the pool has one thread less
+  // than the number of cores.
+  bool defer_observation_encryption = false;
+  size_t num_encryption_workers = 0;
+
+  // |batch_observation_encryption|: If true, and |defer_observation_encryption| is true, the
+  // Observations of each ObservationBatch are encrypted to the Analyzer with a single key
+  // encapsulation (the HYBRID_TINK_BATCH scheme), rather than one per Observation. The Analyzer can
+  // tell which Observations were sent in the same ObservationBatch, so this must only be enabled
+  // where that is acceptable.
+  bool batch_observation_encryption = false;
+
   // |local_aggregate_proto_store_path|: The absolute path where the local aggregate proto should be
   // stored.
   std::string local_aggregate_proto_store_path;
@@ -161,6 +199,29 @@ struct CobaltConfig {
   // stored.
   std::string obs_history_proto_store_path;
 
+  // |use_indexed_local_aggregate_store|: If true, snapshots of the local aggregate and observation
+  // history protos are stored in an indexed format at |local_aggregate_proto_store_path| and
+  // |obs_history_proto_store_path| with an ".idx" suffix. At startup these are only mapped into
+  // memory, and each report is decoded when it is first used or by a background prefetch. Existing
+  // snapshots at the original paths are read once and migrated on the next backup. The saving is
+  // limited to startup: the prefetch decodes all of the reports before the first Observation
+  // generation, after which memory use is the same as without this option.
+  bool use_indexed_local_aggregate_store = false;
+
+  // |use_packed_local_aggregation_observations|: If true, the locally aggregated Observations of
+  // each UNIQUE_N_DAY_ACTIVES and PER_DEVICE_NUMERIC_STATS report for a given day and aggregation
+  // window are packed into a single PackedUniqueActivesObservation or
+  // PackedPerDeviceNumericObservation. The server must support these Observation types. A packed
+  // Observation tells the Analyzer which event codes or components were active on the same device,
+  // which separate Observations do not, so this must only be enabled where that is acceptable.
+  bool use_packed_local_aggregation_observations = false;
+
+  // |local_aggregation_component_limits|: Bounds the number of distinct components for which
+  // aggregates are kept for each PER_DEVICE_NUMERIC_STATS and PER_DEVICE_HISTOGRAM report, and
+  // determines what happens to events for a new component once that bound is reached. By default
+  // the number of components is not limited.
+  local_aggregation::ComponentLimits local_aggregation_component_limits;
+
   // These three values are provided to the UploadScheduler of the shipping manager.
   //
   // |target_interval|: How frequently should ShippingManager perform regular periodic sends to the
@@ -176,12 +237,80 @@ struct CobaltConfig {
   std::chrono::seconds min_interval;
   std::chrono::seconds initial_interval;
 
+  // |max_concurrent_uploads|: How many Envelopes the ShippingManager may upload at the same time.
+  // Concurrent uploads shorten the time needed to drain a backlog of Envelopes over a link with a
+  // high latency. The HTTPClient of |target_pipeline| must support concurrent requests if this is
+  // greater than 1.
+  //
+  // |max_upload_bytes_in_flight|: The maximum total size of the Envelopes which are being uploaded
+  // at the same time. If 0, the total size is not limited.
+  size_t max_concurrent_uploads = 1;
+  size_t max_upload_bytes_in_flight = 0;
+
+  // |max_upload_request_bytes|: The maximum total size of the Envelopes which are uploaded together
+  // in a single request. If 0, each Envelope is uploaded in its own request. A larger value saves
+  // the overhead of a request per Envelope when there is a backlog of small Envelopes.
+  size_t max_upload_request_bytes = 0;
+
+  // |upload_compression_level|: The zlib compression level (1-9, or -1 for the zlib default) at
+  // which the bodies of upload requests are compressed with gzip. If 0, requests are not
+  // compressed.
+  //
+  // |min_compressed_upload_bytes|: Requests smaller than this are not compressed.
+  int upload_compression_level = 0;
+  size_t min_compressed_upload_bytes = lib::clearcut::kMinCompressedBytes;
+
+  // |adaptive_upload_scheduling|: If true, the ShippingManager decides when to upload from the rate
+  // at which the ObservationStore fills, recent upload failures and the wait requested by the
+  // server, instead of uploading every |target_interval|. See AdaptiveUploadScheduler.
+  //
+  // |max_upload_interval|: With adaptive scheduling, the longest time between two uploads while
+  // there are Observations to upload. If 0, |target_interval| is used.
+  //
+  // |target_envelopes_per_upload|: With adaptive scheduling, uploads are delayed until the
+  // ObservationStore holds this many full Envelopes, up to |max_upload_interval|.
+  bool adaptive_upload_scheduling = false;
+  std::chrono::seconds max_upload_interval = std::chrono::seconds(0);
+  size_t target_envelopes_per_upload = 1;
+
+  // |upload_circuit_breaker|: If true, the ShippingManager stops uploading once
+  // |upload_failures_before_circuit_opens| consecutive uploads have failed, and only probes the
+  // backend with a single request from time to time until one succeeds. See UploadCircuitBreaker.
+  //
+  // |upload_circuit_breaker_state_path|: If not empty, the absolute path where the state of the
+  // circuit breaker, including any wait requested by the server, should be stored, so that it is
+  // honored after a restart.
+  bool upload_circuit_breaker = false;
+  size_t upload_failures_before_circuit_opens = 3;
+  std::string upload_circuit_breaker_state_path;
+
+  // |upload_payload_cache_max_memory_bytes|: If not 0, the encrypted Envelopes of failed uploads
+  // are kept in memory, up to this many bytes, so that retrying them does not read and encrypt the
+  // Observations again. Only Envelopes taken from a FileObservationStore are kept.
+  //
+  // |upload_payload_cache_spill_path| and |upload_payload_cache_max_disk_bytes|: If the path is not
+  // empty, the encrypted Envelopes which do not fit in memory are written to this directory, up to
+  // this many bytes. The directory is used only for this purpose, and is emptied at startup.
+  size_t upload_payload_cache_max_memory_bytes = 0;
+  size_t upload_payload_cache_max_disk_bytes = 0;
+  std::string upload_payload_cache_spill_path;
+
   // |target_pipeline|: Used to determine where to send observations, and how to encrypt them.
   std::unique_ptr<TargetPipelineInterface> target_pipeline;
 
   // |local_shipping_manager_path|: If |environments| is equal to {LOCAL}, the observations will be
   // written to this path, instead of being shipped to clearcut.
+  //
+  // |local_shipping_manager_max_bytes_per_file| and |local_shipping_manager_max_file_age|: If not
+  // 0, the file at |local_shipping_manager_path| is rotated once it holds this many bytes or is
+  // this old. See LocalShippingManager::SetFileRotation().
+  //
+  // |local_shipping_manager_sync_policy|: Determines when the file at
+  // |local_shipping_manager_path| is synced to durable storage.
   std::string local_shipping_manager_path;
+  size_t local_shipping_manager_max_bytes_per_file = 0;
+  std::chrono::seconds local_shipping_manager_max_file_age = std::chrono::seconds(0);
+  observation_store::SyncPolicy local_shipping_manager_sync_policy;
 
   // |api_key|: An API key included in each request to the Shuffler. If the API key is unrecognized
   // on the server, the observations may be discarded.
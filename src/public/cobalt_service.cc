@@ -7,12 +7,14 @@
 #include <memory>
 
 #include "src/lib/util/clock.h"
+#include "src/lib/util/consistent_proto_store.h"
 #include "src/lib/util/encrypted_message_util.h"
 #include "src/logger/internal_metrics_config.cb.h"
 #include "src/logger/project_context.h"
 #include "src/observation_store/file_observation_store.h"
 #include "src/observation_store/memory_observation_store.h"
 #include "src/observation_store/observation_store.h"
+#include "src/observation_store/segment_observation_store.h"
 #include "src/system_data/configuration_data.h"
 #include "src/uploader/shipping_manager.h"
 
@@ -20,15 +22,29 @@ namespace cobalt {
 
 namespace {
 
-std::unique_ptr<observation_store::ObservationStore> NewObservationStore(const CobaltConfig &cfg,
-                                                                         util::FileSystem *fs) {
+std::unique_ptr<observation_store::ObservationStore> NewObservationStore(
+    const CobaltConfig &cfg, util::FileSystem *fs, util::EncryptionWorkerPool *encryption_pool) {
+  std::unique_ptr<observation_store::ObservationStore> observation_store;
   if (cfg.use_memory_observation_store) {
-    return std::make_unique<observation_store::MemoryObservationStore>(
+    observation_store = std::make_unique<observation_store::MemoryObservationStore>(
         cfg.max_bytes_per_event, cfg.max_bytes_per_envelope, cfg.max_bytes_total);
+  } else if (cfg.use_segment_observation_store) {
+    auto store = std::make_unique<observation_store::SegmentObservationStore>(
+        cfg.max_bytes_per_event, cfg.max_bytes_per_envelope, cfg.max_bytes_total, fs,
+        cfg.observation_store_directory);
+    store->SetSyncPolicy(cfg.observation_store_sync_policy);
+    observation_store = std::move(store);
+  } else {
+    auto store = std::make_unique<observation_store::FileObservationStore>(
+        cfg.max_bytes_per_event, cfg.max_bytes_per_envelope, cfg.max_bytes_total, fs,
+        cfg.observation_store_directory, "V1 FileObservationStore", /*internal_logger=*/nullptr,
+        cfg.use_observation_store_manifest);
+    store->SetSyncPolicy(cfg.observation_store_sync_policy);
+    store->SetCompressFinalizedFiles(cfg.compress_observation_store_files);
+    observation_store = std::move(store);
   }
-  return std::make_unique<observation_store::FileObservationStore>(
-      cfg.max_bytes_per_event, cfg.max_bytes_per_envelope, cfg.max_bytes_total, fs,
-      cfg.observation_store_directory, "V1 FileObservationStore");
+  observation_store->SetEncryptionWorkerPool(encryption_pool);
+  return observation_store;
 }
 
 std::unique_ptr<util::EncryptedMessageMaker> GetEncryptToAnalyzer(CobaltConfig *cfg) {
@@ -38,7 +54,8 @@ std::unique_ptr<util::EncryptedMessageMaker> GetEncryptToAnalyzer(CobaltConfig *
 
   if (cfg->target_pipeline->analyzer_encryption_key()) {
     return util::EncryptedMessageMaker::MakeForObservations(
-               *cfg->target_pipeline->analyzer_encryption_key())
+               *cfg->target_pipeline->analyzer_encryption_key(),
+               cfg->defer_observation_encryption && cfg->batch_observation_encryption)
         .ConsumeValueOrDie();
   }
 
@@ -64,16 +81,50 @@ std::unique_ptr<uploader::ShippingManager> NewShippingManager(
     util::EncryptedMessageMaker *encrypt_to_analyzer,
     const std::unique_ptr<util::EncryptedMessageMaker> &encrypt_to_shuffler) {
   if (cfg->target_pipeline->environment() == system_data::Environment::LOCAL) {
-    return std::make_unique<uploader::LocalShippingManager>(observation_store,
-                                                            cfg->local_shipping_manager_path, fs);
+    auto shipping_manager = std::make_unique<uploader::LocalShippingManager>(
+        observation_store, encrypt_to_analyzer, cfg->local_shipping_manager_path, fs);
+    shipping_manager->SetFileRotation(cfg->local_shipping_manager_max_bytes_per_file,
+                                      cfg->local_shipping_manager_max_file_age);
+    shipping_manager->SetSyncPolicy(cfg->local_shipping_manager_sync_policy);
+    return std::move(shipping_manager);
   }
+  auto clearcut_uploader = std::make_unique<lib::clearcut::ClearcutUploader>(
+      cfg->target_pipeline->clearcut_endpoint(), cfg->target_pipeline->TakeHttpClient());
+  clearcut_uploader->SetCompression(cfg->upload_compression_level,
+                                    cfg->min_compressed_upload_bytes);
   auto shipping_manager = std::make_unique<uploader::ClearcutV1ShippingManager>(
       uploader::UploadScheduler(cfg->target_interval, cfg->min_interval, cfg->initial_interval),
       observation_store, encrypt_to_shuffler.get(), encrypt_to_analyzer,
-      std::make_unique<lib::clearcut::ClearcutUploader>(cfg->target_pipeline->clearcut_endpoint(),
-                                                        cfg->target_pipeline->TakeHttpClient()),
+      std::move(clearcut_uploader),
       system_data::ConfigurationData(cfg->target_pipeline->environment()).GetLogSourceId(), nullptr,
       cfg->target_pipeline->clearcut_max_retries(), cfg->api_key);
+  shipping_manager->SetUploadConcurrency(cfg->max_concurrent_uploads,
+                                         cfg->max_upload_bytes_in_flight);
+  shipping_manager->SetMaxBytesPerRequest(cfg->max_upload_request_bytes);
+  if (cfg->adaptive_upload_scheduling) {
+    uploader::AdaptiveUploadScheduler::Params params;
+    params.min_interval = cfg->min_interval;
+    params.max_interval = cfg->max_upload_interval.count() > 0 ? cfg->max_upload_interval
+                                                                : cfg->target_interval;
+    params.target_bytes_per_send = cfg->target_envelopes_per_upload * cfg->max_bytes_per_envelope;
+    params.store_capacity_bytes = cfg->max_bytes_total;
+    shipping_manager->SetAdaptiveScheduling(params);
+  }
+  if (cfg->upload_circuit_breaker) {
+    uploader::UploadCircuitBreaker::Params params;
+    params.failure_threshold = cfg->upload_failures_before_circuit_opens;
+    std::unique_ptr<util::ConsistentProtoStore> state_store;
+    if (!cfg->upload_circuit_breaker_state_path.empty()) {
+      state_store = std::make_unique<util::ConsistentProtoStore>(
+          cfg->upload_circuit_breaker_state_path, fs);
+    }
+    shipping_manager->SetCircuitBreaker(params, std::move(state_store));
+  }
+  if (cfg->upload_payload_cache_max_memory_bytes > 0) {
+    shipping_manager->SetUploadPayloadCache(std::make_unique<uploader::UploadPayloadCache>(
+        cfg->upload_payload_cache_max_memory_bytes, cfg->upload_payload_cache_max_disk_bytes, fs,
+        cfg->upload_payload_cache_spill_path));
+  }
 
   return std::move(shipping_manager);
 }
@@ -87,14 +138,18 @@ CobaltService::CobaltService(CobaltConfig cfg)
           cfg.global_registry
               ? std::make_unique<logger::ProjectContextFactory>(std::move(cfg.global_registry))
               : nullptr),
-      observation_store_(NewObservationStore(cfg, fs_.get())),
+      encryption_worker_pool_(
+          cfg.defer_observation_encryption
+              ? std::make_unique<util::EncryptionWorkerPool>(cfg.num_encryption_workers)
+              : nullptr),
+      observation_store_(NewObservationStore(cfg, fs_.get(), encryption_worker_pool_.get())),
       encrypt_to_analyzer_(GetEncryptToAnalyzer(&cfg)),
       encrypt_to_shuffler_(GetEncryptToShuffler(cfg.target_pipeline.get())),
       shipping_manager_(NewShippingManager(&cfg, fs_.get(), observation_store_.get(),
                                            encrypt_to_analyzer_.get(), encrypt_to_shuffler_)),
       logger_encoder_(cfg.client_secret, &system_data_),
       observation_writer_(observation_store_.get(), shipping_manager_.get(),
-                          encrypt_to_analyzer_.get()),
+                          cfg.defer_observation_encryption ? nullptr : encrypt_to_analyzer_.get()),
       event_aggregator_manager_(cfg, fs_.get(), &logger_encoder_, &observation_writer_),
       undated_event_manager_(new logger::UndatedEventManager(
           &logger_encoder_, event_aggregator_manager_.GetEventAggregator(), &observation_writer_,
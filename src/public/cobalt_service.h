@@ -14,6 +14,7 @@
 #include "src/lib/util/clock.h"
 #include "src/lib/util/consistent_proto_store.h"
 #include "src/lib/util/encrypted_message_util.h"
+#include "src/lib/util/encryption_worker_pool.h"
 #include "src/local_aggregation/event_aggregator_mgr.h"
 #include "src/logger/logger.h"
 #include "src/logger/observation_writer.h"
@@ -102,6 +103,18 @@ class CobaltService : public CobaltServiceInterface {
     return observation_store_->num_observations_added_for_reports(report_ids);
   }
 
+  [[nodiscard]] double average_envelope_fill_ratio() const override {
+    return observation_store_->average_envelope_fill_ratio();
+  }
+
+  [[nodiscard]] uint64_t num_local_aggregation_events_rejected() const override {
+    return event_aggregator_manager_.component_limit_counters().num_events_rejected();
+  }
+
+  [[nodiscard]] uint64_t num_local_aggregation_components_evicted() const override {
+    return event_aggregator_manager_.component_limit_counters().num_evicted;
+  }
+
   void ShippingRequestSendSoon(const SendCallback &send_callback) override {
     shipping_manager_->RequestSendSoon(send_callback);
   }
@@ -134,6 +147,7 @@ class CobaltService : public CobaltServiceInterface {
   std::unique_ptr<util::FileSystem> fs_;
   system_data::SystemData system_data_;
   std::unique_ptr<logger::ProjectContextFactory> global_project_context_factory_;
+  std::unique_ptr<util::EncryptionWorkerPool> encryption_worker_pool_;
   std::unique_ptr<observation_store::ObservationStore> observation_store_;
   std::unique_ptr<util::EncryptedMessageMaker> encrypt_to_analyzer_;
   std::unique_ptr<util::EncryptedMessageMaker> encrypt_to_shuffler_;
@@ -84,6 +84,18 @@ class CobaltServiceInterface {
   [[nodiscard]] virtual std::vector<uint64_t> num_observations_added_for_reports(
       const std::vector<uint32_t>& report_ids) const = 0;
 
+  // Returns the average ratio of the size of the Envelopes taken from the ObservationStore to the
+  // maximum size of an Envelope.
+  [[nodiscard]] virtual double average_envelope_fill_ratio() const = 0;
+
+  // Returns the number of events which were not locally aggregated under their own component
+  // because of CobaltConfig::local_aggregation_component_limits.
+  [[nodiscard]] virtual uint64_t num_local_aggregation_events_rejected() const = 0;
+
+  // Returns the number of components whose local aggregates were evicted because of
+  // CobaltConfig::local_aggregation_component_limits.
+  [[nodiscard]] virtual uint64_t num_local_aggregation_components_evicted() const = 0;
+
   using SendCallback = std::function<void(bool)>;
 
   // Register a request for an expedited send of observations to the server. The
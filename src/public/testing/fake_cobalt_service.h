@@ -88,6 +88,12 @@ class FakeCobaltService : public CobaltServiceInterface {
     return {};
   }
 
+  [[nodiscard]] double average_envelope_fill_ratio() const override { return 0; }
+
+  [[nodiscard]] uint64_t num_local_aggregation_events_rejected() const override { return 0; }
+
+  [[nodiscard]] uint64_t num_local_aggregation_components_evicted() const override { return 0; }
+
   void ShippingRequestSendSoon(const SendCallback& send_callback) override {}
 
   void WaitUntilShippingIdle(std::chrono::seconds max_wait) override {}
@@ -4,6 +4,8 @@
 
 #include "src/registry/project_configs.h"
 
+#include <vector>
+
 #include "src/logging.h"
 #include "third_party/abseil-cpp/absl/strings/escaping.h"
 
@@ -39,7 +41,7 @@ ProjectConfigs::ProjectConfigs(std::unique_ptr<CobaltRegistry> cobalt_registry)
   is_empty_ = cobalt_registry_->customers_size() == 0;
   is_single_project_ = false;
   if (cobalt_registry_->customers_size() == 1) {
-    auto customer = cobalt_registry_->customers(0);
+    const auto& customer = cobalt_registry_->customers(0);
     if (customer.projects_size() == 1) {
       const auto& project = customer.projects(0);
       is_single_project_ = true;
@@ -49,23 +51,48 @@ ProjectConfigs::ProjectConfigs(std::unique_ptr<CobaltRegistry> cobalt_registry)
       single_project_name_ = project.project_name();
     }
   }
+
+  // The entries are counted first so that each table is built with a single allocation.
+  size_t num_projects = 0;
+  size_t num_metrics = 0;
+  size_t num_reports = 0;
+  for (const auto& customer : cobalt_registry_->customers()) {
+    num_projects += customer.projects_size();
+    for (const auto& project : customer.projects()) {
+      num_metrics += project.metrics_size();
+      for (const auto& metric : project.metrics()) {
+        num_reports += metric.reports_size();
+      }
+    }
+  }
+
+  std::vector<decltype(customers_by_id_)::Entry> customers;
+  std::vector<decltype(projects_by_id_)::Entry> projects;
+  std::vector<decltype(metrics_by_id_)::Entry> metrics;
+  std::vector<decltype(reports_by_id_)::Entry> reports;
+  customers.reserve(cobalt_registry_->customers_size());
+  projects.reserve(num_projects);
+  metrics.reserve(num_metrics);
+  reports.reserve(num_reports);
   for (const auto& customer : cobalt_registry_->customers()) {
-    customers_by_id_[customer.customer_id()] = &customer;
-    customers_by_name_[customer.customer_name()] = &customer;
+    uint32_t customer_id = customer.customer_id();
+    customers.emplace_back(customer_id, &customer);
     for (const auto& project : customer.projects()) {
-      projects_by_id_[std::make_tuple(customer.customer_id(), project.project_id())] = &project;
-      projects_by_name_[std::make_tuple(customer.customer_name(), project.project_name())] =
-          &project;
+      uint32_t project_id = project.project_id();
+      projects.emplace_back(std::make_tuple(customer_id, project_id), &project);
       for (const auto& metric : project.metrics()) {
-        metrics_by_id_[std::make_tuple(customer.customer_id(), project.project_id(), metric.id())] =
-            &metric;
+        metrics.emplace_back(std::make_tuple(customer_id, project_id, metric.id()), &metric);
         for (const auto& report : metric.reports()) {
-          reports_by_id_[std::make_tuple(customer.customer_id(), project.project_id(), metric.id(),
-                                         report.id())] = &report;
+          reports.emplace_back(std::make_tuple(customer_id, project_id, metric.id(), report.id()),
+                               &report);
         }
       }
     }
   }
+  customers_by_id_ = decltype(customers_by_id_)(std::move(customers));
+  projects_by_id_ = decltype(projects_by_id_)(std::move(projects));
+  metrics_by_id_ = decltype(metrics_by_id_)(std::move(metrics));
+  reports_by_id_ = decltype(reports_by_id_)(std::move(reports));
 }
 
 std::unique_ptr<ProjectConfig> ProjectConfigs::TakeSingleProjectConfig() {
@@ -74,7 +101,6 @@ std::unique_ptr<ProjectConfig> ProjectConfigs::TakeSingleProjectConfig() {
   }
   is_empty_ = true;
   is_single_project_ = false;
-  projects_by_name_.clear();
   projects_by_id_.clear();
   metrics_by_id_.clear();
   reports_by_id_.clear();
@@ -87,40 +113,29 @@ std::unique_ptr<ProjectConfig> ProjectConfigs::TakeSingleProjectConfig() {
 }
 
 const CustomerConfig* ProjectConfigs::GetCustomerConfig(uint32_t customer_id) const {
-  auto iter = customers_by_id_.find(customer_id);
-  if (iter == customers_by_id_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found = customers_by_id_.Find(customer_id);
+  return found == nullptr ? nullptr : *found;
 }
 
 const ProjectConfig* ProjectConfigs::GetProjectConfig(uint32_t customer_id,
                                                       uint32_t project_id) const {
-  auto iter = projects_by_id_.find(std::make_tuple(customer_id, project_id));
-  if (iter == projects_by_id_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found = projects_by_id_.Find(std::make_tuple(customer_id, project_id));
+  return found == nullptr ? nullptr : *found;
 }
 
 const MetricDefinition* ProjectConfigs::GetMetricDefinition(uint32_t customer_id,
                                                             uint32_t project_id,
                                                             uint32_t metric_id) const {
-  auto iter = metrics_by_id_.find(std::make_tuple(customer_id, project_id, metric_id));
-  if (iter == metrics_by_id_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found = metrics_by_id_.Find(std::make_tuple(customer_id, project_id, metric_id));
+  return found == nullptr ? nullptr : *found;
 }
 
 const ReportDefinition* ProjectConfigs::GetReportDefinition(uint32_t customer_id,
                                                             uint32_t project_id, uint32_t metric_id,
                                                             uint32_t report_id) const {
-  auto iter = reports_by_id_.find(std::make_tuple(customer_id, project_id, metric_id, report_id));
-  if (iter == reports_by_id_.end()) {
-    return nullptr;
-  }
-  return iter->second;
+  const auto* found =
+      reports_by_id_.Find(std::make_tuple(customer_id, project_id, metric_id, report_id));
+  return found == nullptr ? nullptr : *found;
 }
 
 }  // namespace cobalt::config
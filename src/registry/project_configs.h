@@ -5,12 +5,12 @@
 #ifndef COBALT_SRC_REGISTRY_PROJECT_CONFIGS_H_
 #define COBALT_SRC_REGISTRY_PROJECT_CONFIGS_H_
 
-#include <map>
 #include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
 
+#include "src/lib/util/flat_sorted_table.h"
 #include "src/registry/cobalt_registry.pb.h"
 #include "src/registry/metric_definition.pb.h"
 #include "src/registry/report_definition.pb.h"
@@ -119,17 +119,17 @@ class ProjectConfigs {
  private:
   std::unique_ptr<CobaltRegistry> cobalt_registry_;
 
-  std::map<std::string, const CustomerConfig*> customers_by_name_;
+  // Built once at construction and only looked up afterwards, so they are kept as flat sorted
+  // tables rather than maps. The values point into |cobalt_registry_|.
+  util::FlatSortedTable<uint32_t, const CustomerConfig*> customers_by_id_;
 
-  std::map<uint32_t, const CustomerConfig*> customers_by_id_;
+  util::FlatSortedTable<std::tuple<uint32_t, uint32_t>, const ProjectConfig*> projects_by_id_;
 
-  std::map<std::tuple<std::string, std::string>, const ProjectConfig*> projects_by_name_;
+  util::FlatSortedTable<std::tuple<uint32_t, uint32_t, uint32_t>, const MetricDefinition*>
+      metrics_by_id_;
 
-  std::map<std::tuple<uint32_t, uint32_t>, const ProjectConfig*> projects_by_id_;
-
-  std::map<std::tuple<uint32_t, uint32_t, uint32_t>, const MetricDefinition*> metrics_by_id_;
-
-  std::map<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t>, const ReportDefinition*>
+  util::FlatSortedTable<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t>,
+                        const ReportDefinition*>
       reports_by_id_;
 
   bool is_single_project_;
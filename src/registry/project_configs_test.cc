@@ -4,7 +4,12 @@
 
 #include "src/registry/project_configs.h"
 
+#include <algorithm>
+#include <chrono>
+#include <random>
 #include <sstream>
+#include <tuple>
+#include <vector>
 
 #include "src/logging.h"
 #include "third_party/abseil-cpp/absl/strings/escaping.h"
@@ -71,6 +76,28 @@ std::unique_ptr<CobaltRegistry> NewTestRegistry(
   return cobalt_registry;
 }
 
+// Creates a CobaltRegistry with |num_customers| customers of |num_projects_per_customer| projects
+// of |num_metrics_per_project| metrics each.
+std::unique_ptr<CobaltRegistry> NewLargeTestRegistry(uint32_t num_customers,
+                                                     uint32_t num_projects_per_customer,
+                                                     uint32_t num_metrics_per_project) {
+  auto cobalt_registry = std::make_unique<CobaltRegistry>();
+  for (uint32_t customer_id = 1; customer_id <= num_customers; customer_id++) {
+    auto* customer = cobalt_registry->add_customers();
+    customer->set_customer_id(customer_id);
+    customer->set_customer_name(CustomerNameForId(customer_id));
+    for (uint32_t project_id = 1; project_id <= num_projects_per_customer; project_id++) {
+      auto* project = customer->add_projects();
+      project->set_project_id(project_id);
+      project->set_project_name(ProjectNameForId(project_id));
+      for (uint32_t metric_id = 1; metric_id <= num_metrics_per_project; metric_id++) {
+        SetupMetric(metric_id, project->add_metrics());
+      }
+    }
+  }
+  return cobalt_registry;
+}
+
 std::unique_ptr<CobaltRegistry> NewTestRegistry() {
   return NewTestRegistry(kNumCustomers, NumProjectsForCustomer);
 }
@@ -340,4 +367,56 @@ TEST_F(ProjectConfigsTest, IsSingleProject) {
   EXPECT_TRUE(project_configs->TakeSingleProjectConfig() == nullptr);
 }
 
+// Measures the time taken to construct a ProjectConfigs for a registry of 10k metrics, and to look
+// up each of its projects, metrics and reports. Run with --gtest_also_run_disabled_tests.
+TEST_F(ProjectConfigsTest, DISABLED_TenThousandMetrics) {
+  const uint32_t kCustomers = 10;
+  const uint32_t kProjectsPerCustomer = 10;
+  const uint32_t kMetricsPerProject = 100;
+  const int kRounds = 20;
+
+  std::vector<std::unique_ptr<CobaltRegistry>> registries;
+  for (int i = 0; i < kRounds; i++) {
+    registries.push_back(
+        NewLargeTestRegistry(kCustomers, kProjectsPerCustomer, kMetricsPerProject));
+  }
+  std::vector<std::unique_ptr<ProjectConfigs>> project_configs;
+  auto start = std::chrono::steady_clock::now();
+  for (auto& registry : registries) {
+    project_configs.push_back(std::make_unique<ProjectConfigs>(std::move(registry)));
+  }
+  std::chrono::duration<double, std::micro> construction_time =
+      (std::chrono::steady_clock::now() - start) / kRounds;
+
+  // The metrics are looked up in a random order, as they would be by loggers.
+  std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> metric_ids;
+  for (uint32_t customer_id = 1; customer_id <= kCustomers; customer_id++) {
+    for (uint32_t project_id = 1; project_id <= kProjectsPerCustomer; project_id++) {
+      for (uint32_t metric_id = 1; metric_id <= kMetricsPerProject; metric_id++) {
+        metric_ids.emplace_back(customer_id, project_id, metric_id);
+      }
+    }
+  }
+  std::shuffle(metric_ids.begin(), metric_ids.end(), std::mt19937());
+
+  size_t num_lookups = 0;
+  size_t num_found = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRounds; i++) {
+    const ProjectConfigs& configs = *project_configs[i];
+    for (const auto& [customer_id, project_id, metric_id] : metric_ids) {
+      num_found += configs.GetProjectConfig(customer_id, project_id) != nullptr;
+      num_found += configs.GetMetricDefinition(customer_id, project_id, metric_id) != nullptr;
+      num_found += configs.GetReportDefinition(customer_id, project_id, metric_id, 1) != nullptr;
+      num_lookups += 3;
+    }
+  }
+  std::chrono::duration<double, std::nano> lookup_time = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(num_lookups, num_found);
+  LOG(INFO) << kCustomers * kProjectsPerCustomer * kMetricsPerProject
+            << " metrics: construction took " << construction_time.count() << " us, lookups took "
+            << lookup_time.count() / num_lookups << " ns each.";
+}
+
 }  // namespace cobalt::config
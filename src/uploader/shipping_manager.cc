@@ -4,18 +4,22 @@
 
 #include "src/uploader/shipping_manager.h"
 
+#include <algorithm>
 #include <mutex>
 #include <utility>
 
+#include "google/protobuf/io/coded_stream.h"
 #include "src/lib/util/protected_fields.h"
 #include "src/logger/logger_interface.h"
 #include "src/logging.h"
 #include "src/pb/clearcut_extensions.pb.h"
+#include "third_party/abseil-cpp/absl/strings/numbers.h"
 #include "third_party/protobuf/src/google/protobuf/util/delimited_message_util.h"
 
 namespace cobalt::uploader {
 
 using observation_store::ObservationStore;
+using observation_store::SyncPolicy;
 using EnvelopeHolder = ObservationStore::EnvelopeHolder;
 using cobalt::clearcut_extensions::LogEventExtension;
 
@@ -25,6 +29,17 @@ namespace {
 // invocation of SendAllEnvelopes().
 constexpr size_t kMaxFailuresWithoutSuccess = 3;
 
+// An upper bound on the tag and length bytes which frame the api key in a serialized Envelope.
+constexpr size_t kApiKeyFramingBytes = 16;
+
+// The LocalShippingManager writes up to this many bytes of Envelopes between two flushes of its
+// output file.
+constexpr size_t kMaxBytesPerLocalBatch = 1024 * 1024;
+
+// Appended to the path of the output file to name the file which replaces it when the Envelopes
+// after the last commit are removed without random access.
+constexpr char kRewriteTmpSuffix[] = ".tmp";
+
 std::string ToString(const std::chrono::system_clock::time_point& t) {
   std::time_t time_struct = std::chrono::system_clock::to_time_t(t);
   return std::ctime(&time_struct);
@@ -71,7 +86,21 @@ void ShippingManager::Start() {
 void ShippingManager::NotifyObservationsAdded() {
   auto locked = protected_fields_.lock();
 
-  if (locked->observation_store->IsAlmostFull()) {
+  // There is no point in waking up the worker thread for a send which would not be allowed.
+  bool send_blocked = SendBlockedLockHeld(&locked, std::chrono::system_clock::now());
+  if (locked->adaptive_scheduler) {
+    // The adaptive scheduler drains the store before it is almost full, and once it is, lets
+    // IsAlmostFull() cut short a backoff after failed sends.
+    auto now = std::chrono::steady_clock::now();
+    size_t store_size = locked->observation_store->Size();
+    bool almost_full = locked->observation_store->IsAlmostFull();
+    locked->adaptive_scheduler->ObserveStoreSize(now, store_size);
+    if (!send_blocked && !locked->expedited_send_requested &&
+        locked->adaptive_scheduler->NextSendTime(now, store_size, almost_full) <= now) {
+      VLOG(4) << name() << ": NotifyObservationsAdded(): adaptive scheduler requests a send.";
+      RequestSendSoonLockHeld(&locked);
+    }
+  } else if (!send_blocked && locked->observation_store->IsAlmostFull()) {
     VLOG(4) << name()
             << ": NotifyObservationsAdded(): observation_store "
                "IsAlmostFull.";
@@ -221,13 +250,47 @@ void ShippingManager::Run() {
       auto now = std::chrono::system_clock::now();
       VLOG(4) << name() << ": now: " << ToString(now)
               << " next_scheduled_send_time_: " << ToString(next_scheduled_send_time_);
-      if (next_scheduled_send_time_ <= now || locked->expedited_send_requested) {
+      if (next_scheduled_send_time_ <= now && !locked->expedited_send_requested &&
+          locked->adaptive_scheduler) {
+        // The adaptive scheduler may have chosen to wait for more Observations since it scheduled
+        // this send.
+        next_scheduled_send_time_ = AdaptiveNextSendTimeLockHeld(&locked);
+      }
+      if ((next_scheduled_send_time_ <= now || locked->expedited_send_requested) &&
+          locked->circuit_breaker && !locked->circuit_breaker->AllowSend(now)) {
+        // Wait for the circuit breaker to allow a send, without being woken up by
+        // NotifyObservationsAdded(). An explicit RequestSendSoon() is answered with a failure.
+        next_scheduled_send_time_ =
+            std::max(next_scheduled_send_time_, locked->circuit_breaker->NextSendTime());
+        VLOG(4) << name() << " worker: sends are stopped by the circuit breaker until "
+                << ToString(next_scheduled_send_time_);
+        InvokeSendCallbacksLockHeld(&locked, false);
+      } else if (next_scheduled_send_time_ <= now || locked->expedited_send_requested) {
         VLOG(4) << name() << " worker: time to send now.";
         locked->expedited_send_requested = false;
+        sending_probe_ = locked->circuit_breaker &&
+                         locked->circuit_breaker->state() == UploadCircuitBreaker::kHalfOpen;
         locked.unlock();
-        SendAllEnvelopes();
-        next_scheduled_send_time_ = std::chrono::system_clock::now() + upload_scheduler_.Interval();
+        bool reached_backend = true;
+        bool success = SendAllEnvelopes(&reached_backend);
         locked.lock();
+        if (locked->circuit_breaker) {
+          CircuitBreakerSendFinishedLockHeld(&locked, reached_backend);
+          if (sending_probe_ && reached_backend && !locked->observation_store->Empty()) {
+            // The probe succeeded, so the rest of the Observations are sent straight away.
+            locked->expedited_send_requested = true;
+          }
+        }
+        sending_probe_ = false;
+        if (locked->adaptive_scheduler) {
+          locked->adaptive_scheduler->PauseUntil(BackendPausedUntil());
+          locked->adaptive_scheduler->SendFinished(std::chrono::steady_clock::now(), success,
+                                                   locked->observation_store->Size());
+          next_scheduled_send_time_ = AdaptiveNextSendTimeLockHeld(&locked);
+        } else {
+          next_scheduled_send_time_ =
+              std::chrono::system_clock::now() + upload_scheduler_.Interval();
+        }
       } else {
         // Wait until the next scheduled send time or until notified of
         // a new request for an expedited send or we are shut down.
@@ -245,44 +308,220 @@ void ShippingManager::Run() {
   }
 }
 
-void ShippingManager::SendAllEnvelopes() {
+void ShippingManager::SetUploadConcurrency(size_t max_concurrent_uploads,
+                                           size_t max_bytes_in_flight) {
+  CHECK(!worker_thread_.joinable()) << "SetUploadConcurrency() must be invoked before Start().";
+  max_concurrent_uploads_ = std::max(max_concurrent_uploads, static_cast<size_t>(1));
+  max_bytes_in_flight_ = max_bytes_in_flight;
+}
+
+void ShippingManager::SetMaxBytesPerRequest(size_t max_bytes_per_request) {
+  CHECK(!worker_thread_.joinable()) << "SetMaxBytesPerRequest() must be invoked before Start().";
+  max_bytes_per_request_ = max_bytes_per_request;
+}
+
+void ShippingManager::SetAdaptiveScheduling(const AdaptiveUploadScheduler::Params& params) {
+  CHECK(!worker_thread_.joinable()) << "SetAdaptiveScheduling() must be invoked before Start().";
+  auto locked = protected_fields_.lock();
+  locked->adaptive_scheduler =
+      std::make_unique<AdaptiveUploadScheduler>(params, std::chrono::steady_clock::now());
+  next_scheduled_send_time_ = AdaptiveNextSendTimeLockHeld(&locked);
+}
+
+void ShippingManager::SetCircuitBreaker(const UploadCircuitBreaker::Params& params,
+                                        std::unique_ptr<util::ConsistentProtoStore> state_store) {
+  CHECK(!worker_thread_.joinable()) << "SetCircuitBreaker() must be invoked before Start().";
+  auto locked = protected_fields_.lock();
+  locked->circuit_breaker_store = std::move(state_store);
+  locked->circuit_breaker = std::make_unique<UploadCircuitBreaker>(
+      params, locked->circuit_breaker_store.get(), std::chrono::system_clock::now());
+}
+
+UploadCircuitBreaker::State ShippingManager::circuit_breaker_state() const {
+  auto locked = protected_fields_.const_lock();
+  if (!locked->circuit_breaker) {
+    return UploadCircuitBreaker::kClosed;
+  }
+  return locked->circuit_breaker->state();
+}
+
+bool ShippingManager::SendBlockedLockHeld(ShippingManager::Fields::LockedFieldsPtr* fields,
+                                          std::chrono::system_clock::time_point now) {
+  auto& f = *fields;
+  return f->circuit_breaker && f->circuit_breaker->NextSendTime() > now;
+}
+
+void ShippingManager::CircuitBreakerSendFinishedLockHeld(
+    ShippingManager::Fields::LockedFieldsPtr* fields, bool reached_backend) {
+  auto& f = *fields;
+  auto now = std::chrono::system_clock::now();
+  // The pause requested by the backend is measured with the steady clock, which does not survive
+  // a restart, so it is converted to the system clock to be persisted.
+  auto steady_now = std::chrono::steady_clock::now();
+  auto backend_paused_until = BackendPausedUntil();
+  if (backend_paused_until > steady_now) {
+    f->circuit_breaker->PauseUntil(
+        now + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                  backend_paused_until - steady_now));
+  }
+  f->circuit_breaker->SendFinished(now, reached_backend);
+}
+
+std::chrono::system_clock::time_point ShippingManager::AdaptiveNextSendTimeLockHeld(
+    ShippingManager::Fields::LockedFieldsPtr* fields) {
+  auto& f = *fields;
+  auto now = std::chrono::steady_clock::now();
+  auto next = f->adaptive_scheduler->NextSendTime(now, f->observation_store->Size(),
+                                                  f->observation_store->IsAlmostFull());
+  return std::chrono::system_clock::now() +
+         std::chrono::duration_cast<std::chrono::system_clock::duration>(next - now);
+}
+
+bool ShippingManager::SendAllEnvelopes(bool* reached_backend) {
   if (protected_fields_.const_lock()->is_disabled) {
-    return;
+    return true;
+  }
+
+  VLOG(5) << name() << ": SendAllEnvelopes()" << (sending_probe_ ? " as a probe." : ".");
+  util::ProtectedFields<UploadState> upload_state;
+  SendEnvelopes(&upload_state);
+
+  std::vector<std::thread> uploader_threads;
+  bool success;
+  {
+    auto state = upload_state.lock();
+    state->notifier.wait(state, [&state] { return state->num_uploaders == 0; });
+    uploader_threads.swap(state->uploader_threads);
+    success = state->success;
+    if (reached_backend != nullptr) {
+      *reached_backend = success || state->num_successful_requests > 0;
+    }
+  }
+  for (auto& thread : uploader_threads) {
+    thread.join();
   }
 
-  VLOG(5) << name() << ": SendAllEnvelopes().";
-  bool success = true;
-  size_t failures_without_success = 0;
+  {
+    auto locked = protected_fields_.lock();
+    // After a successful probe, the callbacks wait for the rest of the Observations to be sent.
+    if (!sending_probe_ || !success || locked->observation_store->Empty()) {
+      InvokeSendCallbacksLockHeld(&locked, success);
+    }
+  }
+  return success;
+}
+
+void ShippingManager::SendEnvelopes(util::ProtectedFields<UploadState>* upload_state) {
   // Loop through all envelopes in the ObservationStore.
   while (true) {
-    auto holder = protected_fields_.lock()->observation_store->TakeNextEnvelopeHolder();
-    if (holder == nullptr) {
+    {
+      auto state = upload_state->const_lock();
+      if (state->failures_without_success >= kMaxFailuresWithoutSuccess) {
+        VLOG(4) << name() << "::SendAllEnvelopes(): failed too many times ("
+                << state->failures_without_success << "). Stopping uploads.";
+        break;
+      }
+    }
+    // The EnvelopeHolders are taken without holding the lock of |upload_state|, so that the other
+    // uploaders can record the end of their requests in the meantime.
+    size_t size = 0;
+    auto holders = TakeEnvelopeHoldersForRequest(&size);
+    if (holders.empty()) {
       // No more envelopes in the store, we can exit the loop.
       break;
     }
-    auto failed_holder = SendEnvelopeToBackend(std::move(holder));
-    if (failed_holder == nullptr) {
-      // The send succeeded.
-      failures_without_success = 0;
+    bool store_empty = protected_fields_.const_lock()->observation_store->Empty();
+
+    {
+      auto state = upload_state->lock();
+      // Wait until |holders| fit within the bytes in flight, unless nothing else is in flight.
+      if (max_bytes_in_flight_ > 0) {
+        state->notifier.wait(state, [this, &state, size] {
+          return state->bytes_in_flight == 0 ||
+                 state->bytes_in_flight + size <= max_bytes_in_flight_ ||
+                 state->failures_without_success >= kMaxFailuresWithoutSuccess;
+        });
+        if (state->failures_without_success >= kMaxFailuresWithoutSuccess) {
+          state.unlock();
+          auto locked = protected_fields_.lock();
+          for (auto& holder : holders) {
+            locked->observation_store->ReturnEnvelopeHolder(std::move(holder));
+          }
+          continue;
+        }
+      }
+      state->bytes_in_flight += size;
+
+      // Start another uploader if there may be another Envelope to send. A probe is sent on its
+      // own.
+      if (!sending_probe_ && state->num_uploaders < max_concurrent_uploads_ && !store_empty) {
+        state->num_uploaders++;
+        state->uploader_threads.emplace_back(
+            [this, upload_state] { SendEnvelopes(upload_state); });
+      }
+    }
+
+    auto failed_holders = SendEnvelopesToBackend(std::move(holders));
+    bool failed = !failed_holders.empty();
+    if (failed) {
+      // The send failed. Return the failed EnvelopeHolders to the store.
+      auto locked = protected_fields_.lock();
+      for (auto& failed_holder : failed_holders) {
+        locked->observation_store->ReturnEnvelopeHolder(std::move(failed_holder));
+      }
+    }
+
+    auto state = upload_state->lock();
+    state->bytes_in_flight -= size;
+    if (failed) {
+      state->success = false;
+      state->failures_without_success++;
     } else {
-      // The send failed. Increment failures_without_success and return the
-      // failed EnvelopeHolder to the store.
-      success = false;
-      failures_without_success++;
-      protected_fields_.lock()->observation_store->ReturnEnvelopeHolder(std::move(failed_holder));
+      state->failures_without_success = 0;
+      state->num_successful_requests++;
+    }
+    state->notifier.notify_all();
+    if (sending_probe_) {
+      break;
     }
+  }
+
+  auto state = upload_state->lock();
+  state->num_uploaders--;
+  state->notifier.notify_all();
+}
 
-    if (failures_without_success >= kMaxFailuresWithoutSuccess) {
-      VLOG(4) << name() << "::SendAllEnvelopes(): failed too many times ("
-              << failures_without_success << "). Stopping uploads.";
+std::vector<std::unique_ptr<EnvelopeHolder>> ShippingManager::TakeEnvelopeHoldersForRequest(
+    size_t* size) {
+  std::vector<std::unique_ptr<EnvelopeHolder>> holders;
+  *size = 0;
+  auto locked = protected_fields_.lock();
+  // The first EnvelopeHolder is taken whatever its size, and the others only if they fit within
+  // what is left of max_bytes_per_request_.
+  while (holders.empty() || *size < max_bytes_per_request_) {
+    auto holder = holders.empty()
+                      ? locked->observation_store->TakeNextEnvelopeHolder()
+                      : locked->observation_store->TakeNextEnvelopeHolder(max_bytes_per_request_ -
+                                                                          *size);
+    if (holder == nullptr) {
       break;
     }
+    *size += holder->Size();
+    holders.push_back(std::move(holder));
   }
+  return holders;
+}
 
-  {
-    auto locked = protected_fields_.lock();
-    InvokeSendCallbacksLockHeld(&locked, success);
+std::vector<std::unique_ptr<EnvelopeHolder>> ShippingManager::SendEnvelopesToBackend(
+    std::vector<std::unique_ptr<EnvelopeHolder>> envelopes_to_send) {
+  std::vector<std::unique_ptr<EnvelopeHolder>> failed_holders;
+  for (auto& holder : envelopes_to_send) {
+    auto failed_holder = SendEnvelopeToBackend(std::move(holder));
+    if (failed_holder != nullptr) {
+      failed_holders.push_back(std::move(failed_holder));
+    }
   }
+  return failed_holders;
 }
 
 void ShippingManager::InvokeSendCallbacksLockHeld(ShippingManager::Fields::LockedFieldsPtr* fields,
@@ -312,6 +551,20 @@ ClearcutV1ShippingManager::ClearcutV1ShippingManager(
       encrypt_to_shuffler_(encrypt_to_shuffler),
       log_source_id_(log_source_id) {}
 
+ClearcutV1ShippingManager::~ClearcutV1ShippingManager() {
+  // The worker thread may use |payload_cache_|, so it is stopped before the members are destroyed.
+  if (worker_thread_.joinable()) {
+    ShutDown();
+    worker_thread_.join();
+  }
+}
+
+void ClearcutV1ShippingManager::SetUploadPayloadCache(
+    std::unique_ptr<UploadPayloadCache> payload_cache) {
+  CHECK(!worker_thread_.joinable()) << "SetUploadPayloadCache() must be invoked before Start().";
+  payload_cache_ = std::move(payload_cache);
+}
+
 void ClearcutV1ShippingManager::ResetInternalMetrics(logger::LoggerInterface* internal_logger) {
   internal_metrics_ = logger::InternalMetrics::NewWithLogger(internal_logger);
   clearcut_->ResetInternalMetrics(internal_logger);
@@ -319,48 +572,107 @@ void ClearcutV1ShippingManager::ResetInternalMetrics(logger::LoggerInterface* in
 
 std::unique_ptr<EnvelopeHolder> ClearcutV1ShippingManager::SendEnvelopeToBackend(
     std::unique_ptr<EnvelopeHolder> envelope_to_send) {
-  auto envelope = envelope_to_send->GetEnvelope(encrypt_to_analyzer_);
-  envelope.set_api_key(api_key_);
+  std::vector<std::unique_ptr<EnvelopeHolder>> envelopes_to_send;
+  envelopes_to_send.push_back(std::move(envelope_to_send));
+  auto failed_holders = SendEnvelopesToBackend(std::move(envelopes_to_send));
+  if (failed_holders.empty()) {
+    return nullptr;
+  }
+  return std::move(failed_holders.front());
+}
+
+std::vector<std::unique_ptr<EnvelopeHolder>> ClearcutV1ShippingManager::SendEnvelopesToBackend(
+    std::vector<std::unique_ptr<EnvelopeHolder>> envelopes_to_send) {
+  lib::clearcut::LogRequest request;
+  request.set_log_source(log_source_id_);
+  std::vector<EnvelopeHolder::BatchSummary> batches;
+  size_t envelopes_size = 0;
+  // For each LogEvent of |request|, the content key of its EnvelopeHolder and its BatchSummaries,
+  // to cache its payload if the upload fails.
+  std::vector<std::pair<std::string, std::vector<EnvelopeHolder::BatchSummary>>> sent_payloads;
+  for (auto& holder : envelopes_to_send) {
+    std::string content_key;
+    UploadPayloadCache::Payload payload;
+    if (payload_cache_ != nullptr) {
+      content_key = holder->ContentKey();
+    }
+    if (content_key.empty() || !payload_cache_->Take(content_key, &payload)) {
+      // The Envelope is serialized straight from the store rather than materialized. Fields of
+      // concatenated serializations are merged when they are parsed, so the api key is appended as
+      // the serialization of an Envelope holding only the api key.
+      // Size() estimates the size of the serialized Envelope, so reserving it up front saves the
+      // copies made as the serialization grows.
+      std::string serialized_envelope;
+      serialized_envelope.reserve(holder->Size() + api_key_.size() + kApiKeyFramingBytes);
+      holder->SerializeEnvelope(encrypt_to_analyzer_, &serialized_envelope, &payload.batches);
+      Envelope api_key_envelope;
+      api_key_envelope.set_api_key(api_key_);
+      api_key_envelope.AppendToString(&serialized_envelope);
+
+      if (!encrypt_to_shuffler_->EncryptSerialized(std::move(serialized_envelope),
+                                                   &payload.encrypted_envelope)) {
+        // TODO(rudominer) log
+        // Drop on floor.
+        continue;
+      }
+    } else {
+      VLOG(5) << name() << ": Reusing the encrypted Envelope of a failed upload.";
+    }
+
+    auto log_extension = std::make_unique<LogEventExtension>();
+    log_extension->mutable_cobalt_encrypted_envelope()->Swap(&payload.encrypted_envelope);
+    request.add_log_event()->SetAllocatedExtension(LogEventExtension::ext,
+                                                   log_extension.release());
+    batches.insert(batches.end(), payload.batches.begin(), payload.batches.end());
+    envelopes_size += holder->Size();
+    sent_payloads.emplace_back(std::move(content_key), std::move(payload.batches));
+  }
+  if (request.log_event_size() == 0) {
+    return {};
+  }
 
-  util::Status status = SendEnvelopeToClearcutDestination(envelope, envelope_to_send->Size());
+  util::Status status = SendEnvelopesToClearcutDestination(&request, batches, envelopes_size);
   if (!status.ok()) {
     VLOG(4) << name() << ": Cobalt send to Shuffler failed: (" << status.error_code() << ") "
             << status.error_message() << ". Observations have been re-enqueued for later.";
-    return envelope_to_send;
+    for (int i = 0; i < request.log_event_size(); i++) {
+      auto& [content_key, payload_batches] = sent_payloads[i];
+      if (content_key.empty()) {
+        continue;
+      }
+      UploadPayloadCache::Payload payload;
+      payload.encrypted_envelope.Swap(request.mutable_log_event(i)
+                                          ->MutableExtension(LogEventExtension::ext)
+                                          ->mutable_cobalt_encrypted_envelope());
+      payload.batches = std::move(payload_batches);
+      payload_cache_->Put(content_key, std::move(payload));
+    }
+    return envelopes_to_send;
   }
-  return nullptr;
-}
-
-util::Status ClearcutV1ShippingManager::SendEnvelopeToClearcutDestination(const Envelope& envelope,
-                                                                          size_t envelope_size) {
-  auto log_extension = std::make_unique<LogEventExtension>();
-
-  if (!encrypt_to_shuffler_->Encrypt(envelope,
-                                     log_extension->mutable_cobalt_encrypted_envelope())) {
-    // TODO(rudominer) log
-    // Drop on floor.
-    return util::Status::OK;
+  // The uploaded data is deleted from the store, so no payload holding any of it can be reused.
+  for (const auto& sent_payload : sent_payloads) {
+    if (!sent_payload.first.empty()) {
+      payload_cache_->Invalidate(sent_payload.first);
+    }
   }
+  return {};
+}
 
-  for (const auto& observation_batch : envelope.batch()) {
-    const auto& metadata = observation_batch.meta_data();
+util::Status ClearcutV1ShippingManager::SendEnvelopesToClearcutDestination(
+    lib::clearcut::LogRequest* request, const std::vector<EnvelopeHolder::BatchSummary>& batches,
+    size_t envelopes_size) {
+  for (const auto& batch : batches) {
     internal_metrics_->BytesUploaded(
-        logger::PerProjectBytesUploadedMetricDimensionStatus::Attempted,
-        observation_batch.ByteSizeLong(), metadata.customer_id(), metadata.project_id());
+        logger::PerProjectBytesUploadedMetricDimensionStatus::Attempted, batch.size,
+        batch.customer_id, batch.project_id);
   }
 
-  VLOG(5) << name() << " worker: Sending Envelope of size " << envelope_size
-          << " bytes to clearcut.";
-
-  lib::clearcut::LogRequest request;
-  request.set_log_source(log_source_id_);
-  request.add_log_event()->SetAllocatedExtension(LogEventExtension::ext, log_extension.release());
+  VLOG(5) << name() << " worker: Sending " << request->log_event_size()
+          << " Envelopes of total size " << envelopes_size << " bytes to clearcut.";
 
-  util::Status status;
-  {
-    std::lock_guard<std::mutex> lock(clearcut_mutex_);
-    status = clearcut_->UploadEvents(&request, max_attempts_per_upload_);
-  }
+  // A probe of a half open circuit breaker is not retried.
+  util::Status status =
+      clearcut_->UploadEvents(request, sending_probe_ ? 1 : max_attempts_per_upload_);
   {
     auto locked = protected_fields_.lock();
     locked->num_send_attempts++;
@@ -372,11 +684,10 @@ util::Status ClearcutV1ShippingManager::SendEnvelopeToClearcutDestination(const
   if (status.ok()) {
     VLOG(4) << name() << "::SendEnvelopeToBackend: OK";
 
-    for (const auto& observation_batch : envelope.batch()) {
-      const auto& metadata = observation_batch.meta_data();
+    for (const auto& batch : batches) {
       internal_metrics_->BytesUploaded(
-          logger::PerProjectBytesUploadedMetricDimensionStatus::Succeeded,
-          observation_batch.GetCachedSize(), metadata.customer_id(), metadata.project_id());
+          logger::PerProjectBytesUploadedMetricDimensionStatus::Succeeded, batch.size,
+          batch.customer_id, batch.project_id);
     }
   }
   return status;
@@ -412,23 +723,82 @@ LocalShippingManager::LocalShippingManager(observation_store::ObservationStore*
       output_file_path_(std::move(output_file_path)),
       fs_(fs) {
   CHECK(fs_);
+  // Several Envelopes are written between two flushes of the output file.
+  max_bytes_per_request_ = kMaxBytesPerLocalBatch;
+}
+
+LocalShippingManager::~LocalShippingManager() {
+  // The worker thread is stopped before the output file is closed, rather than by the destructor of
+  // ShippingManager.
+  if (worker_thread_.joinable()) {
+    ShutDown();
+    worker_thread_.join();
+  }
+  std::lock_guard<std::mutex> lock(output_mutex_);
+  if (output_stream_ != nullptr) {
+    auto status = FlushLockHeld(/*sync=*/sync_policy_.mode != SyncPolicy::kNone);
+    if (!status.ok()) {
+      LOG(ERROR) << name() << ": " << status.error_message();
+    }
+  }
+}
+
+void LocalShippingManager::SetFileRotation(size_t max_bytes_per_file,
+                                           std::chrono::seconds max_file_age) {
+  CHECK(!worker_thread_.joinable()) << "SetFileRotation() must be invoked before Start().";
+  max_bytes_per_file_ = max_bytes_per_file;
+  max_file_age_ = max_file_age;
+}
+
+void LocalShippingManager::SetSyncPolicy(SyncPolicy sync_policy) {
+  CHECK(!worker_thread_.joinable()) << "SetSyncPolicy() must be invoked before Start().";
+  sync_policy_ = sync_policy;
 }
 
 std::unique_ptr<EnvelopeHolder> LocalShippingManager::SendEnvelopeToBackend(
     std::unique_ptr<EnvelopeHolder> envelope_to_send) {
-  const Envelope& envelope = envelope_to_send->GetEnvelope(encrypt_to_analyzer_);
-
-  VLOG(5) << name() << " worker: Saving Envelope of size " << envelope_to_send->Size()
-          << " bytes to local file.";
+  std::vector<std::unique_ptr<EnvelopeHolder>> envelopes_to_send;
+  envelopes_to_send.push_back(std::move(envelope_to_send));
+  auto failed_holders = SendEnvelopesToBackend(std::move(envelopes_to_send));
+  if (failed_holders.empty()) {
+    return nullptr;
+  }
+  return std::move(failed_holders.front());
+}
 
+std::vector<std::unique_ptr<EnvelopeHolder>> LocalShippingManager::SendEnvelopesToBackend(
+    std::vector<std::unique_ptr<EnvelopeHolder>> envelopes_to_send) {
   util::Status status = util::Status::OK;
-
-  auto ofs = fs_->NewProtoOutputStream(output_file_path_, /*append=*/true);
-  if (ofs.ok()) {
-    auto proto_output_stream = std::move(ofs.ValueOrDie());
-    if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(envelope,
-                                                                    proto_output_stream.get())) {
-      VLOG(4) << name() << ": Unable to write Envelope to local file: " << output_file_path_;
+  size_t num_written = 0;
+  // The number of Envelopes which were committed by a rotation of the output file.
+  size_t num_committed = 0;
+  {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    for (auto& holder : envelopes_to_send) {
+      const Envelope& envelope = holder->GetEnvelope(encrypt_to_analyzer_);
+      VLOG(5) << name() << " worker: Saving Envelope of size " << holder->Size()
+              << " bytes to local file.";
+      if (RotationDueLockHeld()) {
+        status = RotateLockHeld();
+        if (!status.ok()) {
+          break;
+        }
+        num_committed = num_written;
+      }
+      status = WriteEnvelopeLockHeld(envelope);
+      if (!status.ok()) {
+        break;
+      }
+      num_written++;
+    }
+    if (status.ok() && num_written > num_committed) {
+      status = FlushLockHeld(/*sync=*/false);
+    }
+    if (!status.ok()) {
+      // The Envelopes which were not committed are removed from the output file, so that they are
+      // not saved twice once the ObservationStore hands them out again.
+      DiscardUncommittedLockHeld();
+      num_written = num_committed;
     }
   }
 
@@ -441,13 +811,203 @@ std::unique_ptr<EnvelopeHolder> LocalShippingManager::SendEnvelopeToBackend(
     locked->last_send_status = CobaltStatusToGrpcStatus(status);
   }
   if (status.ok()) {
-    VLOG(4) << name() << "::SendEnvelopeToBackend: OK";
-    return nullptr;
+    VLOG(4) << name() << "::SendEnvelopesToBackend: OK";
+    return {};
+  }
+
+  LOG_FIRST_N(WARNING, 10) << name() << ": Cobalt save to local file failed: ("
+                           << status.error_code() << ") " << status.error_message()
+                           << ". Observations have been re-enqueued for later.";
+  envelopes_to_send.erase(envelopes_to_send.begin(), envelopes_to_send.begin() + num_written);
+  return envelopes_to_send;
+}
+
+bool LocalShippingManager::RotationDueLockHeld() {
+  if (output_stream_ == nullptr) {
+    return false;
+  }
+  size_t file_size = initial_file_size_ + output_stream_->ByteCount();
+  return (max_bytes_per_file_ > 0 && file_size >= max_bytes_per_file_) ||
+         (max_file_age_.count() > 0 &&
+          std::chrono::steady_clock::now() - file_start_time_ >= max_file_age_);
+}
+
+util::Status LocalShippingManager::WriteEnvelopeLockHeld(const Envelope& envelope) {
+  if (output_stream_ == nullptr) {
+    auto stream_or = fs_->NewProtoOutputStream(output_file_path_, /*append=*/true);
+    if (!stream_or.ok()) {
+      return stream_or.status();
+    }
+    output_stream_ = stream_or.ConsumeValueOrDie();
+    // If the file was left over by an earlier run, its age is counted from now.
+    initial_file_size_ = fs_->FileSize(output_file_path_).ConsumeValueOr(0);
+    committed_file_size_ = initial_file_size_;
+    file_start_time_ = std::chrono::steady_clock::now();
+    last_sync_time_ = file_start_time_;
+    bytes_since_sync_ = 0;
   }
 
-  VLOG(4) << name() << ": Cobalt save to local file failed: (" << status.error_code() << ") "
-          << status.error_message() << ". Observations have been re-enqueued for later.";
-  return envelope_to_send;
+  int64_t byte_count = output_stream_->ByteCount();
+  if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(envelope,
+                                                                  output_stream_.get())) {
+    return util::Status(util::StatusCode::DATA_LOSS,
+                        "Unable to write Envelope to local file: " + output_file_path_);
+  }
+  bytes_since_sync_ += output_stream_->ByteCount() - byte_count;
+  return util::Status::OK;
+}
+
+util::Status LocalShippingManager::FlushLockHeld(bool sync) {
+  if (!fs_->FlushProtoOutputStream(output_stream_.get())) {
+    // The FileSystem may not support flushing a stream, but closing the stream writes out its data.
+    RETURN_IF_ERROR(ReopenLockHeld());
+  }
+
+  switch (sync_policy_.mode) {
+    case SyncPolicy::kNone:
+      break;
+    case SyncPolicy::kInterval:
+      sync = sync || std::chrono::steady_clock::now() - last_sync_time_ >= sync_policy_.interval;
+      break;
+    case SyncPolicy::kBytes:
+      sync = sync || bytes_since_sync_ >= sync_policy_.bytes;
+      break;
+    case SyncPolicy::kEveryBatch:
+      sync = true;
+      break;
+  }
+  if (sync) {
+    if (fs_->SyncFile(output_file_path_)) {
+      bytes_since_sync_ = 0;
+      last_sync_time_ = std::chrono::steady_clock::now();
+    } else if (sync_policy_.mode == SyncPolicy::kEveryBatch) {
+      return util::Status(util::StatusCode::DATA_LOSS,
+                          "Unable to sync local file: " + output_file_path_);
+    } else {
+      LOG_FIRST_N(WARNING, 10) << name() << ": Unable to sync `" << output_file_path_ << "`";
+    }
+  }
+  if (output_stream_ != nullptr) {
+    committed_file_size_ = initial_file_size_ + output_stream_->ByteCount();
+  }
+  return util::Status::OK;
+}
+
+util::Status LocalShippingManager::ReopenLockHeld() {
+  size_t file_size = initial_file_size_ + output_stream_->ByteCount();
+  output_stream_ = nullptr;
+  bool flushed = fs_->FileSize(output_file_path_).ConsumeValueOr(0) == file_size;
+  if (flushed) {
+    committed_file_size_ = file_size;
+  }
+  // The stream is reopened even if some of the data was lost, so that DiscardUncommittedLockHeld()
+  // cuts off what did reach the file.
+  auto stream_or = fs_->NewProtoOutputStream(output_file_path_, /*append=*/true);
+  if (stream_or.ok()) {
+    output_stream_ = stream_or.ConsumeValueOrDie();
+    initial_file_size_ = file_size;
+  }
+  if (!flushed) {
+    return util::Status(util::StatusCode::DATA_LOSS,
+                        "Unable to flush local file: " + output_file_path_);
+  }
+  return util::Status::OK;
+}
+
+void LocalShippingManager::DiscardUncommittedLockHeld() {
+  if (output_stream_ == nullptr) {
+    return;
+  }
+  // Closing the stream writes out the data it still buffers, which may end with part of an
+  // Envelope. That data is then cut off the file.
+  output_stream_ = nullptr;
+  auto file_or = fs_->NewRandomAccessFile(output_file_path_, /*create=*/false);
+  if (file_or.ok() && file_or.ValueOrDie()->Truncate(committed_file_size_)) {
+    return;
+  }
+  if (committed_file_size_ == 0 && fs_->Delete(output_file_path_)) {
+    return;
+  }
+  if (file_or.status().error_code() == util::StatusCode::UNIMPLEMENTED &&
+      RewriteCommittedLockHeld()) {
+    return;
+  }
+  // The Envelopes which follow must not be appended after a torn one, where readers stop.
+  LOG_FIRST_N(WARNING, 10) << name() << ": Unable to truncate `" << output_file_path_
+                           << "` after a failed write. Rotating it instead.";
+  RenameToNextFileLockHeld();
+}
+
+bool LocalShippingManager::RewriteCommittedLockHeld() {
+  auto mapped_or = fs_->MapFile(output_file_path_);
+  if (!mapped_or.ok() || mapped_or.ValueOrDie()->data().size() < committed_file_size_) {
+    return false;
+  }
+  auto mapped = mapped_or.ConsumeValueOrDie();
+  // A partial file left by a failed write is replaced by the next attempt.
+  std::string tmp_file_path = output_file_path_ + kRewriteTmpSuffix;
+  {
+    auto stream_or = fs_->NewProtoOutputStream(tmp_file_path);
+    if (!stream_or.ok()) {
+      return false;
+    }
+    auto stream = stream_or.ConsumeValueOrDie();
+    google::protobuf::io::CodedOutputStream coded_out(stream.get());
+    coded_out.WriteRaw(mapped->data().data(), static_cast<int>(committed_file_size_));
+    if (coded_out.HadError()) {
+      return false;
+    }
+  }
+  if (fs_->FileSize(tmp_file_path).ConsumeValueOr(0) != committed_file_size_ ||
+      (sync_policy_.mode != SyncPolicy::kNone && !fs_->SyncFile(tmp_file_path)) ||
+      !fs_->Rename(tmp_file_path, output_file_path_)) {
+    fs_->Delete(tmp_file_path);
+    return false;
+  }
+  return true;
+}
+
+util::Status LocalShippingManager::RotateLockHeld() {
+  RETURN_IF_ERROR(FlushLockHeld(/*sync=*/sync_policy_.mode != SyncPolicy::kNone));
+  output_stream_ = nullptr;
+  RenameToNextFileLockHeld();
+  return util::Status::OK;
+}
+
+void LocalShippingManager::RenameToNextFileLockHeld() {
+  if (next_file_number_ == 0) {
+    next_file_number_ = FindNextFileNumber();
+  }
+  std::string rotated_file_path = output_file_path_ + "." + std::to_string(next_file_number_);
+  if (!fs_->Rename(output_file_path_, rotated_file_path)) {
+    // The output file keeps growing until a later rotation succeeds.
+    LOG_FIRST_N(WARNING, 10) << name() << ": Unable to rename `" << output_file_path_ << "` to `"
+                             << rotated_file_path << "`";
+    return;
+  }
+  VLOG(4) << name() << ": Rotated the output file to " << rotated_file_path;
+  next_file_number_++;
+}
+
+size_t LocalShippingManager::FindNextFileNumber() {
+  std::string directory = ".";
+  std::string prefix = output_file_path_ + ".";
+  auto last_slash = output_file_path_.rfind('/');
+  if (last_slash != std::string::npos) {
+    directory = output_file_path_.substr(0, last_slash);
+    prefix = output_file_path_.substr(last_slash + 1) + ".";
+  }
+  size_t next_file_number = 1;
+  for (const auto& file : fs_->ListFiles(directory).ConsumeValueOr({})) {
+    size_t file_number;
+    if (file.size() <= prefix.size() || file.compare(0, prefix.size(), prefix) != 0 ||
+        file.find_first_not_of("0123456789", prefix.size()) != std::string::npos ||
+        !absl::SimpleAtoi(file.substr(prefix.size()), &file_number)) {
+      continue;
+    }
+    next_file_number = std::max(next_file_number, file_number + 1);
+  }
+  return next_file_number;
 }
 
 }  // namespace cobalt::uploader
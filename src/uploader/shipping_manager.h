@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "src/lib/clearcut/uploader.h"
+#include "src/lib/util/consistent_proto_store.h"
 #include "src/lib/util/encrypted_message_util.h"
 #include "src/lib/util/file_system.h"
 #include "src/lib/util/protected_fields.h"
@@ -23,7 +24,10 @@
 #include "src/logging.h"
 #include "src/observation_store/observation_store.h"
 #include "src/observation_store/observation_store_update_recipient.h"
+#include "src/observation_store/sync_policy.h"
 #include "src/system_data/configuration_data.h"
+#include "src/uploader/upload_circuit_breaker.h"
+#include "src/uploader/upload_payload_cache.h"
 #include "src/uploader/upload_scheduler.h"
 
 #include "grpc++/grpc++.h"
@@ -119,6 +123,46 @@ class ShippingManager : public observation_store::ObservationStoreUpdateRecipien
   size_t num_failed_attempts() const;
   grpc::Status last_send_status() const;
 
+  // Allows SendAllEnvelopes() to upload up to |max_concurrent_uploads| Envelopes at the same time,
+  // as long as their total size does not exceed |max_bytes_in_flight|. An Envelope which is larger
+  // than |max_bytes_in_flight| is uploaded on its own. If |max_bytes_in_flight| is 0, the total
+  // size is not limited. By default, one Envelope is uploaded at a time.
+  //
+  // This method must be invoked before Start().
+  void SetUploadConcurrency(size_t max_concurrent_uploads, size_t max_bytes_in_flight = 0);
+
+  // Allows SendAllEnvelopes() to send several Envelopes in a single request to the backend, as long
+  // as their total size does not exceed |max_bytes_per_request|. If the request fails, only its
+  // Envelopes are returned to the ObservationStore. An Envelope which is larger than
+  // |max_bytes_per_request| is sent on its own. If |max_bytes_per_request| is 0, which is the
+  // default, each Envelope is sent in its own request.
+  //
+  // This method must be invoked before Start().
+  void SetMaxBytesPerRequest(size_t max_bytes_per_request);
+
+  // Schedules sends with an AdaptiveUploadScheduler configured by |params|, instead of with the
+  // interval of the UploadScheduler and when the ObservationStore IsAlmostFull(). Sends are still
+  // never closer together than the MinInterval() of the UploadScheduler, which should be
+  // |params.min_interval|, and RequestSendSoon() still expedites a send.
+  //
+  // This method must be invoked before Start().
+  void SetAdaptiveScheduling(const AdaptiveUploadScheduler::Params& params);
+
+  // Stops sends with an UploadCircuitBreaker configured by |params| once sends have failed
+  // repeatedly, and while the backend has asked for a pause. While sends are stopped the worker
+  // thread does not wake up to send, NotifyObservationsAdded() does not request a send, and the
+  // callbacks of RequestSendSoon() are invoked with false. Once the circuit half opens, a single
+  // request is sent, with a single attempt, to probe the backend. If |state_store| is not null,
+  // the state of the circuit breaker is persisted in it so that it survives restarts.
+  //
+  // This method must be invoked before Start().
+  void SetCircuitBreaker(const UploadCircuitBreaker::Params& params,
+                         std::unique_ptr<util::ConsistentProtoStore> state_store = nullptr);
+
+  // Returns the state of the circuit breaker. It is always closed if SetCircuitBreaker() was not
+  // invoked.
+  [[nodiscard]] UploadCircuitBreaker::State circuit_breaker_state() const;
+
   // Disable allows enabling/disabling the ShippingManager. When the ShippingManager is disabled,
   // all calls to SendAllEnvelopes will return immediately without uploading any data.
   void Disable(bool is_disabled);
@@ -145,17 +189,61 @@ class ShippingManager : public observation_store::ObservationStoreUpdateRecipien
   // exits when ShutDown() is invoked.
   void Run();
 
-  // Helper method used by Run(). Does not assume mutex_ lock is held.
+  // Helper method used by Run(). Does not assume mutex_ lock is held. Returns false if some of the
+  // Envelopes could not be sent.
+  //
+  // If |reached_backend| is not null, it is set to false if some requests were sent and none of
+  // them succeeded.
+  //
+  // If |sending_probe_| is true, only a single request is sent.
   //
   // N.B. If the ShippingManager has been disabled (protected_fields_.is_disabled == true), this
   // method will do nothing, and will return immediately.
-  void SendAllEnvelopes();
+  bool SendAllEnvelopes(bool* reached_backend = nullptr);
+
+  // The state of the uploads of one invocation of SendAllEnvelopes().
+  struct UploadState {
+    // The number of threads which are uploading Envelopes, including the worker thread.
+    size_t num_uploaders = 1;
+    // The threads which were started to upload Envelopes concurrently with the worker thread.
+    std::vector<std::thread> uploader_threads;
+    size_t bytes_in_flight = 0;
+    size_t failures_without_success = 0;
+    size_t num_successful_requests = 0;
+    bool success = true;
+    std::condition_variable_any notifier;
+  };
+
+  // Helper method used by SendAllEnvelopes(). Uploads Envelopes from the ObservationStore until
+  // there are none left or too many uploads have failed, starting more threads running this method
+  // as long as |max_concurrent_uploads_| allows.
+  void SendEnvelopes(util::ProtectedFields<UploadState>* upload_state);
 
-  // Invoked by SendAllEnvelopes() to actually perform the send..
+  // Helper method used by SendEnvelopes(). Takes the EnvelopeHolders to send in the next request
+  // from the ObservationStore, as many as fit in |max_bytes_per_request_|, and sets |size| to their
+  // total size.
+  std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+  TakeEnvelopeHoldersForRequest(size_t* size);
+
+  // Invoked by SendAllEnvelopes() to actually perform the send. May be invoked concurrently if
+  // SetUploadConcurrency() allowed more than one upload at a time.
   virtual std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>
   SendEnvelopeToBackend(
       std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder> envelope_to_send) = 0;
 
+  // Invoked by SendAllEnvelopes() to send |envelopes_to_send| in a single request. Returns the
+  // EnvelopeHolders which could not be sent. The default implementation sends each Envelope with
+  // SendEnvelopeToBackend(), for backends which do not accept several Envelopes in one request.
+  virtual std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+  SendEnvelopesToBackend(
+      std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+          envelopes_to_send);
+
+  // Returns the time before which the backend asked not to be sent another request, if any.
+  [[nodiscard]] virtual std::chrono::steady_clock::time_point BackendPausedUntil() const {
+    return std::chrono::steady_clock::time_point::min();
+  }
+
   // Returns a name for this ShippingManager. Useful for log messages in cases
   // where the system is working with more than one.
   //
@@ -167,10 +255,18 @@ class ShippingManager : public observation_store::ObservationStoreUpdateRecipien
 
   UploadScheduler upload_scheduler_;
 
+  size_t max_concurrent_uploads_ = 1;
+  size_t max_bytes_in_flight_ = 0;
+  size_t max_bytes_per_request_ = 0;
+
   // Variables accessed only by the worker thread. These are not
   // protected by a mutex.
   std::chrono::system_clock::time_point next_scheduled_send_time_;
 
+  // Whether the current send is the probe of a half open circuit breaker. This is also read by
+  // SendEnvelopesToBackend(), which only runs on the worker thread during a probe.
+  bool sending_probe_ = false;
+
  private:
   // The background worker thread that runs the method "Run()."
   std::thread worker_thread_;
@@ -206,6 +302,14 @@ class ShippingManager : public observation_store::ObservationStoreUpdateRecipien
     bool is_disabled = false;
     observation_store::ObservationStore* observation_store;
 
+    // If set, decides when to send instead of |upload_scheduler_|.
+    std::unique_ptr<AdaptiveUploadScheduler> adaptive_scheduler;
+
+    // If set, stops sends while the backend is unreachable. Its state is persisted in
+    // |circuit_breaker_store| if that is set.
+    std::unique_ptr<util::ConsistentProtoStore> circuit_breaker_store;
+    std::unique_ptr<UploadCircuitBreaker> circuit_breaker;
+
     std::condition_variable_any add_observation_notifier;
     std::condition_variable_any expedited_send_notifier;
     std::condition_variable_any shutdown_notifier;
@@ -225,6 +329,20 @@ class ShippingManager : public observation_store::ObservationStoreUpdateRecipien
   // is held.
   void RequestSendSoonLockHeld(Fields::LockedFieldsPtr* fields);
 
+  // Returns the time of the next send chosen by the adaptive_scheduler, which must be set, and
+  // assumes that the fields->mutex lock is held.
+  std::chrono::system_clock::time_point AdaptiveNextSendTimeLockHeld(
+      Fields::LockedFieldsPtr* fields);
+
+  // Returns true if the circuit_breaker is set and does not allow a send at |now|, and assumes that
+  // the fields->mutex lock is held.
+  static bool SendBlockedLockHeld(Fields::LockedFieldsPtr* fields,
+                                  std::chrono::system_clock::time_point now);
+
+  // Records the result of a send in the circuit_breaker, which must be set, together with any
+  // pause requested by the backend, and assumes that the fields->mutex lock is held.
+  void CircuitBreakerSendFinishedLockHeld(Fields::LockedFieldsPtr* fields, bool reached_backend);
+
   // InvokeSendCallbacksLockHeld invokes all SendCallbacks in
   // send_callback_queue, and also clears the send_callback_queue list.
   void InvokeSendCallbacksLockHeld(Fields::LockedFieldsPtr* fields, bool success);
@@ -247,32 +365,67 @@ class ClearcutV1ShippingManager : public ShippingManager {
 
   // The destructor will stop the worker thread and wait for it to stop
   // before exiting.
-  ~ClearcutV1ShippingManager() override = default;
+  ~ClearcutV1ShippingManager() override;
 
   // Resets the internal metrics for the ShippingManager and the ClearcutUploader to use the
   // provided logger.
   void ResetInternalMetrics(logger::LoggerInterface* internal_logger) override;
 
+  // Keeps the encrypted Envelopes of failed uploads in |payload_cache|, so that they are not read
+  // and encrypted again when they are retried. Only the EnvelopeHolders with a ContentKey() are
+  // cached. Once an upload succeeds, the cached payloads holding any of its data are dropped. By
+  // default nothing is cached.
+  //
+  // This method must be invoked before Start().
+  void SetUploadPayloadCache(std::unique_ptr<UploadPayloadCache> payload_cache);
+
  private:
   std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder> SendEnvelopeToBackend(
       std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder> envelope_to_send)
       override;
 
-  util::Status SendEnvelopeToClearcutDestination(const Envelope& envelope, size_t envelope_size);
+  // Sends all of |envelopes_to_send| in one LogRequest, with a LogEvent for each Envelope.
+  std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+  SendEnvelopesToBackend(
+      std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+          envelopes_to_send) override;
+
+  // Uploads |request|, which holds the encrypted Envelopes, to Clearcut. |batches| summarizes the
+  // ObservationBatches of the Envelopes, and |envelopes_size| is their estimated total size.
+  util::Status SendEnvelopesToClearcutDestination(
+      lib::clearcut::LogRequest* request,
+      const std::vector<observation_store::ObservationStore::EnvelopeHolder::BatchSummary>&
+          batches,
+      size_t envelopes_size);
+
+  [[nodiscard]] std::chrono::steady_clock::time_point BackendPausedUntil() const override {
+    return clearcut_->pause_uploads_until();
+  }
 
   [[nodiscard]] std::string name() const override { return "ClearcutV1ShippingManager"; }
 
   const size_t max_attempts_per_upload_;
 
-  std::mutex clearcut_mutex_;
   std::unique_ptr<lib::clearcut::ClearcutUploader> clearcut_;
   std::unique_ptr<logger::InternalMetrics> internal_metrics_;
   const std::string api_key_;
   util::EncryptedMessageMaker* encrypt_to_shuffler_;
   const int32_t log_source_id_;
+  std::unique_ptr<UploadPayloadCache> payload_cache_;
 };
 
 // A concrete subclass of ShippingManager for capturing data locally to a file.
+//
+// The Envelopes are appended to |output_file_path| as delimited protos through a long-lived
+// buffered stream, which is flushed once per batch of Envelopes. If a write or a flush fails, the
+// output file is truncated back to its size after the last successful flush, and the Envelopes
+// which were written since then are returned to the ObservationStore.
+//
+// Optionally, the output file is rotated once it is large enough or old enough: it is renamed to
+// |output_file_path| followed by "." and the next number, starting from 1, and a new output file is
+// started. Rotated files are complete and are not written again. The output file is also rotated if
+// it cannot be truncated after a failure, in which case the rotated file may end with a torn
+// Envelope.
 class LocalShippingManager : public ShippingManager {
  public:
   explicit LocalShippingManager(observation_store::ObservationStore* observation_store,
@@ -300,21 +453,99 @@ class LocalShippingManager : public ShippingManager {
     owned_fs_ = std::move(owned_fs);
   }
 
-  // The destructor will stop the worker thread and wait for it to stop
-  // before exiting.
-  ~LocalShippingManager() override = default;
+  // The destructor will stop the worker thread and wait for it to stop, and then flush the output
+  // file.
+  ~LocalShippingManager() override;
 
   // We don't want to track internal metrics for LocalShippingManager
   void ResetInternalMetrics(logger::LoggerInterface* internal_logger) override {}
 
+  // Rotates the output file before an Envelope is written to it once it holds at least
+  // |max_bytes_per_file| bytes, or once |max_file_age| has elapsed since it was started. A value of
+  // zero disables the corresponding limit. By default the output file is never rotated.
+  //
+  // This method must be invoked before Start().
+  void SetFileRotation(size_t max_bytes_per_file, std::chrono::seconds max_file_age);
+
+  // Determines when the output file is synced to durable storage. The sync happens after a batch of
+  // Envelopes has been written, and before the output file is rotated. With
+  // SyncPolicy::kEveryBatch, a batch whose sync fails is returned to the ObservationStore. By
+  // default the output file is never explicitly synced.
+  //
+  // This method must be invoked before Start().
+  void SetSyncPolicy(observation_store::SyncPolicy sync_policy);
+
  private:
   std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder> SendEnvelopeToBackend(
       std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder> envelope_to_send)
       override;
 
+  // Writes all of |envelopes_to_send| to the output file, and then flushes it. Returns the
+  // EnvelopeHolders which could not be written.
+  std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+  SendEnvelopesToBackend(
+      std::vector<std::unique_ptr<observation_store::ObservationStore::EnvelopeHolder>>
+          envelopes_to_send) override;
+
+  // Returns true if the output file is open and large enough or old enough to be rotated. Assumes
+  // that |output_mutex_| is held.
+  bool RotationDueLockHeld();
+
+  // Writes |envelope| to the output file, opening it first if needed. Assumes that |output_mutex_|
+  // is held.
+  util::Status WriteEnvelopeLockHeld(const Envelope& envelope);
+
+  // Flushes the output file, and syncs it if the SyncPolicy requires it or |sync| is true. If the
+  // FileSystem cannot flush the output stream, the stream is closed and reopened instead. On
+  // success, the Envelopes written so far are committed. Assumes that |output_mutex_| is held.
+  util::Status FlushLockHeld(bool sync);
+
+  // Closes the output stream, which writes out its data, and opens a new one appending to the
+  // output file. Commits the Envelopes written so far if all of the data reached the file. The
+  // output stream is left closed if it cannot be reopened. Assumes that |output_mutex_| is held.
+  util::Status ReopenLockHeld();
+
+  // Closes the output file and removes the Envelopes written since the last commit from it, by
+  // truncating it or, if the FileSystem does not support random access, by replacing it with a
+  // copy of its committed part. If that fails, the output file is rotated instead. Assumes that
+  // |output_mutex_| is held.
+  void DiscardUncommittedLockHeld();
+
+  // Replaces the closed output file with a copy of its first |committed_file_size_| bytes. Returns
+  // false if the file was not replaced. Assumes that |output_mutex_| is held.
+  bool RewriteCommittedLockHeld();
+
+  // Flushes, syncs and closes the output file, and renames it to the next numbered file. Assumes
+  // that |output_mutex_| is held.
+  util::Status RotateLockHeld();
+
+  // Renames the closed output file to the next numbered file. Assumes that |output_mutex_| is held.
+  void RenameToNextFileLockHeld();
+
+  // Returns the number of the next rotated file, which follows the highest one that exists.
+  size_t FindNextFileNumber();
+
   [[nodiscard]] std::string name() const override { return "LocalShippingManager"; }
 
   std::string output_file_path_;
+  size_t max_bytes_per_file_ = 0;
+  std::chrono::seconds max_file_age_ = std::chrono::seconds::zero();
+  observation_store::SyncPolicy sync_policy_;
+
+  // Serializes the writes to |output_file_path_| of concurrent sends, and guards the fields below.
+  std::mutex output_mutex_;
+  util::FileSystem::ProtoOutputStreamPtr output_stream_;
+  // The size of the output file when |output_stream_| was opened.
+  size_t initial_file_size_ = 0;
+  // The size of the output file after the last successful flush, which ends with a complete
+  // Envelope.
+  size_t committed_file_size_ = 0;
+  std::chrono::steady_clock::time_point file_start_time_;
+  size_t bytes_since_sync_ = 0;
+  std::chrono::steady_clock::time_point last_sync_time_;
+  // 0 until the rotated files have been listed.
+  size_t next_file_number_ = 0;
+
   std::unique_ptr<util::FileSystem> owned_fs_;
   util::FileSystem* fs_;
 };
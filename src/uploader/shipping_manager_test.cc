@@ -4,17 +4,24 @@
 
 #include "src/uploader/shipping_manager.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <ctime>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "src/lib/clearcut/clearcut.pb.h"
 #include "src/lib/util/posix_file_system.h"
+#include "src/lib/util/testing/test_with_files.h"
 #include "src/logger/fake_logger.h"
 #include "src/logging.h"
+#include "src/observation_store/file_observation_store.h"
 #include "src/observation_store/memory_observation_store.h"
 #include "src/observation_store/observation_store.h"
 #include "src/pb/clearcut_extensions.pb.h"
@@ -53,6 +60,15 @@ class FakeHTTPClient : public lib::clearcut::HTTPClient {
       lib::clearcut::HTTPRequest request,
       std::chrono::steady_clock::time_point /*ignored*/) override {
     std::unique_lock<std::mutex> lock(mutex);
+    if (latency > std::chrono::milliseconds::zero()) {
+      // Simulates a link with a high latency, during which other requests may be sent.
+      num_in_flight++;
+      max_num_in_flight = std::max(max_num_in_flight, num_in_flight);
+      lock.unlock();
+      std::this_thread::sleep_for(latency);
+      lock.lock();
+      num_in_flight--;
+    }
 
     lib::clearcut::LogRequest req;
     req.ParseFromString(request.body);
@@ -84,6 +100,9 @@ class FakeHTTPClient : public lib::clearcut::HTTPClient {
   int http_response_code_to_return = kHttpOk;
   int send_call_count = 0;
   int observation_count = 0;
+  std::chrono::milliseconds latency = std::chrono::milliseconds::zero();
+  int num_in_flight = 0;
+  int max_num_in_flight = 0;
 };
 
 std::unique_ptr<EncryptedMessage> CreateObservationMessage(size_t num_bytes) {
@@ -113,9 +132,15 @@ class ShippingManagerTest : public ::testing::Test {
         observation_store_(kMaxBytesPerObservation, kMaxBytesPerEnvelope, kMaxBytesTotal) {}
 
  protected:
-  void Init(std::chrono::seconds schedule_interval, std::chrono::seconds min_interval) {
+  void Init(std::chrono::seconds schedule_interval, std::chrono::seconds min_interval,
+            std::chrono::milliseconds latency = std::chrono::milliseconds::zero(),
+            size_t max_concurrent_uploads = 1, size_t max_bytes_in_flight = 0,
+            const AdaptiveUploadScheduler::Params* adaptive_params = nullptr,
+            size_t max_bytes_per_request = 0,
+            const UploadCircuitBreaker::Params* circuit_breaker_params = nullptr) {
     UploadScheduler upload_scheduler(schedule_interval, min_interval);
     auto http_client = std::make_unique<FakeHTTPClient>();
+    http_client->latency = latency;
     http_client_ = http_client.get();
     shipping_manager_ = std::make_unique<ClearcutV1ShippingManager>(
         upload_scheduler, &observation_store_, encrypt_to_shuffler_.get(),
@@ -123,6 +148,14 @@ class ShippingManagerTest : public ::testing::Test {
         std::make_unique<lib::clearcut::ClearcutUploader>("https://test.com",
                                                           std::move(http_client)),
         /*log_source_id=*/11, /*internal_logger=*/nullptr, /*max_attempts_per_upload=*/1);
+    shipping_manager_->SetUploadConcurrency(max_concurrent_uploads, max_bytes_in_flight);
+    shipping_manager_->SetMaxBytesPerRequest(max_bytes_per_request);
+    if (adaptive_params) {
+      shipping_manager_->SetAdaptiveScheduling(*adaptive_params);
+    }
+    if (circuit_breaker_params) {
+      shipping_manager_->SetCircuitBreaker(*circuit_breaker_params);
+    }
     shipping_manager_->Start();
   }
 
@@ -143,10 +176,10 @@ class ShippingManagerTest : public ::testing::Test {
  private:
   std::unique_ptr<EncryptedMessageMaker> encrypt_to_shuffler_;
   std::unique_ptr<EncryptedMessageMaker> encrypt_to_analyzer_;
-  MemoryObservationStore observation_store_;
   system_data::FakeSystemData system_data_;
 
  protected:
+  MemoryObservationStore observation_store_;
   std::unique_ptr<ClearcutV1ShippingManager> shipping_manager_;
   FakeHTTPClient* http_client_ = nullptr;
 };
@@ -607,6 +640,463 @@ TEST_F(ShippingManagerTest, RequestSendSoonWithCallback) {
   EXPECT_TRUE(captured_success_arg);
 }
 
+// Adds 20 Observations, which make up 4 Envelopes, while the ShippingManager is disabled, and then
+// sends them all. Returns the largest number of requests that were in flight at the same time.
+int SendFourEnvelopes(ShippingManager* shipping_manager, FakeHTTPClient* http_client,
+                      const std::function<void()>& add_observation) {
+  shipping_manager->Disable(true);
+  for (int i = 0; i < 20; i++) {  // NOLINT readability-magic-numbers
+    add_observation();
+  }
+  shipping_manager->Disable(false);
+  shipping_manager->RequestSendSoon();
+  shipping_manager->WaitUntilIdle(kMaxSeconds);
+  std::unique_lock<std::mutex> lock(http_client->mutex);
+  EXPECT_EQ(4, http_client->send_call_count);
+  EXPECT_EQ(20, http_client->observation_count);  // NOLINT readability-magic-numbers
+  return http_client->max_num_in_flight;
+}
+
+// Tests that several Envelopes are uploaded at the same time when the upload concurrency allows it.
+TEST_F(ShippingManagerTest, ConcurrentUploads) {
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds(100),
+       /*max_concurrent_uploads=*/3);
+  int max_num_in_flight = SendFourEnvelopes(shipping_manager_.get(), http_client_, [this] {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  });
+  EXPECT_GT(max_num_in_flight, 1);
+  EXPECT_LE(max_num_in_flight, 3);
+  EXPECT_EQ(4u, shipping_manager_->num_send_attempts());
+  EXPECT_EQ(0u, shipping_manager_->num_failed_attempts());
+  EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
+}
+
+// Tests that the Envelopes are uploaded one at a time when the bytes in flight only allow one.
+TEST_F(ShippingManagerTest, ConcurrentUploadsLimitedByBytesInFlight) {
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds(10),
+       /*max_concurrent_uploads=*/3, /*max_bytes_in_flight=*/kMaxBytesPerEnvelope);
+  int max_num_in_flight = SendFourEnvelopes(shipping_manager_.get(), http_client_, [this] {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  });
+  EXPECT_EQ(1, max_num_in_flight);
+}
+
+// Tests that concurrent uploads which fail are returned to the ObservationStore and are sent later.
+TEST_F(ShippingManagerTest, ConcurrentUploadsFail) {
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds(10),
+       /*max_concurrent_uploads=*/3);
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpInternalServerError;
+  }
+  bool captured_success_arg = true;
+  shipping_manager_->Disable(true);
+  for (int i = 0; i < 20; i++) {  // NOLINT readability-magic-numbers
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  }
+  shipping_manager_->Disable(false);
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_FALSE(captured_success_arg);
+  EXPECT_EQ(shipping_manager_->num_send_attempts(), shipping_manager_->num_failed_attempts());
+
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpOk;
+    http_client_->observation_count = 0;
+  }
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  EXPECT_TRUE(captured_success_arg);
+  std::unique_lock<std::mutex> lock(http_client_->mutex);
+  EXPECT_EQ(20, http_client_->observation_count);  // NOLINT readability-magic-numbers
+}
+
+// Tests that several Envelopes are sent in one request when the request size allows it, and that
+// the Envelopes of a failed request are sent later.
+TEST_F(ShippingManagerTest, SeveralEnvelopesPerRequest) {
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds::zero(), 1, 0, nullptr,
+       /*max_bytes_per_request=*/3 * kMaxBytesPerEnvelope);
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpInternalServerError;
+  }
+  // Four Envelopes of 5 Observations each.
+  shipping_manager_->Disable(true);
+  for (int i = 0; i < 20; i++) {  // NOLINT readability-magic-numbers
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  }
+  shipping_manager_->Disable(false);
+  bool captured_success_arg = true;
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_FALSE(captured_success_arg);
+
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpOk;
+    http_client_->send_call_count = 0;
+    http_client_->observation_count = 0;
+  }
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  EXPECT_TRUE(captured_success_arg);
+  // Three Envelopes fit in the first request, and the fourth is sent in a second one.
+  CheckCallCount(2, 20);  // NOLINT readability-magic-numbers
+}
+
+// Tests that an Envelope which does not fit in what is left of a request is left in the store for
+// the next request, without being taken and returned.
+TEST_F(ShippingManagerTest, EnvelopeNotFittingInRequestIsNotTaken) {
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds::zero(), 1, 0, nullptr,
+       /*max_bytes_per_request=*/kMaxBytesPerEnvelope + kMaxBytesPerEnvelope / 2);
+  // Two full Envelopes of 5 Observations each, and one of 3 Observations.
+  shipping_manager_->Disable(true);
+  for (int i = 0; i < 13; i++) {  // NOLINT readability-magic-numbers
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  }
+  shipping_manager_->Disable(false);
+  shipping_manager_->RequestSendSoon();
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  // The second full Envelope does not fit in the first request, and the Envelope of 3 Observations
+  // does not fit in the second one.
+  CheckCallCount(3, 13);  // NOLINT readability-magic-numbers
+  // Each Envelope was taken from the store exactly once.
+  EXPECT_DOUBLE_EQ(observation_store_.average_envelope_fill_ratio(),
+                   (2.0 + 3.0 / 5.0) / 3.0);  // NOLINT readability-magic-numbers
+}
+
+// With adaptive scheduling, the Observations are sent once they reach the target size, without an
+// expedited send being requested.
+TEST_F(ShippingManagerTest, AdaptiveSchedulingSendsTargetBytes) {
+  AdaptiveUploadScheduler::Params params;
+  params.min_interval = std::chrono::seconds::zero();
+  params.max_interval = kMaxSeconds;
+  params.target_bytes_per_send = kMaxBytesPerEnvelope;
+  params.store_capacity_bytes = kMaxBytesTotal;
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds::zero(), 1, 0,
+       &params);
+
+  // 160 bytes is less than the target.
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  }
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  CheckCallCount(0, 0);
+
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  std::unique_lock<std::mutex> lock(http_client_->mutex);
+  EXPECT_GT(http_client_->send_call_count, 0);
+  EXPECT_EQ(5, http_client_->observation_count);
+}
+
+// Tests that once the circuit breaker opens, nothing is sent until it allows a probe, even when the
+// ObservationStore is almost full, and that the rest of the Observations are sent once the probe
+// succeeds.
+TEST_F(ShippingManagerTest, CircuitBreakerStopsSends) {
+  UploadCircuitBreaker::Params params;
+  params.failure_threshold = 1;
+  params.initial_open_duration = std::chrono::seconds(1);
+  params.max_open_duration = std::chrono::seconds(1);
+  Init(kMaxSeconds, std::chrono::seconds::zero(), std::chrono::milliseconds::zero(), 1, 0, nullptr,
+       0, &params);
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpInternalServerError;
+  }
+  bool captured_success_arg = true;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_FALSE(captured_success_arg);
+  EXPECT_EQ(UploadCircuitBreaker::kOpen, shipping_manager_->circuit_breaker_state());
+
+  {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = kHttpOk;
+    http_client_->send_call_count = 0;
+    http_client_->observation_count = 0;
+  }
+  // Four Envelopes of 5 Observations each, which is enough for the store to be almost full.
+  for (int i = 0; i < 19; i++) {  // NOLINT readability-magic-numbers
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  }
+  captured_success_arg = true;
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_FALSE(captured_success_arg);
+  CheckCallCount(0, 0);
+
+  // Once the circuit is half open, a probe is sent with one Envelope, and then the others.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));  // NOLINT readability-magic-numbers
+  shipping_manager_->RequestSendSoon(
+      [&captured_success_arg](bool success) { captured_success_arg = success; });
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  EXPECT_TRUE(captured_success_arg);
+  EXPECT_EQ(UploadCircuitBreaker::kClosed, shipping_manager_->circuit_breaker_state());
+  CheckCallCount(4, 20);  // NOLINT readability-magic-numbers
+}
+
+// An EncryptedMessageMaker which does not encrypt, but numbers the messages it makes in their
+// key_index, so that a message which is sent again can be told apart from one which is made again.
+class NumberingEncryptedMessageMaker : public EncryptedMessageMaker {
+ public:
+  bool Encrypt(const google::protobuf::MessageLite& message,
+               EncryptedMessage* encrypted_message) const override {
+    return EncryptSerialized(message.SerializeAsString(), encrypted_message);
+  }
+
+  bool EncryptSerialized(std::string serialized_message,
+                         EncryptedMessage* encrypted_message) const override {
+    encrypted_message->set_scheme(EncryptedMessage::NONE);
+    encrypted_message->set_key_index(++num_encrypted);
+    encrypted_message->set_ciphertext(std::move(serialized_message));
+    return true;
+  }
+
+  [[nodiscard]] EncryptedMessage::EncryptionScheme scheme() const override {
+    return EncryptedMessage::NONE;
+  }
+
+  mutable std::atomic<uint32_t> num_encrypted{0};
+};
+
+// An HTTPClient which records the encrypted Envelopes posted to it.
+class RecordingHTTPClient : public lib::clearcut::HTTPClient {
+ public:
+  StatusOr<lib::clearcut::HTTPResponse> PostSync(
+      lib::clearcut::HTTPRequest request,
+      std::chrono::steady_clock::time_point /*ignored*/) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    lib::clearcut::LogRequest req;
+    EXPECT_TRUE(req.ParseFromString(request.body));
+    std::vector<EncryptedMessage> envelopes;
+    for (const auto& event : req.log_event()) {
+      envelopes.push_back(event.GetExtension(LogEventExtension::ext).cobalt_encrypted_envelope());
+    }
+    requests.push_back(std::move(envelopes));
+
+    lib::clearcut::HTTPResponse response;
+    response.http_code = http_response_code_to_return;
+    lib::clearcut::LogResponse resp;
+    resp.SerializeToString(&response.response);
+    return response;
+  }
+
+  std::mutex mutex;
+  int http_response_code_to_return = kHttpOk;
+  // The encrypted Envelopes of each request, in the order they were posted.
+  std::vector<std::vector<EncryptedMessage>> requests;
+};
+
+// Tests the UploadPayloadCache with the FileObservationStore, whose EnvelopeHolders have a
+// ContentKey().
+class FileStoreShippingManagerTest : public util::testing::TestWithFiles {
+ protected:
+  void SetUp() override {
+    MakeTestFolder();
+    encrypt_to_analyzer_ = EncryptedMessageMaker::MakeUnencrypted();
+    observation_store_ = std::make_unique<observation_store::FileObservationStore>(
+        kMaxBytesPerObservation, kMaxBytesPerEnvelope, kMaxBytesTotal, fs(),
+        test_folder() + "/observations");
+    auto http_client = std::make_unique<RecordingHTTPClient>();
+    http_client_ = http_client.get();
+    shipping_manager_ = std::make_unique<ClearcutV1ShippingManager>(
+        UploadScheduler(kMaxSeconds, std::chrono::seconds::zero()), observation_store_.get(),
+        &encrypt_to_shuffler_, encrypt_to_analyzer_.get(),
+        std::make_unique<lib::clearcut::ClearcutUploader>("https://test.com",
+                                                          std::move(http_client)),
+        /*log_source_id=*/11, /*internal_logger=*/nullptr, /*max_attempts_per_upload=*/1);
+    auto payload_cache = std::make_unique<UploadPayloadCache>(/*max_memory_bytes=*/1000);
+    payload_cache_ = payload_cache.get();
+    shipping_manager_->SetUploadPayloadCache(std::move(payload_cache));
+    shipping_manager_->Start();
+  }
+
+  void TearDown() override {
+    shipping_manager_ = nullptr;
+    observation_store_->DeleteData();
+  }
+
+  void AddObservation() {
+    EXPECT_EQ(ObservationStore::kOk,
+              observation_store_->StoreObservation(CreateObservationMessage(20),
+                                                   CreateObservationMetadata()));
+  }
+
+  void SetHttpResponseCode(int http_response_code) {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    http_client_->http_response_code_to_return = http_response_code;
+  }
+
+  // Returns the encrypted Envelopes of each request posted so far.
+  std::vector<std::vector<EncryptedMessage>> Requests() {
+    std::unique_lock<std::mutex> lock(http_client_->mutex);
+    return http_client_->requests;
+  }
+
+  NumberingEncryptedMessageMaker encrypt_to_shuffler_;
+  std::unique_ptr<EncryptedMessageMaker> encrypt_to_analyzer_;
+  std::unique_ptr<observation_store::FileObservationStore> observation_store_;
+  RecordingHTTPClient* http_client_ = nullptr;
+  UploadPayloadCache* payload_cache_ = nullptr;
+  std::unique_ptr<ClearcutV1ShippingManager> shipping_manager_;
+};
+
+// The Envelope of a failed upload is sent again as it was encrypted the first time.
+TEST_F(FileStoreShippingManagerTest, RetrySendsCachedPayload) {
+  SetHttpResponseCode(kHttpInternalServerError);
+  AddObservation();
+  AddObservation();
+  shipping_manager_->RequestSendSoon();
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_EQ(1u, encrypt_to_shuffler_.num_encrypted);
+  EXPECT_EQ(1u, payload_cache_->size());
+
+  SetHttpResponseCode(kHttpOk);
+  shipping_manager_->RequestSendSoon();
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  EXPECT_EQ(1u, encrypt_to_shuffler_.num_encrypted);
+  EXPECT_EQ(0u, payload_cache_->size());
+  EXPECT_TRUE(observation_store_->Empty());
+
+  // The failed upload may have been retried several times before it succeeded.
+  auto requests = Requests();
+  ASSERT_GE(requests.size(), 2u);
+  for (const auto& request : requests) {
+    ASSERT_EQ(1u, request.size());
+    EXPECT_EQ(1u, request[0].key_index());
+    EXPECT_EQ(requests[0][0].ciphertext(), request[0].ciphertext());
+  }
+}
+
+// When the observations of a failed upload are packed with newer ones, their Envelope is not found
+// in the cache and is built again. Once it is sent, the stale payload is dropped from the cache.
+TEST_F(FileStoreShippingManagerTest, RebuildsPayloadAfterCacheMiss) {
+  // The first observation is kept out of the failed upload, in a file of its own.
+  AddObservation();
+  auto held_back = observation_store_->TakeNextEnvelopeHolder();
+  ASSERT_NE(nullptr, held_back);
+
+  SetHttpResponseCode(kHttpInternalServerError);
+  AddObservation();
+  shipping_manager_->RequestSendSoon();
+  shipping_manager_->WaitUntilWorkerWaiting(kMaxSeconds);
+  EXPECT_EQ(1u, encrypt_to_shuffler_.num_encrypted);
+  EXPECT_EQ(1u, payload_cache_->size());
+
+  // Both files now fit in one Envelope.
+  observation_store_->ReturnEnvelopeHolder(std::move(held_back));
+  SetHttpResponseCode(kHttpOk);
+  shipping_manager_->RequestSendSoon();
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  EXPECT_EQ(2u, encrypt_to_shuffler_.num_encrypted);
+  EXPECT_EQ(0u, payload_cache_->size());
+  EXPECT_TRUE(observation_store_->Empty());
+
+  auto requests = Requests();
+  ASSERT_GE(requests.size(), 2u);
+  ASSERT_EQ(1u, requests.back().size());
+  EXPECT_EQ(2u, requests.back()[0].key_index());
+  Envelope envelope;
+  ASSERT_TRUE(envelope.ParseFromString(requests.back()[0].ciphertext()));
+  int num_observations = 0;
+  for (const auto& batch : envelope.batch()) {
+    num_observations += batch.encrypted_observation_size();
+  }
+  EXPECT_EQ(2, num_observations);
+}
+
+// Measures the time taken to drain a backlog of Envelopes over a link with a latency of 100ms, with
+// 1 to 16 concurrent uploads. Run with --gtest_also_run_disabled_tests.
+TEST(ShippingManagerBenchmark, DISABLED_DrainTime) {
+  const int kNumObservations = 2000;
+  auto encrypter = EncryptedMessageMaker::MakeUnencrypted();
+  for (size_t max_concurrent_uploads : {1, 2, 4, 8, 16}) {
+    MemoryObservationStore store(kMaxBytesPerObservation, kMaxBytesPerEnvelope,
+                                 kNumObservations * kMaxBytesPerObservation);
+    auto http_client = std::make_unique<FakeHTTPClient>();
+    http_client->latency = std::chrono::milliseconds(100);
+    FakeHTTPClient* client = http_client.get();
+    ClearcutV1ShippingManager shipping_manager(
+        UploadScheduler(kMaxSeconds, std::chrono::seconds::zero()), &store, encrypter.get(),
+        encrypter.get(),
+        std::make_unique<lib::clearcut::ClearcutUploader>("https://test.com",
+                                                          std::move(http_client)));
+    shipping_manager.SetUploadConcurrency(max_concurrent_uploads);
+    shipping_manager.Disable(true);
+    shipping_manager.Start();
+    for (int i = 0; i < kNumObservations; i++) {
+      store.StoreObservation(CreateObservationMessage(40), CreateObservationMetadata());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    shipping_manager.Disable(false);
+    shipping_manager.RequestSendSoon();
+    shipping_manager.WaitUntilIdle(kMaxSeconds);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::unique_lock<std::mutex> lock(client->mutex);
+    LOG(INFO) << "max_concurrent_uploads=" << max_concurrent_uploads << ": "
+              << client->send_call_count << " envelopes in " << elapsed.count() << "s";
+  }
+}
+
+// An HTTPClient which only counts the bytes posted to it, so that the cost of the upload path
+// is not hidden by the cost of the fake server.
+class CountingHTTPClient : public lib::clearcut::HTTPClient {
+ public:
+  StatusOr<lib::clearcut::HTTPResponse> PostSync(
+      lib::clearcut::HTTPRequest request,
+      std::chrono::steady_clock::time_point /*ignored*/) override {
+    bytes_posted += request.body.size();
+    lib::clearcut::HTTPResponse response;
+    response.http_code = kHttpOk;
+    return response;
+  }
+
+  std::atomic<size_t> bytes_posted{0};
+};
+
+// Measures the CPU time spent uploading 16MB of Observations, per MB posted. Run with
+// --gtest_also_run_disabled_tests.
+TEST(ShippingManagerBenchmark, DISABLED_UploadCpuPerMegabyte) {
+  const size_t kObservationSize = 1000;
+  const size_t kEnvelopeSize = 100000;
+  const size_t kTotalSize = 16 * 1024 * 1024;
+  const double kMegabyte = 1024 * 1024;
+  auto encrypter = EncryptedMessageMaker::MakeUnencrypted();
+  MemoryObservationStore store(kObservationSize, kEnvelopeSize, kTotalSize * 2);
+  auto http_client = std::make_unique<CountingHTTPClient>();
+  CountingHTTPClient* client = http_client.get();
+  ClearcutV1ShippingManager shipping_manager(
+      UploadScheduler(kMaxSeconds, std::chrono::seconds::zero()), &store, encrypter.get(),
+      encrypter.get(),
+      std::make_unique<lib::clearcut::ClearcutUploader>("https://test.com",
+                                                        std::move(http_client)));
+  shipping_manager.Disable(true);
+  shipping_manager.Start();
+  for (size_t i = 0; i < kTotalSize / kObservationSize; i++) {
+    store.StoreObservation(CreateObservationMessage(kObservationSize), CreateObservationMetadata());
+  }
+
+  std::clock_t start = std::clock();
+  shipping_manager.Disable(false);
+  shipping_manager.RequestSendSoon();
+  shipping_manager.WaitUntilIdle(kMaxSeconds);
+  double cpu_ms = 1000.0 * static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+  double megabytes_posted = static_cast<double>(client->bytes_posted) / kMegabyte;
+  LOG(INFO) << megabytes_posted << "MB posted in " << cpu_ms << "ms of CPU time: "
+            << cpu_ms / megabytes_posted << "ms/MB";
+}
+
 constexpr char test_file_base[] = "/tmp/local_shipping_manager_test";
 
 std::string GetTestFileName(const std::string& base) {
@@ -618,6 +1108,97 @@ std::string GetTestFileName(const std::string& base) {
   return fname.str();
 }
 
+// A PosixFileSystem whose output streams can be made to fail partway through a write, and which can
+// be made not to support flushing or random access, or to fail to open files for random access.
+class WriteFailingFileSystem : public util::PosixFileSystem {
+ public:
+  // Once |fail_writes| is set, an output stream accepts |kBytesBeforeFailure| more bytes and then
+  // fails. Streams for files ending with |kNeverFailingSuffix| do not fail.
+  static constexpr int kBytesBeforeFailure = 10;
+  static constexpr char kNeverFailingSuffix[] = ".tmp";
+
+  using FileSystem::NewProtoOutputStream;
+  StatusOr<ProtoOutputStreamPtr> NewProtoOutputStream(const std::string& file, bool append,
+                                                      int block_size) override {
+    auto stream_or = PosixFileSystem::NewProtoOutputStream(file, append, block_size);
+    if (!stream_or.ok()) {
+      return stream_or;
+    }
+    bool can_fail = file.size() < sizeof(kNeverFailingSuffix) - 1 ||
+                    file.compare(file.size() - (sizeof(kNeverFailingSuffix) - 1),
+                                 std::string::npos, kNeverFailingSuffix) != 0;
+    return ProtoOutputStreamPtr(
+        std::make_unique<FailingOutputStream>(stream_or.ConsumeValueOrDie(), this, can_fail));
+  }
+
+  bool FlushProtoOutputStream(google::protobuf::io::ZeroCopyOutputStream* stream) override {
+    if (no_flush) {
+      return FileSystem::FlushProtoOutputStream(stream);
+    }
+    return PosixFileSystem::FlushProtoOutputStream(
+        static_cast<FailingOutputStream*>(stream)->stream());
+  }
+
+  StatusOr<std::unique_ptr<RandomAccessFile>> NewRandomAccessFile(const std::string& file,
+                                                                  bool create) override {
+    if (no_random_access) {
+      return FileSystem::NewRandomAccessFile(file, create);
+    }
+    if (fail_random_access) {
+      return util::Status(util::StatusCode::PERMISSION_DENIED, "Random access failed.");
+    }
+    return PosixFileSystem::NewRandomAccessFile(file, create);
+  }
+
+  std::atomic<bool> fail_writes = false;
+  bool no_flush = false;
+  bool no_random_access = false;
+  bool fail_random_access = false;
+
+ private:
+  class FailingOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+   public:
+    FailingOutputStream(ProtoOutputStreamPtr stream, WriteFailingFileSystem* fs, bool can_fail)
+        : stream_(std::move(stream)), fs_(fs), can_fail_(can_fail) {}
+
+    bool Next(void** data, int* size) override {
+      if (!can_fail_ || !fs_->fail_writes) {
+        return stream_->Next(data, size);
+      }
+      if (bytes_before_failure_ < 0) {
+        bytes_before_failure_ = kBytesBeforeFailure;
+      }
+      if (bytes_before_failure_ == 0 || !stream_->Next(data, size)) {
+        return false;
+      }
+      if (*size > bytes_before_failure_) {
+        stream_->BackUp(*size - bytes_before_failure_);
+        *size = bytes_before_failure_;
+      }
+      bytes_before_failure_ -= *size;
+      return true;
+    }
+
+    void BackUp(int count) override {
+      stream_->BackUp(count);
+      if (bytes_before_failure_ >= 0) {
+        bytes_before_failure_ += count;
+      }
+    }
+
+    [[nodiscard]] int64_t ByteCount() const override { return stream_->ByteCount(); }
+
+    google::protobuf::io::ZeroCopyOutputStream* stream() { return stream_.get(); }
+
+   private:
+    ProtoOutputStreamPtr stream_;
+    WriteFailingFileSystem* fs_;
+    bool can_fail_;
+    // The number of bytes left before the stream fails, or -1 until |fail_writes| is set.
+    int bytes_before_failure_ = -1;
+  };
+};
+
 class LocalShippingManagerTest : public ::testing::Test {
  public:
   LocalShippingManagerTest()
@@ -625,10 +1206,23 @@ class LocalShippingManagerTest : public ::testing::Test {
         test_file_name_(GetTestFileName(test_file_base)) {}
 
  protected:
-  void SetUp() override {
+  void SetUp() override { fs_.Delete(test_file_name_); }
+
+  void TearDown() override {
+    shipping_manager_.reset();
+    for (int i = 0; i < 10; i++) {
+      fs_.Delete(test_file_name_ + "." + std::to_string(i));
+    }
     fs_.Delete(test_file_name_);
-    shipping_manager_ =
+  }
+
+  void Init(size_t max_bytes_per_file = 0,
+            observation_store::SyncPolicy sync_policy = observation_store::SyncPolicy()) {
+    auto shipping_manager =
         std::make_unique<LocalShippingManager>(&observation_store_, test_file_name_, &fs_);
+    shipping_manager->SetFileRotation(max_bytes_per_file, std::chrono::seconds::zero());
+    shipping_manager->SetSyncPolicy(sync_policy);
+    shipping_manager_ = std::move(shipping_manager);
     shipping_manager_->Start();
   }
 
@@ -640,7 +1234,11 @@ class LocalShippingManagerTest : public ::testing::Test {
   }
 
   void CheckObservationCount(int expected_observation_count) {
-    auto ifs = fs_.NewProtoInputStream(test_file_name_);
+    CheckObservationCount(test_file_name_, expected_observation_count);
+  }
+
+  void CheckObservationCount(const std::string& file_name, int expected_observation_count) {
+    auto ifs = fs_.NewProtoInputStream(file_name);
     ASSERT_EQ(util::StatusCode::OK, ifs.status().error_code());
     int observation_count = 0;
     Envelope envelope;
@@ -656,17 +1254,15 @@ class LocalShippingManagerTest : public ::testing::Test {
     EXPECT_EQ(expected_observation_count, observation_count);
   }
 
- private:
   MemoryObservationStore observation_store_;
-
- protected:
   std::string test_file_name_;
   std::unique_ptr<ShippingManager> shipping_manager_;
-  util::PosixFileSystem fs_;
+  WriteFailingFileSystem fs_;
 };
 
 // Add multiple Observations and allow them to be saved.
 TEST_F(LocalShippingManagerTest, ScheduledSave) {
+  Init();
   // Add two Observations but do not invoke RequestSendSoon() and do
   // not add enough Observations to exceed envelope_send_threshold_size_.
   for (int i = 0; i < 2; i++) {
@@ -679,4 +1275,129 @@ TEST_F(LocalShippingManagerTest, ScheduledSave) {
   EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
 }
 
+// Once the output file is large enough, it is renamed to the next numbered file before the next
+// Envelope is written.
+TEST_F(LocalShippingManagerTest, RotatesOutputFile) {
+  observation_store::SyncPolicy sync_policy;
+  sync_policy.mode = observation_store::SyncPolicy::kEveryBatch;
+  Init(/*max_bytes_per_file=*/1, sync_policy);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+    shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  }
+
+  CheckObservationCount(test_file_name_ + ".1", 1);
+  CheckObservationCount(test_file_name_ + ".2", 1);
+  CheckObservationCount(1);
+  EXPECT_FALSE(fs_.FileExists(test_file_name_ + ".3"));
+  EXPECT_EQ(3u, shipping_manager_->num_send_attempts());
+  EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
+}
+
+// If the output file cannot be written, the Envelopes are returned to the ObservationStore.
+TEST_F(LocalShippingManagerTest, WriteFailureKeepsObservations) {
+  test_file_name_ = GetTestFileName(test_file_base) + "_missing_directory/output";
+  Init();
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  // The LocalShippingManager retries straight away, so it never becomes idle.
+  while (shipping_manager_->num_failed_attempts() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_NE(grpc::OK, shipping_manager_->last_send_status().error_code());
+
+  shipping_manager_.reset();
+  EXPECT_FALSE(observation_store_.Empty());
+}
+
+// If a write fails partway through an Envelope, the part which reached the output file is cut off,
+// and the Envelope is saved again once writing succeeds.
+TEST_F(LocalShippingManagerTest, WriteFailureTruncatesOutputFile) {
+  Init();
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  fs_.fail_writes = true;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  // The LocalShippingManager retries straight away, so it never becomes idle.
+  while (shipping_manager_->num_failed_attempts() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  fs_.fail_writes = false;
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  CheckObservationCount(2);
+  EXPECT_FALSE(fs_.FileExists(test_file_name_ + ".1"));
+  EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
+}
+
+// Without random access, the output file is replaced by a copy of its committed part after a failed
+// write.
+TEST_F(LocalShippingManagerTest, WriteFailureRewritesOutputFileWithoutRandomAccess) {
+  fs_.no_random_access = true;
+  Init();
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  fs_.fail_writes = true;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  while (shipping_manager_->num_failed_attempts() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  fs_.fail_writes = false;
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  CheckObservationCount(2);
+  EXPECT_FALSE(fs_.FileExists(test_file_name_ + ".1"));
+  EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
+}
+
+// If the output file cannot be truncated after a failed write, it is rotated, so that no Envelope
+// is written after the torn one.
+TEST_F(LocalShippingManagerTest, WriteFailureRotatesOutputFile) {
+  fs_.fail_random_access = true;
+  Init();
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  fs_.fail_writes = true;
+  EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+  while (shipping_manager_->num_failed_attempts() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  fs_.fail_writes = false;
+  shipping_manager_->WaitUntilIdle(kMaxSeconds);
+
+  CheckObservationCount(1);
+  EXPECT_TRUE(fs_.FileExists(test_file_name_ + ".1"));
+}
+
+// A FileSystem which cannot flush output streams is flushed by closing and reopening the stream.
+TEST_F(LocalShippingManagerTest, SavesWithoutFlushSupport) {
+  fs_.no_flush = true;
+  Init();
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+    shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  }
+
+  CheckObservationCount(3);
+  EXPECT_FALSE(fs_.FileExists(test_file_name_ + ".1"));
+  EXPECT_EQ(0u, shipping_manager_->num_failed_attempts());
+  EXPECT_EQ(grpc::OK, shipping_manager_->last_send_status().error_code());
+}
+
+// Rotated files whose number does not fit in an integer are ignored when numbering the next one.
+TEST_F(LocalShippingManagerTest, IgnoresUnparsableRotatedFileNumbers) {
+  std::string long_name = test_file_name_ + "." + std::string(40, '9');
+  ASSERT_TRUE(fs_.NewProtoOutputStream(long_name).ok());
+  Init(/*max_bytes_per_file=*/1);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ObservationStore::kOk, AddObservation(40));
+    shipping_manager_->WaitUntilIdle(kMaxSeconds);
+  }
+
+  EXPECT_TRUE(fs_.FileExists(test_file_name_ + ".1"));
+  fs_.Delete(long_name);
+}
+
 }  // namespace cobalt::uploader
@@ -0,0 +1,171 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/uploader/upload_circuit_breaker.h"
+
+#include <algorithm>
+
+#include "src/logging.h"
+
+namespace cobalt::uploader {
+
+namespace {
+
+// time_point::min() is persisted as 0.
+int64_t ToMillis(UploadCircuitBreaker::time_point time) {
+  if (time <= UploadCircuitBreaker::time_point()) {
+    return 0;
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+}
+
+UploadCircuitBreaker::time_point FromMillis(int64_t millis) {
+  if (millis <= 0) {
+    return UploadCircuitBreaker::time_point::min();
+  }
+  return UploadCircuitBreaker::time_point(std::chrono::milliseconds(millis));
+}
+
+}  // namespace
+
+UploadCircuitBreaker::UploadCircuitBreaker(const Params& params, util::ConsistentProtoStore* store,
+                                           time_point now, uint32_t seed)
+    : params_(params), store_(store), random_(seed) {
+  CHECK_GT(params_.failure_threshold, 0u);
+  CHECK_GT(params_.initial_open_duration.count(), 0);
+  CHECK_LE(params_.initial_open_duration.count(), params_.max_open_duration.count());
+  Load(now);
+}
+
+bool UploadCircuitBreaker::AllowSend(time_point now) {
+  if (now < pause_until_) {
+    return false;
+  }
+  switch (state_) {
+    case kClosed:
+      return true;
+    case kOpen:
+      if (now < open_until_) {
+        return false;
+      }
+      VLOG(4) << "UploadCircuitBreaker: Half open. Allowing a probe.";
+      state_ = kHalfOpen;
+      Save();
+      return true;
+    case kHalfOpen:
+      // The probe has not finished yet.
+      return false;
+  }
+  return false;
+}
+
+void UploadCircuitBreaker::SendFinished(time_point now, bool success) {
+  if (success) {
+    if (state_ != kClosed || consecutive_failures_ > 0) {
+      if (state_ != kClosed) {
+        VLOG(4) << "UploadCircuitBreaker: Closed.";
+      }
+      state_ = kClosed;
+      consecutive_failures_ = 0;
+      consecutive_opens_ = 0;
+      Save();
+    }
+    return;
+  }
+
+  if (state_ == kHalfOpen) {
+    Open(now);
+  } else if (++consecutive_failures_ >= params_.failure_threshold) {
+    Open(now);
+  }
+  Save();
+}
+
+void UploadCircuitBreaker::PauseUntil(time_point time) {
+  if (time <= pause_until_) {
+    return;
+  }
+  pause_until_ = time;
+  Save();
+}
+
+UploadCircuitBreaker::time_point UploadCircuitBreaker::NextSendTime() const {
+  if (state_ == kClosed) {
+    return pause_until_;
+  }
+  return std::max(pause_until_, open_until_);
+}
+
+void UploadCircuitBreaker::Open(time_point now) {
+  std::chrono::duration<double> open_duration = params_.initial_open_duration;
+  for (size_t i = 0; i < consecutive_opens_ && open_duration < params_.max_open_duration; i++) {
+    open_duration *= 2;
+  }
+  open_duration = std::min<std::chrono::duration<double>>(open_duration, params_.max_open_duration);
+  std::uniform_real_distribution<double> jitter(0.5, 1.0);
+  open_until_ =
+      now + std::chrono::duration_cast<time_point::duration>(open_duration * jitter(random_));
+  state_ = kOpen;
+  consecutive_failures_ = 0;
+  consecutive_opens_++;
+  VLOG(4) << "UploadCircuitBreaker: Open for "
+          << std::chrono::duration<double>(open_until_ - now).count() << "s.";
+}
+
+void UploadCircuitBreaker::Load(time_point now) {
+  if (store_ == nullptr) {
+    return;
+  }
+  UploadCircuitBreakerState persisted;
+  if (!store_->Read(&persisted).ok()) {
+    // Nothing was persisted yet.
+    return;
+  }
+  // If the circuit was half open, a probe was in flight when the state was written. The circuit is
+  // reopened, but since the open period has ended another probe may be sent straight away.
+  switch (persisted.state()) {
+    case UploadCircuitBreakerState::OPEN:
+    case UploadCircuitBreakerState::HALF_OPEN:
+      state_ = kOpen;
+      break;
+    default:
+      state_ = kClosed;
+      break;
+  }
+  consecutive_failures_ = persisted.consecutive_failures();
+  consecutive_opens_ = persisted.consecutive_opens();
+  // If the system clock was set back since the state was written, the persisted times may be far
+  // in the future. They are bounded by the longest open period.
+  time_point latest = now + params_.max_open_duration;
+  open_until_ = std::min(FromMillis(persisted.open_until_millis()), latest);
+  pause_until_ = std::min(FromMillis(persisted.pause_until_millis()), latest);
+}
+
+void UploadCircuitBreaker::Save() {
+  if (store_ == nullptr) {
+    return;
+  }
+  UploadCircuitBreakerState persisted;
+  switch (state_) {
+    case kClosed:
+      persisted.set_state(UploadCircuitBreakerState::CLOSED);
+      break;
+    case kOpen:
+      persisted.set_state(UploadCircuitBreakerState::OPEN);
+      break;
+    case kHalfOpen:
+      persisted.set_state(UploadCircuitBreakerState::HALF_OPEN);
+      break;
+  }
+  persisted.set_consecutive_failures(static_cast<uint32_t>(consecutive_failures_));
+  persisted.set_consecutive_opens(static_cast<uint32_t>(consecutive_opens_));
+  persisted.set_open_until_millis(ToMillis(open_until_));
+  persisted.set_pause_until_millis(ToMillis(pause_until_));
+  auto status = store_->Write(persisted);
+  if (!status.ok()) {
+    LOG(ERROR) << "UploadCircuitBreaker: Unable to persist the state: " << status.error_message();
+  }
+}
+
+}  // namespace cobalt::uploader
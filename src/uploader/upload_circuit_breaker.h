@@ -0,0 +1,98 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_UPLOADER_UPLOAD_CIRCUIT_BREAKER_H_
+#define COBALT_SRC_UPLOADER_UPLOAD_CIRCUIT_BREAKER_H_
+
+#include <chrono>
+#include <random>
+
+#include "src/lib/util/consistent_proto_store.h"
+#include "src/uploader/upload_circuit_breaker.pb.h"
+
+namespace cobalt::uploader {
+
+// UploadCircuitBreaker stops ShippingManager from uploading while the backend is unreachable, and
+// remembers the backoff across restarts:
+//
+// - CLOSED: Sends are allowed. After |failure_threshold| consecutive failed sends, the circuit
+//   opens.
+//
+// - OPEN: No sends are allowed until the open period ends. The period starts at
+//   |initial_open_duration| and doubles each time the circuit reopens, up to |max_open_duration|,
+//   with a random jitter so that devices which failed together do not retry together.
+//
+// - HALF_OPEN: Once the open period ends, a single probe request is allowed. If it succeeds the
+//   circuit closes, and if it fails the circuit opens again.
+//
+// Independently of the state, no send is allowed before the time at which the backend asked for
+// the next request.
+//
+// If a ConsistentProtoStore is given, the state is read from it at construction and written to it
+// whenever it changes. Times are measured with the system clock, so that they remain meaningful
+// after a restart, and are passed in by the caller so that the policy can be driven by a fake
+// clock. This class is not threadsafe.
+class UploadCircuitBreaker {
+ public:
+  using time_point = std::chrono::system_clock::time_point;
+
+  enum State { kClosed, kOpen, kHalfOpen };
+
+  struct Params {
+    // The number of consecutive failed sends after which the circuit opens.
+    size_t failure_threshold = 3;
+
+    // The time for which the circuit first stays open, and the longest time for which it stays
+    // open. The actual time is chosen at random between half of and the full period.
+    std::chrono::seconds initial_open_duration = std::chrono::minutes(5);
+    std::chrono::seconds max_open_duration = std::chrono::hours(6);
+  };
+
+  // |store| may be null, in which case the state is not persisted. |now| bounds the persisted
+  // times, in case the system clock was set back since they were written. |seed| seeds the jitter.
+  UploadCircuitBreaker(const Params& params, util::ConsistentProtoStore* store, time_point now,
+                       uint32_t seed = std::random_device()());
+
+  // Returns true if a send may start at |now|. If the open period has ended, the circuit becomes
+  // half open, and the send is the probe, which should consist of a single request.
+  bool AllowSend(time_point now);
+
+  // Records that a send finished at |now|, and whether it reached the backend.
+  void SendFinished(time_point now, bool success);
+
+  // Records that the backend asked for the next request not to be sent before |time|.
+  void PauseUntil(time_point time);
+
+  // Returns the earliest time at which AllowSend() may return true. This is in the past if the
+  // circuit is closed and the backend has not asked for a pause.
+  [[nodiscard]] time_point NextSendTime() const;
+
+  [[nodiscard]] State state() const { return state_; }
+
+  [[nodiscard]] size_t consecutive_failures() const { return consecutive_failures_; }
+
+ private:
+  // Reads the persisted state from |store_|, if any.
+  void Load(time_point now);
+
+  // Writes the state to |store_|, if any.
+  void Save();
+
+  // Opens the circuit at |now| for a period depending on |consecutive_opens_|.
+  void Open(time_point now);
+
+  const Params params_;
+  util::ConsistentProtoStore* store_;  // not owned
+  std::mt19937 random_;
+
+  State state_ = kClosed;
+  size_t consecutive_failures_ = 0;
+  size_t consecutive_opens_ = 0;
+  time_point open_until_ = time_point::min();
+  time_point pause_until_ = time_point::min();
+};
+
+}  // namespace cobalt::uploader
+
+#endif  // COBALT_SRC_UPLOADER_UPLOAD_CIRCUIT_BREAKER_H_
@@ -0,0 +1,158 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/uploader/upload_circuit_breaker.h"
+
+#include <memory>
+
+#include "src/lib/util/consistent_proto_store.h"
+#include "src/lib/util/testing/test_with_files.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::uploader {
+
+using std::chrono::hours;
+using std::chrono::minutes;
+using std::chrono::seconds;
+using time_point = UploadCircuitBreaker::time_point;
+
+namespace {
+
+const time_point kStart = time_point(hours(24 * 365 * 50));
+
+UploadCircuitBreaker::Params TestParams() {
+  UploadCircuitBreaker::Params params;
+  params.failure_threshold = 3;
+  params.initial_open_duration = minutes(10);
+  params.max_open_duration = minutes(40);
+  return params;
+}
+
+}  // namespace
+
+class UploadCircuitBreakerTest : public util::testing::TestWithFiles {
+ protected:
+  std::unique_ptr<util::ConsistentProtoStore> NewStore() {
+    return std::make_unique<util::ConsistentProtoStore>(test_folder() + "/circuit_breaker", fs());
+  }
+};
+
+// The circuit opens after |failure_threshold| consecutive failures, and a success resets the count.
+TEST_F(UploadCircuitBreakerTest, OpensAfterConsecutiveFailures) {
+  UploadCircuitBreaker breaker(TestParams(), nullptr, kStart);
+  EXPECT_EQ(UploadCircuitBreaker::kClosed, breaker.state());
+  EXPECT_TRUE(breaker.AllowSend(kStart));
+
+  breaker.SendFinished(kStart, false);
+  breaker.SendFinished(kStart, false);
+  breaker.SendFinished(kStart, true);
+  EXPECT_EQ(0u, breaker.consecutive_failures());
+  breaker.SendFinished(kStart, false);
+  breaker.SendFinished(kStart, false);
+  EXPECT_EQ(UploadCircuitBreaker::kClosed, breaker.state());
+  EXPECT_TRUE(breaker.AllowSend(kStart));
+
+  breaker.SendFinished(kStart, false);
+  EXPECT_EQ(UploadCircuitBreaker::kOpen, breaker.state());
+  EXPECT_FALSE(breaker.AllowSend(kStart));
+  // The open period is between half of and the full initial open duration.
+  EXPECT_GE(breaker.NextSendTime(), kStart + minutes(5));
+  EXPECT_LE(breaker.NextSendTime(), kStart + minutes(10));
+}
+
+// Once the open period ends a single probe is allowed. A failed probe reopens the circuit for
+// longer, and a successful one closes it.
+TEST_F(UploadCircuitBreakerTest, ProbesWhenHalfOpen) {
+  UploadCircuitBreaker breaker(TestParams(), nullptr, kStart);
+  for (int i = 0; i < 3; i++) {
+    breaker.SendFinished(kStart, false);
+  }
+  time_point now = breaker.NextSendTime();
+  EXPECT_TRUE(breaker.AllowSend(now));
+  EXPECT_EQ(UploadCircuitBreaker::kHalfOpen, breaker.state());
+  EXPECT_FALSE(breaker.AllowSend(now));
+
+  breaker.SendFinished(now, false);
+  EXPECT_EQ(UploadCircuitBreaker::kOpen, breaker.state());
+  EXPECT_GE(breaker.NextSendTime(), now + minutes(10));
+  EXPECT_LE(breaker.NextSendTime(), now + minutes(20));
+
+  // The open period doubles up to the maximum.
+  for (int i = 0; i < 5; i++) {
+    now = breaker.NextSendTime();
+    EXPECT_TRUE(breaker.AllowSend(now));
+    breaker.SendFinished(now, false);
+  }
+  EXPECT_GE(breaker.NextSendTime(), now + minutes(20));
+  EXPECT_LE(breaker.NextSendTime(), now + minutes(40));
+
+  now = breaker.NextSendTime();
+  EXPECT_TRUE(breaker.AllowSend(now));
+  breaker.SendFinished(now, true);
+  EXPECT_EQ(UploadCircuitBreaker::kClosed, breaker.state());
+  EXPECT_TRUE(breaker.AllowSend(now));
+
+  // After closing, the open period starts again from the initial duration.
+  for (int i = 0; i < 3; i++) {
+    breaker.SendFinished(now, false);
+  }
+  EXPECT_LE(breaker.NextSendTime(), now + minutes(10));
+}
+
+// No send is allowed before the time at which the backend asked for the next request.
+TEST_F(UploadCircuitBreakerTest, HonorsPause) {
+  UploadCircuitBreaker breaker(TestParams(), nullptr, kStart);
+  breaker.PauseUntil(kStart + minutes(1));
+  EXPECT_EQ(UploadCircuitBreaker::kClosed, breaker.state());
+  EXPECT_FALSE(breaker.AllowSend(kStart));
+  EXPECT_EQ(kStart + minutes(1), breaker.NextSendTime());
+  // An earlier pause does not shorten it.
+  breaker.PauseUntil(kStart + seconds(1));
+  EXPECT_FALSE(breaker.AllowSend(kStart + seconds(30)));
+  EXPECT_TRUE(breaker.AllowSend(kStart + minutes(1)));
+}
+
+// The state survives a restart, and a probe which was in flight at the restart may be retried.
+TEST_F(UploadCircuitBreakerTest, PersistsState) {
+  auto store = NewStore();
+  time_point open_until;
+  {
+    UploadCircuitBreaker breaker(TestParams(), store.get(), kStart);
+    for (int i = 0; i < 3; i++) {
+      breaker.SendFinished(kStart, false);
+    }
+    breaker.PauseUntil(kStart + minutes(30));
+    open_until = breaker.NextSendTime();
+  }
+
+  time_point restart = kStart + minutes(1);
+  auto restarted_store = NewStore();
+  UploadCircuitBreaker breaker(TestParams(), restarted_store.get(), restart);
+  EXPECT_EQ(UploadCircuitBreaker::kOpen, breaker.state());
+  EXPECT_FALSE(breaker.AllowSend(restart));
+  EXPECT_EQ(std::chrono::duration_cast<std::chrono::milliseconds>(open_until.time_since_epoch()),
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                breaker.NextSendTime().time_since_epoch()));
+
+  EXPECT_TRUE(breaker.AllowSend(kStart + minutes(30)));
+  EXPECT_EQ(UploadCircuitBreaker::kHalfOpen, breaker.state());
+  UploadCircuitBreaker restarted_breaker(TestParams(), restarted_store.get(), kStart + minutes(31));
+  EXPECT_EQ(UploadCircuitBreaker::kOpen, restarted_breaker.state());
+  EXPECT_TRUE(restarted_breaker.AllowSend(kStart + minutes(31)));
+}
+
+// Persisted times are bounded by the longest open period, in case the clock was set back.
+TEST_F(UploadCircuitBreakerTest, BoundsPersistedTimes) {
+  auto store = NewStore();
+  {
+    UploadCircuitBreaker breaker(TestParams(), store.get(), kStart);
+    breaker.PauseUntil(kStart + hours(24));
+  }
+  time_point clock_set_back = kStart - hours(1);
+  UploadCircuitBreaker breaker(TestParams(), store.get(), clock_set_back);
+  EXPECT_LE(breaker.NextSendTime(), clock_set_back + minutes(40));
+  EXPECT_TRUE(breaker.AllowSend(clock_set_back + minutes(40)));
+}
+
+}  // namespace cobalt::uploader
@@ -0,0 +1,173 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/uploader/upload_payload_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "src/logging.h"
+
+namespace cobalt::uploader {
+
+UploadPayloadCache::UploadPayloadCache(size_t max_memory_bytes, size_t max_disk_bytes,
+                                       util::FileSystem* fs, std::string spill_directory)
+    : max_memory_bytes_(max_memory_bytes),
+      max_disk_bytes_(fs != nullptr && !spill_directory.empty() ? max_disk_bytes : 0),
+      fs_(fs),
+      spill_directory_(std::move(spill_directory)) {
+  if (max_disk_bytes_ == 0) {
+    return;
+  }
+  fs_->MakeDirectory(spill_directory_);
+  // The payloads spilled by an earlier run cannot be matched with their observations any more.
+  for (const auto& file : fs_->ListFiles(spill_directory_).ConsumeValueOr({})) {
+    fs_->Delete(spill_directory_ + "/" + file);
+  }
+}
+
+UploadPayloadCache::~UploadPayloadCache() {
+  auto fields = protected_fields_.lock();
+  while (!fields->entries.empty()) {
+    EraseLockHeld(&fields, fields->entries.begin());
+  }
+}
+
+void UploadPayloadCache::Put(const std::string& key, Payload payload) {
+  auto fields = protected_fields_.lock();
+  EraseOverlappingLockHeld(&fields, key);
+  size_t bytes = payload.encrypted_envelope.ByteSizeLong();
+  fields->entries.push_back({key, bytes, "", std::move(payload)});
+  auto entry = std::prev(fields->entries.end());
+  fields->index[key] = entry;
+  for (auto& line : KeyLines(key)) {
+    fields->index_by_line[std::move(line)] = entry;
+  }
+  fields->memory_bytes += bytes;
+  EnforceLimitsLockHeld(&fields);
+}
+
+void UploadPayloadCache::Invalidate(const std::string& key) {
+  auto fields = protected_fields_.lock();
+  EraseOverlappingLockHeld(&fields, key);
+}
+
+bool UploadPayloadCache::Take(const std::string& key, Payload* payload) {
+  auto fields = protected_fields_.lock();
+  auto found = fields->index.find(key);
+  if (found == fields->index.end()) {
+    return false;
+  }
+  auto entry = found->second;
+  bool ok = true;
+  if (entry->spill_file.empty()) {
+    *payload = std::move(entry->payload);
+  } else {
+    auto stream_or = fs_->NewProtoInputStream(entry->spill_file);
+    ok = stream_or.ok() && payload->encrypted_envelope.ParseFromZeroCopyStream(
+                               stream_or.ValueOrDie().get());
+    if (ok) {
+      payload->batches = std::move(entry->payload.batches);
+    } else {
+      LOG(WARNING) << "UploadPayloadCache: Unable to read `" << entry->spill_file << "`";
+    }
+  }
+  EraseLockHeld(&fields, entry);
+  return ok;
+}
+
+size_t UploadPayloadCache::size() const { return protected_fields_.const_lock()->entries.size(); }
+
+size_t UploadPayloadCache::memory_bytes() const {
+  return protected_fields_.const_lock()->memory_bytes;
+}
+
+size_t UploadPayloadCache::disk_bytes() const { return protected_fields_.const_lock()->disk_bytes; }
+
+std::vector<std::string> UploadPayloadCache::KeyLines(const std::string& key) {
+  std::vector<std::string> lines;
+  size_t start = 0;
+  while (start < key.size()) {
+    size_t end = std::min(key.find('\n', start), key.size());
+    if (end > start) {
+      lines.push_back(key.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return lines;
+}
+
+void UploadPayloadCache::EraseOverlappingLockHeld(
+    util::ProtectedFields<Fields>::LockedFieldsPtr* fields, const std::string& key) {
+  auto& f = *fields;
+  for (const auto& line : KeyLines(key)) {
+    auto found = f->index_by_line.find(line);
+    if (found != f->index_by_line.end()) {
+      EraseLockHeld(fields, found->second);
+    }
+  }
+}
+
+void UploadPayloadCache::EraseLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields,
+                                       std::list<Entry>::iterator entry) {
+  auto& f = *fields;
+  if (entry->spill_file.empty()) {
+    f->memory_bytes -= entry->bytes;
+  } else {
+    f->disk_bytes -= entry->bytes;
+    fs_->Delete(entry->spill_file);
+  }
+  for (const auto& line : KeyLines(entry->key)) {
+    f->index_by_line.erase(line);
+  }
+  f->index.erase(entry->key);
+  f->entries.erase(entry);
+}
+
+void UploadPayloadCache::EnforceLimitsLockHeld(
+    util::ProtectedFields<Fields>::LockedFieldsPtr* fields) {
+  auto& f = *fields;
+  while (f->memory_bytes > max_memory_bytes_) {
+    auto oldest_in_memory =
+        std::find_if(f->entries.begin(), f->entries.end(),
+                     [](const Entry& entry) { return entry.spill_file.empty(); });
+    if (!SpillLockHeld(fields, oldest_in_memory)) {
+      EraseLockHeld(fields, oldest_in_memory);
+    }
+  }
+}
+
+bool UploadPayloadCache::SpillLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields,
+                                       std::list<Entry>::iterator entry) {
+  auto& f = *fields;
+  if (entry->bytes > max_disk_bytes_) {
+    return false;
+  }
+  // The oldest spilled payloads make room for this one.
+  for (auto it = f->entries.begin();
+       it != f->entries.end() && f->disk_bytes + entry->bytes > max_disk_bytes_;) {
+    auto spilled = it++;
+    if (!spilled->spill_file.empty()) {
+      EraseLockHeld(fields, spilled);
+    }
+  }
+
+  std::string spill_file = spill_directory_ + "/" + std::to_string(f->next_spill_file++);
+  {
+    auto stream_or = fs_->NewProtoOutputStream(spill_file, /*append=*/false);
+    if (!stream_or.ok() || !entry->payload.encrypted_envelope.SerializeToZeroCopyStream(
+                               stream_or.ValueOrDie().get())) {
+      LOG(WARNING) << "UploadPayloadCache: Unable to write `" << spill_file << "`";
+      fs_->Delete(spill_file);
+      return false;
+    }
+  }
+  entry->payload.encrypted_envelope.Clear();
+  entry->spill_file = std::move(spill_file);
+  f->memory_bytes -= entry->bytes;
+  f->disk_bytes += entry->bytes;
+  return true;
+}
+
+}  // namespace cobalt::uploader
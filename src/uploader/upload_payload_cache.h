@@ -0,0 +1,117 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COBALT_SRC_UPLOADER_UPLOAD_PAYLOAD_CACHE_H_
+#define COBALT_SRC_UPLOADER_UPLOAD_PAYLOAD_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/lib/util/file_system.h"
+#include "src/lib/util/protected_fields.h"
+#include "src/observation_store/observation_store.h"
+#include "src/pb/encrypted_message.pb.h"
+
+namespace cobalt::uploader {
+
+// UploadPayloadCache keeps the encrypted Envelopes of failed uploads, keyed by the ContentKey() of
+// their EnvelopeHolders, so that when the same observations are uploaded again they are not read,
+// parsed and encrypted again.
+//
+// A key is made of lines, each of which names a unit of stored data, such as a file. Since a unit
+// of data is uploaded in a single Envelope, a payload whose key shares a line with a newer key is
+// stale: the data was packed differently since, or uploaded. It is dropped when a payload is
+// cached under the newer key, or when the newer key is invalidated.
+//
+// The payloads are kept in memory up to |max_memory_bytes|. Beyond that, the oldest payloads are
+// written to files in |spill_directory| up to |max_disk_bytes|, and beyond that they are dropped,
+// oldest first. A dropped payload is simply rebuilt from the ObservationStore by the next upload.
+//
+// The spill directory is owned by the cache: files left in it by an earlier run are deleted at
+// construction, and the files written by the cache are deleted when their payloads are taken or
+// dropped, and at destruction.
+//
+// This object is thread safe.
+class UploadPayloadCache {
+ public:
+  struct Payload {
+    EncryptedMessage encrypted_envelope;
+    std::vector<observation_store::ObservationStore::EnvelopeHolder::BatchSummary> batches;
+  };
+
+  // If |fs| is null or |spill_directory| is empty, payloads are never written to disk.
+  explicit UploadPayloadCache(size_t max_memory_bytes, size_t max_disk_bytes = 0,
+                              util::FileSystem* fs = nullptr, std::string spill_directory = "");
+
+  ~UploadPayloadCache();
+
+  // Caches |payload| under |key|, replacing any payload cached under a key which shares a line with
+  // it.
+  void Put(const std::string& key, Payload payload);
+
+  // Drops any payload cached under a key which shares a line with |key|. This is called once the
+  // data named by |key| has been uploaded, and so deleted from the store.
+  void Invalidate(const std::string& key);
+
+  // Removes the payload cached under |key| and moves it to |payload|. Returns false if there is
+  // none, or if it was spilled to a file which can no longer be read.
+  bool Take(const std::string& key, Payload* payload);
+
+  // The number of cached payloads, and their total size in memory and on disk.
+  [[nodiscard]] size_t size() const;
+  [[nodiscard]] size_t memory_bytes() const;
+  [[nodiscard]] size_t disk_bytes() const;
+
+ private:
+  struct Entry {
+    std::string key;
+    size_t bytes;
+    // Empty if the payload is in memory.
+    std::string spill_file;
+    Payload payload;
+  };
+
+  struct Fields {
+    // Ordered from the least to the most recently cached.
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    // The entry whose key contains each line. Two entries never share a line.
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_by_line;
+    size_t memory_bytes = 0;
+    size_t disk_bytes = 0;
+    size_t next_spill_file = 0;
+  };
+
+  // Splits |key| into its non-empty lines.
+  static std::vector<std::string> KeyLines(const std::string& key);
+
+  // Removes the entries whose keys share a line with |key|.
+  void EraseOverlappingLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields,
+                                const std::string& key);
+
+  // Removes |entry| from the cache, deleting its spill file if any.
+  void EraseLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields,
+                     std::list<Entry>::iterator entry);
+
+  // Spills or drops the oldest payloads in memory until the memory limit is met.
+  void EnforceLimitsLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields);
+
+  // Writes the payload of |entry|, which is in memory, to a new file in |spill_directory_|,
+  // dropping the oldest spilled payloads to make room for it. Returns false if it does not fit
+  // within the disk limit or cannot be written.
+  bool SpillLockHeld(util::ProtectedFields<Fields>::LockedFieldsPtr* fields,
+                     std::list<Entry>::iterator entry);
+
+  const size_t max_memory_bytes_;
+  const size_t max_disk_bytes_;
+  util::FileSystem* fs_;  // not owned
+  const std::string spill_directory_;
+  util::ProtectedFields<Fields> protected_fields_;
+};
+
+}  // namespace cobalt::uploader
+
+#endif  // COBALT_SRC_UPLOADER_UPLOAD_PAYLOAD_CACHE_H_
@@ -0,0 +1,137 @@
+// Copyright 2020 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/uploader/upload_payload_cache.h"
+
+#include <string>
+
+#include "src/lib/util/testing/test_with_files.h"
+#include "third_party/googletest/googletest/include/gtest/gtest.h"
+
+namespace cobalt::uploader {
+
+namespace {
+
+// A payload whose encrypted envelope takes |size| bytes, plus a few bytes of framing.
+UploadPayloadCache::Payload MakePayload(char fill, size_t size) {
+  UploadPayloadCache::Payload payload;
+  payload.encrypted_envelope.set_ciphertext(std::string(size, fill));
+  payload.batches.push_back({1, 2, size});
+  return payload;
+}
+
+}  // namespace
+
+class UploadPayloadCacheTest : public util::testing::TestWithFiles {
+ protected:
+  std::string spill_directory() { return test_folder() + "/spill"; }
+
+  size_t NumSpillFiles() { return fs()->ListFiles(spill_directory()).ConsumeValueOr({}).size(); }
+
+  static void ExpectPayload(UploadPayloadCache* cache, const std::string& key, char fill,
+                            size_t size) {
+    UploadPayloadCache::Payload payload;
+    ASSERT_TRUE(cache->Take(key, &payload));
+    EXPECT_EQ(std::string(size, fill), payload.encrypted_envelope.ciphertext());
+    ASSERT_EQ(1u, payload.batches.size());
+    EXPECT_EQ(size, payload.batches[0].size);
+  }
+};
+
+// A payload is returned once, and replaced when it is cached again under the same key.
+TEST_F(UploadPayloadCacheTest, PutAndTake) {
+  UploadPayloadCache cache(1000);
+  cache.Put("a", MakePayload('a', 100));
+  cache.Put("b", MakePayload('b', 100));
+  cache.Put("a", MakePayload('c', 200));
+  EXPECT_EQ(2u, cache.size());
+
+  ExpectPayload(&cache, "a", 'c', 200);
+  UploadPayloadCache::Payload payload;
+  EXPECT_FALSE(cache.Take("a", &payload));
+  ExpectPayload(&cache, "b", 'b', 100);
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(0u, cache.memory_bytes());
+}
+
+// Without a spill directory, the oldest payloads are dropped once the memory limit is reached.
+TEST_F(UploadPayloadCacheTest, DropsOldestWithoutSpillDirectory) {
+  UploadPayloadCache cache(250, 1000);
+  cache.Put("a", MakePayload('a', 100));
+  cache.Put("b", MakePayload('b', 100));
+  cache.Put("c", MakePayload('c', 100));
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_LE(cache.memory_bytes(), 250u);
+  EXPECT_EQ(0u, cache.disk_bytes());
+
+  UploadPayloadCache::Payload payload;
+  EXPECT_FALSE(cache.Take("a", &payload));
+  ExpectPayload(&cache, "b", 'b', 100);
+  ExpectPayload(&cache, "c", 'c', 100);
+}
+
+// The oldest payloads are spilled to disk once the memory limit is reached, and dropped once the
+// disk limit is reached too. Spilled payloads are read back when they are taken.
+TEST_F(UploadPayloadCacheTest, SpillsOldestToDisk) {
+  UploadPayloadCache cache(250, 250, fs(), spill_directory());
+  for (char key = 'a'; key <= 'e'; key++) {
+    cache.Put(std::string(1, key), MakePayload(key, 100));
+  }
+  EXPECT_EQ(4u, cache.size());
+  EXPECT_LE(cache.memory_bytes(), 250u);
+  EXPECT_LE(cache.disk_bytes(), 250u);
+  EXPECT_EQ(2u, NumSpillFiles());
+
+  UploadPayloadCache::Payload payload;
+  EXPECT_FALSE(cache.Take("a", &payload));
+  ExpectPayload(&cache, "b", 'b', 100);
+  EXPECT_EQ(1u, NumSpillFiles());
+  ExpectPayload(&cache, "e", 'e', 100);
+  EXPECT_EQ(2u, cache.size());
+}
+
+// A payload is dropped when a payload is cached under a key sharing a line with its own, and when
+// such a key is invalidated.
+TEST_F(UploadPayloadCacheTest, DropsOverlappingKeys) {
+  UploadPayloadCache cache(0, 1000, fs(), spill_directory());
+  cache.Put("f1\nf2\n", MakePayload('a', 100));
+  cache.Put("f3\n", MakePayload('b', 100));
+  cache.Put("f2\nf4\n", MakePayload('c', 100));
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(2u, NumSpillFiles());
+
+  UploadPayloadCache::Payload payload;
+  EXPECT_FALSE(cache.Take("f1\nf2\n", &payload));
+
+  cache.Invalidate("f4\nf5\n");
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_EQ(1u, NumSpillFiles());
+  EXPECT_FALSE(cache.Take("f2\nf4\n", &payload));
+
+  // Lines are matched whole.
+  cache.Invalidate("f\n3\n");
+  ExpectPayload(&cache, "f3\n", 'b', 100);
+  EXPECT_EQ(0u, cache.disk_bytes());
+}
+
+// The spill files are deleted when the cache is destroyed, and files left in the spill directory
+// are deleted when the cache is created.
+TEST_F(UploadPayloadCacheTest, CleansUpSpillDirectory) {
+  {
+    UploadPayloadCache cache(0, 1000, fs(), spill_directory());
+    cache.Put("a", MakePayload('a', 100));
+    EXPECT_EQ(1u, NumSpillFiles());
+  }
+  EXPECT_EQ(0u, NumSpillFiles());
+
+  {
+    auto stream = fs()->NewProtoOutputStream(spill_directory() + "/leftover", false);
+    ASSERT_TRUE(stream.ok());
+  }
+  EXPECT_EQ(1u, NumSpillFiles());
+  UploadPayloadCache cache(0, 1000, fs(), spill_directory());
+  EXPECT_EQ(0u, NumSpillFiles());
+}
+
+}  // namespace cobalt::uploader
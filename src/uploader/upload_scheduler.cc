@@ -4,6 +4,8 @@
 
 #include "src/uploader/upload_scheduler.h"
 
+#include <algorithm>
+
 namespace cobalt::uploader {
 
 // Definition of the static constant declared in shipping_manager.h.
@@ -39,4 +41,94 @@ std::chrono::seconds UploadScheduler::Interval() {
   return interval;
 }
 
+AdaptiveUploadScheduler::AdaptiveUploadScheduler(const Params& params, time_point start,
+                                                 uint32_t seed)
+    : params_(params),
+      random_(seed),
+      window_start_(start),
+      last_send_finished_(start) {
+  CHECK_GE(params_.min_interval.count(), 0);
+  CHECK_LE(params_.min_interval.count(), params_.max_interval.count());
+  CHECK_LE(params_.max_interval.count(), UploadScheduler::kMaxSeconds.count());
+  CHECK_LE(params_.initial_backoff.count(), params_.max_backoff.count());
+  CHECK_GT(params_.fill_rate_window.count(), 0);
+}
+
+void AdaptiveUploadScheduler::ObserveStoreSize(time_point now, size_t store_bytes) {
+  if (store_bytes < window_start_bytes_) {
+    // Observations were taken from the store since the window started.
+    window_start_ = now;
+    window_start_bytes_ = store_bytes;
+    return;
+  }
+  std::chrono::duration<double> elapsed = now - window_start_;
+  if (elapsed < params_.fill_rate_window) {
+    return;
+  }
+  double rate = static_cast<double>(store_bytes - window_start_bytes_) / elapsed.count();
+  if (has_fill_rate_) {
+    fill_rate_ =
+        params_.fill_rate_smoothing * rate + (1 - params_.fill_rate_smoothing) * fill_rate_;
+  } else {
+    fill_rate_ = rate;
+    has_fill_rate_ = true;
+  }
+  window_start_ = now;
+  window_start_bytes_ = store_bytes;
+}
+
+void AdaptiveUploadScheduler::SendFinished(time_point now, bool success, size_t store_bytes) {
+  last_send_finished_ = now;
+  window_start_ = now;
+  window_start_bytes_ = store_bytes;
+  if (success) {
+    consecutive_failures_ = 0;
+    backoff_until_ = time_point::min();
+    return;
+  }
+
+  consecutive_failures_++;
+  std::chrono::duration<double> backoff = params_.initial_backoff;
+  for (size_t i = 1; i < consecutive_failures_ && backoff < params_.max_backoff; i++) {
+    backoff *= 2;
+  }
+  backoff = std::min<std::chrono::duration<double>>(backoff, params_.max_backoff);
+  std::uniform_real_distribution<double> jitter(0.5, 1.0);
+  backoff_until_ = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             backoff * jitter(random_));
+}
+
+void AdaptiveUploadScheduler::PauseUntil(time_point time) {
+  pause_until_ = std::max(pause_until_, time);
+}
+
+AdaptiveUploadScheduler::time_point AdaptiveUploadScheduler::NextSendTime(
+    time_point now, size_t store_bytes, bool almost_full) const {
+  // A store which is almost full is worth a retry before the backoff ends, but not a request the
+  // server asked not to receive yet.
+  time_point earliest = std::max({last_send_finished_ + params_.min_interval,
+                                  almost_full ? time_point::min() : backoff_until_, pause_until_});
+  time_point latest = last_send_finished_ + params_.max_interval;
+
+  // The store should hold at most |drain_threshold| of its capacity when the send starts, which may
+  // be up to |min_interval| after the returned time.
+  std::chrono::duration<double> min_interval = params_.min_interval;
+  double drain_bytes = params_.drain_threshold * static_cast<double>(params_.store_capacity_bytes) -
+                       fill_rate_ * min_interval.count();
+  double send_bytes = std::min(static_cast<double>(params_.target_bytes_per_send), drain_bytes);
+
+  time_point send_time = latest;
+  if (static_cast<double>(store_bytes) >= send_bytes) {
+    send_time = now;
+  } else if (fill_rate_ > 0) {
+    std::chrono::duration<double> time_to_fill(
+        (send_bytes - static_cast<double>(store_bytes)) / fill_rate_);
+    if (time_to_fill < latest - now) {
+      send_time =
+          now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(time_to_fill);
+    }
+  }
+  return std::max(std::min(send_time, latest), earliest);
+}
+
 }  // namespace cobalt::uploader
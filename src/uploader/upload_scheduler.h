@@ -6,6 +6,7 @@
 #define COBALT_SRC_UPLOADER_UPLOAD_SCHEDULER_H_
 
 #include <chrono>
+#include <random>
 
 #include "src/logging.h"
 
@@ -54,6 +55,96 @@ class UploadScheduler {
   std::chrono::seconds min_interval_;
 };
 
+// AdaptiveUploadScheduler is an alternative to UploadScheduler which chooses when ShippingManager
+// should next send from what it has observed, rather than from a fixed interval:
+//
+// - When traffic is low, a send is delayed until the ObservationStore holds enough Observations to
+//   fill |target_bytes_per_send|, but by no more than |max_interval|, so that there are fewer
+//   uploads of fuller Envelopes.
+//
+// - When traffic spikes, a send is brought forward so that the store is drained before it holds
+//   |drain_threshold| of its capacity, given the rate at which it is filling.
+//
+// - After a failed send, the next send is delayed by an exponential backoff with jitter, unless
+//   the store is almost full: as with UploadScheduler, store pressure cuts the backoff short, so
+//   that the end of an outage is noticed before Observations have to be dropped.
+//
+// - A send is never scheduled before the time at which the server asked for the next request.
+//
+// The times are passed in by the caller, so that the policy can be driven by a fake clock. This
+// class is not threadsafe.
+class AdaptiveUploadScheduler {
+ public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  struct Params {
+    // Two sends are never closer together than |min_interval|, and while there are Observations to
+    // send, they are never further apart than |max_interval| unless a backoff or the server
+    // requires it.
+    std::chrono::seconds min_interval;
+    std::chrono::seconds max_interval;
+
+    // The number of bytes of Observations a send should upload, typically a whole number of full
+    // Envelopes.
+    size_t target_bytes_per_send;
+
+    // The capacity of the ObservationStore, and the fraction of it which it should hold at most.
+    size_t store_capacity_bytes;
+    double drain_threshold = 0.5;
+
+    // The backoff after the first of consecutive failed sends. It doubles with each further failure
+    // up to |max_backoff|. The actual delay is chosen at random between half of and the full
+    // backoff.
+    std::chrono::seconds initial_backoff = std::chrono::minutes(1);
+    std::chrono::seconds max_backoff = std::chrono::hours(1);
+
+    // The fill rate of the store is measured over windows of at least |fill_rate_window|, and each
+    // measurement has the weight |fill_rate_smoothing| in the moving average of the fill rate.
+    std::chrono::seconds fill_rate_window = std::chrono::seconds(10);
+    double fill_rate_smoothing = 0.5;
+  };
+
+  // |start| is the time from which |max_interval| is counted before the first send. |seed| seeds
+  // the jitter of the backoff.
+  AdaptiveUploadScheduler(const Params& params, time_point start,
+                          uint32_t seed = std::random_device()());
+
+  // Records that the store held |store_bytes| at |now|. Call this whenever Observations are added.
+  void ObserveStoreSize(time_point now, size_t store_bytes);
+
+  // Records that a send finished at |now|, and whether all of its Envelopes were sent, leaving
+  // |store_bytes| in the store.
+  void SendFinished(time_point now, bool success, size_t store_bytes);
+
+  // Records that the server asked for the next request not to be sent before |time|.
+  void PauseUntil(time_point time);
+
+  // Returns the time at which the next send should start, if the store holds |store_bytes| at
+  // |now|, and whether it is |almost_full|. The send may start up to |min_interval| later than the
+  // returned time.
+  [[nodiscard]] time_point NextSendTime(time_point now, size_t store_bytes,
+                                        bool almost_full = false) const;
+
+  // The estimated rate at which the store fills, in bytes per second.
+  [[nodiscard]] double fill_rate() const { return fill_rate_; }
+
+  [[nodiscard]] size_t consecutive_failures() const { return consecutive_failures_; }
+
+ private:
+  const Params params_;
+  std::mt19937 random_;
+
+  double fill_rate_ = 0;
+  bool has_fill_rate_ = false;
+  time_point window_start_;
+  size_t window_start_bytes_ = 0;
+
+  time_point last_send_finished_;
+  size_t consecutive_failures_ = 0;
+  time_point backoff_until_ = time_point::min();
+  time_point pause_until_ = time_point::min();
+};
+
 }  // namespace cobalt::uploader
 
 namespace cobalt::encoder {
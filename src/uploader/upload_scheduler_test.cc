@@ -4,10 +4,21 @@
 
 #include "src/uploader/upload_scheduler.h"
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include "src/lib/util/clock.h"
+#include "src/logging.h"
 #include "third_party/googletest/googletest/include/gtest/gtest.h"
 
 namespace cobalt::uploader {
 
+using std::chrono::hours;
+using std::chrono::minutes;
+using std::chrono::seconds;
+using time_point = std::chrono::steady_clock::time_point;
+
 TEST(UploadScheduler, NoBackoff) {
   auto scheduler = UploadScheduler(std::chrono::hours(1), std::chrono::seconds(0));
 
@@ -52,4 +63,351 @@ TEST(UploadScheduler, LongBackoff) {
   EXPECT_EQ(scheduler.Interval(), std::chrono::seconds(3600));
 }
 
+AdaptiveUploadScheduler::Params TestParams() {
+  AdaptiveUploadScheduler::Params params;
+  params.min_interval = seconds(10);
+  params.max_interval = hours(1);
+  params.target_bytes_per_send = 1000;
+  params.store_capacity_bytes = 10000;
+  params.drain_threshold = 0.5;
+  params.initial_backoff = minutes(1);
+  params.max_backoff = minutes(8);
+  params.fill_rate_window = seconds(10);
+  params.fill_rate_smoothing = 1;
+  return params;
+}
+
+TEST(AdaptiveUploadScheduler, WaitsForTargetBytes) {
+  time_point start;
+  AdaptiveUploadScheduler scheduler(TestParams(), start);
+
+  // Nothing is known about the fill rate yet, so the send is scheduled after max_interval.
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(1), 100), start + hours(1));
+
+  // 10 bytes per second: the store holds 1000 bytes 90s after it held 100.
+  scheduler.ObserveStoreSize(start + seconds(10), 100);
+  EXPECT_EQ(scheduler.fill_rate(), 10);
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(10), 100), start + seconds(100));
+
+  // Once the store holds the target, a send is due.
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(100), 1000), start + seconds(100));
+}
+
+TEST(AdaptiveUploadScheduler, DrainsEarlyWhenFillingFast) {
+  time_point start;
+  AdaptiveUploadScheduler scheduler(TestParams(), start);
+  scheduler.SendFinished(start, true, 0);
+
+  // 450 bytes per second: the store would hold 4500 bytes more by the time a send scheduled now
+  // starts, so the send is due once the store holds 500 bytes, although the target of 1000 bytes is
+  // not reached.
+  scheduler.ObserveStoreSize(start + seconds(10), 4500);
+  EXPECT_EQ(scheduler.fill_rate(), 450);
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(10), 600), start + seconds(10));
+
+  // Two sends are never closer together than min_interval.
+  scheduler.SendFinished(start + seconds(11), true, 0);
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(12), 600), start + seconds(21));
+}
+
+TEST(AdaptiveUploadScheduler, BacksOffWithJitter) {
+  time_point start;
+  AdaptiveUploadScheduler scheduler(TestParams(), start, /*seed=*/1);
+
+  time_point now = start;
+  seconds expected_backoff = minutes(1);
+  for (int i = 0; i < 6; i++) {
+    scheduler.SendFinished(now, false, 5000);
+    EXPECT_EQ(scheduler.consecutive_failures(), i + 1);
+    time_point next = scheduler.NextSendTime(now, 5000);
+    EXPECT_GE(next, now + expected_backoff / 2) << "i=" << i;
+    EXPECT_LE(next, now + expected_backoff) << "i=" << i;
+    expected_backoff = std::min<seconds>(expected_backoff * 2, minutes(8));
+    now = next;
+  }
+
+  scheduler.SendFinished(now, true, 0);
+  EXPECT_EQ(scheduler.consecutive_failures(), 0u);
+  EXPECT_EQ(scheduler.NextSendTime(now, 5000), now + seconds(10));
+}
+
+TEST(AdaptiveUploadScheduler, RespectsServerWait) {
+  time_point start;
+  AdaptiveUploadScheduler scheduler(TestParams(), start);
+  scheduler.SendFinished(start, true, 0);
+  scheduler.PauseUntil(start + minutes(5));
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(20), 5000), start + minutes(5));
+
+  // Even an almost full store waits for the server.
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(20), 7000, /*almost_full=*/true),
+            start + minutes(5));
+}
+
+TEST(AdaptiveUploadScheduler, AlmostFullCutsBackoffShort) {
+  time_point start;
+  AdaptiveUploadScheduler scheduler(TestParams(), start, /*seed=*/1);
+  for (int i = 0; i < 4; i++) {
+    scheduler.SendFinished(start, false, 7000);
+  }
+  EXPECT_GE(scheduler.NextSendTime(start + seconds(20), 7000), start + minutes(4));
+
+  // Only min_interval is kept.
+  EXPECT_EQ(scheduler.NextSendTime(start + seconds(5), 7000, /*almost_full=*/true),
+            start + seconds(10));
+  EXPECT_EQ(scheduler.consecutive_failures(), 4u);
+}
+
+namespace {
+
+// The traffic and server behavior of a simulation.
+struct Workload {
+  // The number of bytes of Observations added in the second starting at the given time.
+  std::function<size_t(seconds)> bytes_per_second;
+  seconds duration;
+  // Every upload fails between these times.
+  seconds outage_start = seconds(0);
+  seconds outage_end = seconds(0);
+  // The next_request_wait_millis returned by the server with each successful upload.
+  seconds server_wait = seconds(0);
+};
+
+struct StoreParams {
+  size_t capacity_bytes;
+  size_t envelope_bytes;
+};
+
+struct SimulationResult {
+  size_t num_requests = 0;
+  size_t num_sends = 0;
+  // Sends which were attempted while the server had asked to wait.
+  size_t num_refused_sends = 0;
+  size_t bytes_added = 0;
+  size_t bytes_dropped = 0;
+
+  [[nodiscard]] double drop_rate() const {
+    return bytes_added == 0 ? 0 : static_cast<double>(bytes_dropped) / bytes_added;
+  }
+};
+
+// The decisions of ShippingManager::Run() about when to send.
+class SchedulingPolicy {
+ public:
+  virtual ~SchedulingPolicy() = default;
+  [[nodiscard]] virtual seconds min_interval() const = 0;
+  // Called after Observations are added. Returns true if a send is due, either because it was
+  // scheduled or because it was requested.
+  virtual bool SendDue(time_point now, size_t store_bytes) = 0;
+  virtual void SendFinished(time_point now, bool success, size_t store_bytes,
+                            time_point server_paused_until) = 0;
+};
+
+// The behavior of ShippingManager with an UploadScheduler: a send every Interval(), and an
+// expedited send when the store IsAlmostFull().
+class FixedPolicy : public SchedulingPolicy {
+ public:
+  FixedPolicy(UploadScheduler scheduler, time_point start, size_t almost_full_bytes)
+      : scheduler_(scheduler),
+        next_send_(start + scheduler_.Interval()),
+        almost_full_bytes_(almost_full_bytes) {}
+
+  [[nodiscard]] seconds min_interval() const override { return scheduler_.MinInterval(); }
+
+  bool SendDue(time_point now, size_t store_bytes) override {
+    return now >= next_send_ || store_bytes > almost_full_bytes_;
+  }
+
+  void SendFinished(time_point now, bool /*success*/, size_t /*store_bytes*/,
+                    time_point /*server_paused_until*/) override {
+    next_send_ = now + scheduler_.Interval();
+  }
+
+ private:
+  UploadScheduler scheduler_;
+  time_point next_send_;
+  size_t almost_full_bytes_;
+};
+
+// The behavior of ShippingManager with an AdaptiveUploadScheduler, which is told when the store
+// IsAlmostFull().
+class AdaptivePolicy : public SchedulingPolicy {
+ public:
+  AdaptivePolicy(const AdaptiveUploadScheduler::Params& params, time_point start,
+                 size_t almost_full_bytes)
+      : min_interval_(params.min_interval),
+        scheduler_(params, start, /*seed=*/42),
+        almost_full_bytes_(almost_full_bytes) {}
+
+  [[nodiscard]] seconds min_interval() const override { return min_interval_; }
+
+  bool SendDue(time_point now, size_t store_bytes) override {
+    scheduler_.ObserveStoreSize(now, store_bytes);
+    return scheduler_.NextSendTime(now, store_bytes, store_bytes > almost_full_bytes_) <= now;
+  }
+
+  void SendFinished(time_point now, bool success, size_t store_bytes,
+                    time_point server_paused_until) override {
+    scheduler_.PauseUntil(server_paused_until);
+    scheduler_.SendFinished(now, success, store_bytes);
+  }
+
+ private:
+  seconds min_interval_;
+  AdaptiveUploadScheduler scheduler_;
+  size_t almost_full_bytes_;
+};
+
+// Simulates |workload| in steps of one second of the fake |clock|, for a ShippingManager whose
+// ObservationStore is described by |store|, scheduling sends with |policy|.
+//
+// As in ShippingManager::Run(), the worker sleeps for |min_interval| after each send. A send which
+// becomes due during that sleep starts when it ends, and one which becomes due later starts
+// |min_interval| later. A send uploads the whole store, one request per Envelope, and stops after 3
+// failed requests. Sends take no time.
+SimulationResult Simulate(const Workload& workload, const StoreParams& store,
+                          util::IncrementingSteadyClock* clock, SchedulingPolicy* policy) {
+  const size_t kMaxFailuresWithoutSuccess = 3;
+  SimulationResult result;
+  time_point start = clock->peek_now();
+  time_point last_send_finished = start;
+  time_point server_paused_until = start;
+  bool send_pending = false;
+  time_point pending_send_time;
+  size_t store_bytes = 0;
+  for (seconds t(0); t < workload.duration; t += seconds(1)) {
+    clock->increment_by(seconds(1));
+    time_point now = clock->peek_now();
+
+    size_t bytes = workload.bytes_per_second(t);
+    result.bytes_added += bytes;
+    size_t stored = std::min(bytes, store.capacity_bytes - store_bytes);
+    store_bytes += stored;
+    result.bytes_dropped += bytes - stored;
+
+    if (!send_pending && store_bytes > 0 && policy->SendDue(now, store_bytes)) {
+      send_pending = true;
+      pending_send_time = last_send_finished + policy->min_interval();
+      if (now > pending_send_time) {
+        pending_send_time = now + policy->min_interval();
+      }
+    }
+    if (!send_pending || now < pending_send_time) {
+      continue;
+    }
+
+    send_pending = false;
+    result.num_sends++;
+    bool success = true;
+    size_t num_envelopes = (store_bytes + store.envelope_bytes - 1) / store.envelope_bytes;
+    if (now < server_paused_until) {
+      // The ClearcutUploader refuses to send while the server asked it to wait.
+      result.num_refused_sends++;
+      success = false;
+    } else if (t >= workload.outage_start && t < workload.outage_end) {
+      result.num_requests += std::min(num_envelopes, kMaxFailuresWithoutSuccess);
+      success = false;
+    } else {
+      result.num_requests += num_envelopes;
+      store_bytes = 0;
+      server_paused_until = now + workload.server_wait;
+    }
+    last_send_finished = now;
+    policy->SendFinished(now, success, store_bytes, server_paused_until);
+  }
+  return result;
+}
+
+const StoreParams kStore = {/*capacity_bytes=*/1000000, /*envelope_bytes=*/100000};
+
+// Compares the current scheduling, with a target interval of 1 hour, to the adaptive scheduling,
+// which may wait for up to 4 hours for 2 full Envelopes, on |workload|.
+void Compare(const Workload& workload, SimulationResult* fixed, SimulationResult* adaptive) {
+  const seconds kMinInterval = minutes(5);
+  {
+    util::IncrementingSteadyClock clock;
+    FixedPolicy policy(UploadScheduler(hours(1), kMinInterval, minutes(1)), clock.peek_now(),
+                       kStore.capacity_bytes * 6 / 10);
+    *fixed = Simulate(workload, kStore, &clock, &policy);
+  }
+  {
+    util::IncrementingSteadyClock clock;
+    AdaptiveUploadScheduler::Params params;
+    params.min_interval = kMinInterval;
+    params.max_interval = hours(4);
+    params.target_bytes_per_send = 2 * kStore.envelope_bytes;
+    params.store_capacity_bytes = kStore.capacity_bytes;
+    params.initial_backoff = minutes(5);
+    params.max_backoff = minutes(15);
+    AdaptivePolicy policy(params, clock.peek_now(), kStore.capacity_bytes * 6 / 10);
+    *adaptive = Simulate(workload, kStore, &clock, &policy);
+  }
+  LOG(INFO) << "fixed: " << fixed->num_requests << " requests in " << fixed->num_sends
+            << " sends, " << fixed->num_refused_sends << " refused, drop rate "
+            << fixed->drop_rate() << "; adaptive: " << adaptive->num_requests << " requests in "
+            << adaptive->num_sends << " sends, " << adaptive->num_refused_sends
+            << " refused, drop rate " << adaptive->drop_rate();
+}
+
+}  // namespace
+
+// With low traffic, the adaptive scheduling makes fewer requests of fuller Envelopes.
+TEST(UploadSchedulerSimulation, LowTraffic) {
+  Workload workload;
+  workload.bytes_per_second = [](seconds /*t*/) { return 10; };
+  workload.duration = hours(48);
+  SimulationResult fixed, adaptive;
+  Compare(workload, &fixed, &adaptive);
+  EXPECT_LT(adaptive.num_requests, fixed.num_requests);
+  EXPECT_EQ(fixed.bytes_dropped, 0u);
+  EXPECT_EQ(adaptive.bytes_dropped, 0u);
+}
+
+// When traffic spikes, the adaptive scheduling drains the store before it is full.
+TEST(UploadSchedulerSimulation, TrafficSpike) {
+  Workload workload;
+  workload.bytes_per_second = [](seconds t) -> size_t {
+    return t >= hours(2) && t < hours(3) ? 1600 : 10;
+  };
+  workload.duration = hours(6);
+  SimulationResult fixed, adaptive;
+  Compare(workload, &fixed, &adaptive);
+  EXPECT_GT(fixed.bytes_dropped, 0u);
+  EXPECT_EQ(adaptive.bytes_dropped, 0u);
+}
+
+// During an outage, the adaptive scheduling backs off, but once the store is almost full it retries
+// as often as the fixed scheduling, so that it notices the end of the outage as soon. How much is
+// dropped mostly depends on how full the store was when the outage started, so the drop rates are
+// averaged over outages starting at different times.
+TEST(UploadSchedulerSimulation, Outage) {
+  const int kNumOutages = 40;
+  double fixed_drop_rate = 0;
+  double adaptive_drop_rate = 0;
+  for (int i = 0; i < kNumOutages; i++) {
+    Workload workload;
+    workload.bytes_per_second = [](seconds /*t*/) { return 100; };
+    workload.duration = hours(12);
+    workload.outage_start = hours(1) + minutes(3 * i);
+    workload.outage_end = workload.outage_start + hours(4);
+    SimulationResult fixed, adaptive;
+    Compare(workload, &fixed, &adaptive);
+    fixed_drop_rate += fixed.drop_rate() / kNumOutages;
+    adaptive_drop_rate += adaptive.drop_rate() / kNumOutages;
+  }
+  LOG(INFO) << "mean drop rate: fixed " << fixed_drop_rate << ", adaptive " << adaptive_drop_rate;
+  EXPECT_LT(adaptive_drop_rate, fixed_drop_rate);
+}
+
+// The adaptive scheduling does not send while the server asked it to wait.
+TEST(UploadSchedulerSimulation, ServerWait) {
+  Workload workload;
+  workload.bytes_per_second = [](seconds /*t*/) { return 100; };
+  workload.duration = hours(12);
+  workload.server_wait = hours(2);
+  SimulationResult fixed, adaptive;
+  Compare(workload, &fixed, &adaptive);
+  EXPECT_GT(fixed.num_refused_sends, 0u);
+  EXPECT_EQ(adaptive.num_refused_sends, 0u);
+  EXPECT_EQ(adaptive.bytes_dropped, 0u);
+}
+
 }  // namespace cobalt::uploader